@@ -0,0 +1,251 @@
+#include "../fs.h"
+#include <time.h>
+
+// Runs the workloads named on the command line, or all of them, against a
+// fresh image and prints one JSON object per workload run, in an array.
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define FILE_SIZE (16 * BYTES_MB)
+#define RANDOM_OPS 4096
+#define CHURN_OPS 2000
+#define CHURN_FILE_SIZE 512
+#define LISTFILES_OPS 2000
+#define DIR_FILES 64 // a full directory
+#define MOUNT_OPS 200
+#define TRUNCATE_OPS 200
+#define TRUNCATE_FILE_SIZE BYTES_MB
+
+struct workload {
+  const char *name;
+  void (*run)(const char *name, size_t size);
+  size_t size; // request size, 0 if the workload has none
+};
+
+const char *disk_name = "bench_fs";
+const char *file_name = "bench_file";
+char *buf;
+uint64_t *latencies; // of the operations of the current run, in ns
+int num_ops;
+bool is_first_result = true;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void check(bool ok, const char *what) {
+  if (ok == false) {
+    fprintf(stderr, "bench: %s failed\n", what);
+    exit(1);
+  }
+}
+
+// Starts timing an operation; end_op records it.
+uint64_t start_op() { return now_ns(); }
+
+void end_op(uint64_t start) { latencies[num_ops++] = now_ns() - start; }
+
+int compare_latencies(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Prints the result of a run of num_ops operations moving bytes bytes.
+void report(const char *name, size_t size, uint64_t bytes) {
+  uint64_t total = 0;
+  for (int i = 0; i < num_ops; i++) {
+    total += latencies[i];
+  }
+  qsort(latencies, num_ops, sizeof(uint64_t), compare_latencies);
+  double seconds = total / 1e9;
+  printf("%s\n  {\"workload\": \"%s\", \"request_size\": %zu, \"ops\": %d, "
+         "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+         "\"p50_us\": %.2f, \"p99_us\": %.2f}",
+         is_first_result ? "" : ",", name, size, num_ops, seconds,
+         num_ops / seconds, bytes / (double)BYTES_MB / seconds,
+         latencies[num_ops / 2] / 1e3, latencies[num_ops * 99 / 100] / 1e3);
+  is_first_result = false;
+  num_ops = 0;
+}
+
+// Makes and mounts a fresh image holding one file of file_size bytes, open
+// as the returned descriptor.
+int setup(int file_size) {
+  remove(disk_name);
+  check(make_fs(disk_name) == 0, "make_fs");
+  check(mount_fs(disk_name) == 0, "mount_fs");
+  check(fs_create(file_name) == 0, "fs_create");
+  int fd = fs_open(file_name);
+  check(fd >= 0, "fs_open");
+  check(fs_write(fd, buf, file_size) == file_size, "fs_write");
+  check(fs_lseek(fd, 0) == 0, "fs_lseek");
+  return fd;
+}
+
+void teardown(int fd) {
+  check(fs_close(fd) == 0, "fs_close");
+  check(umount_fs(disk_name) == 0, "umount_fs");
+  check(remove(disk_name) == 0, "remove");
+}
+
+void seq_write(const char *name, size_t size) {
+  int fd = setup(0);
+  for (size_t off = 0; off < FILE_SIZE; off += size) {
+    uint64_t start = start_op();
+    check(fs_write(fd, buf + off, size) == (int)size, "fs_write");
+    end_op(start);
+  }
+  report(name, size, FILE_SIZE);
+  teardown(fd);
+}
+
+void seq_read(const char *name, size_t size) {
+  int fd = setup(FILE_SIZE);
+  check(fs_sync() == 0, "fs_sync");
+  for (size_t off = 0; off < FILE_SIZE; off += size) {
+    uint64_t start = start_op();
+    check(fs_read(fd, buf + off, size) == (int)size, "fs_read");
+    end_op(start);
+  }
+  report(name, size, FILE_SIZE);
+  teardown(fd);
+}
+
+// Reads or writes size bytes at RANDOM_OPS block-aligned random offsets.
+void random_io(const char *name, size_t size, bool is_write) {
+  int fd = setup(FILE_SIZE);
+  check(fs_sync() == 0, "fs_sync");
+  srand(1);
+  for (int i = 0; i < RANDOM_OPS; i++) {
+    off_t off = (off_t)(rand() % (FILE_SIZE / size)) * size;
+    uint64_t start = start_op();
+    check(fs_lseek(fd, off) == 0, "fs_lseek");
+    if (is_write) {
+      check(fs_write(fd, buf + off, size) == (int)size, "fs_write");
+    } else {
+      check(fs_read(fd, buf + off, size) == (int)size, "fs_read");
+    }
+    end_op(start);
+  }
+  report(name, size, (uint64_t)RANDOM_OPS * size);
+  teardown(fd);
+}
+
+void rand_write(const char *name, size_t size) { random_io(name, size, true); }
+
+void rand_read(const char *name, size_t size) { random_io(name, size, false); }
+
+// Creates, writes, closes and deletes a small file per operation.
+void create_delete(const char *name, size_t size) {
+  int fd = setup(0);
+  char churn_name[16];
+  for (int i = 0; i < CHURN_OPS; i++) {
+    snprintf(churn_name, sizeof(churn_name), "churn%d", i % 16);
+    uint64_t start = start_op();
+    check(fs_create(churn_name) == 0, "fs_create");
+    int churn_fd = fs_open(churn_name);
+    check(churn_fd >= 0, "fs_open");
+    check(fs_write(churn_fd, buf, size) == (int)size, "fs_write");
+    check(fs_close(churn_fd) == 0, "fs_close");
+    check(fs_delete(churn_name) == 0, "fs_delete");
+    end_op(start);
+  }
+  report(name, size, (uint64_t)CHURN_OPS * size);
+  teardown(fd);
+}
+
+void listfiles(const char *name, size_t size) {
+  int fd = setup(0);
+  char dir_name[16];
+  for (int i = 1; i < DIR_FILES; i++) {
+    snprintf(dir_name, sizeof(dir_name), "file%d", i);
+    check(fs_create(dir_name) == 0, "fs_create");
+  }
+  for (int i = 0; i < LISTFILES_OPS; i++) {
+    char **files;
+    uint64_t start = start_op();
+    check(fs_listfiles(&files) == 0, "fs_listfiles");
+    end_op(start);
+    for (char **file = files; *file; file++) {
+      free(*file);
+    }
+    free(files);
+  }
+  report(name, size, 0);
+  teardown(fd);
+}
+
+// Mounts and unmounts an image holding a full file.
+void mount_umount(const char *name, size_t size) {
+  int fd = setup(FILE_SIZE);
+  check(fs_close(fd) == 0, "fs_close");
+  check(umount_fs(disk_name) == 0, "umount_fs");
+  for (int i = 0; i < MOUNT_OPS; i++) {
+    uint64_t start = start_op();
+    check(mount_fs(disk_name) == 0, "mount_fs");
+    check(umount_fs(disk_name) == 0, "umount_fs");
+    end_op(start);
+  }
+  report(name, size, 0);
+  check(remove(disk_name) == 0, "remove");
+}
+
+// Truncates a file of TRUNCATE_FILE_SIZE bytes to nothing; only the
+// truncation is timed.
+void truncate_file(const char *name, size_t size) {
+  int fd = setup(0);
+  for (int i = 0; i < TRUNCATE_OPS; i++) {
+    check(fs_lseek(fd, 0) == 0, "fs_lseek");
+    check(fs_write(fd, buf, TRUNCATE_FILE_SIZE) == TRUNCATE_FILE_SIZE,
+          "fs_write");
+    uint64_t start = start_op();
+    check(fs_truncate(fd, 0) == 0, "fs_truncate");
+    end_op(start);
+  }
+  report(name, size, 0);
+  teardown(fd);
+}
+
+struct workload workloads[] = {
+    {"seq_write", seq_write, 4 * BYTES_KB},
+    {"seq_write", seq_write, 64 * BYTES_KB},
+    {"seq_write", seq_write, BYTES_MB},
+    {"seq_read", seq_read, 4 * BYTES_KB},
+    {"seq_read", seq_read, 64 * BYTES_KB},
+    {"seq_read", seq_read, BYTES_MB},
+    {"rand_write", rand_write, 4 * BYTES_KB},
+    {"rand_read", rand_read, 4 * BYTES_KB},
+    {"create_delete", create_delete, CHURN_FILE_SIZE},
+    {"listfiles", listfiles, 0},
+    {"mount_umount", mount_umount, 0},
+    {"truncate", truncate_file, TRUNCATE_FILE_SIZE},
+};
+
+int main(int argc, char *argv[]) {
+  int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+  buf = malloc(FILE_SIZE);
+  latencies = malloc(FILE_SIZE / 512 * sizeof(uint64_t));
+  check(buf != NULL && latencies != NULL, "malloc");
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  printf("[");
+  for (int i = 0; i < num_workloads; i++) {
+    bool is_selected = argc == 1;
+    for (int j = 1; j < argc; j++) {
+      is_selected |= strcmp(argv[j], workloads[i].name) == 0;
+    }
+    if (is_selected) {
+      workloads[i].run(workloads[i].name, workloads[i].size);
+      fflush(stdout);
+    }
+  }
+  printf("\n]\n");
+  free(buf);
+  free(latencies);
+  return 0;
+}
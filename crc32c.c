@@ -0,0 +1,78 @@
+#include "crc32c.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82F63B78 // reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+static bool has_sse42;
+
+static void crc32c_init() __attribute__((constructor));
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t size);
+#if defined(__x86_64__)
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t size)
+    __attribute__((target("sse4.2")));
+#endif
+
+void crc32c_init() {
+  for (int i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (int i = 0; i < 256; i++) {
+    for (int j = 1; j < 8; j++) {
+      uint32_t prev = crc32c_table[j - 1][i];
+      crc32c_table[j][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+    }
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t size) {
+  for (; size >= 8; size -= 8, p += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    lo ^= crc;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+  }
+  for (; size > 0; size--, p++) {
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+  uint64_t crc64 = crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    crc64 = __builtin_ia32_crc32di(crc64, value);
+  }
+  crc = crc64;
+  for (; size > 0; size--, p++) {
+    crc = __builtin_ia32_crc32qi(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (has_sse42) {
+    return ~crc32c_sse42(crc, data, size);
+  }
+#endif
+  return ~crc32c_sw(crc, data, size);
+}
@@ -0,0 +1,12 @@
+#ifndef INCLUDE_CRC32C_H
+#define INCLUDE_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Extends crc, the CRC32C (Castagnoli) of some earlier data or 0, over size
+// bytes of data. Uses the SSE4.2 crc32 instruction when the CPU has it and a
+// table-driven (slice-by-8) implementation otherwise.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif /* INCLUDE_CRC32C_H */
@@ -0,0 +1,44 @@
+#include "fs.h"
+
+// Defragments one file, or every file if no file name is given, in calls of
+// bounded work until nothing is left to move.
+int main(int argc, char *argv[]) {
+  struct fs_defrag_report report, first;
+  uint64_t moved_blocks = 0;
+  int calls = 0;
+  int ret;
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s disk_name [file_name]\n", argv[0]);
+    return 1;
+  }
+  if (mount_fs(argv[1])) {
+    return 1;
+  }
+  do {
+    ret = argc == 3 ? fs_defrag(argv[2], &report) : fs_defrag_all(&report);
+    if (ret == -1) {
+      umount_fs(argv[1]);
+      return 1;
+    }
+    if (calls++ == 0) {
+      first = report;
+    }
+    moved_blocks += report.moved_blocks;
+  } while (ret == 1 && report.moved_blocks);
+  if (umount_fs(argv[1])) {
+    return 1;
+  }
+
+  printf("%llu files, %llu blocks\n", (unsigned long long)report.files,
+         (unsigned long long)report.blocks);
+  printf("before: %llu extents, %llu free extents\n",
+         (unsigned long long)first.extents_before,
+         (unsigned long long)first.free_extents_before);
+  printf("after:  %llu extents, %llu free extents\n",
+         (unsigned long long)report.extents_after,
+         (unsigned long long)report.free_extents_after);
+  printf("moved %llu blocks in %d calls\n", (unsigned long long)moved_blocks,
+         calls);
+  return 0;
+}
@@ -8,35 +8,162 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE /* defined by linux/fs.h for its own use */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__NR_copy_file_range)
+#define HAVE_COPY_FILE_RANGE
+#endif
+#endif
 
 #include "disk.h"
 
 /******************************************************************************/
-static int active = 0; /* is the virtual disk open (active) */
-static int handle; /* file handle to virtual disk       */
+#define COPY_BUFFER_SIZE (256 << 10) /* moved at a time by a copy in memory */
+#define QUEUE_DEPTH 64  /* requests in flight on a queue at a time    */
+#define QUEUE_THREADS 4 /* threads of a queue that does not use io_uring */
+
+/* The requests of one disk. Submitters wait while QUEUE_DEPTH requests are in
+ * flight; with io_uring that many always fit in the submission ring. */
+struct disk_queue {
+	int handle;
+	int block_size;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;      /* signalled as requests come and go        */
+	int inflight;             /* submitted and not yet done               */
+	int stopping;
+	/* thread pool */
+	struct disk_request *head, *tail; /* waiting for a thread      */
+	pthread_t threads[QUEUE_THREADS];
+	int num_threads;
+	/* io_uring, if ring is not -1 */
+	int ring;
+	int ring_failed;          /* requests go to the thread pool instead   */
+	struct disk_request *ring_reqs; /* on the ring, linked by next */
+	pthread_t reaper;         /* calls done as completions arrive         */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+#ifdef HAVE_IO_URING
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+/******************************************************************************/
+static struct disk default_disk; /* used by threads that select no other */
+static __thread struct disk *disk = &default_disk; /* selected disk */
+static __thread struct disk_stats *stats; /* of this thread, if counted */
+static pthread_mutex_t queue_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static int use_io_uring = 1;
 /******************************************************************************/
 
+static void stats_start(struct timespec *start);
+static void stats_count(uint64_t *calls, uint64_t *bytes, uint64_t *ns,
+			size_t size, const struct timespec *start);
+static int copy_range(int handle, off_t src, off_t dst, size_t size);
+static int advise(const char *func, int block, int count, int advice);
+static struct disk_queue *queue_start(int handle, int block_size);
+static void queue_stop(struct disk_queue *q);
+static void queue_done(struct disk_queue *q, struct disk_request *req,
+		       int result);
+static int queue_start_threads(struct disk_queue *q);
+static void *queue_thread(void *arg);
+#ifdef HAVE_IO_URING
+static int ring_start(struct disk_queue *q);
+static int ring_submit(struct disk_queue *q, struct disk_request *req);
+static void *ring_reaper(void *arg);
+static void ring_fail(struct disk_queue *q);
+static void ring_stop(struct disk_queue *q);
+#endif
+
+struct disk *disk_select(struct disk *d)
+{
+	struct disk *prev = disk;
+
+	disk = d ? d : &default_disk;
+
+	return prev;
+}
+
+void disk_set_stats(struct disk_stats *s)
+{
+	stats = s;
+}
+
+/* Notes when a counted call starts. */
+static void stats_start(struct timespec *start)
+{
+	if (stats)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/* Counts a call that moved size bytes. Other threads may share the counters
+ * and read them at any time. */
+static void stats_count(uint64_t *calls, uint64_t *bytes, uint64_t *ns,
+			size_t size, const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	__atomic_fetch_add(calls, 1, __ATOMIC_RELAXED);
+	if (bytes)
+		__atomic_fetch_add(bytes, size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(ns,
+			   (end.tv_sec - start->tv_sec) * 1000000000ULL +
+				   end.tv_nsec - start->tv_nsec,
+			   __ATOMIC_RELAXED);
+}
+
 int make_disk(const char *name)
 {
-	int f, cnt;
-	char buf[BLOCK_SIZE];
+	return make_disk_sized(name, BLOCK_SIZE);
+}
+
+int make_disk_sized(const char *name, int block_size)
+{
+	int f;
 
 	if (!name) {
 		fprintf(stderr, "make_disk: invalid file name\n");
 		return -1;
 	}
 
+	if (!is_block_size(block_size)) {
+		fprintf(stderr, "make_disk: invalid block size\n");
+		return -1;
+	}
+
 	if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
 		perror("make_disk: cannot open file");
 		return -1;
 	}
 
-	memset(buf, 0, BLOCK_SIZE);
-	for (cnt = 0; cnt < DISK_BLOCKS; ++cnt) {
-		if (write(f, buf, BLOCK_SIZE) < 0) {
-			perror("make_disk: failed to write");
-			return -1;
-		}
+	/* the blocks read as zeros without being written */
+	if (ftruncate(f, (off_t)DISK_BLOCKS * block_size) < 0) {
+		perror("make_disk: failed to size file");
+		close(f);
+		return -1;
 	}
 
 	close(f);
@@ -44,16 +171,23 @@ int make_disk(const char *name)
 	return 0;
 }
 
+int is_block_size(int block_size)
+{
+	return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE &&
+	       (block_size & (block_size - 1)) == 0;
+}
+
 int open_disk(const char *name)
 {
 	int f;
+	struct stat st;
 
 	if (!name) {
 		fprintf(stderr, "open_disk: invalid file name\n");
 		return -1;
 	}
 
-	if (active) {
+	if (disk->active) {
 		fprintf(stderr, "open_disk: disk is already open\n");
 		return -1;
 	}
@@ -63,29 +197,50 @@ int open_disk(const char *name)
 		return -1;
 	}
 
-	handle = f;
-	active = 1;
+	/* the block size follows from the size of the image */
+	if (fstat(f, &st) < 0 || st.st_size % DISK_BLOCKS ||
+	    !is_block_size(st.st_size / DISK_BLOCKS)) {
+		fprintf(stderr, "open_disk: not a disk image\n");
+		close(f);
+		return -1;
+	}
+
+	disk->handle = f;
+	disk->block_size = st.st_size / DISK_BLOCKS;
+	disk->active = 1;
 
 	return 0;
 }
 
+int disk_block_size()
+{
+	return disk->block_size;
+}
+
 int close_disk()
 {
-	if (!active) {
+	if (!disk->active) {
 		fprintf(stderr, "close_disk: no open disk\n");
 		return -1;
 	}
 
-	close(handle);
+	if (disk->queue) {
+		queue_stop(disk->queue);
+		disk->queue = NULL;
+	}
+
+	close(disk->handle);
 
-	active = handle = 0;
+	disk->active = disk->handle = 0;
 
 	return 0;
 }
 
 int block_write(int block, const void *buf)
 {
-	if (!active) {
+	struct timespec start;
+
+	if (!disk->active) {
 		fprintf(stderr, "block_write: disk not active\n");
 		return -1;
 	}
@@ -95,22 +250,25 @@ int block_write(int block, const void *buf)
 		return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_write: failed to lseek");
-		return -1;
-	}
-
-	if (write(handle, buf, BLOCK_SIZE) < 0) {
+	/* positioned I/O, so that threads do not share a file offset */
+	stats_start(&start);
+	if (pwrite(disk->handle, buf, disk->block_size,
+		   (off_t)block * disk->block_size) < 0) {
 		perror("block_write: failed to write");
 		return -1;
 	}
+	if (stats)
+		stats_count(&stats->writes, &stats->write_bytes,
+			    &stats->write_ns, disk->block_size, &start);
 
 	return 0;
 }
 
 int block_read(int block, void *buf)
 {
-	if (!active) {
+	struct timespec start;
+
+	if (!disk->active) {
 		fprintf(stderr, "block_read: disk not active\n");
 		return -1;
 	}
@@ -120,15 +278,612 @@ int block_read(int block, void *buf)
 		return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_read: failed to lseek");
+	stats_start(&start);
+	if (pread(disk->handle, buf, disk->block_size,
+		  (off_t)block * disk->block_size) < 0) {
+		perror("block_read: failed to read");
 		return -1;
 	}
+	if (stats)
+		stats_count(&stats->reads, &stats->read_bytes, &stats->read_ns,
+			    disk->block_size, &start);
 
-	if (read(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_read: failed to read");
+	return 0;
+}
+
+int block_readv(int block, const struct iovec *iov, int iovcnt)
+{
+	struct timespec start;
+	size_t size = 0;
+	int i;
+
+	if (!disk->active) {
+		fprintf(stderr, "block_readv: disk not active\n");
 		return -1;
 	}
 
+	for (i = 0; i < iovcnt; ++i)
+		size += iov[i].iov_len;
+
+	if ((block < 0) || (size % disk->block_size) ||
+	    (block + size / disk->block_size > DISK_BLOCKS)) {
+		fprintf(stderr, "block_readv: block index out of bounds\n");
+		return -1;
+	}
+
+	stats_start(&start);
+	if (preadv(disk->handle, iov, iovcnt,
+		   (off_t)block * disk->block_size) !=
+	    (ssize_t)size) {
+		perror("block_readv: failed to read");
+		return -1;
+	}
+	if (stats)
+		stats_count(&stats->reads, &stats->read_bytes, &stats->read_ns,
+			    size, &start);
+
 	return 0;
 }
+
+int block_writev(int block, const struct iovec *iov, int iovcnt)
+{
+	struct timespec start;
+	size_t size = 0;
+	int i;
+
+	if (!disk->active) {
+		fprintf(stderr, "block_writev: disk not active\n");
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; ++i)
+		size += iov[i].iov_len;
+
+	if ((block < 0) || (size % disk->block_size) ||
+	    (block + size / disk->block_size > DISK_BLOCKS)) {
+		fprintf(stderr, "block_writev: block index out of bounds\n");
+		return -1;
+	}
+
+	stats_start(&start);
+	if (pwritev(disk->handle, iov, iovcnt,
+		    (off_t)block * disk->block_size) !=
+	    (ssize_t)size) {
+		perror("block_writev: failed to write");
+		return -1;
+	}
+	if (stats)
+		stats_count(&stats->writes, &stats->write_bytes,
+			    &stats->write_ns, size, &start);
+
+	return 0;
+}
+
+/* Copies size bytes at offset src of handle to offset dst, within the kernel
+ * if copy_file_range works on the file, else through a buffer. */
+static int copy_range(int handle, off_t src, off_t dst, size_t size)
+{
+	char *buf = NULL;
+	ssize_t n;
+
+	while (size > 0) {
+		n = -1;
+#ifdef HAVE_COPY_FILE_RANGE
+		if (!buf) {
+			int64_t in = src, out = dst;
+
+			n = syscall(__NR_copy_file_range, handle, &in, handle,
+				    &out, size, 0);
+		}
+#endif
+		if (n <= 0) {
+			/* not supported here; copy the rest through memory */
+			size_t len = size < COPY_BUFFER_SIZE ?
+					     size :
+					     COPY_BUFFER_SIZE;
+
+			if (!buf && !(buf = malloc(COPY_BUFFER_SIZE)))
+				return -1;
+			if (pread(handle, buf, len, src) != (ssize_t)len ||
+			    pwrite(handle, buf, len, dst) != (ssize_t)len) {
+				free(buf);
+				return -1;
+			}
+			n = len;
+		}
+		src += n;
+		dst += n;
+		size -= n;
+	}
+	free(buf);
+	return 0;
+}
+
+int block_copy(int src, int dst, int count)
+{
+	struct timespec start;
+	size_t size = (size_t)count * disk->block_size;
+
+	if (!disk->active) {
+		fprintf(stderr, "block_copy: disk not active\n");
+		return -1;
+	}
+
+	if ((src < 0) || (dst < 0) || (count < 0) ||
+	    (src + count > DISK_BLOCKS) || (dst + count > DISK_BLOCKS) ||
+	    (src < dst + count && dst < src + count)) {
+		fprintf(stderr, "block_copy: block index out of bounds\n");
+		return -1;
+	}
+
+	stats_start(&start);
+	if (copy_range(disk->handle, (off_t)src * disk->block_size,
+		       (off_t)dst * disk->block_size, size) < 0) {
+		perror("block_copy: failed to copy");
+		return -1;
+	}
+	if (stats)
+		stats_count(&stats->writes, &stats->write_bytes,
+			    &stats->write_ns, size, &start);
+
+	return 0;
+}
+
+void *block_map(int block, int count)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t offset = (off_t)block * disk->block_size;
+	size_t skip = offset % page_size; /* mappings start at a page */
+	char *addr;
+
+	if (!disk->active) {
+		fprintf(stderr, "block_map: disk not active\n");
+		return NULL;
+	}
+
+	if ((block < 0) || (count <= 0) || (block + count > DISK_BLOCKS)) {
+		fprintf(stderr, "block_map: block index out of bounds\n");
+		return NULL;
+	}
+
+	addr = mmap(NULL, skip + (size_t)count * disk->block_size, PROT_READ,
+		    MAP_SHARED, disk->handle, offset - skip);
+	if (addr == MAP_FAILED) {
+		perror("block_map: failed to map");
+		return NULL;
+	}
+
+	return addr + skip;
+}
+
+int block_unmap(const void *addr, int count)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t skip = (uintptr_t)addr % page_size;
+
+	if (munmap((char *)addr - skip,
+		   skip + (size_t)count * disk->block_size) < 0) {
+		perror("block_unmap: failed to unmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Passes advice about count blocks starting at block to the page cache of
+ * the host, on behalf of func. */
+static int advise(const char *func, int block, int count, int advice)
+{
+	int err;
+
+	if (!disk->active) {
+		fprintf(stderr, "%s: disk not active\n", func);
+		return -1;
+	}
+
+	if ((block < 0) || (count < 0) || (block + count > DISK_BLOCKS)) {
+		fprintf(stderr, "%s: block index out of bounds\n", func);
+		return -1;
+	}
+
+	err = posix_fadvise(disk->handle, (off_t)block * disk->block_size,
+			    (off_t)count * disk->block_size, advice);
+	if (err) {
+		fprintf(stderr, "%s: failed to advise: %s\n", func,
+			strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_prefetch(int block, int count)
+{
+	return advise("block_prefetch", block, count, POSIX_FADV_WILLNEED);
+}
+
+int block_evict(int block, int count)
+{
+	return advise("block_evict", block, count, POSIX_FADV_DONTNEED);
+}
+
+int block_sync()
+{
+	struct timespec start;
+
+	if (!disk->active) {
+		fprintf(stderr, "block_sync: disk not active\n");
+		return -1;
+	}
+
+	stats_start(&start);
+	if (fdatasync(disk->handle) < 0) {
+		perror("block_sync: failed to sync");
+		return -1;
+	}
+	if (stats)
+		stats_count(&stats->syncs, NULL, &stats->sync_ns, 0, &start);
+
+	return 0;
+}
+
+int disk_submit(struct disk_request *req)
+{
+	struct disk_queue *q;
+
+	if (!disk->active) {
+		fprintf(stderr, "disk_submit: disk not active\n");
+		return -1;
+	}
+
+	if ((req->block < 0) || (req->count <= 0) ||
+	    (req->block + req->count > DISK_BLOCKS)) {
+		fprintf(stderr, "disk_submit: block index out of bounds\n");
+		return -1;
+	}
+
+	/* threads working on the same disk may start its queue together */
+	q = __atomic_load_n(&disk->queue, __ATOMIC_ACQUIRE);
+	if (!q) {
+		pthread_mutex_lock(&queue_start_lock);
+		q = disk->queue;
+		if (!q && (q = queue_start(disk->handle, disk->block_size)))
+			__atomic_store_n(&disk->queue, q, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&queue_start_lock);
+		if (!q)
+			return -1;
+	}
+
+	req->iov.iov_base = req->buf;
+	req->iov.iov_len = (size_t)req->count * disk->block_size;
+	req->next = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->inflight == QUEUE_DEPTH)
+		pthread_cond_wait(&q->cond, &q->lock);
+	q->inflight++;
+#ifdef HAVE_IO_URING
+	if (q->ring != -1 && !q->ring_failed) {
+		if (ring_submit(q, req)) {
+			q->inflight--;
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+#endif
+	if (!q->num_threads) {
+		q->inflight--;
+		pthread_mutex_unlock(&q->lock);
+		fprintf(stderr, "disk_submit: queue has no threads\n");
+		return -1;
+	}
+	if (q->tail)
+		q->tail->next = req;
+	else
+		q->head = req;
+	q->tail = req;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+void disk_set_io_uring(int enabled)
+{
+	__atomic_store_n(&use_io_uring, enabled, __ATOMIC_RELAXED);
+}
+
+/* Starts the queue of the disk open as handle, whose blocks are block_size
+ * bytes: io_uring if it can be set up,
+ * a pool of threads otherwise. */
+static struct disk_queue *queue_start(int handle, int block_size)
+{
+	struct disk_queue *q;
+
+	if (!(q = calloc(1, sizeof(*q)))) {
+		fprintf(stderr, "disk_submit: out of memory\n");
+		return NULL;
+	}
+	q->handle = handle;
+	q->block_size = block_size;
+	q->ring = -1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+#ifdef HAVE_IO_URING
+	if (__atomic_load_n(&use_io_uring, __ATOMIC_RELAXED) &&
+	    ring_start(q) == 0)
+		return q;
+#endif
+
+	if (!queue_start_threads(q)) {
+		fprintf(stderr, "disk_submit: failed to start queue threads\n");
+		queue_stop(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/* Starts the threads of the pool that are not running yet. Returns how many
+ * are running. */
+static int queue_start_threads(struct disk_queue *q)
+{
+	for (; q->num_threads < QUEUE_THREADS; ++q->num_threads) {
+		if (pthread_create(&q->threads[q->num_threads], NULL,
+				   queue_thread, q))
+			break;
+	}
+
+	return q->num_threads;
+}
+
+/* Waits for the requests in flight, then stops and frees the queue. */
+static void queue_stop(struct disk_queue *q)
+{
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->inflight)
+		pthread_cond_wait(&q->cond, &q->lock);
+	q->stopping = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	/* a failing ring starts the pool, so it goes first */
+#ifdef HAVE_IO_URING
+	if (q->ring != -1)
+		ring_stop(q);
+#endif
+	for (i = 0; i < q->num_threads; ++i)
+		pthread_join(q->threads[i], NULL);
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q);
+}
+
+/* Hands req back to its submitter; req may be gone once done returns. */
+static void queue_done(struct disk_queue *q, struct disk_request *req,
+		       int result)
+{
+	req->result = result;
+	req->done(req);
+
+	pthread_mutex_lock(&q->lock);
+	q->inflight--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* A thread of the pool, serving requests in the order they were queued. */
+static void *queue_thread(void *arg)
+{
+	struct disk_queue *q = arg;
+	struct disk_request *req;
+	off_t offset;
+	ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (!q->head && !q->stopping)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (!(req = q->head)) {
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+		if (!(q->head = req->next))
+			q->tail = NULL;
+		pthread_mutex_unlock(&q->lock);
+
+		offset = (off_t)req->block * q->block_size;
+		if (req->is_write)
+			ret = pwritev(q->handle, &req->iov, 1, offset);
+		else
+			ret = preadv(q->handle, &req->iov, 1, offset);
+		if (ret != (ssize_t)req->iov.iov_len)
+			perror("disk_submit: request failed");
+		queue_done(q, req, ret == (ssize_t)req->iov.iov_len ? 0 : -1);
+	}
+}
+
+#ifdef HAVE_IO_URING
+/* Sets up an io_uring instance and maps its rings, the way liburing does
+ * without depending on it. */
+static int ring_start(struct disk_queue *q)
+{
+	struct io_uring_params p;
+	int ring;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &p)) < 0)
+		return -1;
+
+	q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED ||
+	    q->sqes == MAP_FAILED)
+		goto fail;
+
+	q->sq_tail = (unsigned *)((char *)q->sq_ring + p.sq_off.tail);
+	q->sq_mask = (unsigned *)((char *)q->sq_ring + p.sq_off.ring_mask);
+	q->sq_array = (unsigned *)((char *)q->sq_ring + p.sq_off.array);
+	q->cq_head = (unsigned *)((char *)q->cq_ring + p.cq_off.head);
+	q->cq_tail = (unsigned *)((char *)q->cq_ring + p.cq_off.tail);
+	q->cq_mask = (unsigned *)((char *)q->cq_ring + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)((char *)q->cq_ring + p.cq_off.cqes);
+	q->ring = ring;
+
+	if (pthread_create(&q->reaper, NULL, ring_reaper, q)) {
+		q->ring = -1;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (q->sq_ring != MAP_FAILED && q->sq_ring)
+		munmap(q->sq_ring, q->sq_ring_size);
+	if (q->cq_ring != MAP_FAILED && q->cq_ring)
+		munmap(q->cq_ring, q->cq_ring_size);
+	if (q->sqes != MAP_FAILED && q->sqes)
+		munmap(q->sqes, q->sqes_size);
+	close(ring);
+	return -1;
+}
+
+/* Puts req, or a request to stop the reaper if NULL, on the submission ring
+ * and submits it. Called with the queue locked. */
+static int ring_submit(struct disk_queue *q, struct disk_request *req)
+{
+	unsigned tail = *q->sq_tail;
+	unsigned idx = tail & *q->sq_mask;
+	struct io_uring_sqe *sqe = &q->sqes[idx];
+	int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (req) {
+		sqe->opcode = req->is_write ? IORING_OP_WRITEV :
+					      IORING_OP_READV;
+		sqe->fd = q->handle;
+		sqe->off = (unsigned long long)req->block * q->block_size;
+		sqe->addr = (unsigned long long)(uintptr_t)&req->iov;
+		sqe->len = 1;
+	} else {
+		sqe->opcode = IORING_OP_NOP;
+	}
+	sqe->user_data = (unsigned long long)(uintptr_t)req;
+	q->sq_array[idx] = idx;
+	__atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, q->ring, 1, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		perror("disk_submit: io_uring_enter failed");
+		__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+		return -1;
+	}
+	if (req) {
+		req->next = q->ring_reqs;
+		q->ring_reqs = req;
+	}
+
+	return 0;
+}
+
+/* Waits for completions and hands them back until the stop request (user
+ * data 0) comes through, or until waiting fails; see ring_fail. */
+static void *ring_reaper(void *arg)
+{
+	struct disk_queue *q = arg;
+	struct io_uring_cqe *cqe;
+	struct disk_request *req, **link;
+	unsigned head, tail;
+	int result, stop = 0;
+
+	while (!stop) {
+		if (syscall(__NR_io_uring_enter, q->ring, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR) {
+			perror("disk_submit: io_uring_enter failed");
+			ring_fail(q);
+			return NULL;
+		}
+		head = *q->cq_head;
+		tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			cqe = &q->cqes[head & *q->cq_mask];
+			req = (struct disk_request *)(uintptr_t)cqe->user_data;
+			result = cqe->res;
+			__atomic_store_n(q->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+			if (!req) {
+				stop = 1;
+				continue;
+			}
+			pthread_mutex_lock(&q->lock);
+			for (link = &q->ring_reqs; *link != req;
+			     link = &(*link)->next)
+				;
+			*link = req->next;
+			pthread_mutex_unlock(&q->lock);
+			if (result != (int)req->iov.iov_len) {
+				fprintf(stderr, "disk_submit: request failed: %s\n",
+					result < 0 ? strerror(-result) :
+						     "short transfer");
+			}
+			queue_done(q, req,
+				   result == (int)req->iov.iov_len ? 0 : -1);
+		}
+	}
+
+	return NULL;
+}
+
+/* Moves the queue over to the thread pool once the reaper can no longer wait
+ * for completions, and fails the requests still on the ring, since nothing
+ * will reap them. */
+static void ring_fail(struct disk_queue *q)
+{
+	struct disk_request *req, *next;
+
+	pthread_mutex_lock(&q->lock);
+	q->ring_failed = 1;
+	if (!queue_start_threads(q))
+		fprintf(stderr, "disk_submit: failed to start queue threads\n");
+	req = q->ring_reqs;
+	q->ring_reqs = NULL;
+	pthread_mutex_unlock(&q->lock);
+
+	for (; req; req = next) {
+		next = req->next;
+		queue_done(q, req, -1);
+	}
+}
+
+/* Stops the reaper of an idle queue and tears the ring down. */
+static void ring_stop(struct disk_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	if (!q->ring_failed)
+		ring_submit(q, NULL);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->reaper, NULL);
+
+	munmap(q->sq_ring, q->sq_ring_size);
+	munmap(q->cq_ring, q->cq_ring_size);
+	munmap(q->sqes, q->sqes_size);
+	close(q->ring);
+}
+#endif
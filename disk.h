@@ -1,19 +1,98 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 /******************************************************************************/
 #define DISK_BLOCKS 8192 /* number of blocks on the disk                */
-#define BLOCK_SIZE 4096  /* block size on "disk"                        */
+#define BLOCK_SIZE 4096  /* block size of disks made by make_disk      */
+#define MIN_BLOCK_SIZE 1024   /* block sizes are powers of two in between */
+#define MAX_BLOCK_SIZE 65536
+
+/******************************************************************************/
+struct disk_queue; /* asynchronous requests of a disk, see disk.c */
+
+struct disk {
+	int active; /* is the virtual disk open (active) */
+	int handle; /* file handle to virtual disk       */
+	struct disk_queue *queue; /* started by the first disk_submit */
+	int block_size; /* bytes per block, from the size of the file */
+};
+
+/* A read or write of consecutive blocks that completes in the background.
+ * done is called from a thread of the queue once it has, with result set. */
+struct disk_request {
+	int block;    /* first block                                   */
+	int count;    /* number of blocks                              */
+	void *buf;    /* count blocks of bytes to read or write        */
+	int is_write; /* write buf to the blocks rather than read them */
+	int result;   /* 0, or -1 if the request failed                */
+	void (*done)(struct disk_request *req);
+	/* used by the queue */
+	struct iovec iov;
+	struct disk_request *next;
+};
+
+/* Calls, bytes and time in ns of the block functions of a thread */
+struct disk_stats {
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t read_ns;
+	uint64_t writes;
+	uint64_t write_bytes;
+	uint64_t write_ns;
+	uint64_t syncs;
+	uint64_t sync_ns;
+};
 
 /******************************************************************************/
+struct disk *disk_select(struct disk *disk);
+/* make the calls of this thread use disk, or the default disk if NULL, and
+ * return the disk they used before                                        */
+void disk_set_stats(struct disk_stats *stats);
+/* count the block function calls of this thread in stats, none if NULL    */
 int make_disk(const char *name); /* create an empty, virtual disk file */
+int make_disk_sized(const char *name, int block_size);
+/* create one whose blocks are block_size bytes                            */
+int is_block_size(int block_size); /* whether disks can use block_size */
+int disk_block_size(); /* bytes per block of the open disk */
 int open_disk(const char *name); /* open a virtual disk (file) */
 int close_disk(); /* close a previously opened disk (file)       */
 
 int block_write(int block, const void *buf);
-/* write a block of size BLOCK_SIZE to disk    */
+/* write a block to disk                      */
 int block_read(int block, void *buf);
-/* read a block of size BLOCK_SIZE from disk   */
+/* read a block from disk                     */
+int block_readv(int block, const struct iovec *iov, int iovcnt);
+/* read consecutive blocks starting at block into the buffers of iov, whose
+ * lengths must be multiples of the block size, with a single system call */
+int block_writev(int block, const struct iovec *iov, int iovcnt);
+/* write the buffers of iov to consecutive blocks starting at block with a
+ * single system call                                                      */
+int block_copy(int src, int dst, int count);
+/* copy count blocks starting at src to the ones starting at dst, which must
+ * not overlap, within the kernel where it can; counted as a write         */
+void *block_map(int block, int count);
+/* map count blocks starting at block read-only into memory and return
+ * where they start, or NULL; the mapping shows later writes to the blocks
+ * and stays valid after close_disk                                         */
+int block_unmap(const void *addr, int count);
+/* unmap the count blocks block_map mapped at addr                         */
+int block_prefetch(int block, int count);
+/* start reading count blocks starting at block into the page cache of the
+ * host in the background                                                  */
+int block_evict(int block, int count);
+/* let the host drop the count blocks starting at block from its page cache,
+ * once written back                                                       */
+int block_sync();
+/* wait until all blocks written so far are stored durably                  */
+int disk_submit(struct disk_request *req);
+/* queue req on the disk and return without waiting for it; requests are
+ * passed to io_uring if the kernel supports it, else to a pool of threads.
+ * close_disk waits for the requests still queued                           */
+void disk_set_io_uring(int enabled);
+/* whether queues started from now on may use io_uring (the default)        */
 /******************************************************************************/
 
 #endif
@@ -1,26 +1,128 @@
+#define _GNU_SOURCE
 #include "fs.h"
+#include "crc32c.h"
 #include "disk.h"
+#include "hash.h"
+#include "lz.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define MAX_FILES 64
 #define MAX_FILE_SIZE ((1 << 20) * 40) // 40 MiB
 #define MAX_FILE_NAME_CHAR 16
 #define DIRECT_OFFSETS_PER_INODE 12
-#define DIRECT_OFFSETS_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
 #define INODE_SIZE sizeof(struct inode)
-#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
-#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct dir_entry))
-#define METADATA_BLOCKS 5
-#define MAX_FD 32
+#define METADATA_BLOCKS 10     // before the dedup region, with 2 KiB blocks up
+#define METADATA_MAX_BLOCKS 14 // the same with the smallest blocks
+#define MAX_FD (1 << 16)
+#define FD_CHUNK_SIZE 1024 // descriptors added to the table at a time
+#define FD_CHUNKS (MAX_FD / FD_CHUNK_SIZE)
+#define COMPRESSION_CLUSTER_BLOCKS 8
+#define DEDUP_REFCOUNT_SIZE (DISK_BLOCKS * sizeof(uint16_t))
+#define DEDUP_FINGERPRINT_SIZE (DISK_BLOCKS * sizeof(uint64_t))
+#define DEDUP_INDEX_SIZE (2 * DISK_BLOCKS) // power of two
+#define CHECKSUM_SIZE (DISK_BLOCKS * sizeof(uint32_t))
+#define READ_BATCH_BLOCKS 64
+#define READ_BOUNCE_BLOCKS 4 // blocks of a read run that straddle buffers
+#define WRITE_MAX_THREADS 16
+#define WRITE_CHUNK_SIZE (1 << 20)        // per worker write
+#define WRITE_PARALLEL_MIN (4 << 20)      // 4 MiB
+#define COPY_BATCH_BLOCKS 256             // mapped per batch of a block copy
+#define COPY_BUFFER_SIZE (64 << 10)       // for the unaligned part of a copy
+#define READAHEAD_MIN_SIZE (128 << 10)    // first readahead of a descriptor
+#define READAHEAD_MAX_SIZE (4 << 20)
+#define JOURNAL_BLOCKS 128
+#define JOURNAL_MAGIC 0x4a524e4c // "JRNL"
+// metadata blocks with the smallest blocks, which bounds the transactions
+// and the block sets
+#define JOURNAL_MAX_BLOCKS                                                     \
+  (METADATA_MAX_BLOCKS +                                                       \
+   (DEDUP_REFCOUNT_SIZE + DEDUP_FINGERPRINT_SIZE + CHECKSUM_SIZE) /            \
+       MIN_BLOCK_SIZE)
+#define BLOCK_SET_WORDS ((JOURNAL_MAX_BLOCKS + 63) / 64)
+// bytes of the journal's transaction buffers, enough for any block size
+#define JOURNAL_BUFFER_SIZE                                                    \
+  ((1 + METADATA_BLOCKS + 3) * MAX_BLOCK_SIZE + DEDUP_REFCOUNT_SIZE +          \
+   DEDUP_FINGERPRINT_SIZE + CHECKSUM_SIZE)
+#define JOURNAL_COMMIT_OPS 32
+#define JOURNAL_COMMIT_INTERVAL_NS (50 * 1000 * 1000) // 50 ms
+#define RESERVED_BLOCKS (COMPRESSION_CLUSTER_BLOCKS + 4)
+#define FSCK_MAX_THREADS 16
+#define FSCK_READ_SIZE (1 << 20)
+#define DEFRAG_MAX_BLOCKS 256  // data blocks moved per call
+#define LOG_SEGMENT_BLOCKS 64
+#define LOG_SEGMENTS (DISK_BLOCKS / LOG_SEGMENT_BLOCKS)
+#define LOG_CLEAN_LOW 8   // clean segments below which the cleaner wakes
+#define LOG_CLEAN_HIGH 16 // and the number it cleans up to
+#define LOG_CLEAN_MAX_USED (LOG_SEGMENT_BLOCKS * 3 / 4) // worth cleaning
+#define LOG_CLEAN_BLOCKS 256 // blocks moved per pass
+#define IMAGE_MOUNTING_BYTE 0 // image bytes locked by mounts, see lock_image
+#define IMAGE_MOUNTED_BYTE 1
+#define IMAGE_FILE_BYTE 2 // then one per inode, see lock_file_data
+#define METADATA_REGIONS 13
+#define STATS_SHARDS 16
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
+// Sizes that follow from the block size of the image of the current context,
+// which make_fs picks; see set_block_size.
+#define BLOCKS_FOR(size) (((size) + ctx->block_size - 1) / ctx->block_size)
+#define DIRECT_OFFSETS_PER_BLOCK (ctx->block_size / sizeof(uint16_t))
+#define COMPRESSION_CLUSTER_SIZE (COMPRESSION_CLUSTER_BLOCKS * ctx->block_size)
+#define DEDUP_REFCOUNT_BLOCKS BLOCKS_FOR(DEDUP_REFCOUNT_SIZE)
+#define DEDUP_BLOCKS                                                           \
+  (DEDUP_REFCOUNT_BLOCKS + BLOCKS_FOR(DEDUP_FINGERPRINT_SIZE))
+#define CHECKSUM_BLOCKS BLOCKS_FOR(CHECKSUM_SIZE)
+#define JOURNAL_MAX_TRANSACTION_BLOCKS                                         \
+  (ctx->sb.dedup_offset + DEDUP_BLOCKS + CHECKSUM_BLOCKS)
+#define WRITE_CHUNK_BLOCKS (WRITE_CHUNK_SIZE / ctx->block_size)
+#define FSCK_READ_BLOCKS (FSCK_READ_SIZE / ctx->block_size)
+// The block at index i of consecutive blocks starting at blocks.
+#define BLOCK_AT(blocks, i)                                                    \
+  ((union fs_block *)((char *)(blocks) + (size_t)(i) * ctx->block_size))
+
 struct super_block {
   uint16_t dir_table_offset;
   uint16_t inode_metadata_offset;
   uint16_t used_block_bitmap_offset;
   uint16_t inode_offset;
   uint16_t data_offset;
+  uint16_t snapshot_offset;
+  uint16_t has_snapshot;
+  uint32_t features;
+  uint16_t dedup_offset;
+  uint16_t checksum_offset;
+  uint16_t journal_offset;
+  // written by umount_fs; the counts are only valid while is_clean is set
+  uint16_t is_clean;
+  uint16_t free_blocks;
+  uint16_t free_inodes;
+  uint32_t block_size; // 0 on images made before the size was recorded
+  uint16_t log_head;   // next block of the log, with FS_FEATURE_LOG
+};
+
+// First block of the journal. Transactions are appended after it, the first
+// one with this sequence number and each following one with the next.
+struct journal_header {
+  uint32_t magic;
+  uint32_t sequence;
+};
+
+// Starts a transaction; the images of the listed metadata blocks follow it.
+// checksum is the CRC32C of block_nums and the images, so a transaction that
+// was only partially written is not replayed.
+struct journal_descriptor {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t checksum;
+  uint16_t count;
+  uint16_t block_nums[JOURNAL_MAX_BLOCKS];
 };
 
 struct dir_entry {
@@ -36,20 +138,40 @@ struct inode {
   int file_size;
 };
 
+// A block of any size. Only the first ctx->block_size bytes are used, and
+// arrays of blocks are laid out at that stride; see BLOCK_AT.
 union fs_block {
   struct super_block super;
-  struct dir_entry dir_table[DIR_ENTRIES_PER_BLOCK];
-  uint8_t inode_bitmap[MAX_FILES / CHAR_BIT];
   uint8_t used_block_bitmap[DISK_BLOCKS / CHAR_BIT];
-  struct inode inode_table[INODES_PER_BLOCK];
-  uint16_t block_offsets[DIRECT_OFFSETS_PER_BLOCK];
-  char data[BLOCK_SIZE];
+  uint16_t block_offsets[MAX_BLOCK_SIZE / sizeof(uint16_t)];
+  struct journal_header journal_header;
+  struct journal_descriptor journal_descriptor;
+  char data[MAX_BLOCK_SIZE];
 };
 
 struct file_descriptor {
   bool is_used;
   uint16_t inode_number;
   int offset;
+  int next_free; // next descriptor on the free list, -1 for none
+  // How the file is read through the descriptor, FS_ADVICE_NORMAL,
+  // SEQUENTIAL or RANDOM, and the range of it readahead covers: reads within
+  // the range continue it, its blocks from readahead_end on were prefetched
+  // and readahead_size bytes are prefetched past the next read.
+  int advice;
+  int readahead_start;
+  int readahead_end;
+  int readahead_size;
+};
+
+// Compressed files are stored in clusters of COMPRESSION_CLUSTER_BLOCKS data
+// blocks. The block map entries of a cluster hold the blocks of its stored run
+// and are 0 past the end of the run. A run with fewer blocks than the cluster
+// holds data for starts with this header, followed by the lz stream; any other
+// run holds the data as is.
+struct compressed_cluster {
+  uint32_t compressed_size;
+  uint8_t data[];
 };
 
 enum indirection_level {
@@ -57,58 +179,1115 @@ enum indirection_level {
   DOUBLE_INDIRECTION,
 };
 
-// in-memory and on-disk
-struct super_block sb;
-struct dir_entry dir_table[MAX_FILES];
-uint8_t inode_bitmap[MAX_FILES / CHAR_BIT];
-uint8_t used_block_bitmap[DISK_BLOCKS / CHAR_BIT];
-struct inode inode_table[MAX_FILES];
+// State shared by the fsck worker threads. The block maps of the inodes with
+// a directory entry are walked first, keeping the indirect blocks they read
+// in indirect; then the disk is streamed past the checksums. refs counts the
+// block map entries pointing at each block as a data block, indirect_refs as
+// an indirect block. Indirect blocks with entries cleared by a repair are
+// marked in rewritten.
+struct fsck_state {
+  struct fs_ctx *ctx; // of the calling thread, for the workers
+  union fs_block *indirect[DISK_BLOCKS]; // of block_size bytes each
+  int num_threads;
+  bool repair;
+  bool has_dentry[MAX_FILES];
+  uint16_t refs[DISK_BLOCKS];
+  uint16_t indirect_refs[DISK_BLOCKS];
+  uint8_t rewritten[DISK_BLOCKS / CHAR_BIT];
+  uint64_t bad_pointers;
+  uint64_t checksum_errors;
+  uint64_t bytes_read;
+  bool has_error;
+};
+
+// Each worker handles the share of the blocks or inodes picked by its index.
+struct fsck_worker {
+  struct fsck_state *state;
+  int idx;
+  void *(*fn)(void *);
+  pthread_t thread;
+};
+
+// A position in the caller's buffers of a read or write, which copying to or
+// from them advances. iov is the buffer the position is in, and offset how
+// far into it; empty buffers are skipped.
+struct iov_iter {
+  const struct iovec *iov;
+  int iovcnt; // buffers left, iov included
+  size_t offset;
+};
+
+// A run of physically consecutive data blocks of a parallel write, written
+// with one system call from the part of the caller's buffers at buf.
+struct write_chunk {
+  int block_num;
+  int count;
+  const char *buf;
+};
+
+// State shared by the workers of a parallel write, which take the chunks in
+// turn.
+struct write_state {
+  struct fs_ctx *ctx; // of the calling thread, for the workers
+  struct write_chunk *chunks;
+  int num_chunks;
+  int next_chunk;
+  bool has_error;
+};
+
+// One disk request of an asynchronous read or write. A read of a block the
+// caller's buffer covers only part of goes to a bounce block of the request,
+// and copy_len bytes starting copy_from bytes into it are then copied to
+// copy_to.
+struct async_part {
+  struct disk_request req; // first, so that a request leads to its part
+  struct async_request *request;
+  char *copy_to;
+  int copy_from;
+  size_t copy_len;
+};
+
+// An asynchronous read or write, complete once all of its parts are. It then
+// waits on the completion queue of its context until reaped.
+struct async_request {
+  struct fs_ctx *ctx; // of the submitting thread, for the completions
+  uint64_t user_data;
+  int result;  // bytes read or written, unless a part fails
+  int pending; // parts not done yet, plus one until all are submitted
+  bool has_error;
+  bool is_read;
+  int data_inum; // whose lock of file data the parts hold, or -1
+  struct async_request *next; // on the completion queue
+  union fs_block bounce[2];
+  int num_parts;
+  struct async_part parts[];
+};
+
+// A range handed out by fs_map: either the blocks holding it, mapped from the
+// disk and pinned, or a copy of it assembled in memory.
+struct mapping {
+  const void *ptr; // as returned to the caller
+  void *mem;       // the mapped blocks, or the copy
+  int first_block; // of the mapped blocks, -1 for a copy
+  int count;
+  struct mapping *next;
+};
+
+// Statistics counted by the threads that share a shard; see stats_shard.
+struct stats_shard {
+  struct fs_stats stats; // without the disk_* fields, counted in disk
+  struct disk_stats disk;
+};
+
+// A public call in progress, timed by op_start and op_end and logged to the
+// trace with the arguments it took.
+struct op_call {
+  enum fs_op op;
+  uint64_t start;
+  int fd;
+  int64_t offset;
+  size_t size;
+  const char *name;
+  int src_fd; // of a copy, else -1
+  int64_t src_offset;
+  int advice; // of an advise, else 0
+};
+
+// Metadata kept in memory while mounted, and where it is stored on disk.
+struct metadata_region {
+  void *mem;
+  size_t size;
+  const uint16_t *offset; // super block field holding the first block
+  int first_block;        // relative to *offset, -1 right after the previous
+  uint32_t feature;       // FS_FEATURE_* the region exists for, 0 if always
+  bool is_lazy;           // loaded on first use after a clean mount
+  bool is_loaded;
+};
+
+// The segment in POSIX shared memory through which the processes sharing a
+// mount of an image keep their copies of its metadata current; see
+// mount_fs_shared. lock is held by a process while its calls change
+// metadata, and is_changing tells whether the holder may be in the middle of
+// a change; see join_change. lock is robust: a process that dies holding it
+// hands it to the next one, which recovers the image if the dead one was
+// changing it; see lock_segment. Commits publish the end of the journal,
+// journal_pos and journal_sequence, and count in generation; checkpoints
+// count in checkpoints. Both counts are odd while their fields change, so
+// that other processes read them like a seqlock, without the lock; see
+// refresh_metadata. The rest of the segment only changes with the image
+// locked by lock_image; open_count is the number of descriptors open on each
+// inode in all of the processes, so that none of them deletes a file open in
+// another.
+struct shared_mount {
+  pthread_mutex_t lock;
+  bool is_changing;
+  uint64_t generation;
+  uint64_t checkpoints;
+  int journal_pos;
+  uint32_t journal_sequence;
+  int open_count[MAX_FILES];
+};
+
+// A set of metadata blocks, as a bitmap by block number; metadata lies within
+// the first JOURNAL_MAX_BLOCKS blocks.
+struct block_set {
+  uint64_t words[BLOCK_SET_WORDS];
+};
+
+// State of one file system, mounted or not. The library functions work on the
+// context ctx points at: the default context, unless the calling thread is in
+// one of the fs_ctx_* functions, which select the context they are given.
+struct fs_ctx {
+  struct disk disk; // unused by the default context, see enter_ctx
+  // in-memory and on-disk
+  struct super_block sb;
+  struct dir_entry dir_table[MAX_FILES];
+  uint8_t inode_bitmap[MAX_FILES / CHAR_BIT];
+  uint8_t used_block_bitmap[DISK_BLOCKS / CHAR_BIT];
+  struct inode inode_table[MAX_FILES];
+  // The snapshot area, from sb.snapshot_offset. The first three are frozen
+  // copies of the live metadata, the block bitmap marks every block the
+  // snapshot references and the free bitmap marks the ones the live file
+  // system has since let go of.
+  struct dir_entry snapshot_dir_table[MAX_FILES];
+  uint8_t snapshot_inode_bitmap[MAX_FILES / CHAR_BIT];
+  struct inode snapshot_inode_table[MAX_FILES];
+  uint8_t snapshot_block_bitmap[DISK_BLOCKS / CHAR_BIT];
+  uint8_t snapshot_free_bitmap[DISK_BLOCKS / CHAR_BIT];
+  // number of block map entries pointing at each data block, and the hash of
+  // its contents; both only maintained with FS_FEATURE_DEDUP
+  uint16_t block_refcount[DISK_BLOCKS];
+  uint64_t block_fingerprint[DISK_BLOCKS];
+  // CRC32C of every data and indirect block, only maintained with
+  // FS_FEATURE_CHECKSUM; see block_checksum
+  uint32_t block_checksums[DISK_BLOCKS];
+  struct metadata_region metadata_regions[METADATA_REGIONS];
 
-// in-memory only
-bool is_mounted = false;
-struct file_descriptor fds[MAX_FD];
+  // in-memory only
+  // Locks, always taken in this order. mount_lock is held shared by every
+  // call and exclusively by the calls that replace or walk all of the state.
+  // On a shared mount, the locks of file data on the image come next, then
+  // the lock of the shared segment or refresh_lock; see lock_shared.
+  // op_lock is held shared by operations while they change metadata and
+  // exclusively by journal commits, so a commit only ever sees whole
+  // operations. dir_lock protects the directory table and the inode bitmap,
+  // inode_locks each inode and its data, alloc_lock the block bitmaps, free
+  // counts and dedup state, region_lock the loading of lazy regions and
+  // journal_lock the group commit counters. fd_lock serializes growing the
+  // descriptor table and is never held while taking another lock; neither is
+  // map_lock, which guards the list of mappings.
+  pthread_rwlock_t mount_lock;
+  pthread_rwlock_t op_lock;
+  pthread_mutex_t dir_lock;
+  pthread_rwlock_t inode_locks[MAX_FILES];
+  pthread_mutex_t alloc_lock; // recursive
+  pthread_mutex_t region_lock;
+  pthread_mutex_t journal_lock;
+  pthread_mutex_t fd_lock;
+  pthread_mutex_t map_lock;
+  // Ranges handed out by fs_map, and how many of them pin each data block.
+  // Pinned blocks are never written in place, moved or reused: writes move
+  // the file to new blocks, as for blocks shared with the snapshot, and
+  // blocks freed while pinned are set in pinned_free_bitmap and only freed
+  // once the last mapping of them goes. Pins change under alloc_lock.
+  struct mapping *mappings;
+  int block_pins[DISK_BLOCKS];
+  uint8_t pinned_free_bitmap[DISK_BLOCKS / CHAR_BIT];
+  // Asynchronous requests in flight, and the completed ones not reaped yet.
+  // async_lock protects both and is taken last; async_cond is signalled as
+  // requests complete.
+  pthread_mutex_t async_lock;
+  pthread_cond_t async_cond;
+  int async_inflight;
+  struct async_request *async_completed;
+  struct async_request *async_completed_tail;
+  // Statistics, counted in shards so that threads rarely update the same
+  // counters. fs_stats sums the shards and subtracts stats_base, the sum at
+  // the last reset; stats_lock serializes the two.
+  struct stats_shard stats_shards[STATS_SHARDS];
+  struct fs_stats stats_base;
+  pthread_mutex_t stats_lock;
+  // The file calls are logged to while tracing, and when the trace started.
+  // trace_lock keeps the records whole and guards starting and stopping.
+  FILE *trace_file;
+  uint64_t trace_start_ns;
+  pthread_mutex_t trace_lock;
+  bool is_mounted;
+  bool is_read_only;
+  // open addressing hash table of the blocks with a fingerprint, keyed by it
+  uint16_t dedup_index[DEDUP_INDEX_SIZE];
+  bool is_dedup_index_loaded;
+  uint64_t dedup_lookups;
+  uint64_t dedup_hits;
+  // Descriptors live in chunks that never move once added, so they are
+  // looked up without a lock. The free ones form a lock-free stack:
+  // fd_free_head holds the top descriptor plus one in its low 32 bits and
+  // the number of pops in its high 32 bits, so a pop fails on a stale top.
+  struct file_descriptor *fd_chunks[FD_CHUNKS];
+  int num_fd_chunks;
+  uint64_t fd_free_head;
+  int open_count[MAX_FILES]; // descriptors open on each inode
+  int write_threads;         // for large writes, 0 for one per online CPU
+  int num_free_blocks;
+  int num_free_inodes;
+  // Sets of metadata blocks. dirty_blocks changed since their last commit:
+  // op_dirty_blocks during the current operation of a thread,
+  // inode_dirty_blocks[i] during earlier operations on inode i and
+  // unowned_dirty_blocks during earlier operations on no inode in particular.
+  // journaled_blocks were committed since the last checkpoint, as
+  // committed_blocks holds them.
+  struct block_set dirty_blocks;
+  struct block_set inode_dirty_blocks[MAX_FILES];
+  struct block_set unowned_dirty_blocks;
+  struct block_set journaled_blocks;
+  char committed_blocks[JOURNAL_BUFFER_SIZE]; // see BLOCK_AT
+  // data blocks freed since the last commit; committed metadata may still
+  // reference them, so they are only cleared and reused after the next commit
+  uint8_t freed_block_bitmap[DISK_BLOCKS / CHAR_BIT];
+  int freed_block_count;
+  // data and indirect blocks claimed since the last commit; no committed
+  // metadata references them yet, so only they are written in place
+  uint8_t claimed_block_bitmap[DISK_BLOCKS / CHAR_BIT];
+  uint32_t journal_sequence; // sequence number of the next transaction
+  int journal_pos;           // journal block the next transaction starts at
+  int journal_pending_ops;   // operations since the last commit
+  struct timespec journal_first_op_time;
+  char journal_blocks[JOURNAL_BUFFER_SIZE];
+  // bytes per block of the disk, and the checksum of a block of zeros
+  int block_size;
+  uint32_t zero_block_crc;
+  // Log-structured images claim blocks at sb.log_head; see claim_log_block.
+  // segment_used counts the used blocks of each segment and
+  // num_clean_segments the segments without any, both under alloc_lock while
+  // mounted. clean_victims marks the segments the cleaning pass in progress
+  // empties, also under alloc_lock, or is NULL. The cleaner thread runs while
+  // such an image is mounted read-write; cleaner_lock guards its flags and
+  // cleaner_cond wakes it.
+  int segment_used[LOG_SEGMENTS];
+  int num_clean_segments;
+  const bool *clean_victims;
+  pthread_t cleaner_thread;
+  bool has_cleaner;
+  bool is_cleaner_due;
+  bool is_cleaner_stopping;
+  pthread_mutex_t cleaner_lock;
+  pthread_cond_t cleaner_cond;
+  // The segment of a shared mount, or NULL, and its name. lock_fd is the
+  // image, open again to lock it against other processes with lock_image
+  // while mounted. shared_generation and shared_checkpoints are the counts of
+  // the segment the metadata in memory reflects, UINT64_MAX before it is
+  // first loaded. refresh_lock is held shared by the calls that only read
+  // metadata and exclusively to bring it up to date.
+  struct shared_mount *shared;
+  char shared_name[64];
+  int lock_fd;
+  uint64_t shared_generation;
+  uint64_t shared_checkpoints;
+  pthread_rwlock_t refresh_lock;
+  // The calls changing a shared mount, counted in shared_changes. The first
+  // one takes the lock of the segment for all of them, as shared_owner, and
+  // sets is_shared_held; it releases the lock once the others are done,
+  // with is_shared_releasing set meanwhile. change_lock guards the four and
+  // change_cond is signalled as they change.
+  int shared_changes;
+  bool is_shared_held;
+  bool is_shared_releasing;
+  pthread_t shared_owner;
+  pthread_mutex_t change_lock;
+  pthread_cond_t change_cond;
+  // The lock of the data of each file on the image held by a shared mount,
+  // F_UNLCK, F_RDLCK or F_WRLCK, the calls of the process relying on it, and
+  // whether a thread is waiting for the image to grant one. file_lock guards
+  // them and file_cond is signalled as they change; see lock_file_data.
+  short file_lock_types[MAX_FILES];
+  int file_readers[MAX_FILES];
+  int file_writers[MAX_FILES];
+  bool is_file_locking[MAX_FILES];
+  pthread_mutex_t file_lock;
+  pthread_cond_t file_cond;
+};
+
+static const uint16_t super_block_offset = 0;
+struct fs_ctx default_ctx;
+pthread_once_t library_once = PTHREAD_ONCE_INIT;
+__thread struct fs_ctx *ctx = &default_ctx;
+__thread struct block_set op_dirty_blocks;
+__thread int stats_shard_idx = -1; // of the calling thread, once it counts
+int next_stats_shard;
 
 /*
  * Helper functions
  */
 
 bool memvcmp(void *memory, unsigned char val, unsigned int size);
+static void init_ctx(struct fs_ctx *c);
+static void destroy_ctx(struct fs_ctx *c);
+static void init_library();
+static void set_block_size(int block_size);
+static struct fs_ctx *enter_ctx(struct fs_ctx *c);
+static void lock_mount(bool is_write);
+static struct fs_ctx *mount_ctx(const char *disk_name,
+                                int (*mount)(const char *disk_name));
+static struct stats_shard *stats_shard();
+static void stat_add(uint64_t *counter, uint64_t n);
+static uint64_t now_ns();
+static struct op_call op_start(enum fs_op op, int fd, int64_t offset,
+                               size_t size, const char *name);
+static int op_end(const struct op_call *call, int ret);
+static void trace_call(const struct op_call *call, uint64_t ns, int ret);
+static void sum_stats(struct fs_stats *stats);
+static void lock_alloc();
+static void unlock_alloc();
+static void lock_inode(int inum, bool is_write);
+static void unlock_inode(int inum);
+static int lock_mount_fd(const char *func, int fildes, bool is_write);
+static int lock_change(const char *func, int reserve_blocks);
+static int lock_file(const char *func, int fildes, bool is_write,
+                     int reserve_blocks);
+static int unlock_file(int inum, bool is_write, int ret);
+static bool has_free_blocks();
+static struct file_descriptor *get_fd(int fildes);
+static int grow_fds();
+static int claim_fd();
+static void release_fd(int fildes);
+static void free_fds();
 static struct dir_entry *get_dentry(const char *name);
 static struct dir_entry *claim_dentry(uint16_t inum, const char *name);
 static void clear_dentry(struct dir_entry *dentry);
 static bool bitmap_test(const uint8_t *bitmap, int idx);
 static void bitmap_set(uint8_t *bitmap, int idx, bool val);
-static bool bitmap_full(const uint8_t *bitmap, int size);
 static int claim_inum_from_bitmap();
 static int claim_unused_data_block();
-static int add_inode_data_block(uint16_t inum, uint16_t block_num);
+static int claim_log_block();
+static uint32_t block_checksum(const void *block_buffer);
+static int verify_block_checksum(int block_num, const void *block_buffer);
+static int data_block_read(int block_num, void *block_buffer);
+static int data_block_write(int block_num, const void *block_buffer);
+static bool is_snapshot_block(uint16_t block_num);
+static bool is_shared_block(uint16_t block_num);
+static bool is_in_place_block(uint16_t block_num);
+static int free_data_block(uint16_t block_num);
+static void dedup_index_insert(uint16_t block_num);
+static void dedup_index_remove(uint16_t block_num);
+static int dedup_lookup(uint64_t fingerprint,
+                        const union fs_block *block_buffer);
+static int release_data_block(uint16_t block_num);
+static int write_indirect_block(uint16_t *block_num,
+                                const union fs_block *block_buffer);
+static int set_indirect_entry(uint16_t *block_num, int idx, uint16_t value);
+static int set_data_block_num(uint16_t inum, int file_offset,
+                              uint16_t block_num);
 static int get_data_block_num(uint16_t inum, int file_offset);
-static size_t read_bytes(int block_num, struct file_descriptor *fd, void *buf,
-                         size_t nbyte);
+static int get_data_block_nums(uint16_t inum, int first_block_idx, int count,
+                               uint16_t *block_nums);
+static int set_indirect_entries(uint16_t *block_num, int first_idx, int count,
+                                const uint16_t *values);
+static int set_data_block_nums(uint16_t inum, int first_block_idx, int count,
+                               const uint16_t *block_nums);
+static int claim_data_blocks(int count, int reserve, uint16_t *block_nums);
+static void iter_init(struct iov_iter *iter, const struct iovec *iov,
+                      int iovcnt);
+static void iter_advance(struct iov_iter *iter, size_t n);
+static char *iter_contiguous(const struct iov_iter *iter, size_t n);
+static void iter_gather(struct iov_iter *iter, void *dst, size_t n);
+static void iter_scatter(struct iov_iter *iter, const void *src, size_t n);
+static ssize_t iov_length(const struct iovec *iov, int iovcnt);
+static int read_data_run(int block_num, int count, int offset_in_block,
+                         struct iov_iter *iter, size_t nbyte);
+static size_t read_bytes(int block_num, struct file_descriptor *fd,
+                         struct iov_iter *iter, size_t nbyte);
+static int write_data_block(uint16_t inum, int file_offset, int *block_num,
+                            const union fs_block *block_buffer);
+static int store_data_block(uint16_t inum, int file_offset, int *block_num,
+                            const union fs_block *block_buffer);
 static size_t write_bytes(int block_num, struct file_descriptor *fd,
-                          const void *buf, size_t nbyte);
+                          struct iov_iter *iter, size_t nbyte);
+static size_t write_bytes_at(struct file_descriptor *fd, struct iov_iter *iter,
+                             size_t nbyte);
+static int claim_mapped_blocks(uint16_t inum, int first_block_idx, int count,
+                               uint16_t *block_nums, uint16_t *old_block_nums);
+static int install_mapped_blocks(uint16_t inum, int first_block_idx,
+                                 int count, const uint16_t *block_nums,
+                                 const uint16_t *old_block_nums);
+static void unclaim_mapped_blocks(int count, const uint16_t *block_nums,
+                                  const uint16_t *old_block_nums);
+static int map_data_blocks(uint16_t inum, int first_block_idx, int count,
+                           uint16_t *block_nums);
+static int write_threads();
+static void *write_worker(void *arg);
+static size_t write_bytes_parallel(struct file_descriptor *fd,
+                                   struct iov_iter *iter, size_t nbyte);
+static struct async_request *new_async_request(uint64_t user_data, int result,
+                                               int max_parts);
+static struct async_part *add_async_part(struct async_request *request,
+                                         int block_num, int count, void *buf,
+                                         bool is_write);
+static int submit_async(struct async_request *request);
+static void async_part_done(struct disk_request *req);
+static void complete_async(struct async_request *request);
+static void wait_async();
+static void free_async_completions();
+static int read_cluster(uint16_t inum, int cluster_idx, char *buf);
+static int write_cluster(uint16_t inum, int cluster_idx, const char *buf,
+                         int size);
+static size_t read_bytes_compressed(struct file_descriptor *fd,
+                                    struct iov_iter *iter, size_t nbyte);
+static size_t write_bytes_compressed(struct file_descriptor *fd,
+                                     struct iov_iter *iter, size_t nbyte);
 static int clear_indirect_block(uint16_t block_num, int indirection_level);
+static int truncate_indirect_block(uint16_t *block_num, int indirection_level,
+                                   int first_free_idx);
+static int release_snapshot();
+static int read_region(int block_num, void *mem, size_t size);
+static int region_first_block(const struct metadata_region *region);
+static bool has_region(const struct metadata_region *region);
+static void block_set_add(struct block_set *set, int block_num);
+static bool block_set_test(const struct block_set *set, int block_num);
+static bool block_set_is_empty(const struct block_set *set);
+static bool block_set_overlaps(const struct block_set *a,
+                               const struct block_set *b);
+static void block_set_merge(struct block_set *dst, const struct block_set *src);
+static void block_set_remove(struct block_set *dst,
+                             const struct block_set *src);
+static void block_set_intersect(struct block_set *dst,
+                                const struct block_set *src);
+static void mark_dirty(const void *ptr, size_t size);
+static void get_metadata_block(int block_num, union fs_block *block_buffer);
+static void put_metadata_block(int block_num,
+                               const union fs_block *block_buffer);
+static int require_region(void *mem);
+static int load_dedup_index();
+static int load_metadata(bool load_all);
+static int read_metadata(bool load_all);
+static int count_free_bits(const uint8_t *bitmap, int first, int last);
+static int scan_indirect_block(uint16_t block_num, int indirection_level,
+                               uint8_t *referenced, uint16_t *refs,
+                               int *bad_blocks);
+static int scan_entry(uint16_t block_num, int indirection_level,
+                      uint8_t *referenced, uint16_t *refs, int *bad_blocks);
+static int scan_metadata();
+static void count_segments();
+static int mark_clean();
+static int run_fsck_workers(struct fsck_state *state, void *(*fn)(void *));
+static void *fsck_worker_main(void *arg);
+static void fsck_walk_entry(struct fsck_state *state, uint16_t *entry,
+                            uint16_t parent, int indirection_level);
+static void *fsck_walk_worker(void *arg);
+static bool fsck_is_referenced(struct fsck_state *state, int block_num);
+static void *fsck_verify_worker(void *arg);
+static int fsck_check(struct fsck_state *state, struct fs_fsck_report *report);
+static int count_extents(const uint16_t *block_nums, int count);
+static int count_free_extents();
+static int largest_free_extent();
+static int find_free_run(int length);
+static int move_data_block(uint16_t inum, int block_idx, uint16_t old_block_num,
+                           uint16_t new_block_num);
+static int defrag_file(uint16_t inum, int *budget,
+                       struct fs_defrag_report *report);
+static int defrag_file_locked(uint16_t inum, int *budget,
+                              struct fs_defrag_report *report);
+static int defrag_begin();
+static int commit_freed_blocks();
+static int copy_data_block(uint16_t old_block_num, uint16_t new_block_num);
+static int clean_reserve(int file_size);
+static int pick_victims(bool *victims);
+static int clean_file(uint16_t inum, const bool *victims, int *budget,
+                      struct fs_clean_report *report);
+static int clean_indirect_blocks(struct inode *inode, const bool *victims,
+                                 struct fs_clean_report *report);
+static void *cleaner_main(void *arg);
+static int start_cleaner();
+static void stop_cleaner();
+static void wake_cleaner();
+static int release_freed_blocks();
+static int reclaim_freed_blocks(int blocks);
+static int journal_recover();
+static int journal_commit_blocks(struct block_set blocks);
+static int journal_commit();
+static int journal_commit_inode(uint16_t inum);
+static int journal_checkpoint();
+static int journal_commit_all();
+static int journal_flush();
+static void journal_end_op(int inum);
+static int journal_commit_due();
+static int lock_image(int fd, short type, int byte, bool wait);
+static int lock_private(const char *disk_name);
+static void unlock_private();
+static void name_shared(const struct stat *st);
+static int open_shared(const char *disk_name, bool *is_first);
+static void close_shared(bool is_last);
+static int lock_segment(const char *func, bool is_change);
+static int recover_shared();
+static void publish_commit();
+static void start_checkpoint();
+static void end_checkpoint();
+static int apply_journal(int pos, uint32_t sequence, int end);
+static int reload_metadata(int end);
+static int refresh_metadata();
+static int wait_shared(const char *func);
+static int join_change(const char *func);
+static int leave_change(int ret);
+static int lock_shared(const char *func, bool is_change);
+static int unlock_shared(bool is_change, int ret);
+static int lock_file_data(int inum, bool is_write, bool wait);
+static void unlock_file_data(int inum, bool is_write);
+static void update_file_data_lock(int inum, bool is_kept);
+static void release_file_data();
+static int fs_open_locked(const char *name);
+static int fs_close_locked(int fildes);
+static int fs_create_locked(const char *name);
+static int fs_delete_locked(const char *name);
+static int release_inode_blocks(struct inode *inode);
+static int fs_read_locked(int fildes, void *buf, size_t nbyte);
+static int fs_write_locked(int fildes, void *buf, size_t nbyte);
+static int fs_readv_locked(int fildes, const struct iovec *iov, int iovcnt,
+                           size_t nbyte);
+static int fs_writev_locked(int fildes, const struct iovec *iov, int iovcnt,
+                            size_t nbyte);
+static int read_fd(struct file_descriptor *fd, struct iov_iter *iter,
+                   size_t nbyte);
+static int write_fd(struct file_descriptor *fd, struct iov_iter *iter,
+                    size_t nbyte);
+static int lock_files(int src_fildes, int dst_fildes, int reserve_blocks,
+                      int *src_inum);
+static int unlock_files(int src_inum, int dst_inum, int ret);
+static int fs_copy_range_locked(int src_fildes, off_t src_offset,
+                                int dst_fildes, off_t dst_offset, size_t len);
+static size_t copy_buffered(struct file_descriptor *src,
+                            struct file_descriptor *dst, size_t nbyte);
+static int copy_blocks(struct file_descriptor *src, struct file_descriptor *dst,
+                       int count);
+static int share_data_blocks(uint16_t inum, int first_block_idx, int count,
+                             const uint16_t *block_nums);
+static int fs_map_locked(int fildes, off_t offset, size_t len,
+                         const void **ptr);
+static struct mapping *map_blocks(uint16_t inum, int offset, int len);
+static struct mapping *map_copy(int fildes, int offset, int len);
+static int release_mapping(struct mapping *m);
+static int release_mappings();
+static int fs_advise_locked(int fildes, off_t offset, size_t len, int advice);
+static int advise_blocks(uint16_t inum, int offset, int len, bool is_prefetch);
+static void readahead_fd(struct file_descriptor *fd, size_t nbyte);
+static void evict_behind(struct file_descriptor *fd);
+static int fs_listfiles_locked(char ***files);
+static int fs_lseek_locked(int fildes, off_t offset);
+static int fs_truncate_locked(int fildes, off_t length);
+static int make_fs_locked(const char *disk_name, const struct fs_options *opts);
+static int mount_fs_locked(const char *disk_name);
+static int mount_fs_shared_locked(const char *disk_name);
+static int umount_fs_locked();
+static int fs_snapshot_create_locked();
+static int fs_snapshot_delete_locked();
+static int fs_snapshot_mount_locked(const char *disk_name);
+static int fs_dedup_stats_locked(struct fs_dedup_stats *stats);
+static int fs_statfs_locked(struct fs_statfs *statfs);
+static int fs_fsck_locked(const char *disk_name,
+                          const struct fs_fsck_options *opts,
+                          struct fs_fsck_report *report);
+static int fs_defrag_locked(const char *name, struct fs_defrag_report *report);
+static int fs_defrag_all_locked(struct fs_defrag_report *report);
+static int fs_clean_locked(struct fs_clean_report *report);
+static int fs_fsync_locked(int fildes);
+static int fs_read_async_locked(int fildes, void *buf, size_t nbyte,
+                                uint64_t user_data);
+static int fs_write_async_locked(int fildes, void *buf, size_t nbyte,
+                                 uint64_t user_data);
 
 bool memvcmp(void *memory, unsigned char val, unsigned int size) {
   unsigned char *mm = (unsigned char *)memory;
   return (*mm == val) && (memcmp(mm, mm + 1, size - 1) == 0);
 }
 
+// Sets up the region table and the locks of context c. alloc_lock is
+// recursive, since freeing a block may free others.
+void init_ctx(struct fs_ctx *c) {
+  struct metadata_region regions[] = {
+      {&c->sb, sizeof(c->sb), &super_block_offset, 0, 0, false},
+      {c->dir_table, sizeof(c->dir_table), &c->sb.dir_table_offset, 0, 0,
+       false},
+      {c->inode_bitmap, sizeof(c->inode_bitmap), &c->sb.inode_metadata_offset,
+       0, 0, false},
+      {c->used_block_bitmap, sizeof(c->used_block_bitmap),
+       &c->sb.used_block_bitmap_offset, 0, 0, false},
+      {c->inode_table, sizeof(c->inode_table), &c->sb.inode_offset, 0, 0,
+       false},
+      {c->snapshot_dir_table, sizeof(c->snapshot_dir_table),
+       &c->sb.snapshot_offset, 0, 0, true},
+      {c->snapshot_inode_bitmap, sizeof(c->snapshot_inode_bitmap),
+       &c->sb.snapshot_offset, -1, 0, true},
+      {c->snapshot_inode_table, sizeof(c->snapshot_inode_table),
+       &c->sb.snapshot_offset, -1, 0, true},
+      {c->snapshot_block_bitmap, sizeof(c->snapshot_block_bitmap),
+       &c->sb.snapshot_offset, -1, 0, false},
+      {c->snapshot_free_bitmap, sizeof(c->snapshot_free_bitmap),
+       &c->sb.snapshot_offset, -1, 0, false},
+      {c->block_refcount, sizeof(c->block_refcount), &c->sb.dedup_offset, 0,
+       FS_FEATURE_DEDUP, true},
+      {c->block_fingerprint, sizeof(c->block_fingerprint), &c->sb.dedup_offset,
+       -1, FS_FEATURE_DEDUP, true},
+      {c->block_checksums, sizeof(c->block_checksums), &c->sb.checksum_offset,
+       0, FS_FEATURE_CHECKSUM, true},
+  };
+  assert(sizeof(regions) == sizeof(c->metadata_regions));
+  memcpy(c->metadata_regions, regions, sizeof(regions));
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&c->alloc_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_rwlock_init(&c->mount_lock, NULL);
+  pthread_rwlock_init(&c->op_lock, NULL);
+  pthread_mutex_init(&c->dir_lock, NULL);
+  for (int i = 0; i < MAX_FILES; i++) {
+    pthread_rwlock_init(&c->inode_locks[i], NULL);
+  }
+  pthread_mutex_init(&c->region_lock, NULL);
+  pthread_mutex_init(&c->journal_lock, NULL);
+  pthread_mutex_init(&c->fd_lock, NULL);
+  pthread_mutex_init(&c->map_lock, NULL);
+  pthread_mutex_init(&c->async_lock, NULL);
+  pthread_cond_init(&c->async_cond, NULL);
+  pthread_mutex_init(&c->stats_lock, NULL);
+  pthread_mutex_init(&c->trace_lock, NULL);
+  pthread_mutex_init(&c->cleaner_lock, NULL);
+  pthread_cond_init(&c->cleaner_cond, NULL);
+  pthread_rwlock_init(&c->refresh_lock, NULL);
+  pthread_mutex_init(&c->change_lock, NULL);
+  pthread_cond_init(&c->change_cond, NULL);
+  pthread_mutex_init(&c->file_lock, NULL);
+  pthread_cond_init(&c->file_cond, NULL);
+  c->lock_fd = -1;
+}
+
+// Destroys the locks of context c.
+void destroy_ctx(struct fs_ctx *c) {
+  pthread_rwlock_destroy(&c->mount_lock);
+  pthread_rwlock_destroy(&c->op_lock);
+  pthread_mutex_destroy(&c->dir_lock);
+  for (int i = 0; i < MAX_FILES; i++) {
+    pthread_rwlock_destroy(&c->inode_locks[i]);
+  }
+  pthread_mutex_destroy(&c->alloc_lock);
+  pthread_mutex_destroy(&c->region_lock);
+  pthread_mutex_destroy(&c->journal_lock);
+  pthread_mutex_destroy(&c->fd_lock);
+  pthread_mutex_destroy(&c->map_lock);
+  pthread_mutex_destroy(&c->async_lock);
+  pthread_cond_destroy(&c->async_cond);
+  pthread_mutex_destroy(&c->stats_lock);
+  pthread_mutex_destroy(&c->trace_lock);
+  pthread_mutex_destroy(&c->cleaner_lock);
+  pthread_cond_destroy(&c->cleaner_cond);
+  pthread_rwlock_destroy(&c->refresh_lock);
+  pthread_mutex_destroy(&c->change_lock);
+  pthread_cond_destroy(&c->change_cond);
+  pthread_mutex_destroy(&c->file_lock);
+  pthread_cond_destroy(&c->file_cond);
+  if (c->trace_file) {
+    fclose(c->trace_file);
+  }
+  disk_set_stats(NULL); // they may have been counted in c
+}
+
+// Sets up the default context.
+void init_library() { init_ctx(&default_ctx); }
+
+// Makes the current context work with blocks of block_size bytes.
+void set_block_size(int block_size) {
+  static const char zeros[MAX_BLOCK_SIZE];
+  ctx->block_size = block_size;
+  ctx->zero_block_crc = crc32c(0, zeros, block_size);
+}
+
+// Makes the calling thread work on context c and the disk it opened. Returns
+// the context the thread worked on before.
+struct fs_ctx *enter_ctx(struct fs_ctx *c) {
+  struct fs_ctx *prev = ctx;
+  ctx = c;
+  // the default context uses the default disk, like code outside this file
+  disk_select(c == &default_ctx ? NULL : &c->disk);
+  disk_set_stats(&stats_shard()->disk);
+  return prev;
+}
+
+// Takes mount_lock, which every call takes first; the library is set up on
+// first use.
+void lock_mount(bool is_write) {
+  pthread_once(&library_once, init_library);
+  disk_set_stats(&stats_shard()->disk);
+  if (is_write) {
+    pthread_rwlock_wrlock(&ctx->mount_lock);
+  } else {
+    pthread_rwlock_rdlock(&ctx->mount_lock);
+  }
+}
+
+// The statistics shard of the calling thread in the current context. Threads
+// are dealt the shards in turn as they first count something.
+struct stats_shard *stats_shard() {
+  if (stats_shard_idx == -1) {
+    stats_shard_idx =
+        __atomic_fetch_add(&next_stats_shard, 1, __ATOMIC_RELAXED) %
+        STATS_SHARDS;
+  }
+  return &ctx->stats_shards[stats_shard_idx];
+}
+
+void stat_add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Starts timing a call to op with the arguments the trace records; offset is
+// -1 and name NULL if the call takes none.
+struct op_call op_start(enum fs_op op, int fd, int64_t offset, size_t size,
+                        const char *name) {
+  struct op_call call = {op, now_ns(), fd, offset, size, name, -1, -1, 0};
+  return call;
+}
+
+// Counts call, logs it if tracing, and returns its result ret.
+int op_end(const struct op_call *call, int ret) {
+  uint64_t ns = now_ns() - call->start;
+  struct fs_op_stats *op_stats = &stats_shard()->stats.ops[call->op];
+  int bucket = ns ? MIN(63 - __builtin_clzll(ns), FS_STATS_BUCKETS - 1) : 0;
+  stat_add(&op_stats->calls, 1);
+  stat_add(&op_stats->errors, ret == -1);
+  stat_add(&op_stats->total_ns, ns);
+  stat_add(&op_stats->latency[bucket], 1);
+  if (__atomic_load_n(&ctx->trace_file, __ATOMIC_ACQUIRE)) {
+    trace_call(call, ns, ret);
+  }
+  return ret;
+}
+
+// Appends the record of call, which took ns and returned ret, to the trace.
+// A call that started before the trace did is logged at its start.
+void trace_call(const struct op_call *call, uint64_t ns, int ret) {
+  struct fs_trace_record record = {0};
+  size_t name_len = call->name ? strnlen(call->name, UINT8_MAX) : 0;
+  record.offset = call->offset;
+  record.src_offset = call->src_offset;
+  record.size = MIN(call->size, UINT32_MAX);
+  record.fd = call->fd;
+  record.src_fd = call->src_fd;
+  record.result = ret;
+  record.duration_ns = MIN(ns, UINT32_MAX);
+  record.op = call->op;
+  record.advice = call->advice;
+  record.name_len = name_len;
+  pthread_mutex_lock(&ctx->trace_lock);
+  if (ctx->trace_file) {
+    if (call->start > ctx->trace_start_ns) {
+      record.time_ns = call->start - ctx->trace_start_ns;
+    }
+    fwrite(&record, sizeof(record), 1, ctx->trace_file);
+    fwrite(call->name, 1, name_len, ctx->trace_file);
+  }
+  pthread_mutex_unlock(&ctx->trace_lock);
+}
+
+// Sums the shards of the current context into stats.
+void sum_stats(struct fs_stats *stats) {
+  assert(sizeof(*stats) % sizeof(uint64_t) == 0);
+  uint64_t *sum = (uint64_t *)stats;
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < STATS_SHARDS; i++) {
+    struct stats_shard *shard = &ctx->stats_shards[i];
+    uint64_t *counters = (uint64_t *)&shard->stats;
+    for (size_t j = 0; j < sizeof(*stats) / sizeof(uint64_t); j++) {
+      sum[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+    }
+    struct disk_stats *disk = &shard->disk;
+    stats->disk_reads.calls += __atomic_load_n(&disk->reads, __ATOMIC_RELAXED);
+    stats->disk_reads.bytes +=
+        __atomic_load_n(&disk->read_bytes, __ATOMIC_RELAXED);
+    stats->disk_reads.ns += __atomic_load_n(&disk->read_ns, __ATOMIC_RELAXED);
+    stats->disk_writes.calls +=
+        __atomic_load_n(&disk->writes, __ATOMIC_RELAXED);
+    stats->disk_writes.bytes +=
+        __atomic_load_n(&disk->write_bytes, __ATOMIC_RELAXED);
+    stats->disk_writes.ns += __atomic_load_n(&disk->write_ns, __ATOMIC_RELAXED);
+    stats->disk_syncs.calls += __atomic_load_n(&disk->syncs, __ATOMIC_RELAXED);
+    stats->disk_syncs.ns += __atomic_load_n(&disk->sync_ns, __ATOMIC_RELAXED);
+  }
+}
+
+void lock_alloc() { pthread_mutex_lock(&ctx->alloc_lock); }
+
+void unlock_alloc() { pthread_mutex_unlock(&ctx->alloc_lock); }
+
+void lock_inode(int inum, bool is_write) {
+  if (is_write) {
+    pthread_rwlock_wrlock(&ctx->inode_locks[inum]);
+  } else {
+    pthread_rwlock_rdlock(&ctx->inode_locks[inum]);
+  }
+}
+
+void unlock_inode(int inum) { pthread_rwlock_unlock(&ctx->inode_locks[inum]); }
+
+// Takes mount_lock shared for an operation on the file open as fildes, which
+// changes the file if is_write. Returns its inode number, or -1 with the lock
+// released if the file system is not mounted, or read-only for a change, or
+// fildes is not open.
+int lock_mount_fd(const char *func, int fildes, bool is_write) {
+  lock_mount(false);
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "%s: file system not mounted\n", func);
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return -1;
+  }
+  if (is_write && ctx->is_read_only) {
+    fprintf(stderr, "%s: file system is read-only\n", func);
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return -1;
+  }
+  struct file_descriptor *fd = get_fd(fildes);
+  int inum = fd && fd->is_used ? fd->inode_number : -1;
+  if (inum == -1) {
+    fprintf(stderr, "%s: invalid file descriptor\n", func);
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return -1;
+  }
+  return inum;
+}
+
+// Takes the locks of an operation changing metadata once mount_lock is held:
+// the lock of a shared mount, see lock_shared, and op_lock shared, first
+// committing early if fewer than reserve_blocks blocks are free. Returns -1
+// with neither held.
+int lock_change(const char *func, int reserve_blocks) {
+  if (lock_shared(func, true)) {
+    return -1;
+  }
+  if (reclaim_freed_blocks(reserve_blocks)) {
+    fprintf(stderr, "%s: failed to reclaim freed blocks\n", func);
+    unlock_shared(true, -1);
+    return -1;
+  }
+  pthread_rwlock_rdlock(&ctx->op_lock);
+  return 0;
+}
+
+// Takes the locks of an operation on the file open as fildes: mount_lock
+// shared, on a shared mount the lock of the file data and of the mount, and
+// the inode lock, exclusive if the operation changes the file, in which case
+// op_lock is held shared as well; see lock_change. Returns the inode number,
+// or -1 with no lock held.
+int lock_file(const char *func, int fildes, bool is_write,
+              int reserve_blocks) {
+  int inum = lock_mount_fd(func, fildes, is_write);
+  if (inum == -1) {
+    return -1;
+  }
+  if (lock_file_data(inum, is_write, true)) {
+    fprintf(stderr, "%s: failed to lock file data\n", func);
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return -1;
+  }
+  if (is_write ? lock_change(func, reserve_blocks)
+               : lock_shared(func, false)) {
+    unlock_file_data(inum, is_write);
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return -1;
+  }
+  lock_inode(inum, is_write);
+  return inum;
+}
+
+// Releases the locks taken by lock_file and returns ret, or -1 if the group
+// commit the operation completed failed.
+int unlock_file(int inum, bool is_write, int ret) {
+  unlock_inode(inum);
+  if (is_write) {
+    journal_end_op(inum);
+    pthread_rwlock_unlock(&ctx->op_lock);
+    if (journal_commit_due()) {
+      ret = -1;
+    }
+    wake_cleaner();
+  }
+  ret = unlock_shared(is_write, ret);
+  unlock_file_data(inum, is_write);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+// Takes the locks of a copy from the file open as src_fildes to the one open
+// as dst_fildes: those lock_file takes for a change to the destination, and
+// those for a read of the source, the locks of file data and inode locks in
+// inode number order. Returns the destination inode number with the
+// source's in *src_inum, or -1 with no lock held.
+int lock_files(int src_fildes, int dst_fildes, int reserve_blocks,
+               int *src_inum) {
+  int dst_inum = lock_mount_fd("fs_copy_range", dst_fildes, true);
+  if (dst_inum == -1) {
+    return -1;
+  }
+  struct file_descriptor *fd = get_fd(src_fildes);
+  *src_inum = fd && fd->is_used ? fd->inode_number : -1;
+  if (*src_inum == -1) {
+    fprintf(stderr, "fs_copy_range: invalid file descriptor\n");
+    goto fail;
+  }
+  int first = MIN(*src_inum, dst_inum);
+  int last = MAX(*src_inum, dst_inum);
+  if (lock_file_data(first, first == dst_inum, true)) {
+    fprintf(stderr, "fs_copy_range: failed to lock file data\n");
+    goto fail;
+  }
+  if (last != first && lock_file_data(last, last == dst_inum, true)) {
+    fprintf(stderr, "fs_copy_range: failed to lock file data\n");
+    unlock_file_data(first, first == dst_inum);
+    goto fail;
+  }
+  if (lock_change("fs_copy_range", reserve_blocks)) {
+    if (last != first) {
+      unlock_file_data(last, last == dst_inum);
+    }
+    unlock_file_data(first, first == dst_inum);
+    goto fail;
+  }
+  lock_inode(first, first == dst_inum);
+  if (last != first) {
+    lock_inode(last, last == dst_inum);
+  }
+  return dst_inum;
+fail:
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return -1;
+}
+
+// Releases the locks taken by lock_files and returns ret, as unlock_file
+// does.
+int unlock_files(int src_inum, int dst_inum, int ret) {
+  if (src_inum != dst_inum) {
+    unlock_inode(src_inum);
+    unlock_file_data(src_inum, false);
+  }
+  return unlock_file(dst_inum, true, ret);
+}
+
+bool has_free_blocks() {
+  lock_alloc();
+  bool has_free = ctx->num_free_blocks > 0;
+  unlock_alloc();
+  return has_free;
+}
+
+// Returns descriptor fildes, or NULL if the table does not reach it.
+struct file_descriptor *get_fd(int fildes) {
+  if (fildes < 0 || fildes >= MAX_FD) {
+    return NULL;
+  }
+  struct file_descriptor *chunk = __atomic_load_n(
+      &ctx->fd_chunks[fildes / FD_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+  return chunk ? &chunk[fildes % FD_CHUNK_SIZE] : NULL;
+}
+
+// Adds a chunk of free descriptors to the table, unless another thread did
+// while this one waited for fd_lock.
+int grow_fds() {
+  pthread_mutex_lock(&ctx->fd_lock);
+  int ret = 0;
+  uint64_t head = __atomic_load_n(&ctx->fd_free_head, __ATOMIC_ACQUIRE);
+  if ((uint32_t)head == 0) {
+    struct file_descriptor *chunk = NULL;
+    if (ctx->num_fd_chunks < FD_CHUNKS) {
+      chunk = calloc(FD_CHUNK_SIZE, sizeof(*chunk));
+    }
+    if (chunk == NULL) {
+      ret = -1;
+    } else {
+      int first = ctx->num_fd_chunks * FD_CHUNK_SIZE;
+      for (int i = 0; i < FD_CHUNK_SIZE - 1; i++) {
+        chunk[i].next_free = first + i + 1;
+      }
+      __atomic_store_n(&ctx->fd_chunks[ctx->num_fd_chunks++], chunk,
+                       __ATOMIC_RELEASE);
+      // descriptors closed meanwhile go below the new ones
+      do {
+        __atomic_store_n(&chunk[FD_CHUNK_SIZE - 1].next_free,
+                         (int)(uint32_t)head - 1, __ATOMIC_RELAXED);
+      } while (__atomic_compare_exchange_n(
+                   &ctx->fd_free_head, &head,
+                   (head & ~(uint64_t)UINT32_MAX) | (uint32_t)(first + 1),
+                   true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == false);
+    }
+  }
+  pthread_mutex_unlock(&ctx->fd_lock);
+  return ret;
+}
+
+// Pops a free descriptor off the stack, growing the table when it is empty.
+// Returns -1 if the table is full.
+int claim_fd() {
+  uint64_t head = __atomic_load_n(&ctx->fd_free_head, __ATOMIC_ACQUIRE);
+  while (true) {
+    int fildes = (int)(uint32_t)head - 1;
+    if (fildes == -1) {
+      if (grow_fds()) {
+        return -1;
+      }
+      head = __atomic_load_n(&ctx->fd_free_head, __ATOMIC_ACQUIRE);
+      continue;
+    }
+    int next = __atomic_load_n(&get_fd(fildes)->next_free, __ATOMIC_RELAXED);
+    uint64_t new_head = (((head >> 32) + 1) << 32) | (uint32_t)(next + 1);
+    if (__atomic_compare_exchange_n(&ctx->fd_free_head, &head, new_head, true,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return fildes;
+    }
+  }
+}
+
+// Pushes descriptor fildes onto the free stack.
+void release_fd(int fildes) {
+  struct file_descriptor *fd = get_fd(fildes);
+  uint64_t head = __atomic_load_n(&ctx->fd_free_head, __ATOMIC_ACQUIRE);
+  do {
+    __atomic_store_n(&fd->next_free, (int)(uint32_t)head - 1,
+                     __ATOMIC_RELAXED);
+  } while (__atomic_compare_exchange_n(
+               &ctx->fd_free_head, &head,
+               (head & ~(uint64_t)UINT32_MAX) | (uint32_t)(fildes + 1), true,
+               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == false);
+}
+
+// Empties the descriptor table; called with mount_lock held exclusively.
+void free_fds() {
+  for (int i = 0; i < ctx->num_fd_chunks; i++) {
+    free(ctx->fd_chunks[i]);
+    ctx->fd_chunks[i] = NULL;
+  }
+  ctx->num_fd_chunks = 0;
+  ctx->fd_free_head = 0;
+  memset(ctx->open_count, 0, sizeof(ctx->open_count));
+}
+
 struct dir_entry *get_dentry(const char *name) {
   for (int i = 0; i < MAX_FILES; i++) {
-    if (dir_table[i].is_used && strcmp(dir_table[i].name, name) == 0)
-      return &dir_table[i];
+    if (ctx->dir_table[i].is_used && strcmp(ctx->dir_table[i].name, name) == 0)
+      return &ctx->dir_table[i];
   }
   return NULL;
 }
 
 struct dir_entry *claim_dentry(uint16_t inum, const char *name) {
   for (int i = 0; i < MAX_FILES; i++) {
-    if (dir_table[i].is_used == false) {
-      dir_table[i].is_used = true;
-      dir_table[i].inode_number = inum;
-      memcpy(dir_table[i].name, name, strlen(name));
-      return &dir_table[i];
+    if (ctx->dir_table[i].is_used == false) {
+      ctx->dir_table[i].is_used = true;
+      ctx->dir_table[i].inode_number = inum;
+      memcpy(ctx->dir_table[i].name, name, strlen(name));
+      mark_dirty(&ctx->dir_table[i], sizeof(ctx->dir_table[i]));
+      return &ctx->dir_table[i];
     }
   }
   return NULL;
@@ -120,6 +1299,7 @@ void clear_dentry(struct dir_entry *dentry) {
   dentry->is_used = false;
   dentry->inode_number = -1;
   memset(dentry->name, 0, sizeof(dentry->name));
+  mark_dirty(dentry, sizeof(*dentry));
 }
 
 bool bitmap_test(const uint8_t *bitmap, int idx) {
@@ -130,18 +1310,24 @@ void bitmap_set(uint8_t *bitmap, int idx, bool val) {
   if (bitmap_test(bitmap, idx) == val)
     return;
   bitmap[idx / CHAR_BIT] ^= 1 << (idx % CHAR_BIT);
-}
-
-bool bitmap_full(const uint8_t *bitmap, int size) {
-  uint8_t full_bitmap[size];
-  memset(full_bitmap, 0xff, size);
-  return memcmp(bitmap, full_bitmap, size) == 0;
+  if (bitmap == ctx->used_block_bitmap) {
+    ctx->num_free_blocks += val ? -1 : 1;
+    if ((ctx->sb.features & FS_FEATURE_LOG) && ctx->is_mounted) {
+      int *used = &ctx->segment_used[idx / LOG_SEGMENT_BLOCKS];
+      *used += val ? 1 : -1;
+      __atomic_fetch_add(&ctx->num_clean_segments,
+                         (*used == 0) - (val && *used == 1), __ATOMIC_RELAXED);
+    }
+  } else if (bitmap == ctx->inode_bitmap) {
+    ctx->num_free_inodes += val ? -1 : 1;
+  }
+  mark_dirty(&bitmap[idx / CHAR_BIT], 1);
 }
 
 int claim_inum_from_bitmap() {
   for (int i = 0; i < MAX_FILES; i++) {
-    if (bitmap_test(inode_bitmap, i) == 0) {
-      bitmap_set(inode_bitmap, i, 1);
+    if (bitmap_test(ctx->inode_bitmap, i) == 0) {
+      bitmap_set(ctx->inode_bitmap, i, 1);
       return i;
     }
   }
@@ -149,653 +1335,5513 @@ int claim_inum_from_bitmap() {
 }
 
 int claim_unused_data_block() {
-  for (int i = sb.data_offset; i < DISK_BLOCKS; i++) {
-    if (bitmap_test(used_block_bitmap, i) == 0) {
-      bitmap_set(used_block_bitmap, i, 1);
+  struct fs_stats *stats = &stats_shard()->stats;
+  stat_add(&stats->alloc_calls, 1);
+  lock_alloc();
+  if (ctx->sb.features & FS_FEATURE_LOG) {
+    int block_num = claim_log_block();
+    unlock_alloc();
+    return block_num;
+  }
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    if (bitmap_test(ctx->used_block_bitmap, i) == 0) {
+      bitmap_set(ctx->used_block_bitmap, i, 1);
+      bitmap_set(ctx->claimed_block_bitmap, i, 1);
+      stat_add(&stats->alloc_scanned, i - ctx->sb.data_offset + 1);
+      unlock_alloc();
       return i;
     }
   }
+  stat_add(&stats->alloc_scanned, DISK_BLOCKS - ctx->sb.data_offset);
+  unlock_alloc();
   return -1;
 }
 
-int add_inode_data_block(uint16_t inum, uint16_t block_num) {
-  struct inode *inode = &inode_table[inum];
-  for (int i = 0; i < DIRECT_OFFSETS_PER_INODE; i++) {
-    if (inode->direct_offset[i] == 0) {
-      inode->direct_offset[i] = block_num;
-      return 0;
-    }
+// Claims count free data blocks, lowest first, into block_nums, if at least
+// reserve more stay free for the indirect blocks mapping them. Claims none
+// and returns -1 otherwise.
+int claim_data_blocks(int count, int reserve, uint16_t *block_nums) {
+  lock_alloc();
+  if (ctx->num_free_blocks < count + reserve) {
+    unlock_alloc();
+    return -1;
   }
-  union fs_block indirect_block_buffer;
-  memset(&indirect_block_buffer, 0, BLOCK_SIZE);
-  if (inode->single_indirect_offset == 0) {
-    int indirect_block_num = claim_unused_data_block();
-    if (indirect_block_num == -1) {
-      return -1;
-    }
-    indirect_block_buffer.block_offsets[0] = block_num;
-    if (block_write(indirect_block_num, &indirect_block_buffer) == -1) {
-      fprintf(stderr, "add_inode_data_block: block_write failed\n");
-      return -1;
+  struct fs_stats *stats = &stats_shard()->stats;
+  stat_add(&stats->alloc_calls, 1);
+  int claimed = 0;
+  if (ctx->sb.features & FS_FEATURE_LOG) {
+    for (; claimed < count; claimed++) {
+      block_nums[claimed] = claim_log_block();
     }
-    inode->single_indirect_offset = indirect_block_num;
+    unlock_alloc();
     return 0;
   }
-  if (block_read(inode->single_indirect_offset, &indirect_block_buffer) == -1) {
-    fprintf(stderr, "add_inode_data_block: block_read failed\n");
-    return -1;
+  int i = ctx->sb.data_offset;
+  for (; claimed < count && i < DISK_BLOCKS; i++) {
+    if (bitmap_test(ctx->used_block_bitmap, i) == 0) {
+      bitmap_set(ctx->used_block_bitmap, i, 1);
+      bitmap_set(ctx->claimed_block_bitmap, i, 1);
+      block_nums[claimed++] = i;
+    }
   }
-  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
-    if (indirect_block_buffer.block_offsets[i] == 0) {
-      indirect_block_buffer.block_offsets[i] = block_num;
-      if (block_write(inode->single_indirect_offset, &indirect_block_buffer) ==
-          -1) {
-        fprintf(stderr, "add_inode_data_block: block_write failed\n");
-        return -1;
-      }
-      return 0;
+  stat_add(&stats->alloc_scanned, i - ctx->sb.data_offset);
+  unlock_alloc();
+  assert(claimed == count);
+  return 0;
+}
+
+// Claims the block at the head of the log of a log-structured image and
+// moves the head past it, with alloc_lock held. The head fills the rest of
+// its segment, then moves on to the next segment without used blocks, so
+// blocks are laid out in the order they are written, a segment at a time;
+// with no clean segment left it takes the next free block, outside the
+// segments being cleaned unless no other is free. The head is saved in the
+// super block, which makes the log continue across mounts. Returns -1 if no
+// block is free.
+int claim_log_block() {
+  int head = ctx->sb.log_head;
+  int segment = head / LOG_SEGMENT_BLOCKS;
+  int segment_end = MIN((segment + 1) * LOG_SEGMENT_BLOCKS, DISK_BLOCKS);
+  int block_num = -1;
+  int scanned = 0;
+  for (int i = head; block_num == -1 && i < segment_end; i++, scanned++) {
+    if (bitmap_test(ctx->used_block_bitmap, i) == false) {
+      block_num = i;
     }
   }
-  memset(&indirect_block_buffer, 0, BLOCK_SIZE);
-  if (inode->double_indirect_offset == 0) {
-    int first_indirect_block_num = claim_unused_data_block();
-    int second_indirect_block_num = claim_unused_data_block();
-    if (first_indirect_block_num <= 0 || second_indirect_block_num <= 0) {
-      return -1;
+  for (int i = 1; block_num == -1 && i <= LOG_SEGMENTS; i++) {
+    int next = (segment + i) % LOG_SEGMENTS;
+    if (ctx->segment_used[next] == 0) {
+      block_num = next * LOG_SEGMENT_BLOCKS;
     }
-    inode->double_indirect_offset = first_indirect_block_num;
-    // first indirect block
-    indirect_block_buffer.block_offsets[0] = second_indirect_block_num;
-    if (block_write(inode->double_indirect_offset, &indirect_block_buffer) ==
-        -1) {
-      fprintf(stderr, "add_inode_data_block: block_write failed\n");
-      return -1;
+  }
+  int data_blocks = DISK_BLOCKS - ctx->sb.data_offset;
+  int victim_block_num = -1;
+  for (int i = 0; block_num == -1 && i < data_blocks; i++, scanned++) {
+    int next =
+        ctx->sb.data_offset + (head - ctx->sb.data_offset + i) % data_blocks;
+    if (bitmap_test(ctx->used_block_bitmap, next)) {
+      continue;
     }
-    // second indirect block
-    memset(&indirect_block_buffer, 0, BLOCK_SIZE);
-    indirect_block_buffer.block_offsets[0] = block_num;
-    if (block_write(second_indirect_block_num, &indirect_block_buffer) == -1) {
-      fprintf(stderr, "add_inode_data_block: block_write failed\n");
-      return -1;
+    if (ctx->clean_victims && ctx->clean_victims[next / LOG_SEGMENT_BLOCKS]) {
+      victim_block_num = victim_block_num == -1 ? next : victim_block_num;
+    } else {
+      block_num = next;
     }
+  }
+  block_num = block_num == -1 ? victim_block_num : block_num;
+  stat_add(&stats_shard()->stats.alloc_scanned, scanned);
+  if (block_num == -1) {
+    return -1;
+  }
+  bitmap_set(ctx->used_block_bitmap, block_num, 1);
+  ctx->sb.log_head =
+      block_num + 1 < DISK_BLOCKS ? block_num + 1 : ctx->sb.data_offset;
+  return block_num;
+}
+
+// The CRC32C of a block, offset so that an all-zero block, which is what every
+// free block holds, checksums to 0 like a freshly made checksum table.
+uint32_t block_checksum(const void *block_buffer) {
+  return crc32c(0, block_buffer, ctx->block_size) ^ ctx->zero_block_crc;
+}
+
+int verify_block_checksum(int block_num, const void *block_buffer) {
+  if ((ctx->sb.features & FS_FEATURE_CHECKSUM) == 0) {
     return 0;
   }
-  if (block_read(inode->double_indirect_offset, &indirect_block_buffer) == -1) {
-    fprintf(stderr, "add_inode_data_block: block_read failed\n");
+  if (require_region(ctx->block_checksums)) {
     return -1;
   }
-  union fs_block second_indirect_block;
-  memset(&second_indirect_block, 0, BLOCK_SIZE);
-  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
-    if (indirect_block_buffer.block_offsets[i] == 0) {
-      int indirect_block_num = claim_unused_data_block();
-      if (indirect_block_num == -1) {
-        return -1;
-      }
-      indirect_block_buffer.block_offsets[i] = indirect_block_num;
-      if (block_write(inode->double_indirect_offset, &indirect_block_buffer) ==
-          -1) {
-        fprintf(stderr, "add_inode_data_block: block_write failed\n");
-        return -1;
-      }
-      memset(&indirect_block_buffer, 0, BLOCK_SIZE);
-      indirect_block_buffer.block_offsets[0] = block_num;
-      if (block_write(indirect_block_num, &indirect_block_buffer) == -1) {
-        fprintf(stderr, "add_inode_data_block: block_write failed\n");
-        return -1;
-      }
-      return 0;
-    }
-    if (block_read(indirect_block_buffer.block_offsets[i],
-                   &second_indirect_block) == -1) {
-      fprintf(stderr, "add_inode_data_block: block_read failed\n");
+  if (block_checksum(block_buffer) != ctx->block_checksums[block_num]) {
+    fprintf(stderr, "checksum mismatch in block %d\n", block_num);
+    return -1;
+  }
+  return 0;
+}
+
+// Reads a data or indirect block and verifies its checksum.
+int data_block_read(int block_num, void *block_buffer) {
+  if (block_read(block_num, block_buffer)) {
+    return -1;
+  }
+  return verify_block_checksum(block_num, block_buffer);
+}
+
+// Writes a data or indirect block and records its checksum.
+int data_block_write(int block_num, const void *block_buffer) {
+  if (ctx->sb.features & FS_FEATURE_CHECKSUM) {
+    if (require_region(ctx->block_checksums)) {
       return -1;
     }
-    for (int j = 0; j < DIRECT_OFFSETS_PER_BLOCK; j++) {
-      if (second_indirect_block.block_offsets[j] == 0) {
-        second_indirect_block.block_offsets[j] = block_num;
-        if (block_write(indirect_block_buffer.block_offsets[i],
-                        &second_indirect_block) == -1) {
-          fprintf(stderr, "add_inode_data_block: block_write failed\n");
-          return -1;
-        }
-        return 0;
-      }
-    }
+    ctx->block_checksums[block_num] = block_checksum(block_buffer);
+    mark_dirty(&ctx->block_checksums[block_num],
+               sizeof(ctx->block_checksums[block_num]));
   }
-  return -1;
+  return block_write(block_num, block_buffer);
 }
 
-// Returns the block number of the data block at the given file offset.
-// Returns 0 if the block is not allocated.
-// Returns -1 on read/write error.
-int get_data_block_num(uint16_t inum, int file_offset) {
-  assert(inum >= 0 && inum < MAX_FILES);
-  assert(file_offset >= 0 && file_offset < MAX_FILE_SIZE);
+// A block is shared with the snapshot if the snapshot references it. Shared
+// blocks are never modified or zeroed by the live file system.
+bool is_snapshot_block(uint16_t block_num) {
+  return ctx->sb.has_snapshot &&
+         bitmap_test(ctx->snapshot_block_bitmap, block_num);
+}
 
-  struct inode *inode = &inode_table[inum];
-  int block_idx = file_offset / BLOCK_SIZE;
+// A block is shared if the snapshot references it or a mapping pins it; it
+// is then copied rather than written in place.
+bool is_shared_block(uint16_t block_num) {
+  return is_snapshot_block(block_num) ||
+         __atomic_load_n(&ctx->block_pins[block_num], __ATOMIC_RELAXED);
+}
 
-  // direct offset
-  if (block_idx < DIRECT_OFFSETS_PER_INODE) {
-    return inode->direct_offset[block_idx];
+// A block may be written in place if it was claimed since the last commit
+// and is not shared, unless the image is log-structured: every write then
+// goes to the log head. Blocks the committed metadata references are copied
+// instead, so a crash before the next commit finds them as they were.
+bool is_in_place_block(uint16_t block_num) {
+  return block_num && bitmap_test(ctx->claimed_block_bitmap, block_num) &&
+         is_shared_block(block_num) == false &&
+         (ctx->sb.features & FS_FEATURE_LOG) == 0;
+}
+
+// Releases a data or indirect block. Blocks shared with the snapshot stay
+// allocated until the snapshot is released, pinned blocks until they are
+// unmapped, other blocks until the next journal commit.
+int free_data_block(uint16_t block_num) {
+  lock_alloc();
+  if (is_snapshot_block(block_num)) {
+    bitmap_set(ctx->snapshot_free_bitmap, block_num, 1);
+  } else if (ctx->block_pins[block_num]) {
+    bitmap_set(ctx->pinned_free_bitmap, block_num, 1);
+  } else if (bitmap_test(ctx->freed_block_bitmap, block_num) == false) {
+    bitmap_set(ctx->freed_block_bitmap, block_num, 1);
+    ctx->freed_block_count++;
   }
+  unlock_alloc();
+  return 0;
+}
 
-  union fs_block block_buffer;
-  block_idx -= DIRECT_OFFSETS_PER_INODE;
+void dedup_index_insert(uint16_t block_num) {
+  uint32_t i = ctx->block_fingerprint[block_num] & (DEDUP_INDEX_SIZE - 1);
+  while (ctx->dedup_index[i]) {
+    i = (i + 1) & (DEDUP_INDEX_SIZE - 1);
+  }
+  ctx->dedup_index[i] = block_num;
+}
 
-  // single indirect
-  if (block_idx < DIRECT_OFFSETS_PER_BLOCK) {
-    if (inode->single_indirect_offset == 0) {
-      return 0;
+void dedup_index_remove(uint16_t block_num) {
+  uint32_t i = ctx->block_fingerprint[block_num] & (DEDUP_INDEX_SIZE - 1);
+  while (ctx->dedup_index[i] != block_num) {
+    if (ctx->dedup_index[i] == 0) {
+      return;
     }
-    if (block_read(inode->single_indirect_offset, &block_buffer)) {
-      fprintf(stderr,
-              "get_data_block_num: failed to read single indirect block\n");
+    i = (i + 1) & (DEDUP_INDEX_SIZE - 1);
+  }
+  // shift later entries of the probe sequence back into the hole
+  for (uint32_t j = (i + 1) & (DEDUP_INDEX_SIZE - 1); ctx->dedup_index[j];
+       j = (j + 1) & (DEDUP_INDEX_SIZE - 1)) {
+    uint32_t home =
+        ctx->block_fingerprint[ctx->dedup_index[j]] & (DEDUP_INDEX_SIZE - 1);
+    if (((j - home) & (DEDUP_INDEX_SIZE - 1)) >=
+        ((j - i) & (DEDUP_INDEX_SIZE - 1))) {
+      ctx->dedup_index[i] = ctx->dedup_index[j];
+      i = j;
+    }
+  }
+  ctx->dedup_index[i] = 0;
+}
+
+// Returns a block holding exactly the contents of block_buffer, 0 if there is
+// none, or -1 on read error. Candidates are compared byte for byte.
+int dedup_lookup(uint64_t fingerprint, const union fs_block *block_buffer) {
+  ctx->dedup_lookups++;
+  union fs_block candidate;
+  for (uint32_t i = fingerprint & (DEDUP_INDEX_SIZE - 1); ctx->dedup_index[i];
+       i = (i + 1) & (DEDUP_INDEX_SIZE - 1)) {
+    uint16_t block_num = ctx->dedup_index[i];
+    if (ctx->block_fingerprint[block_num] != fingerprint) {
+      continue;
+    }
+    if (data_block_read(block_num, &candidate)) {
+      fprintf(stderr, "dedup_lookup: failed to read data block %d\n",
+              block_num);
       return -1;
     }
-    return block_buffer.block_offsets[block_idx];
+    if (memcmp(&candidate, block_buffer, ctx->block_size) == 0) {
+      ctx->dedup_hits++;
+      return block_num;
+    }
+  }
+  return 0;
+}
+
+// Drops one block map reference to a data block, freeing the block when it
+// was the last one.
+int release_data_block(uint16_t block_num) {
+  lock_alloc();
+  int ret = 0;
+  if ((ctx->sb.features & FS_FEATURE_DEDUP) && load_dedup_index()) {
+    ret = -1;
+  } else if (ctx->block_refcount[block_num] > 1) {
+    ctx->block_refcount[block_num]--;
+    mark_dirty(&ctx->block_refcount[block_num],
+               sizeof(ctx->block_refcount[block_num]));
+  } else {
+    if (ctx->block_refcount[block_num] == 1) {
+      dedup_index_remove(block_num);
+      ctx->block_refcount[block_num] = 0;
+      mark_dirty(&ctx->block_refcount[block_num],
+                 sizeof(ctx->block_refcount[block_num]));
+    }
+    ret = free_data_block(block_num);
   }
+  unlock_alloc();
+  return ret;
+}
 
-  // double indirect
-  block_idx -= DIRECT_OFFSETS_PER_BLOCK;
-  if (inode->double_indirect_offset == 0) {
-    return 0;
+// Writes an indirect block back to disk. Unless the block may be written in
+// place (see is_in_place_block), it is written to a new block and *block_num
+// is updated.
+int write_indirect_block(uint16_t *block_num,
+                         const union fs_block *block_buffer) {
+  uint16_t target = *block_num;
+  if (is_in_place_block(target) == false) {
+    int new_block_num = claim_unused_data_block();
+    if (new_block_num == -1) {
+      fprintf(stderr, "write_indirect_block: no free blocks\n");
+      return -1;
+    }
+    target = new_block_num;
   }
-  if (block_read(inode->double_indirect_offset, &block_buffer)) {
-    fprintf(stderr,
-            "get_data_block_num: failed to read double indirect block\n");
+  if (data_block_write(target, block_buffer)) {
+    fprintf(stderr, "write_indirect_block: block_write failed\n");
     return -1;
   }
-  int block_offset = block_idx / DIRECT_OFFSETS_PER_BLOCK;
-  if (block_buffer.block_offsets[block_offset] == 0) {
-    return 0;
+  if (target != *block_num && *block_num != 0 &&
+      free_data_block(*block_num)) {
+    return -1;
   }
-  if (block_read(block_buffer.block_offsets[block_offset], &block_buffer)) {
+  *block_num = target;
+  mark_dirty(block_num, sizeof(*block_num));
+  return 0;
+}
+
+// Sets entry idx of the indirect block at *block_num, allocating the indirect
+// block if *block_num is 0.
+int set_indirect_entry(uint16_t *block_num, int idx, uint16_t value) {
+  union fs_block block_buffer;
+  memset(&block_buffer, 0, ctx->block_size);
+  if (*block_num && data_block_read(*block_num, &block_buffer)) {
+    fprintf(stderr, "set_indirect_entry: block_read failed\n");
+    return -1;
+  }
+  if (block_buffer.block_offsets[idx] == value) {
+    return 0;
+  }
+  block_buffer.block_offsets[idx] = value;
+  return write_indirect_block(block_num, &block_buffer);
+}
+
+// Maps the data block at the given file offset to block_num.
+// Returns -1 if an indirect block could not be allocated or written.
+int set_data_block_num(uint16_t inum, int file_offset, uint16_t block_num) {
+  assert(inum >= 0 && inum < MAX_FILES);
+  assert(file_offset >= 0 && file_offset < MAX_FILE_SIZE);
+
+  struct inode *inode = &ctx->inode_table[inum];
+  int block_idx = file_offset / ctx->block_size;
+
+  // direct offset
+  if (block_idx < DIRECT_OFFSETS_PER_INODE) {
+    inode->direct_offset[block_idx] = block_num;
+    mark_dirty(inode, INODE_SIZE);
+    return 0;
+  }
+  block_idx -= DIRECT_OFFSETS_PER_INODE;
+
+  // single indirect
+  if (block_idx < DIRECT_OFFSETS_PER_BLOCK) {
+    return set_indirect_entry(&inode->single_indirect_offset, block_idx,
+                              block_num);
+  }
+
+  // double indirect
+  block_idx -= DIRECT_OFFSETS_PER_BLOCK;
+  int first_idx = block_idx / DIRECT_OFFSETS_PER_BLOCK;
+  uint16_t second_indirect_block_num = 0;
+  if (inode->double_indirect_offset) {
+    union fs_block block_buffer;
+    if (data_block_read(inode->double_indirect_offset, &block_buffer)) {
+      fprintf(stderr, "set_data_block_num: failed to read double indirect "
+                      "block\n");
+      return -1;
+    }
+    second_indirect_block_num = block_buffer.block_offsets[first_idx];
+  }
+  uint16_t old_second_indirect_block_num = second_indirect_block_num;
+  if (set_indirect_entry(&second_indirect_block_num,
+                         block_idx % DIRECT_OFFSETS_PER_BLOCK, block_num)) {
+    return -1;
+  }
+  if (second_indirect_block_num == old_second_indirect_block_num) {
+    return 0;
+  }
+  return set_indirect_entry(&inode->double_indirect_offset, first_idx,
+                            second_indirect_block_num);
+}
+
+// Sets count consecutive entries of the indirect block at *block_num,
+// starting at entry first_idx, to values, allocating the indirect block if
+// *block_num is 0. The block is written once.
+int set_indirect_entries(uint16_t *block_num, int first_idx, int count,
+                         const uint16_t *values) {
+  union fs_block block_buffer;
+  memset(&block_buffer, 0, ctx->block_size);
+  if (*block_num && data_block_read(*block_num, &block_buffer)) {
+    fprintf(stderr, "set_indirect_entries: block_read failed\n");
+    return -1;
+  }
+  if (memcmp(&block_buffer.block_offsets[first_idx], values,
+             count * sizeof(uint16_t)) == 0) {
+    return 0;
+  }
+  memcpy(&block_buffer.block_offsets[first_idx], values,
+         count * sizeof(uint16_t));
+  return write_indirect_block(block_num, &block_buffer);
+}
+
+// Maps count consecutive data blocks of inode inum, starting at block index
+// first_block_idx, to block_nums. Each indirect block is read and written at
+// most once. Returns -1 if an indirect block could not be allocated or
+// written.
+int set_data_block_nums(uint16_t inum, int first_block_idx, int count,
+                        const uint16_t *block_nums) {
+  struct inode *inode = &ctx->inode_table[inum];
+  int i = 0;
+  for (; i < count && first_block_idx + i < DIRECT_OFFSETS_PER_INODE; i++) {
+    inode->direct_offset[first_block_idx + i] = block_nums[i];
+    mark_dirty(inode, INODE_SIZE);
+  }
+  int block_idx = first_block_idx + i - DIRECT_OFFSETS_PER_INODE;
+  if (i < count && block_idx < DIRECT_OFFSETS_PER_BLOCK) {
+    int n = MIN(count - i, DIRECT_OFFSETS_PER_BLOCK - block_idx);
+    if (set_indirect_entries(&inode->single_indirect_offset, block_idx, n,
+                             block_nums + i)) {
+      return -1;
+    }
+    i += n;
+  }
+  if (i == count) {
+    return 0;
+  }
+
+  union fs_block block_buffer;
+  memset(&block_buffer, 0, ctx->block_size);
+  if (inode->double_indirect_offset &&
+      data_block_read(inode->double_indirect_offset, &block_buffer)) {
+    fprintf(stderr,
+            "set_data_block_nums: failed to read double indirect block\n");
+    return -1;
+  }
+  bool is_changed = false;
+  int ret = 0;
+  while (i < count) {
+    block_idx = first_block_idx + i - DIRECT_OFFSETS_PER_INODE -
+                DIRECT_OFFSETS_PER_BLOCK;
+    int first_idx = block_idx / DIRECT_OFFSETS_PER_BLOCK;
+    int second_idx = block_idx % DIRECT_OFFSETS_PER_BLOCK;
+    int n = MIN(count - i, DIRECT_OFFSETS_PER_BLOCK - second_idx);
+    uint16_t second_indirect_block_num = block_buffer.block_offsets[first_idx];
+    if (set_indirect_entries(&second_indirect_block_num, second_idx, n,
+                             block_nums + i)) {
+      ret = -1;
+      break;
+    }
+    if (second_indirect_block_num != block_buffer.block_offsets[first_idx]) {
+      block_buffer.block_offsets[first_idx] = second_indirect_block_num;
+      is_changed = true;
+    }
+    i += n;
+  }
+  // the second level blocks copied so far had their old copies freed, so the
+  // double indirect block points at the new ones even if a later one failed
+  if (is_changed &&
+      write_indirect_block(&inode->double_indirect_offset, &block_buffer)) {
+    return -1;
+  }
+  return ret;
+}
+
+// Returns the block number of the data block at the given file offset.
+// Returns 0 if the block is not allocated.
+// Returns -1 on read/write error.
+int get_data_block_num(uint16_t inum, int file_offset) {
+  assert(inum >= 0 && inum < MAX_FILES);
+  assert(file_offset >= 0 && file_offset < MAX_FILE_SIZE);
+
+  struct inode *inode = &ctx->inode_table[inum];
+  int block_idx = file_offset / ctx->block_size;
+  struct fs_stats *stats = &stats_shard()->stats;
+  stat_add(&stats->map_lookups, 1);
+  stat_add(&stats->map_blocks, 1);
+
+  // direct offset
+  if (block_idx < DIRECT_OFFSETS_PER_INODE) {
+    return inode->direct_offset[block_idx];
+  }
+
+  union fs_block block_buffer;
+  block_idx -= DIRECT_OFFSETS_PER_INODE;
+
+  // single indirect
+  if (block_idx < DIRECT_OFFSETS_PER_BLOCK) {
+    if (inode->single_indirect_offset == 0) {
+      return 0;
+    }
+    stat_add(&stats->map_indirect_reads, 1);
+    if (data_block_read(inode->single_indirect_offset, &block_buffer)) {
+      fprintf(stderr,
+              "get_data_block_num: failed to read single indirect block\n");
+      return -1;
+    }
+    return block_buffer.block_offsets[block_idx];
+  }
+
+  // double indirect
+  block_idx -= DIRECT_OFFSETS_PER_BLOCK;
+  if (inode->double_indirect_offset == 0) {
+    return 0;
+  }
+  stat_add(&stats->map_indirect_reads, 1);
+  if (data_block_read(inode->double_indirect_offset, &block_buffer)) {
+    fprintf(stderr,
+            "get_data_block_num: failed to read double indirect block\n");
+    return -1;
+  }
+  int block_offset = block_idx / DIRECT_OFFSETS_PER_BLOCK;
+  if (block_buffer.block_offsets[block_offset] == 0) {
+    return 0;
+  }
+  stat_add(&stats->map_indirect_reads, 1);
+  if (data_block_read(block_buffer.block_offsets[block_offset],
+                      &block_buffer)) {
     fprintf(stderr,
             "get_data_block_num: failed to read single indirect block\n");
     return -1;
   }
-  block_offset = block_idx % DIRECT_OFFSETS_PER_BLOCK;
-  return block_buffer.block_offsets[block_offset];
+  block_offset = block_idx % DIRECT_OFFSETS_PER_BLOCK;
+  return block_buffer.block_offsets[block_offset];
+}
+
+// Fills block_nums with the block numbers of count consecutive data blocks of
+// inode inum, starting at block index first_block_idx. Each indirect block is
+// read once. Unallocated blocks are 0.
+int get_data_block_nums(uint16_t inum, int first_block_idx, int count,
+                        uint16_t *block_nums) {
+  struct inode *inode = &ctx->inode_table[inum];
+  union fs_block single_indirect_block;
+  union fs_block double_indirect_block;
+  union fs_block second_indirect_block;
+  bool has_single_indirect_block = false;
+  bool has_double_indirect_block = false;
+  int second_indirect_idx = -1;
+  int indirect_reads = 0;
+  int ret = 0;
+  for (int i = 0; ret == 0 && i < count; i++) {
+    int block_idx = first_block_idx + i;
+    block_nums[i] = 0;
+    if (block_idx < DIRECT_OFFSETS_PER_INODE) {
+      block_nums[i] = inode->direct_offset[block_idx];
+      continue;
+    }
+    block_idx -= DIRECT_OFFSETS_PER_INODE;
+    if (block_idx < DIRECT_OFFSETS_PER_BLOCK) {
+      if (inode->single_indirect_offset == 0) {
+        continue;
+      }
+      if (has_single_indirect_block == false) {
+        indirect_reads++;
+        if (data_block_read(inode->single_indirect_offset,
+                            &single_indirect_block)) {
+          ret = -1;
+          break;
+        }
+        has_single_indirect_block = true;
+      }
+      block_nums[i] = single_indirect_block.block_offsets[block_idx];
+      continue;
+    }
+    block_idx -= DIRECT_OFFSETS_PER_BLOCK;
+    if (inode->double_indirect_offset == 0) {
+      continue;
+    }
+    if (has_double_indirect_block == false) {
+      indirect_reads++;
+      if (data_block_read(inode->double_indirect_offset,
+                          &double_indirect_block)) {
+        ret = -1;
+        break;
+      }
+      has_double_indirect_block = true;
+    }
+    int first_idx = block_idx / DIRECT_OFFSETS_PER_BLOCK;
+    uint16_t second_indirect_block_num =
+        double_indirect_block.block_offsets[first_idx];
+    if (second_indirect_block_num == 0) {
+      continue;
+    }
+    if (second_indirect_idx != first_idx) {
+      indirect_reads++;
+      if (data_block_read(second_indirect_block_num, &second_indirect_block)) {
+        ret = -1;
+        break;
+      }
+      second_indirect_idx = first_idx;
+    }
+    block_nums[i] = second_indirect_block
+                        .block_offsets[block_idx % DIRECT_OFFSETS_PER_BLOCK];
+  }
+  struct fs_stats *stats = &stats_shard()->stats;
+  stat_add(&stats->map_lookups, 1);
+  stat_add(&stats->map_blocks, count);
+  stat_add(&stats->map_indirect_reads, indirect_reads);
+  return ret;
+}
+
+void iter_init(struct iov_iter *iter, const struct iovec *iov, int iovcnt) {
+  iter->iov = iov;
+  iter->iovcnt = iovcnt;
+  iter->offset = 0;
+  iter_advance(iter, 0);
+}
+
+void iter_advance(struct iov_iter *iter, size_t n) {
+  iter->offset += n;
+  while (iter->iovcnt > 0 && iter->offset >= iter->iov->iov_len) {
+    iter->offset -= iter->iov->iov_len;
+    iter->iov++;
+    iter->iovcnt--;
+  }
+}
+
+// The next n bytes of iter if they lie in one buffer, or NULL.
+char *iter_contiguous(const struct iov_iter *iter, size_t n) {
+  if (iter->iovcnt == 0 || iter->iov->iov_len - iter->offset < n) {
+    return NULL;
+  }
+  return (char *)iter->iov->iov_base + iter->offset;
+}
+
+// Copies the next n bytes of iter to dst.
+void iter_gather(struct iov_iter *iter, void *dst, size_t n) {
+  while (n > 0) {
+    size_t len = MIN(n, iter->iov->iov_len - iter->offset);
+    memcpy(dst, (char *)iter->iov->iov_base + iter->offset, len);
+    dst = (char *)dst + len;
+    n -= len;
+    iter_advance(iter, len);
+  }
+}
+
+// Copies n bytes from src to the next n bytes of iter.
+void iter_scatter(struct iov_iter *iter, const void *src, size_t n) {
+  while (n > 0) {
+    size_t len = MIN(n, iter->iov->iov_len - iter->offset);
+    memcpy((char *)iter->iov->iov_base + iter->offset, src, len);
+    src = (const char *)src + len;
+    n -= len;
+    iter_advance(iter, len);
+  }
+}
+
+// The total length of iovcnt buffers, or -1 if it does not fit the int a
+// call returns.
+ssize_t iov_length(const struct iovec *iov, int iovcnt) {
+  size_t nbyte = 0;
+  if (iovcnt < 0) {
+    return -1;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > INT_MAX - nbyte) {
+      return -1;
+    }
+    nbyte += iov[i].iov_len;
+  }
+  return nbyte;
+}
+
+// Reads up to count physically consecutive blocks starting at block_num with
+// one vectored read and verifies their checksums, then copies nbyte bytes
+// starting offset_in_block bytes into the first block to iter. Blocks that
+// one buffer of iter covers whole are read straight into it, the others
+// through bounce blocks; the run stops short of a block that would need more
+// than READ_BOUNCE_BLOCKS of them. Returns the number of blocks read, or -1.
+int read_data_run(int block_num, int count, int offset_in_block,
+                  struct iov_iter *iter, size_t nbyte) {
+  union fs_block bounce[READ_BOUNCE_BLOCKS];
+  struct iovec iov[READ_BATCH_BLOCKS];
+  struct iov_iter plan = *iter;
+  size_t end = offset_in_block + nbyte;
+  int num_bounce = 0;
+  int n = 0;
+  for (; n < count; n++) {
+    size_t block_start = (size_t)n * ctx->block_size;
+    size_t skip = n == 0 ? offset_in_block : 0;
+    size_t len = MIN(end - block_start, ctx->block_size) - skip;
+    char *direct = len == ctx->block_size ? iter_contiguous(&plan, len) : NULL;
+    if (direct) {
+      iov[n].iov_base = direct;
+    } else if (num_bounce < READ_BOUNCE_BLOCKS) {
+      iov[n].iov_base = &bounce[num_bounce++];
+    } else {
+      break;
+    }
+    iov[n].iov_len = ctx->block_size;
+    iter_advance(&plan, len);
+  }
+  if (block_readv(block_num, iov, n)) {
+    fprintf(stderr, "read_data_run: failed to read data blocks %d-%d\n",
+            block_num, block_num + n - 1);
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (verify_block_checksum(block_num + i, iov[i].iov_base)) {
+      return -1;
+    }
+  }
+  for (int i = 0, b = 0; i < n; i++) {
+    size_t skip = i == 0 ? offset_in_block : 0;
+    size_t len = MIN(end - (size_t)i * ctx->block_size, ctx->block_size) - skip;
+    if (b < num_bounce && iov[i].iov_base == &bounce[b]) {
+      iter_scatter(iter, bounce[b++].data + skip, len);
+    } else {
+      iter_advance(iter, len);
+    }
+  }
+  return n;
+}
+
+// Reads from the file of fd to iter, starting at data block block_num. The
+// block map is resolved a batch of blocks at a time, and physically
+// consecutive blocks of a batch are read together.
+size_t read_bytes(int block_num, struct file_descriptor *fd,
+                  struct iov_iter *iter, size_t nbyte) {
+  int file_size = ctx->inode_table[fd->inode_number].file_size;
+  size_t bytes_read = 0;
+  uint16_t block_nums[READ_BATCH_BLOCKS];
+  nbyte = MIN(nbyte, file_size - fd->offset);
+  while (bytes_read < nbyte) {
+    int first_block_idx = fd->offset / ctx->block_size;
+    int last_block_idx =
+        (fd->offset + (nbyte - bytes_read) - 1) / ctx->block_size;
+    int count = MIN(last_block_idx - first_block_idx + 1, READ_BATCH_BLOCKS);
+    if (get_data_block_nums(fd->inode_number, first_block_idx, count,
+                            block_nums)) {
+      fprintf(stderr, "read_bytes: failed to get data block numbers\n");
+      return -1;
+    }
+    assert(bytes_read > 0 || block_nums[0] == block_num);
+    for (int i = 0; i < count;) {
+      int run = 1;
+      while (i + run < count && block_nums[i + run] == block_nums[i] + run) {
+        run++;
+      }
+      assert(block_nums[i] >= ctx->sb.data_offset);
+      int offset_in_block = fd->offset % ctx->block_size;
+      size_t bytes_to_read =
+          MIN(nbyte - bytes_read,
+              (size_t)run * ctx->block_size - offset_in_block);
+      run = read_data_run(block_nums[i], run, offset_in_block, iter,
+                          bytes_to_read);
+      if (run == -1) {
+        fprintf(stderr, "read_bytes: failed to read data block %d\n",
+                block_nums[i]);
+        return -1;
+      }
+      bytes_to_read =
+          MIN(bytes_to_read, (size_t)run * ctx->block_size - offset_in_block);
+      bytes_read += bytes_to_read;
+      fd->offset += bytes_to_read;
+      i += run;
+    }
+  }
+  return bytes_read;
+}
+
+// Writes a data block of inode inum back to disk. *block_num is 0 for a block
+// that is not allocated yet. A new block is allocated and mapped in its place
+// unless the block may be written in place (see is_in_place_block) and no
+// other block map entry shares it. With FS_FEATURE_DEDUP, contents already
+// stored elsewhere are not written again; the entry is pointed at the existing
+// copy instead, and the fingerprint index is shared by all files, so such
+// writes hold alloc_lock.
+int write_data_block(uint16_t inum, int file_offset, int *block_num,
+                     const union fs_block *block_buffer) {
+  if ((ctx->sb.features & FS_FEATURE_DEDUP) == 0) {
+    return store_data_block(inum, file_offset, block_num, block_buffer);
+  }
+  lock_alloc();
+  int ret = store_data_block(inum, file_offset, block_num, block_buffer);
+  unlock_alloc();
+  return ret;
+}
+
+int store_data_block(uint16_t inum, int file_offset, int *block_num,
+                     const union fs_block *block_buffer) {
+  bool is_dedup = ctx->sb.features & FS_FEATURE_DEDUP;
+  uint64_t fingerprint = 0;
+  if (is_dedup) {
+    if (load_dedup_index()) {
+      return -1;
+    }
+    fingerprint = hash64(block_buffer, ctx->block_size);
+    int dup_block_num = dedup_lookup(fingerprint, block_buffer);
+    if (dup_block_num == -1) {
+      return -1;
+    }
+    if (dup_block_num == *block_num && *block_num) {
+      return 0;
+    }
+    if (dup_block_num) {
+      ctx->block_refcount[dup_block_num]++;
+      mark_dirty(&ctx->block_refcount[dup_block_num],
+                 sizeof(ctx->block_refcount[dup_block_num]));
+      if (set_data_block_num(inum, file_offset, dup_block_num) ||
+          (*block_num && release_data_block(*block_num))) {
+        return -1;
+      }
+      *block_num = dup_block_num;
+      return 0;
+    }
+  }
+  if (is_in_place_block(*block_num) == false ||
+      ctx->block_refcount[*block_num] > 1) {
+    int new_block_num = claim_unused_data_block();
+    if (new_block_num == -1) {
+      fprintf(stderr, "write_data_block: no free blocks\n");
+      return -1;
+    }
+    if (set_data_block_num(inum, file_offset, new_block_num) ||
+        (*block_num && release_data_block(*block_num))) {
+      return -1;
+    }
+    *block_num = new_block_num;
+  } else if (ctx->block_refcount[*block_num]) {
+    dedup_index_remove(*block_num); // contents are about to change
+  }
+  if (data_block_write(*block_num, block_buffer)) {
+    fprintf(stderr, "write_data_block: failed to write data block %d\n",
+            *block_num);
+    return -1;
+  }
+  if (is_dedup) {
+    ctx->block_refcount[*block_num] = 1;
+    ctx->block_fingerprint[*block_num] = fingerprint;
+    mark_dirty(&ctx->block_refcount[*block_num],
+               sizeof(ctx->block_refcount[*block_num]));
+    mark_dirty(&ctx->block_fingerprint[*block_num],
+               sizeof(ctx->block_fingerprint[*block_num]));
+    dedup_index_insert(*block_num);
+  }
+  return 0;
+}
+
+size_t write_bytes(int block_num, struct file_descriptor *fd,
+                   struct iov_iter *iter, size_t nbyte) {
+  union fs_block block_buffer;
+  uint16_t inum = fd->inode_number;
+  int offset_in_block = fd->offset % ctx->block_size;
+  memset(&block_buffer, 0, ctx->block_size);
+  // a block that is overwritten whole is not read first
+  if (block_num && (offset_in_block > 0 || nbyte < ctx->block_size) &&
+      data_block_read(block_num, &block_buffer)) {
+    fprintf(stderr, "write_bytes: failed to read data block\n");
+    return -1;
+  }
+  int block_offset = fd->offset - offset_in_block;
+  size_t bytes_written = 0;
+  nbyte = MIN(nbyte, MAX_FILE_SIZE - fd->offset);
+  while (bytes_written < nbyte) {
+    if (offset_in_block == ctx->block_size) {
+      if (write_data_block(inum, block_offset, &block_num, &block_buffer)) {
+        fprintf(stderr, "write_bytes: failed to write data block\n");
+        return -1;
+      }
+      memset(&block_buffer, 0, ctx->block_size);
+      offset_in_block = 0;
+      if (has_free_blocks() == false) {
+        break;
+      }
+      block_offset = fd->offset;
+      int next_block_num = get_data_block_num(inum, fd->offset);
+      if (next_block_num == -1) {
+        fprintf(stderr, "write_bytes: failed to get data block number\n");
+        return -1;
+      }
+      // unallocated blocks (0) are allocated by write_data_block
+      if (next_block_num && nbyte - bytes_written < ctx->block_size &&
+          data_block_read(next_block_num, &block_buffer)) {
+        fprintf(stderr, "write_bytes: failed to read data block\n");
+        return -1;
+      }
+      assert(next_block_num == 0 || next_block_num >= ctx->sb.data_offset);
+      block_num = next_block_num;
+    }
+    size_t bytes_to_write =
+        MIN(nbyte - bytes_written, ctx->block_size - offset_in_block);
+    iter_gather(iter, block_buffer.data + offset_in_block, bytes_to_write);
+    bytes_written += bytes_to_write;
+    offset_in_block += bytes_to_write;
+    fd->offset += bytes_to_write;
+  }
+  if (offset_in_block > 0 &&
+      write_data_block(inum, block_offset, &block_num, &block_buffer)) {
+    fprintf(stderr, "write_bytes: failed to write data block\n");
+    return -1;
+  }
+  if (fd->offset > ctx->inode_table[inum].file_size) {
+    ctx->inode_table[inum].file_size = fd->offset;
+    mark_dirty(&ctx->inode_table[inum], INODE_SIZE);
+  }
+  return bytes_written;
+}
+
+// Writes nbyte bytes from iter at the offset of fd, starting with the block
+// the offset falls in.
+size_t write_bytes_at(struct file_descriptor *fd, struct iov_iter *iter,
+                      size_t nbyte) {
+  int start_block = get_data_block_num(fd->inode_number, fd->offset);
+  if (start_block == -1) {
+    fprintf(stderr, "fs_write: failed to get data block number\n");
+    return -1;
+  }
+  if (start_block == 0 && has_free_blocks() == false) {
+    fprintf(stderr, "fs_write: failed to get unused data block\n");
+    return -1;
+  }
+  return write_bytes(start_block, fd, iter, nbyte);
+}
+
+// Picks the blocks to overwrite count whole data blocks of inode inum with,
+// starting at block index first_block_idx: the block map is resolved into
+// old_block_nums, and the missing blocks (and the ones that may not be written
+// in place) are claimed. block_nums receives the blocks to write. Nothing is
+// mapped until install_mapped_blocks. Returns 1, with nothing claimed, if the
+// disk cannot hold them all.
+int claim_mapped_blocks(uint16_t inum, int first_block_idx, int count,
+                        uint16_t *block_nums, uint16_t *old_block_nums) {
+  if (get_data_block_nums(inum, first_block_idx, count, old_block_nums)) {
+    fprintf(stderr,
+            "claim_mapped_blocks: failed to get data block numbers\n");
+    return -1;
+  }
+  if ((ctx->sb.features & FS_FEATURE_CHECKSUM) &&
+      require_region(ctx->block_checksums)) {
+    return -1;
+  }
+  int num_new = 0;
+  for (int i = 0; i < count; i++) {
+    num_new += is_in_place_block(old_block_nums[i]) == false;
+  }
+  // the partial blocks, one single and one double indirect block and a second
+  // level block per DIRECT_OFFSETS_PER_BLOCK blocks, each possibly copied
+  // to a new block
+  int reserve = 2 + 2 * (count / DIRECT_OFFSETS_PER_BLOCK + 3);
+  if (claim_data_blocks(num_new, reserve, block_nums)) {
+    return 1;
+  }
+  // spreads the claimed blocks out from the front of block_nums, back to
+  // front so that none is overwritten before it is moved
+  for (int i = count - 1, j = num_new - 1; i >= 0; i--) {
+    bool is_new = is_in_place_block(old_block_nums[i]) == false;
+    block_nums[i] = is_new ? block_nums[j--] : old_block_nums[i];
+  }
+  return 0;
+}
+
+// Stores the mapping picked by claim_mapped_blocks in one batch and releases
+// the old blocks it replaces.
+int install_mapped_blocks(uint16_t inum, int first_block_idx, int count,
+                          const uint16_t *block_nums,
+                          const uint16_t *old_block_nums) {
+  if (set_data_block_nums(inum, first_block_idx, count, block_nums)) {
+    fprintf(stderr, "install_mapped_blocks: failed to update block map\n");
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    if (old_block_nums[i] && old_block_nums[i] != block_nums[i] &&
+        release_data_block(old_block_nums[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Gives back the blocks claim_mapped_blocks claimed, when they will not be
+// installed after all. Nothing refers to them yet.
+void unclaim_mapped_blocks(int count, const uint16_t *block_nums,
+                           const uint16_t *old_block_nums) {
+  lock_alloc();
+  for (int i = 0; i < count; i++) {
+    if (block_nums[i] != old_block_nums[i]) {
+      bitmap_set(ctx->used_block_bitmap, block_nums[i], 0);
+    }
+  }
+  unlock_alloc();
+}
+
+// Prepares count whole data blocks of inode inum, starting at block index
+// first_block_idx, to be overwritten in place with claim_mapped_blocks and
+// install_mapped_blocks. block_nums receives the blocks to write. Returns 1,
+// with nothing changed, if the disk cannot hold them all.
+int map_data_blocks(uint16_t inum, int first_block_idx, int count,
+                    uint16_t *block_nums) {
+  uint16_t *old_block_nums = malloc(count * sizeof(uint16_t));
+  if (old_block_nums == NULL) {
+    fprintf(stderr, "map_data_blocks: out of memory\n");
+    return -1;
+  }
+  int ret = claim_mapped_blocks(inum, first_block_idx, count, block_nums,
+                                old_block_nums);
+  if (ret == 0) {
+    ret = install_mapped_blocks(inum, first_block_idx, count, block_nums,
+                                old_block_nums);
+  }
+  free(old_block_nums);
+  return ret;
+}
+
+// The number of threads a large write is split across.
+int write_threads() {
+  int threads = __atomic_load_n(&ctx->write_threads, __ATOMIC_RELAXED);
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  return MAX(1, MIN(threads, WRITE_MAX_THREADS));
+}
+
+// Writes the chunks of a parallel write until none is left, computing the
+// checksums of their blocks on the way.
+void *write_worker(void *arg) {
+  struct write_state *state = arg;
+  enter_ctx(state->ctx);
+  bool is_checksummed = ctx->sb.features & FS_FEATURE_CHECKSUM;
+  while (true) {
+    int idx = __atomic_fetch_add(&state->next_chunk, 1, __ATOMIC_RELAXED);
+    if (idx >= state->num_chunks) {
+      break;
+    }
+    struct write_chunk *chunk = &state->chunks[idx];
+    for (int i = 0; is_checksummed && i < chunk->count; i++) {
+      ctx->block_checksums[chunk->block_num + i] =
+          block_checksum(chunk->buf + (size_t)i * ctx->block_size);
+    }
+    struct iovec iov = {(void *)chunk->buf,
+                        (size_t)chunk->count * ctx->block_size};
+    if (block_writev(chunk->block_num, &iov, 1)) {
+      fprintf(stderr, "write_worker: failed to write data blocks %d-%d\n",
+              chunk->block_num, chunk->block_num + chunk->count - 1);
+      state->has_error = true;
+    }
+  }
+  return NULL;
+}
+
+// Writes nbyte bytes from iter at the offset of fd. The partial blocks at
+// either end go through write_bytes. The blocks in between are claimed in one
+// batch by claim_mapped_blocks; then worker threads write the data straight
+// from the caller's buffers, a run of consecutive blocks per system call, and
+// only then is the new mapping installed, so a failed write never leaves the
+// block map pointing at blocks that were not written. Blocks that straddle
+// two buffers are gathered into bounce blocks first. If the disk cannot hold
+// all of it, the write goes through write_bytes alone, which writes as much
+// as fits.
+size_t write_bytes_parallel(struct file_descriptor *fd, struct iov_iter *iter,
+                            size_t nbyte) {
+  uint16_t inum = fd->inode_number;
+  nbyte = MIN(nbyte, MAX_FILE_SIZE - fd->offset);
+  size_t head = MIN(nbyte, (ctx->block_size - fd->offset % ctx->block_size) %
+                               ctx->block_size);
+  int first_block_idx = (fd->offset + head) / ctx->block_size;
+  int count = (nbyte - head) / ctx->block_size;
+  size_t tail = nbyte - head - (size_t)count * ctx->block_size;
+  // a block straddles buffers only where one buffer ends
+  int max_bounce = MIN(count, iter->iovcnt - 1);
+  uint16_t *block_nums = malloc(2 * count * sizeof(uint16_t));
+  uint16_t *old_block_nums = block_nums + count;
+  struct write_chunk *chunks = malloc(count * sizeof(struct write_chunk));
+  char *bounce = malloc(MAX(max_bounce, 1) * ctx->block_size); // BLOCK_AT
+  struct write_state state = {ctx, chunks, 0, 0, false};
+  pthread_t threads[WRITE_MAX_THREADS];
+  bool is_claimed = false;
+  size_t ret = -1;
+  if (block_nums == NULL || chunks == NULL || bounce == NULL) {
+    fprintf(stderr, "write_bytes_parallel: out of memory\n");
+    goto out;
+  }
+  int claimed = claim_mapped_blocks(inum, first_block_idx, count, block_nums,
+                                    old_block_nums);
+  if (claimed == 1) {
+    ret = write_bytes_at(fd, iter, nbyte);
+    goto out;
+  }
+  if (claimed) {
+    goto out;
+  }
+  is_claimed = true;
+
+  if (head && write_bytes_at(fd, iter, head) != head) {
+    goto out;
+  }
+  for (int i = 0, num_bounce = 0; i < count;) {
+    const char *data = iter_contiguous(iter, ctx->block_size);
+    if (data == NULL) {
+      assert(num_bounce < max_bounce);
+      union fs_block *block = BLOCK_AT(bounce, num_bounce++);
+      iter_gather(iter, block, ctx->block_size);
+      chunks[state.num_chunks++] =
+          (struct write_chunk){block_nums[i], 1, block->data};
+      i++;
+      continue;
+    }
+    int run = 1;
+    iter_advance(iter, ctx->block_size);
+    while (i + run < count && run < WRITE_CHUNK_BLOCKS &&
+           block_nums[i + run] == block_nums[i] + run &&
+           iter_contiguous(iter, ctx->block_size) ==
+               data + (size_t)run * ctx->block_size) {
+      iter_advance(iter, ctx->block_size);
+      run++;
+    }
+    chunks[state.num_chunks++] = (struct write_chunk){block_nums[i], run, data};
+    i += run;
+  }
+  // the calling thread is one of the workers
+  int num_threads = MIN(write_threads(), state.num_chunks) - 1;
+  int started = 0;
+  for (; started < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, write_worker, &state)) {
+      break;
+    }
+  }
+  write_worker(&state);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (state.has_error) {
+    goto out;
+  }
+  // the block map owns the claimed blocks from here on
+  is_claimed = false;
+  if (install_mapped_blocks(inum, first_block_idx, count, block_nums,
+                            old_block_nums)) {
+    goto out;
+  }
+  for (int i = 0; (ctx->sb.features & FS_FEATURE_CHECKSUM) && i < count; i++) {
+    mark_dirty(&ctx->block_checksums[block_nums[i]], sizeof(uint32_t));
+  }
+  fd->offset += (size_t)count * ctx->block_size;
+  if (fd->offset > ctx->inode_table[inum].file_size) {
+    ctx->inode_table[inum].file_size = fd->offset;
+    mark_dirty(&ctx->inode_table[inum], INODE_SIZE);
+  }
+  if (tail && write_bytes_at(fd, iter, tail) != tail) {
+    goto out;
+  }
+  ret = nbyte;
+out:
+  if (is_claimed) {
+    unclaim_mapped_blocks(count, block_nums, old_block_nums);
+  }
+  free(block_nums);
+  free(chunks);
+  free(bounce);
+  return ret;
+}
+
+// Allocates an asynchronous request of the current context with room for
+// max_parts parts. It completes with result unless a part fails.
+struct async_request *new_async_request(uint64_t user_data, int result,
+                                        int max_parts) {
+  struct async_request *request =
+      malloc(sizeof(*request) + max_parts * sizeof(struct async_part));
+  if (request == NULL) {
+    fprintf(stderr, "new_async_request: out of memory\n");
+    return NULL;
+  }
+  request->ctx = ctx;
+  request->user_data = user_data;
+  request->result = result;
+  request->has_error = false;
+  request->is_read = false;
+  request->data_inum = -1;
+  request->next = NULL;
+  request->num_parts = 0;
+  return request;
+}
+
+// Adds a part reading or writing count blocks starting at block_num from or
+// to buf.
+struct async_part *add_async_part(struct async_request *request,
+                                  int block_num, int count, void *buf,
+                                  bool is_write) {
+  struct async_part *part = &request->parts[request->num_parts++];
+  part->req.block = block_num;
+  part->req.count = count;
+  part->req.buf = buf;
+  part->req.is_write = is_write;
+  part->req.done = async_part_done;
+  part->request = request;
+  part->copy_to = NULL;
+  return part;
+}
+
+// Queues the parts of request on the disk, or completes the request right
+// away if it has none. The request counts as in flight until it completes;
+// a part the disk refuses fails it like a part that fails to run.
+int submit_async(struct async_request *request) {
+  pthread_mutex_lock(&ctx->async_lock);
+  ctx->async_inflight++;
+  pthread_mutex_unlock(&ctx->async_lock);
+  int num_parts = request->num_parts;
+  request->pending = 1 + num_parts;
+  for (int i = 0; i < num_parts; i++) {
+    if (disk_submit(&request->parts[i].req)) {
+      __atomic_store_n(&request->has_error, true, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&request->pending, 1, __ATOMIC_ACQ_REL);
+    }
+  }
+  if (__atomic_sub_fetch(&request->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    complete_async(request);
+  }
+  return 0;
+}
+
+// Called from a thread of the disk queue as a part finishes. Read blocks are
+// verified against their checksums before their bytes are handed over.
+void async_part_done(struct disk_request *req) {
+  struct async_part *part = (struct async_part *)req;
+  struct async_request *request = part->request;
+  enter_ctx(request->ctx);
+  bool ok = req->result == 0;
+  for (int i = 0; ok && request->is_read && i < req->count; i++) {
+    ok = verify_block_checksum(req->block + i,
+                               (char *)req->buf +
+                                   (size_t)i * ctx->block_size) == 0;
+  }
+  if (ok == false) {
+    __atomic_store_n(&request->has_error, true, __ATOMIC_RELAXED);
+  } else if (part->copy_to) {
+    memcpy(part->copy_to, (char *)req->buf + part->copy_from, part->copy_len);
+  }
+  if (__atomic_sub_fetch(&request->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    complete_async(request);
+  }
+}
+
+// Moves a request whose parts are all done to the completion queue.
+void complete_async(struct async_request *request) {
+  struct fs_ctx *c = request->ctx;
+  if (__atomic_load_n(&request->has_error, __ATOMIC_RELAXED)) {
+    request->result = -1;
+  }
+  if (request->data_inum != -1) {
+    unlock_file_data(request->data_inum, false);
+  }
+  pthread_mutex_lock(&c->async_lock);
+  if (c->async_completed_tail) {
+    c->async_completed_tail->next = request;
+  } else {
+    c->async_completed = request;
+  }
+  c->async_completed_tail = request;
+  c->async_inflight--;
+  pthread_cond_broadcast(&c->async_cond);
+  pthread_mutex_unlock(&c->async_lock);
+}
+
+// Waits until no asynchronous request is in flight. Commits wait before
+// writing metadata that may point at blocks still being written, and before
+// reusing freed blocks that may still be read.
+void wait_async() {
+  pthread_mutex_lock(&ctx->async_lock);
+  while (ctx->async_inflight) {
+    pthread_cond_wait(&ctx->async_cond, &ctx->async_lock);
+  }
+  pthread_mutex_unlock(&ctx->async_lock);
+}
+
+// Drops the completions nobody reaped before the unmount.
+void free_async_completions() {
+  pthread_mutex_lock(&ctx->async_lock);
+  while (ctx->async_completed) {
+    struct async_request *request = ctx->async_completed;
+    ctx->async_completed = request->next;
+    free(request);
+  }
+  ctx->async_completed_tail = NULL;
+  pthread_mutex_unlock(&ctx->async_lock);
+}
+
+// Reads cluster cluster_idx of inode inum into buf, which must hold
+// COMPRESSION_CLUSTER_SIZE bytes.
+int read_cluster(uint16_t inum, int cluster_idx, char *buf) {
+  int cluster_offset = cluster_idx * COMPRESSION_CLUSTER_SIZE;
+  int size = MIN(COMPRESSION_CLUSTER_SIZE,
+                 ctx->inode_table[inum].file_size - cluster_offset);
+  if (size <= 0) {
+    return 0;
+  }
+  int logical_blocks = (size + ctx->block_size - 1) / ctx->block_size;
+  char stored[COMPRESSION_CLUSTER_SIZE];
+  int stored_blocks = 0;
+  while (stored_blocks < logical_blocks) {
+    int block_num = get_data_block_num(
+        inum, cluster_offset + stored_blocks * ctx->block_size);
+    if (block_num == -1) {
+      fprintf(stderr, "read_cluster: failed to get data block number\n");
+      return -1;
+    }
+    if (block_num == 0) {
+      break;
+    }
+    if (data_block_read(block_num, stored + stored_blocks * ctx->block_size)) {
+      fprintf(stderr, "read_cluster: failed to read data block %d\n",
+              block_num);
+      return -1;
+    }
+    stored_blocks++;
+  }
+  if (stored_blocks == logical_blocks) {
+    memcpy(buf, stored, size);
+    return 0;
+  }
+  if (stored_blocks == 0) {
+    fprintf(stderr, "read_cluster: cluster %d is not stored\n", cluster_idx);
+    return -1;
+  }
+  struct compressed_cluster *cluster = (struct compressed_cluster *)stored;
+  if (cluster->compressed_size >
+          stored_blocks * ctx->block_size - sizeof(struct compressed_cluster) ||
+      lz_decompress(cluster->data, cluster->compressed_size, buf, size) !=
+          size) {
+    fprintf(stderr, "read_cluster: corrupt cluster %d\n", cluster_idx);
+    return -1;
+  }
+  return 0;
+}
+
+// Stores the first size bytes of buf as cluster cluster_idx of inode inum,
+// compressed if that saves at least one block. The cluster is written to
+// newly claimed blocks and its old blocks are freed afterwards.
+int write_cluster(uint16_t inum, int cluster_idx, const char *buf, int size) {
+  int cluster_offset = cluster_idx * COMPRESSION_CLUSTER_SIZE;
+  int stored_blocks = (size + ctx->block_size - 1) / ctx->block_size;
+  const char *stored = buf;
+  char compressed[COMPRESSION_CLUSTER_SIZE];
+  int capacity = (stored_blocks - 1) * ctx->block_size -
+                 (int)sizeof(struct compressed_cluster);
+  if (capacity > 0) {
+    struct compressed_cluster *cluster =
+        (struct compressed_cluster *)compressed;
+    int compressed_size = lz_compress(buf, size, cluster->data, capacity);
+    if (compressed_size > 0) {
+      cluster->compressed_size = compressed_size;
+      size = sizeof(struct compressed_cluster) + compressed_size;
+      stored_blocks = (size + ctx->block_size - 1) / ctx->block_size;
+      stored = compressed;
+    }
+  }
+
+  int new_blocks[COMPRESSION_CLUSTER_BLOCKS];
+  int claimed = 0;
+  for (; claimed < stored_blocks; claimed++) {
+    new_blocks[claimed] = claim_unused_data_block();
+    if (new_blocks[claimed] == -1) {
+      fprintf(stderr, "write_cluster: no free blocks\n");
+      goto fail;
+    }
+  }
+  union fs_block block_buffer;
+  for (int i = 0; i < stored_blocks; i++) {
+    int bytes = MIN(ctx->block_size, size - i * ctx->block_size);
+    memset(&block_buffer, 0, ctx->block_size);
+    memcpy(block_buffer.data, stored + i * ctx->block_size, bytes);
+    if (data_block_write(new_blocks[i], &block_buffer)) {
+      fprintf(stderr, "write_cluster: failed to write data block %d\n",
+              new_blocks[i]);
+      goto fail;
+    }
+  }
+  for (int i = 0; i < COMPRESSION_CLUSTER_BLOCKS; i++) {
+    int file_offset = cluster_offset + i * ctx->block_size;
+    int old_block_num = get_data_block_num(inum, file_offset);
+    if (old_block_num == -1) {
+      return -1;
+    }
+    uint16_t new_block_num = i < stored_blocks ? new_blocks[i] : 0;
+    if (old_block_num == new_block_num) {
+      continue;
+    }
+    if (set_data_block_num(inum, file_offset, new_block_num)) {
+      return -1;
+    }
+    if (old_block_num && free_data_block(old_block_num)) {
+      return -1;
+    }
+  }
+  return 0;
+fail:
+  // the blocks are not mapped yet, so nothing else refers to them
+  lock_alloc();
+  while (claimed-- > 0) {
+    bitmap_set(ctx->used_block_bitmap, new_blocks[claimed], 0);
+  }
+  unlock_alloc();
+  return -1;
+}
+
+size_t read_bytes_compressed(struct file_descriptor *fd,
+                             struct iov_iter *iter, size_t nbyte) {
+  char cluster[COMPRESSION_CLUSTER_SIZE];
+  int file_size = ctx->inode_table[fd->inode_number].file_size;
+  size_t bytes_read = 0;
+  nbyte = MIN(nbyte, file_size - fd->offset);
+  while (bytes_read < nbyte) {
+    int cluster_idx = fd->offset / COMPRESSION_CLUSTER_SIZE;
+    int offset_in_cluster = fd->offset % COMPRESSION_CLUSTER_SIZE;
+    if (read_cluster(fd->inode_number, cluster_idx, cluster)) {
+      return -1;
+    }
+    size_t bytes_to_read =
+        MIN(nbyte - bytes_read, COMPRESSION_CLUSTER_SIZE - offset_in_cluster);
+    iter_scatter(iter, cluster + offset_in_cluster, bytes_to_read);
+    bytes_read += bytes_to_read;
+    fd->offset += bytes_to_read;
+  }
+  return bytes_read;
+}
+
+size_t write_bytes_compressed(struct file_descriptor *fd,
+                              struct iov_iter *iter, size_t nbyte) {
+  char cluster[COMPRESSION_CLUSTER_SIZE];
+  struct inode *inode = &ctx->inode_table[fd->inode_number];
+  size_t bytes_written = 0;
+  nbyte = MIN(nbyte, MAX_FILE_SIZE - fd->offset);
+  while (bytes_written < nbyte) {
+    int cluster_idx = fd->offset / COMPRESSION_CLUSTER_SIZE;
+    int offset_in_cluster = fd->offset % COMPRESSION_CLUSTER_SIZE;
+    int old_size =
+        MIN(COMPRESSION_CLUSTER_SIZE,
+            MAX(0, inode->file_size - cluster_idx * COMPRESSION_CLUSTER_SIZE));
+    size_t bytes_to_write = MIN(nbyte - bytes_written,
+                                COMPRESSION_CLUSTER_SIZE - offset_in_cluster);
+    // only a cluster that is partially overwritten needs its old contents
+    if ((offset_in_cluster > 0 ||
+         offset_in_cluster + bytes_to_write < old_size) &&
+        read_cluster(fd->inode_number, cluster_idx, cluster)) {
+      return -1;
+    }
+    iter_gather(iter, cluster + offset_in_cluster, bytes_to_write);
+    int new_size = MAX(old_size, offset_in_cluster + bytes_to_write);
+    if (write_cluster(fd->inode_number, cluster_idx, cluster, new_size)) {
+      break;
+    }
+    bytes_written += bytes_to_write;
+    fd->offset += bytes_to_write;
+    if (fd->offset > inode->file_size) {
+      inode->file_size = fd->offset;
+      mark_dirty(inode, INODE_SIZE);
+    }
+  }
+  return bytes_written;
+}
+
+// Recursively clear indirect blocks. indirection_level > 0 means entries in
+// block_num point to indirect blocks.
+int clear_indirect_block(uint16_t block_num, int indirection_level) {
+  union fs_block block_buffer;
+  if (data_block_read(block_num, &block_buffer)) {
+    fprintf(stderr, "clear_indirect_block: failed to read indirect block\n");
+    return -1;
+  }
+  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
+    if (block_buffer.block_offsets[i]) {
+      if (indirection_level > SINGLE_INDIRECTION) {
+        if (clear_indirect_block(block_buffer.block_offsets[i],
+                                 indirection_level - 1)) {
+          fprintf(stderr,
+                  "clear_indirect_block: failed to clear indirect block\n");
+          return -1;
+        }
+      } else if (release_data_block(block_buffer.block_offsets[i])) {
+        fprintf(stderr, "clear_indirect_block: failed to clear data block %d\n",
+                block_buffer.block_offsets[i]);
+        return -1;
+      }
+    }
+  }
+  if (free_data_block(block_num)) {
+    fprintf(stderr, "clear_indirect_block: failed to clear indirect block\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Frees the data blocks of the indirect tree at *block_num whose index
+// (relative to the first block the tree maps) is first_free_idx or larger.
+// Indirect blocks left without entries are freed and *block_num is cleared.
+int truncate_indirect_block(uint16_t *block_num, int indirection_level,
+                            int first_free_idx) {
+  if (*block_num == 0) {
+    return 0;
+  }
+  if (first_free_idx <= 0) {
+    if (clear_indirect_block(*block_num, indirection_level)) {
+      return -1;
+    }
+    *block_num = 0;
+    mark_dirty(block_num, sizeof(*block_num));
+    return 0;
+  }
+  int blocks_per_entry =
+      indirection_level > SINGLE_INDIRECTION ? DIRECT_OFFSETS_PER_BLOCK : 1;
+  union fs_block block_buffer;
+  if (data_block_read(*block_num, &block_buffer)) {
+    fprintf(stderr, "truncate_indirect_block: failed to read indirect block\n");
+    return -1;
+  }
+  bool is_modified = false;
+  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
+    uint16_t entry = block_buffer.block_offsets[i];
+    int first_entry_idx = i * blocks_per_entry;
+    if (entry == 0 || first_entry_idx + blocks_per_entry <= first_free_idx) {
+      continue;
+    }
+    if (indirection_level > SINGLE_INDIRECTION) {
+      if (truncate_indirect_block(&entry, indirection_level - 1,
+                                  first_free_idx - first_entry_idx)) {
+        return -1;
+      }
+    } else {
+      if (release_data_block(entry)) {
+        return -1;
+      }
+      entry = 0;
+    }
+    if (entry != block_buffer.block_offsets[i]) {
+      block_buffer.block_offsets[i] = entry;
+      is_modified = true;
+    }
+  }
+  if (is_modified == false) {
+    return 0;
+  }
+  return write_indirect_block(block_num, &block_buffer);
+}
+
+// Drops the snapshot, releasing the blocks that only the snapshot still
+// references.
+int release_snapshot() {
+  if (ctx->sb.has_snapshot == false) {
+    return 0;
+  }
+  ctx->sb.has_snapshot = false;
+  mark_dirty(&ctx->sb, sizeof(ctx->sb));
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    if (bitmap_test(ctx->snapshot_free_bitmap, i) && free_data_block(i)) {
+      fprintf(stderr, "release_snapshot: failed to free block %d\n", i);
+      return -1;
+    }
+  }
+  memset(ctx->snapshot_block_bitmap, 0, sizeof(ctx->snapshot_block_bitmap));
+  memset(ctx->snapshot_free_bitmap, 0, sizeof(ctx->snapshot_free_bitmap));
+  mark_dirty(ctx->snapshot_block_bitmap, sizeof(ctx->snapshot_block_bitmap));
+  mark_dirty(ctx->snapshot_free_bitmap, sizeof(ctx->snapshot_free_bitmap));
+  return 0;
+}
+
+// Reads size bytes of metadata stored in consecutive blocks from block_num on.
+int read_region(int block_num, void *mem, size_t size) {
+  union fs_block block_buffer;
+  for (size_t done = 0; done < size; done += ctx->block_size, block_num++) {
+    if (block_read(block_num, &block_buffer)) {
+      return -1;
+    }
+    memcpy((char *)mem + done, block_buffer.data,
+           MIN(ctx->block_size, size - done));
+  }
+  return 0;
+}
+
+int region_first_block(const struct metadata_region *region) {
+  if (region->first_block == -1) {
+    const struct metadata_region *prev = region - 1;
+    return region_first_block(prev) + BLOCKS_FOR(prev->size);
+  }
+  return *region->offset + region->first_block;
+}
+
+bool has_region(const struct metadata_region *region) {
+  return region->feature == 0 || (ctx->sb.features & region->feature);
+}
+
+// Adds block_num to set. Operations running side by side add blocks to the
+// same sets, so words are updated atomically.
+void block_set_add(struct block_set *set, int block_num) {
+  assert(block_num < JOURNAL_MAX_BLOCKS);
+  __atomic_fetch_or(&set->words[block_num / 64], 1ULL << (block_num % 64),
+                    __ATOMIC_RELAXED);
+}
+
+bool block_set_test(const struct block_set *set, int block_num) {
+  return set->words[block_num / 64] & (1ULL << (block_num % 64));
+}
+
+bool block_set_is_empty(const struct block_set *set) {
+  for (int i = 0; i < BLOCK_SET_WORDS; i++) {
+    if (set->words[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool block_set_overlaps(const struct block_set *a, const struct block_set *b) {
+  for (int i = 0; i < BLOCK_SET_WORDS; i++) {
+    if (a->words[i] & b->words[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Adds the blocks of src to dst, atomically as block_set_add does.
+void block_set_merge(struct block_set *dst, const struct block_set *src) {
+  for (int i = 0; i < BLOCK_SET_WORDS; i++) {
+    __atomic_fetch_or(&dst->words[i], src->words[i], __ATOMIC_RELAXED);
+  }
+}
+
+// Removes the blocks of src from dst.
+void block_set_remove(struct block_set *dst, const struct block_set *src) {
+  for (int i = 0; i < BLOCK_SET_WORDS; i++) {
+    dst->words[i] &= ~src->words[i];
+  }
+}
+
+// Keeps only the blocks of dst that src holds too.
+void block_set_intersect(struct block_set *dst, const struct block_set *src) {
+  for (int i = 0; i < BLOCK_SET_WORDS; i++) {
+    dst->words[i] &= src->words[i];
+  }
+}
+
+// Marks the metadata blocks holding the size bytes at ptr as changed since the
+// last commit. Pointers outside the metadata regions are ignored, so a block
+// number can be marked without checking whether it lives in an inode.
+void mark_dirty(const void *ptr, size_t size) {
+  const char *p = ptr;
+  for (int i = 0; i < METADATA_REGIONS; i++) {
+    const struct metadata_region *region = &ctx->metadata_regions[i];
+    const char *mem = region->mem;
+    if (p < mem || p >= mem + region->size) {
+      continue;
+    }
+    if (has_region(region) == false) {
+      return;
+    }
+    assert(__atomic_load_n(&region->is_loaded, __ATOMIC_ACQUIRE) ||
+           ctx->is_mounted == false);
+    int first = region_first_block(region) + (p - mem) / ctx->block_size;
+    int last =
+        region_first_block(region) + (p + size - 1 - mem) / ctx->block_size;
+    for (int block_num = first; block_num <= last; block_num++) {
+      block_set_add(&ctx->dirty_blocks, block_num);
+      block_set_add(&op_dirty_blocks, block_num);
+    }
+    return;
+  }
+}
+
+// Fills block_buffer with the in-memory contents of metadata block block_num.
+void get_metadata_block(int block_num, union fs_block *block_buffer) {
+  memset(block_buffer, 0, ctx->block_size);
+  for (int i = 0; i < METADATA_REGIONS; i++) {
+    const struct metadata_region *region = &ctx->metadata_regions[i];
+    int first = region_first_block(region);
+    int blocks = (region->size + ctx->block_size - 1) / ctx->block_size;
+    if (has_region(region) && block_num >= first &&
+        block_num < first + blocks) {
+      size_t offset = (size_t)(block_num - first) * ctx->block_size;
+      memcpy(block_buffer->data, (char *)region->mem + offset,
+             MIN(ctx->block_size, region->size - offset));
+      return;
+    }
+  }
+}
+
+// Copies block_buffer into the in-memory contents of metadata block
+// block_num, the reverse of get_metadata_block.
+void put_metadata_block(int block_num, const union fs_block *block_buffer) {
+  for (int i = 0; i < METADATA_REGIONS; i++) {
+    const struct metadata_region *region = &ctx->metadata_regions[i];
+    int first = region_first_block(region);
+    int blocks = (region->size + ctx->block_size - 1) / ctx->block_size;
+    if (has_region(region) && block_num >= first &&
+        block_num < first + blocks) {
+      size_t offset = (size_t)(block_num - first) * ctx->block_size;
+      memcpy((char *)region->mem + offset, block_buffer->data,
+             MIN(ctx->block_size, region->size - offset));
+      return;
+    }
+  }
+}
+
+// Loads the region holding mem if it was left for later at mount time.
+int require_region(void *mem) {
+  for (int i = 0; i < METADATA_REGIONS; i++) {
+    struct metadata_region *region = &ctx->metadata_regions[i];
+    if (region->mem != mem) {
+      continue;
+    }
+    if (__atomic_load_n(&region->is_loaded, __ATOMIC_ACQUIRE)) {
+      return 0;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&ctx->region_lock);
+    if (region->is_loaded == false) {
+      if (read_region(region_first_block(region), region->mem,
+                      region->size)) {
+        fprintf(stderr, "require_region: failed to read metadata block %d\n",
+                region_first_block(region));
+        ret = -1;
+      } else {
+        __atomic_store_n(&region->is_loaded, true, __ATOMIC_RELEASE);
+      }
+    }
+    pthread_mutex_unlock(&ctx->region_lock);
+    return ret;
+  }
+  return 0;
+}
+
+// Loads the reference counts and fingerprints and builds the fingerprint
+// index from them.
+int load_dedup_index() {
+  if (ctx->is_dedup_index_loaded) {
+    return 0;
+  }
+  if (require_region(ctx->block_refcount) ||
+      require_region(ctx->block_fingerprint)) {
+    return -1;
+  }
+  memset(ctx->dedup_index, 0, sizeof(ctx->dedup_index));
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    if (ctx->block_refcount[i]) {
+      dedup_index_insert(i);
+    }
+  }
+  ctx->is_dedup_index_loaded = true;
+  return 0;
+}
+
+// Reads the super block, replays the journal and loads the metadata regions.
+// Lazy regions are only loaded if load_all is set or the file system was not
+// unmounted cleanly; otherwise require_region loads them when first used.
+int load_metadata(bool load_all) {
+  union fs_block block_buffer;
+  set_block_size(disk_block_size());
+  if (block_read(0, &block_buffer)) {
+    fprintf(stderr, "load_metadata: failed to read super block\n");
+    return -1;
+  }
+  if (memvcmp(&block_buffer.super, 0, sizeof(ctx->sb))) {
+    fprintf(stderr, "load_metadata: file system not initialized\n");
+    return -1;
+  }
+  ctx->sb = block_buffer.super;
+  if (ctx->sb.block_size != 0 && ctx->sb.block_size != ctx->block_size) {
+    fprintf(stderr, "load_metadata: block size does not match the image\n");
+    return -1;
+  }
+  if (journal_recover()) {
+    fprintf(stderr, "load_metadata: failed to recover journal\n");
+    return -1;
+  }
+  return read_metadata(load_all);
+}
+
+// Reads the super block and the metadata regions as load_metadata does,
+// without replaying the journal, and forgets the changes since the last
+// commit.
+int read_metadata(bool load_all) {
+  // the journal may have replayed the super block
+  if (read_region(0, &ctx->sb, sizeof(ctx->sb))) {
+    fprintf(stderr, "load_metadata: failed to read super block\n");
+    return -1;
+  }
+  load_all |= ctx->sb.is_clean == false;
+  for (int i = 0; i < METADATA_REGIONS; i++) {
+    struct metadata_region *region = &ctx->metadata_regions[i];
+    region->is_loaded = false;
+    if (has_region(region) == false) {
+      memset(region->mem, 0, region->size);
+    } else if (region->is_lazy && load_all == false) {
+      continue;
+    } else if (read_region(region_first_block(region), region->mem,
+                           region->size)) {
+      fprintf(stderr, "load_metadata: failed to read metadata block %d\n",
+              region_first_block(region));
+      return -1;
+    }
+    region->is_loaded = true;
+  }
+  ctx->is_dedup_index_loaded = false;
+  ctx->dirty_blocks = op_dirty_blocks = ctx->unowned_dirty_blocks =
+      (struct block_set){{0}};
+  memset(ctx->inode_dirty_blocks, 0, sizeof(ctx->inode_dirty_blocks));
+  ctx->journaled_blocks = (struct block_set){{0}};
+  memset(ctx->freed_block_bitmap, 0, sizeof(ctx->freed_block_bitmap));
+  ctx->freed_block_count = 0;
+  memset(ctx->claimed_block_bitmap, 0, sizeof(ctx->claimed_block_bitmap));
+  ctx->journal_pending_ops = 0;
+  return 0;
+}
+
+// Counts the clear bits of bitmap from index first up to index last.
+int count_free_bits(const uint8_t *bitmap, int first, int last) {
+  int count = 0;
+  for (int i = first; i < last; i++) {
+    count += bitmap_test(bitmap, i) == false;
+  }
+  return count;
+}
+
+// Marks the blocks of the indirect tree at block_num in referenced and counts
+// the block map entries pointing at each data block in refs. An indirect
+// block failing its checksum is walked all the same, as fsck does, and
+// counted in *bad_blocks; entries outside of the data area are skipped.
+int scan_indirect_block(uint16_t block_num, int indirection_level,
+                        uint8_t *referenced, uint16_t *refs, int *bad_blocks) {
+  union fs_block block_buffer;
+  if (block_read(block_num, &block_buffer)) {
+    fprintf(stderr, "scan_indirect_block: failed to read indirect block %d\n",
+            block_num);
+    return -1;
+  }
+  if (verify_block_checksum(block_num, &block_buffer)) {
+    (*bad_blocks)++;
+  }
+  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
+    if (scan_entry(block_buffer.block_offsets[i], indirection_level - 1,
+                   referenced, refs, bad_blocks)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Marks the block a block map entry points at in referenced, walking it if
+// it is an indirect block (indirection_level >= SINGLE_INDIRECTION) and
+// counting the entry in refs if it is a data block.
+int scan_entry(uint16_t block_num, int indirection_level, uint8_t *referenced,
+               uint16_t *refs, int *bad_blocks) {
+  if (block_num < ctx->sb.data_offset || block_num >= DISK_BLOCKS) {
+    return 0;
+  }
+  referenced[block_num / CHAR_BIT] |= 1 << (block_num % CHAR_BIT);
+  if (indirection_level < SINGLE_INDIRECTION) {
+    refs[block_num]++;
+    return 0;
+  }
+  return scan_indirect_block(block_num, indirection_level, referenced, refs,
+                             bad_blocks);
+}
+
+// The pass run by mount_fs after an unclean shutdown. The journal keeps the
+// metadata consistent, but blocks freed by the last committed operations may
+// still be marked used, since freed blocks are only released after the commit
+// that frees them, and the free counts in the super block are stale. Walks
+// the block maps of all inodes, releases the blocks nothing references,
+// corrects the reference counts and recounts the free blocks and inodes.
+// Damaged indirect blocks are reported rather than failing the mount.
+int scan_metadata() {
+  uint8_t referenced[DISK_BLOCKS / CHAR_BIT];
+  uint16_t refs[DISK_BLOCKS];
+  int bad_blocks = 0;
+  memset(referenced, 0, sizeof(referenced));
+  memset(refs, 0, sizeof(refs));
+  if (ctx->sb.has_snapshot) {
+    memcpy(referenced, ctx->snapshot_block_bitmap, sizeof(referenced));
+  }
+  for (int inum = 0; inum < MAX_FILES; inum++) {
+    if (bitmap_test(ctx->inode_bitmap, inum) == false) {
+      continue;
+    }
+    struct inode *inode = &ctx->inode_table[inum];
+    for (int i = 0; i < DIRECT_OFFSETS_PER_INODE; i++) {
+      scan_entry(inode->direct_offset[i], SINGLE_INDIRECTION - 1, referenced,
+                 refs, &bad_blocks);
+    }
+    if (scan_entry(inode->single_indirect_offset, SINGLE_INDIRECTION,
+                   referenced, refs, &bad_blocks) ||
+        scan_entry(inode->double_indirect_offset, DOUBLE_INDIRECTION,
+                   referenced, refs, &bad_blocks)) {
+      return -1;
+    }
+  }
+  // the blocks stay as they are for fsck to report and repair
+  if (bad_blocks) {
+    fprintf(stderr,
+            "scan_metadata: %d indirect blocks failed their checksum, "
+            "run fsck\n",
+            bad_blocks);
+  }
+
+  union fs_block empty_block;
+  memset(&empty_block, 0, ctx->block_size);
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    bool is_referenced = bitmap_test(referenced, i);
+    if (bitmap_test(ctx->used_block_bitmap, i) && is_referenced == false) {
+      if (data_block_write(i, &empty_block)) {
+        fprintf(stderr, "scan_metadata: failed to clear data block %d\n", i);
+        return -1;
+      }
+      bitmap_set(ctx->used_block_bitmap, i, 0);
+    } else if (is_referenced) {
+      bitmap_set(ctx->used_block_bitmap, i, 1);
+    }
+    if ((ctx->sb.features & FS_FEATURE_DEDUP) && ctx->block_refcount[i] &&
+        ctx->block_refcount[i] != refs[i]) {
+      ctx->block_refcount[i] = refs[i];
+      mark_dirty(&ctx->block_refcount[i], sizeof(ctx->block_refcount[i]));
+    }
+  }
+  ctx->num_free_blocks =
+      count_free_bits(ctx->used_block_bitmap, 0, DISK_BLOCKS);
+  ctx->num_free_inodes = count_free_bits(ctx->inode_bitmap, 0, MAX_FILES);
+  return 0;
+}
+
+// Counts the used blocks of the segments of a log-structured image, and
+// starts the log at the start of the data area if it has no head yet.
+void count_segments() {
+  memset(ctx->segment_used, 0, sizeof(ctx->segment_used));
+  for (int i = 0; i < DISK_BLOCKS; i++) {
+    ctx->segment_used[i / LOG_SEGMENT_BLOCKS] +=
+        bitmap_test(ctx->used_block_bitmap, i);
+  }
+  ctx->num_clean_segments = 0;
+  for (int i = 0; i < LOG_SEGMENTS; i++) {
+    ctx->num_clean_segments += ctx->segment_used[i] == 0;
+  }
+  if (ctx->sb.log_head < ctx->sb.data_offset) {
+    ctx->sb.log_head = ctx->sb.data_offset;
+  }
+}
+
+// Commits everything and records a clean shutdown in the super block, along
+// with the free counts, which are final once the freed blocks are released.
+int mark_clean() {
+  if (journal_flush()) {
+    return -1;
+  }
+  ctx->sb.is_clean = true;
+  ctx->sb.free_blocks = ctx->num_free_blocks;
+  ctx->sb.free_inodes = ctx->num_free_inodes;
+  mark_dirty(&ctx->sb, sizeof(ctx->sb));
+  return journal_flush();
+}
+
+// Runs fn on state->num_threads threads and waits for all of them.
+int run_fsck_workers(struct fsck_state *state, void *(*fn)(void *)) {
+  struct fsck_worker workers[FSCK_MAX_THREADS];
+  int started = 0;
+  for (; started < state->num_threads; started++) {
+    workers[started].state = state;
+    workers[started].idx = started;
+    workers[started].fn = fn;
+    if (pthread_create(&workers[started].thread, NULL, fsck_worker_main,
+                       &workers[started])) {
+      break;
+    }
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (started < state->num_threads) {
+    fprintf(stderr, "run_fsck_workers: failed to start thread\n");
+    return -1;
+  }
+  return state->has_error ? -1 : 0;
+}
+
+// Runs the function of a worker on the context of the thread that started it.
+void *fsck_worker_main(void *arg) {
+  struct fsck_worker *worker = arg;
+  enter_ctx(worker->state->ctx);
+  return worker->fn(arg);
+}
+
+// Counts the block map entry at entry, which lives in indirect block parent or
+// in an inode if parent is 0, and walks the tree below it. indirection_level
+// is below SINGLE_INDIRECTION for a data block. Entries pointing outside the
+// data area are cleared when repairing. An indirect block is read and walked
+// only once, by the walker that counted it first.
+void fsck_walk_entry(struct fsck_state *state, uint16_t *entry,
+                     uint16_t parent, int indirection_level) {
+  uint16_t block_num = *entry;
+  if (block_num == 0) {
+    return;
+  }
+  if (block_num < ctx->sb.data_offset || block_num >= DISK_BLOCKS) {
+    __atomic_fetch_add(&state->bad_pointers, 1, __ATOMIC_RELAXED);
+    if (state->repair) {
+      *entry = 0;
+      __atomic_fetch_or(&state->rewritten[parent / CHAR_BIT],
+                        1 << (parent % CHAR_BIT), __ATOMIC_RELAXED);
+    }
+    return;
+  }
+  if (indirection_level < SINGLE_INDIRECTION) {
+    __atomic_fetch_add(&state->refs[block_num], 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (__atomic_fetch_add(&state->indirect_refs[block_num], 1,
+                         __ATOMIC_RELAXED)) {
+    return;
+  }
+  union fs_block *block = malloc(ctx->block_size);
+  if (block == NULL || block_read(block_num, block)) {
+    fprintf(stderr, "fsck_walk_entry: failed to read indirect block %d\n",
+            block_num);
+    free(block);
+    __atomic_store_n(&state->has_error, true, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&state->bytes_read, ctx->block_size, __ATOMIC_RELAXED);
+  state->indirect[block_num] = block;
+  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
+    fsck_walk_entry(state, &block->block_offsets[i], block_num,
+                    indirection_level - 1);
+  }
+}
+
+// Walks the block maps of every num_threads-th inode with a directory entry.
+void *fsck_walk_worker(void *arg) {
+  struct fsck_worker *worker = arg;
+  struct fsck_state *state = worker->state;
+  for (int inum = worker->idx; inum < MAX_FILES; inum += state->num_threads) {
+    if (state->has_dentry[inum] == false) {
+      continue;
+    }
+    struct inode *inode = &ctx->inode_table[inum];
+    for (int i = 0; i < DIRECT_OFFSETS_PER_INODE; i++) {
+      fsck_walk_entry(state, &inode->direct_offset[i], 0,
+                      SINGLE_INDIRECTION - 1);
+    }
+    fsck_walk_entry(state, &inode->single_indirect_offset, 0,
+                    SINGLE_INDIRECTION);
+    fsck_walk_entry(state, &inode->double_indirect_offset, 0,
+                    DOUBLE_INDIRECTION);
+  }
+  return NULL;
+}
+
+// Whether the walk or the snapshot references block_num.
+bool fsck_is_referenced(struct fsck_state *state, int block_num) {
+  return state->refs[block_num] || state->indirect_refs[block_num] ||
+         is_snapshot_block(block_num);
+}
+
+// Verifies the checksums of the referenced blocks in a contiguous share of
+// the data area. The share is streamed through a window of FSCK_READ_BLOCKS,
+// so the reads stay large and sequential; windows with nothing referenced
+// are skipped.
+void *fsck_verify_worker(void *arg) {
+  struct fsck_worker *worker = arg;
+  struct fsck_state *state = worker->state;
+  int data_blocks = DISK_BLOCKS - ctx->sb.data_offset;
+  int first = ctx->sb.data_offset +
+              data_blocks * worker->idx / state->num_threads;
+  int last = ctx->sb.data_offset +
+             data_blocks * (worker->idx + 1) / state->num_threads;
+  char *window = malloc(FSCK_READ_SIZE); // see BLOCK_AT
+  uint64_t errors = 0;
+  if (window == NULL) {
+    fprintf(stderr, "fsck_verify_worker: out of memory\n");
+    __atomic_store_n(&state->has_error, true, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  for (int block_num = first; block_num < last;
+       block_num += FSCK_READ_BLOCKS) {
+    int count = MIN(FSCK_READ_BLOCKS, last - block_num);
+    int i = 0;
+    while (i < count && fsck_is_referenced(state, block_num + i) == false) {
+      i++;
+    }
+    if (i == count) {
+      continue;
+    }
+    struct iovec iov = {window, (size_t)count * ctx->block_size};
+    if (block_readv(block_num, &iov, 1)) {
+      fprintf(stderr, "fsck_verify_worker: failed to read block %d\n",
+              block_num);
+      __atomic_store_n(&state->has_error, true, __ATOMIC_RELAXED);
+      break;
+    }
+    __atomic_fetch_add(&state->bytes_read, iov.iov_len, __ATOMIC_RELAXED);
+    for (; i < count; i++) {
+      if (fsck_is_referenced(state, block_num + i) &&
+          block_checksum(BLOCK_AT(window, i)) !=
+              ctx->block_checksums[block_num + i]) {
+        errors++;
+      }
+    }
+  }
+  free(window);
+  __atomic_fetch_add(&state->checksum_errors, errors, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// The checks of fs_fsck, on the loaded metadata. Directory entries decide
+// which inodes are in use, the block maps of those inodes and the snapshot
+// decide which blocks are, and both bitmaps are rebuilt to match.
+int fsck_check(struct fsck_state *state, struct fs_fsck_report *report) {
+  for (int i = 0; i < MAX_FILES; i++) {
+    struct dir_entry *dentry = &ctx->dir_table[i];
+    if (dentry->is_used == false) {
+      continue;
+    }
+    uint16_t inum = dentry->inode_number;
+    if (inum >= MAX_FILES || state->has_dentry[inum]) {
+      report->bad_dir_entries++;
+      if (state->repair) {
+        clear_dentry(dentry);
+      }
+      continue;
+    }
+    state->has_dentry[inum] = true;
+    report->files++;
+    if (bitmap_test(ctx->inode_bitmap, inum) == false) {
+      report->missing_inodes++;
+      if (state->repair) {
+        bitmap_set(ctx->inode_bitmap, inum, 1);
+      }
+    }
+  }
+  for (int inum = 0; inum < MAX_FILES; inum++) {
+    if (bitmap_test(ctx->inode_bitmap, inum) &&
+        state->has_dentry[inum] == false) {
+      report->orphaned_inodes++;
+      if (state->repair) {
+        bitmap_set(ctx->inode_bitmap, inum, 0);
+        memset(&ctx->inode_table[inum], 0, sizeof(ctx->inode_table[inum]));
+        mark_dirty(&ctx->inode_table[inum], sizeof(ctx->inode_table[inum]));
+      }
+    }
+  }
+
+  if (run_fsck_workers(state, fsck_walk_worker) ||
+      ((ctx->sb.features & FS_FEATURE_CHECKSUM) &&
+       run_fsck_workers(state, fsck_verify_worker))) {
+    return -1;
+  }
+  report->bytes_read = state->bytes_read;
+  report->bad_pointers = state->bad_pointers;
+  report->checksum_errors = state->checksum_errors;
+  if (state->repair && state->bad_pointers) {
+    mark_dirty(ctx->inode_table, sizeof(ctx->inode_table));
+  }
+
+  union fs_block empty_block;
+  memset(&empty_block, 0, ctx->block_size);
+  for (int i = 0; i < DISK_BLOCKS; i++) {
+    bool is_used = bitmap_test(ctx->used_block_bitmap, i);
+    if (i < ctx->sb.data_offset) {
+      if (is_used == false) {
+        report->missing_blocks++;
+        if (state->repair) {
+          bitmap_set(ctx->used_block_bitmap, i, 1);
+        }
+      }
+      continue;
+    }
+    int refs = state->refs[i];
+    int indirect_refs = state->indirect_refs[i];
+    // deduplicated blocks may be shared by as many entries as they count
+    int max_refs = (ctx->sb.features & FS_FEATURE_DEDUP)
+                       ? MAX(1, ctx->block_refcount[i])
+                       : 1;
+    if (indirect_refs > 1 || (indirect_refs && refs) || refs > max_refs) {
+      report->cross_linked_blocks++;
+    }
+    bool is_referenced = fsck_is_referenced(state, i);
+    if (is_used && is_referenced == false) {
+      report->orphaned_blocks++;
+      if (state->repair) {
+        if (data_block_write(i, &empty_block)) {
+          fprintf(stderr, "fsck_check: failed to clear data block %d\n", i);
+          return -1;
+        }
+        bitmap_set(ctx->used_block_bitmap, i, 0);
+      }
+    } else if (is_used == false && is_referenced) {
+      report->missing_blocks++;
+      if (state->repair) {
+        bitmap_set(ctx->used_block_bitmap, i, 1);
+      }
+    }
+    if (state->repair && (ctx->sb.features & FS_FEATURE_DEDUP) &&
+        ctx->block_refcount[i] && ctx->block_refcount[i] != refs) {
+      ctx->block_refcount[i] = refs;
+      mark_dirty(&ctx->block_refcount[i], sizeof(ctx->block_refcount[i]));
+    }
+    if (state->repair && bitmap_test(state->rewritten, i) &&
+        data_block_write(i, state->indirect[i])) {
+      fprintf(stderr, "fsck_check: failed to rewrite indirect block %d\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Counts the runs of consecutive block numbers among the count block numbers
+// of block_nums.
+int count_extents(const uint16_t *block_nums, int count) {
+  int extents = 0;
+  for (int i = 0; i < count; i++) {
+    extents += i == 0 || block_nums[i] != block_nums[i - 1] + 1;
+  }
+  return extents;
+}
+
+// Counts the runs of free blocks in the data area.
+int count_free_extents() {
+  int extents = 0;
+  lock_alloc();
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    extents += bitmap_test(ctx->used_block_bitmap, i) == false &&
+               (i == ctx->sb.data_offset ||
+                bitmap_test(ctx->used_block_bitmap, i - 1));
+  }
+  unlock_alloc();
+  return extents;
+}
+
+// Returns the length of the longest run of free blocks in the data area.
+// Bytes of the bitmap with every block used are skipped whole.
+int largest_free_extent() {
+  int largest = 0;
+  int run = 0;
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    if (i % CHAR_BIT == 0 && i + CHAR_BIT <= DISK_BLOCKS &&
+        ctx->used_block_bitmap[i / CHAR_BIT] == UINT8_MAX) {
+      run = 0;
+      i += CHAR_BIT - 1;
+      continue;
+    }
+    run = bitmap_test(ctx->used_block_bitmap, i) ? 0 : run + 1;
+    largest = MAX(largest, run);
+  }
+  return largest;
+}
+
+// Returns the first block of the lowest run of at least length free blocks,
+// or -1 if there is none.
+int find_free_run(int length) {
+  int run_length = 0;
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    run_length = bitmap_test(ctx->used_block_bitmap, i) ? 0 : run_length + 1;
+    if (run_length == length) {
+      return i - length + 1;
+    }
+  }
+  return -1;
+}
+
+// Moves data block block_idx of inode inum from block old_block_num to the
+// free block new_block_num. The old block is freed like any other, so it keeps
+// its contents until the new block map is committed.
+int move_data_block(uint16_t inum, int block_idx, uint16_t old_block_num,
+                    uint16_t new_block_num) {
+  bitmap_set(ctx->used_block_bitmap, new_block_num, 1);
+  if (copy_data_block(old_block_num, new_block_num)) {
+    return -1;
+  }
+  if (set_data_block_num(inum, block_idx * ctx->block_size, new_block_num)) {
+    fprintf(stderr, "move_data_block: failed to update block map\n");
+    return -1;
+  }
+  return free_data_block(old_block_num);
+}
+
+// Copies data block old_block_num to the claimed block new_block_num, along
+// with its dedup state, with alloc_lock held.
+int copy_data_block(uint16_t old_block_num, uint16_t new_block_num) {
+  union fs_block block_buffer;
+  if (data_block_read(old_block_num, &block_buffer)) {
+    fprintf(stderr, "copy_data_block: failed to read data block %d\n",
+            old_block_num);
+    return -1;
+  }
+  if (data_block_write(new_block_num, &block_buffer)) {
+    fprintf(stderr, "copy_data_block: failed to write data block %d\n",
+            new_block_num);
+    return -1;
+  }
+  if (ctx->block_refcount[old_block_num]) {
+    dedup_index_remove(old_block_num);
+    ctx->block_refcount[new_block_num] = ctx->block_refcount[old_block_num];
+    ctx->block_fingerprint[new_block_num] =
+        ctx->block_fingerprint[old_block_num];
+    ctx->block_refcount[old_block_num] = 0;
+    mark_dirty(&ctx->block_refcount[new_block_num], sizeof(uint16_t));
+    mark_dirty(&ctx->block_fingerprint[new_block_num], sizeof(uint64_t));
+    mark_dirty(&ctx->block_refcount[old_block_num], sizeof(uint16_t));
+    dedup_index_insert(new_block_num);
+  }
+  return 0;
+}
+
+// Moves the data blocks of inode inum into one run of free blocks, at most
+// *budget of them, and takes the moved blocks off *budget. A file that is
+// partly moved continues the run it starts with; a file that is already in
+// one run moves to a lower free run that holds it, which compacts the free
+// space towards the end of the disk. Files sharing blocks with the snapshot
+// or with other files stay in place. Returns 1 if the budget ran out first.
+// The allocator stays locked throughout, so the free run cannot be taken.
+int defrag_file(uint16_t inum, int *budget, struct fs_defrag_report *report) {
+  lock_alloc();
+  int ret = defrag_file_locked(inum, budget, report);
+  unlock_alloc();
+  return ret;
+}
+
+int defrag_file_locked(uint16_t inum, int *budget,
+                       struct fs_defrag_report *report) {
+  int count = BLOCKS_FOR(ctx->inode_table[inum].file_size);
+  uint16_t block_nums[MAX_FILE_SIZE / MIN_BLOCK_SIZE];
+  uint16_t block_idxs[MAX_FILE_SIZE / MIN_BLOCK_SIZE];
+  if (get_data_block_nums(inum, 0, count, block_nums)) {
+    fprintf(stderr, "defrag_file: failed to read block map\n");
+    return -1;
+  }
+  // holes and the unused ends of compressed clusters are skipped
+  int n = 0;
+  bool is_movable = true;
+  for (int i = 0; i < count; i++) {
+    if (block_nums[i]) {
+      is_movable &= is_shared_block(block_nums[i]) == false &&
+                    ctx->block_refcount[block_nums[i]] <= 1;
+      block_idxs[n] = i;
+      block_nums[n++] = block_nums[i];
+    }
+  }
+  int extents = count_extents(block_nums, n);
+  report->files++;
+  report->blocks += n;
+  report->extents_before += extents;
+  if (n == 0 || is_movable == false) {
+    report->extents_after += extents;
+    return 0;
+  }
+
+  int first_extent = 1;
+  while (first_extent < n &&
+         block_nums[first_extent] == block_nums[0] + first_extent) {
+    first_extent++;
+  }
+  int target = block_nums[0];
+  for (int i = first_extent; i < n; i++) {
+    if (target + i >= DISK_BLOCKS ||
+        (bitmap_test(ctx->used_block_bitmap, target + i) &&
+         block_nums[i] != target + i)) {
+      target = -1;
+      break;
+    }
+  }
+  if (target == -1 || first_extent == n) {
+    int run = find_free_run(n);
+    if (run != -1 && (target == -1 || run < target)) {
+      target = run;
+    }
+  }
+
+  int ret = 0;
+  for (int i = 0; target != -1 && i < n; i++) {
+    if (block_nums[i] == target + i) {
+      continue;
+    }
+    // an indirect block may have been allocated in the run
+    if (*budget == 0 || bitmap_test(ctx->used_block_bitmap, target + i)) {
+      ret = 1;
+      break;
+    }
+    if (move_data_block(inum, block_idxs[i], block_nums[i], target + i)) {
+      return -1;
+    }
+    block_nums[i] = target + i;
+    (*budget)--;
+    report->moved_blocks++;
+  }
+  report->extents_after += count_extents(block_nums, n);
+  return ret;
+}
+
+// Loads the dedup index and commits the blocks freed by earlier moves, which
+// are only free again after a commit. Called before taking op_lock.
+int defrag_begin() {
+  wait_async(); // blocks are moved by copying what they hold
+  lock_alloc();
+  int ret = (ctx->sb.features & FS_FEATURE_DEDUP) ? load_dedup_index() : 0;
+  unlock_alloc();
+  return ret ? ret : commit_freed_blocks();
+}
+
+// Commits if blocks freed by earlier operations are waiting for a commit,
+// which frees them. Called outside of operations.
+int commit_freed_blocks() {
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  int ret = ctx->freed_block_count ? journal_commit() : 0;
+  pthread_rwlock_unlock(&ctx->op_lock);
+  return ret;
+}
+
+// The most indirect blocks a cleaning pass writes for a file of file_size
+// bytes: each of its indirect blocks once, and the double indirect block
+// twice, once for the data blocks moved and once for the second level blocks
+// moved afterwards; see clean_file.
+int clean_reserve(int file_size) {
+  int blocks = BLOCKS_FOR(file_size) - DIRECT_OFFSETS_PER_INODE;
+  int per_block = DIRECT_OFFSETS_PER_BLOCK;
+  if (blocks <= 0) {
+    return 0;
+  }
+  if (blocks <= per_block) {
+    return 1;
+  }
+  return 3 + (blocks - per_block + per_block - 1) / per_block;
+}
+
+// Marks in victims the segments a cleaning pass empties, those with the
+// fewest used blocks first: segments of the data area with at most
+// LOG_CLEAN_MAX_USED used blocks, other than the one at the log head. Their
+// blocks must fit in LOG_CLEAN_BLOCKS and in the free blocks outside of
+// victims, which claim_log_block moves them to, less the indirect blocks the
+// pass writes. Returns how many segments were marked. Called with op_lock
+// held exclusively and alloc_lock held.
+int pick_victims(bool *victims) {
+  int head_segment = ctx->sb.log_head / LOG_SEGMENT_BLOCKS;
+  int room = ctx->num_free_blocks;
+  int budget = LOG_CLEAN_BLOCKS;
+  for (int i = 0; i < MAX_FILES; i++) {
+    if (bitmap_test(ctx->inode_bitmap, i)) {
+      room -= clean_reserve(ctx->inode_table[i].file_size);
+    }
+  }
+  int picked = 0;
+  memset(victims, 0, LOG_SEGMENTS * sizeof(bool));
+  for (int used = 1; used <= LOG_CLEAN_MAX_USED; used++) {
+    for (int i = 0; i < LOG_SEGMENTS; i++) {
+      if (ctx->segment_used[i] != used || i == head_segment ||
+          i * LOG_SEGMENT_BLOCKS < ctx->sb.data_offset) {
+        continue;
+      }
+      int segment_free = LOG_SEGMENT_BLOCKS - used;
+      if (used > budget || used > room - segment_free) {
+        return picked;
+      }
+      victims[i] = true;
+      budget -= used;
+      room -= used + segment_free;
+      picked++;
+    }
+  }
+  return picked;
+}
+
+// Moves the data blocks of inode inum in the segments marked in victims to
+// the log head, at most *budget of them, and takes the moved blocks off
+// *budget. The block map is rewritten once, which moves the indirect blocks
+// mapping moved blocks along with them; the other indirect blocks in victims
+// are moved afterwards. Enough free blocks are left for all of those, see
+// clean_reserve. Blocks shared with the snapshot, a mapping or other files
+// stay in place. Called with alloc_lock held.
+int clean_file(uint16_t inum, const bool *victims, int *budget,
+               struct fs_clean_report *report) {
+  struct inode *inode = &ctx->inode_table[inum];
+  int count = BLOCKS_FOR(inode->file_size);
+  int reserve = clean_reserve(inode->file_size);
+  if (ctx->num_free_blocks < reserve) {
+    return 0; // not even room to move its indirect blocks
+  }
+  uint16_t old_block_nums[MAX_FILE_SIZE / MIN_BLOCK_SIZE];
+  uint16_t block_nums[MAX_FILE_SIZE / MIN_BLOCK_SIZE];
+  if (get_data_block_nums(inum, 0, count, old_block_nums)) {
+    fprintf(stderr, "clean_file: failed to read block map\n");
+    return -1;
+  }
+  memcpy(block_nums, old_block_nums, count * sizeof(uint16_t));
+  int moved = 0;
+  int ret = 0;
+  for (int i = 0; i < count && *budget > 0 && ctx->num_free_blocks > reserve;
+       i++) {
+    uint16_t block_num = old_block_nums[i];
+    if (block_num == 0 || victims[block_num / LOG_SEGMENT_BLOCKS] == false ||
+        is_shared_block(block_num) || ctx->block_refcount[block_num] > 1) {
+      continue;
+    }
+    int new_block_num = claim_log_block();
+    if (new_block_num == -1) {
+      break;
+    }
+    if (copy_data_block(block_num, new_block_num)) {
+      bitmap_set(ctx->used_block_bitmap, new_block_num, 0);
+      ret = -1;
+      break;
+    }
+    block_nums[i] = new_block_num;
+    moved++;
+    (*budget)--;
+  }
+  if (ret == 0 && moved && set_data_block_nums(inum, 0, count, block_nums)) {
+    fprintf(stderr, "clean_file: failed to update block map\n");
+    ret = -1;
+  }
+  // after a failure the block map may be updated in part: the copies it
+  // maps replace their blocks, the others are released
+  for (int i = 0; moved && i < count; i++) {
+    if (block_nums[i] == old_block_nums[i]) {
+      continue;
+    }
+    int mapped =
+        ret ? get_data_block_num(inum, i * ctx->block_size) : block_nums[i];
+    if (mapped == block_nums[i]) {
+      if (free_data_block(old_block_nums[i])) {
+        return -1;
+      }
+    } else if (mapped == old_block_nums[i]) {
+      bitmap_set(ctx->used_block_bitmap, block_nums[i], 0);
+    }
+  }
+  if (ret) {
+    return -1;
+  }
+  report->moved_blocks += moved;
+  return clean_indirect_blocks(inode, victims, report);
+}
+
+// Moves the indirect blocks of inode in the segments marked in victims,
+// other than those shared with the snapshot, to the log head by writing them
+// again. Called with alloc_lock held.
+int clean_indirect_blocks(struct inode *inode, const bool *victims,
+                          struct fs_clean_report *report) {
+  union fs_block block_buffer;
+  union fs_block second_block_buffer;
+  uint16_t block_num = inode->single_indirect_offset;
+  if (block_num && victims[block_num / LOG_SEGMENT_BLOCKS] &&
+      is_snapshot_block(block_num) == false) {
+    if (data_block_read(block_num, &block_buffer) ||
+        write_indirect_block(&inode->single_indirect_offset, &block_buffer)) {
+      fprintf(stderr, "clean_indirect_blocks: failed to move indirect block "
+                      "%d\n", block_num);
+      return -1;
+    }
+    report->moved_blocks++;
+  }
+  block_num = inode->double_indirect_offset;
+  if (block_num == 0) {
+    return 0;
+  }
+  if (data_block_read(block_num, &block_buffer)) {
+    fprintf(stderr, "clean_indirect_blocks: failed to read indirect block "
+                    "%d\n", block_num);
+    return -1;
+  }
+  bool is_changed = victims[block_num / LOG_SEGMENT_BLOCKS] &&
+                    is_snapshot_block(block_num) == false;
+  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
+    uint16_t *entry = &block_buffer.block_offsets[i];
+    if (*entry == 0 || victims[*entry / LOG_SEGMENT_BLOCKS] == false ||
+        is_snapshot_block(*entry)) {
+      continue;
+    }
+    if (data_block_read(*entry, &second_block_buffer) ||
+        write_indirect_block(entry, &second_block_buffer)) {
+      fprintf(stderr, "clean_indirect_blocks: failed to move indirect block "
+                      "%d\n", *entry);
+      return -1;
+    }
+    is_changed = true;
+    report->moved_blocks++;
+  }
+  if (is_changed &&
+      write_indirect_block(&inode->double_indirect_offset, &block_buffer)) {
+    fprintf(stderr, "clean_indirect_blocks: failed to move indirect block "
+                    "%d\n", block_num);
+    return -1;
+  }
+  report->moved_blocks += is_changed;
+  return 0;
+}
+
+// Runs the segment cleaner of context c, which arg points at, until
+// stop_cleaner. Once woken by wake_cleaner, it runs cleaning passes until
+// LOG_CLEAN_HIGH segments are clean or a pass empties none. Passes are
+// skipped while mount_lock is held exclusively: the unmount stops the thread
+// with it held.
+void *cleaner_main(void *arg) {
+  enter_ctx(arg);
+  pthread_mutex_lock(&ctx->cleaner_lock);
+  while (ctx->is_cleaner_stopping == false) {
+    if (ctx->is_cleaner_due == false) {
+      pthread_cond_wait(&ctx->cleaner_cond, &ctx->cleaner_lock);
+      continue;
+    }
+    ctx->is_cleaner_due = false;
+    pthread_mutex_unlock(&ctx->cleaner_lock);
+    if (pthread_rwlock_tryrdlock(&ctx->mount_lock) == 0) {
+      struct fs_clean_report report;
+      while (ctx->is_mounted &&
+             __atomic_load_n(&ctx->num_clean_segments, __ATOMIC_RELAXED) <
+                 LOG_CLEAN_HIGH &&
+             fs_clean_locked(&report) == 0 && report.segments) {
+      }
+      pthread_rwlock_unlock(&ctx->mount_lock);
+    }
+    pthread_mutex_lock(&ctx->cleaner_lock);
+  }
+  pthread_mutex_unlock(&ctx->cleaner_lock);
+  return NULL;
+}
+
+// Starts the cleaner thread of the current context.
+int start_cleaner() {
+  ctx->is_cleaner_due = ctx->is_cleaner_stopping = false;
+  if (pthread_create(&ctx->cleaner_thread, NULL, cleaner_main, ctx)) {
+    return -1;
+  }
+  ctx->has_cleaner = true;
+  return 0;
+}
+
+// Stops the cleaner thread of the current context, if it has one. Called with
+// mount_lock held exclusively.
+void stop_cleaner() {
+  if (ctx->has_cleaner == false) {
+    return;
+  }
+  pthread_mutex_lock(&ctx->cleaner_lock);
+  ctx->is_cleaner_stopping = true;
+  pthread_cond_signal(&ctx->cleaner_cond);
+  pthread_mutex_unlock(&ctx->cleaner_lock);
+  pthread_join(ctx->cleaner_thread, NULL);
+  ctx->has_cleaner = false;
+}
+
+// Wakes the cleaner thread once fewer than LOG_CLEAN_LOW segments are clean.
+void wake_cleaner() {
+  if (ctx->has_cleaner == false ||
+      __atomic_load_n(&ctx->num_clean_segments, __ATOMIC_RELAXED) >=
+          LOG_CLEAN_LOW) {
+    return;
+  }
+  pthread_mutex_lock(&ctx->cleaner_lock);
+  ctx->is_cleaner_due = true;
+  pthread_cond_signal(&ctx->cleaner_cond);
+  pthread_mutex_unlock(&ctx->cleaner_lock);
+}
+
+// Clears the blocks freed before the last commit and makes them available.
+// Log-structured images leave their contents, which would take a write to
+// every freed block.
+int release_freed_blocks() {
+  if (ctx->freed_block_count) {
+    wait_async();
+  }
+  lock_alloc();
+  union fs_block empty_block;
+  memset(&empty_block, 0, ctx->block_size);
+  for (int i = ctx->sb.data_offset; ctx->freed_block_count && i < DISK_BLOCKS;
+       i++) {
+    if (bitmap_test(ctx->freed_block_bitmap, i) == false) {
+      continue;
+    }
+    if ((ctx->sb.features & FS_FEATURE_LOG) == 0 &&
+        data_block_write(i, &empty_block)) {
+      fprintf(stderr, "release_freed_blocks: failed to clear data block %d\n",
+              i);
+      unlock_alloc();
+      return -1;
+    }
+    bitmap_set(ctx->used_block_bitmap, i, 0);
+    bitmap_set(ctx->freed_block_bitmap, i, 0);
+  }
+  ctx->freed_block_count = 0;
+  unlock_alloc();
+  return 0;
+}
+
+// Commits ahead of time if fewer than blocks blocks are free while blocks
+// freed by earlier operations are waiting for a commit. Called outside of
+// operations, since the commit takes op_lock exclusively.
+int reclaim_freed_blocks(int blocks) {
+  lock_alloc();
+  bool is_due = ctx->freed_block_count && ctx->num_free_blocks < blocks;
+  unlock_alloc();
+  if (is_due == false) {
+    return 0;
+  }
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  int ret = ctx->freed_block_count && ctx->num_free_blocks < blocks
+                ? journal_commit()
+                : 0;
+  pthread_rwlock_unlock(&ctx->op_lock);
+  return ret;
+}
+
+// Replays the committed transactions of the journal to their home blocks and
+// empties the journal. Replay stops at the first transaction that is out of
+// sequence or fails its checksum, which is where the last commit ended.
+int journal_recover() {
+  union fs_block header;
+  if (block_read(ctx->sb.journal_offset, &header)) {
+    fprintf(stderr, "journal_recover: failed to read journal header\n");
+    return -1;
+  }
+  if (header.journal_header.magic != JOURNAL_MAGIC) {
+    fprintf(stderr, "journal_recover: journal not found\n");
+    return -1;
+  }
+  struct journal_descriptor *descriptor =
+      &BLOCK_AT(ctx->journal_blocks, 0)->journal_descriptor;
+  uint32_t sequence = header.journal_header.sequence;
+  int pos = 1;
+  while (pos < JOURNAL_BLOCKS) {
+    if (block_read(ctx->sb.journal_offset + pos, descriptor)) {
+      fprintf(stderr, "journal_recover: failed to read descriptor\n");
+      return -1;
+    }
+    int count = descriptor->count;
+    if (descriptor->magic != JOURNAL_MAGIC ||
+        descriptor->sequence != sequence || count == 0 ||
+        count > JOURNAL_MAX_TRANSACTION_BLOCKS ||
+        pos + 1 + count > JOURNAL_BLOCKS) {
+      break;
+    }
+    struct iovec iov = {BLOCK_AT(ctx->journal_blocks, 1),
+                        (size_t)count * ctx->block_size};
+    if (block_readv(ctx->sb.journal_offset + pos + 1, &iov, 1)) {
+      fprintf(stderr, "journal_recover: failed to read transaction\n");
+      return -1;
+    }
+    uint32_t checksum =
+        crc32c(0, descriptor->block_nums, count * sizeof(uint16_t));
+    checksum = crc32c(checksum, iov.iov_base, iov.iov_len);
+    if (checksum != descriptor->checksum) {
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (descriptor->block_nums[i] >= ctx->sb.journal_offset ||
+          block_write(descriptor->block_nums[i],
+                      BLOCK_AT(ctx->journal_blocks, 1 + i))) {
+        fprintf(stderr, "journal_recover: failed to replay block %d\n",
+                descriptor->block_nums[i]);
+        return -1;
+      }
+    }
+    pos += 1 + count;
+    sequence++;
+  }
+  // the journal is emptied once the replayed blocks are durable
+  if (sequence != header.journal_header.sequence) {
+    header.journal_header.sequence = sequence;
+    if (block_sync() || block_write(ctx->sb.journal_offset, &header) ||
+        block_sync()) {
+      fprintf(stderr, "journal_recover: failed to reset journal\n");
+      return -1;
+    }
+  }
+  ctx->journal_sequence = sequence;
+  ctx->journal_pos = 1;
+  return 0;
+}
+
+// Writes the dirty metadata blocks among blocks to the journal as one
+// transaction, with a single sequential write. Data and indirect blocks are
+// written before the metadata referencing them commits, and never in place
+// once it has.
+int journal_commit_blocks(struct block_set blocks) {
+  block_set_intersect(&blocks, &ctx->dirty_blocks);
+  if (block_set_is_empty(&blocks)) {
+    return 0;
+  }
+  wait_async();
+  struct journal_descriptor *descriptor =
+      &BLOCK_AT(ctx->journal_blocks, 0)->journal_descriptor;
+  memset(descriptor, 0, ctx->block_size);
+  int count = 0;
+  for (int i = 0; i < ctx->sb.journal_offset; i++) {
+    if (block_set_test(&blocks, i)) {
+      get_metadata_block(i, BLOCK_AT(ctx->journal_blocks, 1 + count));
+      descriptor->block_nums[count++] = i;
+    }
+  }
+  descriptor->magic = JOURNAL_MAGIC;
+  descriptor->sequence = ctx->journal_sequence;
+  descriptor->count = count;
+  struct iovec iov = {ctx->journal_blocks,
+                      (size_t)(1 + count) * ctx->block_size};
+  descriptor->checksum =
+      crc32c(0, descriptor->block_nums, count * sizeof(uint16_t));
+  descriptor->checksum =
+      crc32c(descriptor->checksum, BLOCK_AT(ctx->journal_blocks, 1),
+             iov.iov_len - ctx->block_size);
+  if (block_sync() ||
+      block_writev(ctx->sb.journal_offset + ctx->journal_pos, &iov, 1) ||
+      block_sync()) {
+    fprintf(stderr, "journal_commit_blocks: failed to write transaction\n");
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    memcpy(BLOCK_AT(ctx->committed_blocks, descriptor->block_nums[i]),
+           BLOCK_AT(ctx->journal_blocks, 1 + i), ctx->block_size);
+  }
+  // the committed blocks may reference any block claimed so far
+  memset(ctx->claimed_block_bitmap, 0, sizeof(ctx->claimed_block_bitmap));
+  block_set_merge(&ctx->journaled_blocks, &blocks);
+  block_set_remove(&ctx->dirty_blocks, &blocks);
+  block_set_remove(&op_dirty_blocks, &blocks);
+  block_set_remove(&ctx->unowned_dirty_blocks, &blocks);
+  for (int i = 0; i < MAX_FILES; i++) {
+    block_set_remove(&ctx->inode_dirty_blocks[i], &blocks);
+  }
+  ctx->journal_pos += 1 + count;
+  ctx->journal_sequence++;
+  publish_commit();
+  // the next transaction must always fit
+  if (ctx->journal_pos + 1 + JOURNAL_MAX_TRANSACTION_BLOCKS > JOURNAL_BLOCKS) {
+    return journal_checkpoint();
+  }
+  return 0;
+}
+
+// Commits all metadata changes, then releases the blocks they freed.
+int journal_commit() {
+  pthread_mutex_lock(&ctx->journal_lock);
+  ctx->journal_pending_ops = 0;
+  pthread_mutex_unlock(&ctx->journal_lock);
+  if (journal_commit_blocks(ctx->dirty_blocks)) {
+    return -1;
+  }
+  return release_freed_blocks();
+}
+
+// Commits the metadata changed by the operations on inode inum, along with the
+// operations sharing a metadata block with them, so that every operation
+// still commits whole. Other changes stay pending.
+int journal_commit_inode(uint16_t inum) {
+  block_set_merge(&ctx->unowned_dirty_blocks, &op_dirty_blocks);
+  op_dirty_blocks = (struct block_set){{0}};
+  struct block_set blocks = ctx->inode_dirty_blocks[inum];
+  struct block_set prev_blocks;
+  do {
+    prev_blocks = blocks;
+    for (int i = 0; i < MAX_FILES; i++) {
+      if (block_set_overlaps(&ctx->inode_dirty_blocks[i], &blocks)) {
+        block_set_merge(&blocks, &ctx->inode_dirty_blocks[i]);
+      }
+    }
+    if (block_set_overlaps(&ctx->unowned_dirty_blocks, &blocks)) {
+      block_set_merge(&blocks, &ctx->unowned_dirty_blocks);
+    }
+  } while (memcmp(&blocks, &prev_blocks, sizeof(blocks)) != 0);
+  return journal_commit_blocks(blocks);
+}
+
+// Writes the committed blocks to their home locations and empties the journal.
+int journal_checkpoint() {
+  if (ctx->journal_pos == 1) {
+    return 0;
+  }
+  int ret = -1;
+  start_checkpoint();
+  for (int i = 0; i < ctx->sb.journal_offset; i++) {
+    if (block_set_test(&ctx->journaled_blocks, i) &&
+        block_write(i, BLOCK_AT(ctx->committed_blocks, i))) {
+      fprintf(stderr, "journal_checkpoint: failed to write block %d\n", i);
+      goto out;
+    }
+  }
+  union fs_block block_buffer;
+  memset(&block_buffer, 0, ctx->block_size);
+  block_buffer.journal_header.magic = JOURNAL_MAGIC;
+  block_buffer.journal_header.sequence = ctx->journal_sequence;
+  if (block_sync() || block_write(ctx->sb.journal_offset, &block_buffer) ||
+      block_sync()) {
+    fprintf(stderr, "journal_checkpoint: failed to reset journal\n");
+    goto out;
+  }
+  ctx->journaled_blocks = (struct block_set){{0}};
+  ctx->journal_pos = 1;
+  ret = 0;
+out:
+  end_checkpoint();
+  return ret;
+}
+
+// Commits all changes, leaving them in the journal.
+int journal_commit_all() {
+  // releasing freed blocks after a commit changes metadata again
+  while (block_set_is_empty(&ctx->dirty_blocks) == false ||
+         ctx->freed_block_count) {
+    if (journal_commit()) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Commits all changes and checkpoints them, leaving the journal empty.
+int journal_flush() {
+  if (journal_commit_all()) {
+    return -1;
+  }
+  return journal_checkpoint();
+}
+
+// Ends an operation that changed metadata, on inode inum or -1 for none,
+// while op_lock is still held. The operation then counts towards the next
+// group commit; see journal_commit_due.
+void journal_end_op(int inum) {
+  struct block_set *owner_blocks =
+      inum >= 0 ? &ctx->inode_dirty_blocks[inum] : &ctx->unowned_dirty_blocks;
+  block_set_merge(owner_blocks, &op_dirty_blocks);
+  op_dirty_blocks = (struct block_set){{0}};
+  pthread_mutex_lock(&ctx->journal_lock);
+  if (ctx->journal_pending_ops++ == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ctx->journal_first_op_time);
+  }
+  pthread_mutex_unlock(&ctx->journal_lock);
+}
+
+// Commits the pending operations once JOURNAL_COMMIT_OPS of them are pending
+// or the first of them is JOURNAL_COMMIT_INTERVAL_NS old. Called after
+// releasing op_lock, which the commit takes exclusively.
+int journal_commit_due() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&ctx->journal_lock);
+  long elapsed =
+      (now.tv_sec - ctx->journal_first_op_time.tv_sec) * 1000000000L +
+      (now.tv_nsec - ctx->journal_first_op_time.tv_nsec);
+  bool is_due = ctx->journal_pending_ops >= JOURNAL_COMMIT_OPS ||
+                (ctx->journal_pending_ops &&
+                 elapsed >= JOURNAL_COMMIT_INTERVAL_NS);
+  pthread_mutex_unlock(&ctx->journal_lock);
+  if (is_due == false) {
+    return 0;
+  }
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  // another thread may have committed in the meantime
+  pthread_mutex_lock(&ctx->journal_lock);
+  is_due = ctx->journal_pending_ops > 0;
+  pthread_mutex_unlock(&ctx->journal_lock);
+  int ret = is_due ? journal_commit() : 0;
+  pthread_rwlock_unlock(&ctx->op_lock);
+  return ret;
+}
+
+// Locks byte of the image open as fd with an open file description lock of
+// type F_RDLCK, F_WRLCK or F_UNLCK, waiting for it if wait. Such locks
+// belong to the open image rather than to the process, so two contexts of
+// one process exclude each other too, and go away with the process. Every
+// mount holds IMAGE_MOUNTED_BYTE, shared for a shared mount and exclusively
+// for any other, and shared mounts hold IMAGE_MOUNTING_BYTE exclusively while
+// they mount and unmount, and the bytes after it to use files; see
+// lock_file_data.
+int lock_image(int fd, short type, int byte, bool wait) {
+  struct flock lock = {
+      .l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1};
+  return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+}
+
+// Locks the image disk_name against other processes and contexts for a
+// private mount of the current context, until ctx->lock_fd is closed. Fails
+// if the image is mounted elsewhere. A segment left behind by shared mounts
+// whose processes died is removed.
+int lock_private(const char *disk_name) {
+  struct stat st;
+  int fd = open(disk_name, O_RDWR);
+  if (fd == -1 || fstat(fd, &st)) {
+    fprintf(stderr, "mount_fs: failed to open the image\n");
+  } else if (lock_image(fd, F_WRLCK, IMAGE_MOUNTED_BYTE, false)) {
+    fprintf(stderr, "mount_fs: image mounted by another process\n");
+  } else {
+    name_shared(&st);
+    shm_unlink(ctx->shared_name);
+    ctx->lock_fd = fd;
+    return 0;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  return -1;
+}
+
+// Unlocks the image locked by lock_private.
+void unlock_private() {
+  close(ctx->lock_fd);
+  ctx->lock_fd = -1;
+}
+
+// Names the shared segment of the image st describes after its device and
+// inode numbers, so every path to the image finds it.
+void name_shared(const struct stat *st) {
+  snprintf(ctx->shared_name, sizeof(ctx->shared_name), "/fs-%llx-%llx",
+           (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+// Maps the shared segment of the image disk_name into the current context
+// and locks the image against other processes mounting or unmounting it
+// until close_shared or IMAGE_MOUNTING_BYTE is unlocked. Sets *is_first if no
+// other process has the image mounted; IMAGE_MOUNTED_BYTE is then held
+// exclusively, and the segment is a new one, replacing any left behind by
+// processes that died while mounted. Otherwise it is held shared. Fails if
+// the image is mounted privately.
+int open_shared(const char *disk_name, bool *is_first) {
+  struct stat st;
+  struct shared_mount *shared = MAP_FAILED;
+  int shm_fd = -1;
+  int fd = open(disk_name, O_RDWR);
+  if (fd == -1 || lock_image(fd, F_WRLCK, IMAGE_MOUNTING_BYTE, true) ||
+      fstat(fd, &st)) {
+    fprintf(stderr, "open_shared: failed to lock the image\n");
+    goto fail;
+  }
+  *is_first = lock_image(fd, F_WRLCK, IMAGE_MOUNTED_BYTE, false) == 0;
+  if (*is_first == false &&
+      lock_image(fd, F_RDLCK, IMAGE_MOUNTED_BYTE, false)) {
+    fprintf(stderr, "open_shared: image mounted by another process\n");
+    goto fail;
+  }
+  name_shared(&st);
+  if (*is_first) {
+    shm_unlink(ctx->shared_name);
+  }
+  shm_fd = shm_open(ctx->shared_name, O_RDWR | O_CREAT, 0600);
+  if (shm_fd == -1 || fstat(shm_fd, &st) ||
+      (st.st_size == 0 && ftruncate(shm_fd, sizeof(*shared)))) {
+    fprintf(stderr, "open_shared: failed to create shared memory\n");
+    goto fail;
+  }
+  shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED,
+                shm_fd, 0);
+  if (shared == MAP_FAILED) {
+    fprintf(stderr, "open_shared: failed to map shared memory\n");
+    goto fail;
+  }
+  close(shm_fd);
+  // a new segment is all zeros but for its lock
+  if (st.st_size == 0) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+  ctx->shared = shared;
+  ctx->lock_fd = fd;
+  for (int i = 0; i < MAX_FILES; i++) {
+    ctx->file_lock_types[i] = F_UNLCK;
+  }
+  return 0;
+fail:
+  if (shm_fd != -1) {
+    close(shm_fd);
+  }
+  if (fd != -1) {
+    close(fd); // which drops the locks
+  }
+  return -1;
+}
+
+// Unmaps the shared segment of the current context, removing it if is_last,
+// and closes the image opened to lock it, which unlocks it.
+void close_shared(bool is_last) {
+  if (is_last) {
+    pthread_mutex_destroy(&ctx->shared->lock);
+    shm_unlink(ctx->shared_name);
+  }
+  munmap(ctx->shared, sizeof(*ctx->shared));
+  close(ctx->lock_fd);
+  ctx->lock_fd = -1;
+  ctx->shared = NULL;
+}
+
+// Takes the lock of the segment of a shared mount for a call that changes
+// the image if is_change. If a process died holding it in the middle of a
+// change, the image is recovered first, which needs the image open. Returns
+// -1, with the lock released, if that fails; the lock is then left
+// unrecoverable, and every later call fails too.
+int lock_segment(const char *func, bool is_change) {
+  struct shared_mount *shared = ctx->shared;
+  int err = pthread_mutex_lock(&shared->lock);
+  if (err == EOWNERDEAD &&
+      (shared->is_changing == false || recover_shared() == 0)) {
+    pthread_mutex_consistent(&shared->lock);
+    err = 0;
+  }
+  if (err) {
+    fprintf(stderr, "%s: failed to recover from a process that died\n", func);
+    if (err == EOWNERDEAD) {
+      pthread_mutex_unlock(&shared->lock);
+    }
+    return -1;
+  }
+  shared->is_changing = is_change;
+  return 0;
+}
+
+// Recovers the image of a shared mount after a process died changing it, as
+// mount_fs does after a crash: the journal is replayed, which checkpoints
+// it, and the block maps scanned. The repairs are committed for the other
+// processes to apply. Called with the lock of the segment held, and neither
+// refresh_lock nor op_lock.
+int recover_shared() {
+  pthread_rwlock_wrlock(&ctx->refresh_lock);
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  start_checkpoint();
+  int ret = load_metadata(true) || scan_metadata() ? -1 : 0;
+  end_checkpoint();
+  if (ret == 0) {
+    if (ctx->sb.features & FS_FEATURE_LOG) {
+      count_segments();
+    }
+    // scan_metadata only repairs the copy in memory
+    mark_dirty(ctx->used_block_bitmap, sizeof(ctx->used_block_bitmap));
+    ret = journal_commit_all();
+  }
+  pthread_rwlock_unlock(&ctx->op_lock);
+  pthread_rwlock_unlock(&ctx->refresh_lock);
+  return ret;
+}
+
+// Publishes the end of the journal after a commit on a shared mount, for the
+// other processes to apply the transaction; see refresh_metadata. The
+// metadata in memory is then that of the new generation. Called with the
+// lock of the segment held.
+void publish_commit() {
+  struct shared_mount *shared = ctx->shared;
+  if (shared == NULL) {
+    return;
+  }
+  // odd while the fields change, even if a process died leaving it odd
+  uint64_t generation = shared->generation | 1;
+  __atomic_store_n(&shared->generation, generation, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&shared->journal_pos, ctx->journal_pos, __ATOMIC_RELAXED);
+  __atomic_store_n(&shared->journal_sequence, ctx->journal_sequence,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&shared->generation, generation + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&ctx->shared_generation, generation + 1, __ATOMIC_RELEASE);
+}
+
+// Marks the journal of a shared mount as being checkpointed, which rewrites
+// the blocks other processes may be reading it from; see refresh_metadata.
+// Called with the lock of the segment held.
+void start_checkpoint() {
+  struct shared_mount *shared = ctx->shared;
+  if (shared == NULL) {
+    return;
+  }
+  __atomic_store_n(&shared->checkpoints, shared->checkpoints | 1,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Ends what start_checkpoint started and publishes the start of the journal,
+// where it was if the checkpoint failed.
+void end_checkpoint() {
+  struct shared_mount *shared = ctx->shared;
+  if (shared == NULL) {
+    return;
+  }
+  uint64_t checkpoints = shared->checkpoints + 1;
+  __atomic_store_n(&shared->journal_pos, ctx->journal_pos, __ATOMIC_RELAXED);
+  __atomic_store_n(&shared->journal_sequence, ctx->journal_sequence,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&shared->checkpoints, checkpoints, __ATOMIC_RELEASE);
+  ctx->shared_checkpoints = checkpoints;
+}
+
+// Applies the transactions committed to the journal from block pos on, the
+// first numbered sequence, up to block end to the metadata in memory, as
+// journal_recover replays them to the image. They stay in the journal, and
+// in committed_blocks for whichever process checkpoints it next.
+int apply_journal(int pos, uint32_t sequence, int end) {
+  struct journal_descriptor *descriptor =
+      &BLOCK_AT(ctx->journal_blocks, 0)->journal_descriptor;
+  while (pos < end) {
+    if (block_read(ctx->sb.journal_offset + pos, descriptor)) {
+      fprintf(stderr, "apply_journal: failed to read descriptor\n");
+      return -1;
+    }
+    int count = descriptor->count;
+    if (descriptor->magic != JOURNAL_MAGIC ||
+        descriptor->sequence != sequence || count == 0 ||
+        count > JOURNAL_MAX_TRANSACTION_BLOCKS || pos + 1 + count > end) {
+      fprintf(stderr, "apply_journal: transaction %u not found\n", sequence);
+      return -1;
+    }
+    struct iovec iov = {BLOCK_AT(ctx->journal_blocks, 1),
+                        (size_t)count * ctx->block_size};
+    if (block_readv(ctx->sb.journal_offset + pos + 1, &iov, 1)) {
+      fprintf(stderr, "apply_journal: failed to read transaction\n");
+      return -1;
+    }
+    uint32_t checksum =
+        crc32c(0, descriptor->block_nums, count * sizeof(uint16_t));
+    checksum = crc32c(checksum, iov.iov_base, iov.iov_len);
+    if (checksum != descriptor->checksum) {
+      fprintf(stderr, "apply_journal: transaction %u is damaged\n", sequence);
+      return -1;
+    }
+    for (int i = 0; i < count; i++) {
+      int block_num = descriptor->block_nums[i];
+      if (block_num >= ctx->sb.journal_offset) {
+        fprintf(stderr, "apply_journal: invalid block %d\n", block_num);
+        return -1;
+      }
+      put_metadata_block(block_num, BLOCK_AT(ctx->journal_blocks, 1 + i));
+      memcpy(BLOCK_AT(ctx->committed_blocks, block_num),
+             BLOCK_AT(ctx->journal_blocks, 1 + i), ctx->block_size);
+      block_set_add(&ctx->journaled_blocks, block_num);
+    }
+    pos += 1 + count;
+    sequence++;
+  }
+  return 0;
+}
+
+// Reads all of the metadata of a shared mount from its home blocks, then
+// applies the transactions committed since the last checkpoint up to
+// journal block end.
+int reload_metadata(int end) {
+  union fs_block header;
+  if (read_metadata(true)) {
+    return -1;
+  }
+  if (block_read(ctx->sb.journal_offset, &header)) {
+    fprintf(stderr, "reload_metadata: failed to read journal header\n");
+    return -1;
+  }
+  return apply_journal(1, header.journal_header.sequence, end);
+}
+
+// Brings the metadata of a shared mount up to the generation the other
+// processes published, while they go on changing the image: the
+// transactions committed since it was loaded are applied from the journal,
+// or all of it is read again if the journal was checkpointed meanwhile.
+// Returns 1, with nothing read, while a commit or checkpoint is being
+// published; see wait_shared. Called with refresh_lock held exclusively, or
+// mount_lock.
+int refresh_metadata() {
+  struct shared_mount *shared = ctx->shared;
+  for (;;) {
+    uint64_t generation =
+        __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+    uint64_t checkpoints =
+        __atomic_load_n(&shared->checkpoints, __ATOMIC_ACQUIRE);
+    int pos = __atomic_load_n(&shared->journal_pos, __ATOMIC_RELAXED);
+    uint32_t sequence =
+        __atomic_load_n(&shared->journal_sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((generation | checkpoints) & 1) {
+      return 1;
+    }
+    if (__atomic_load_n(&shared->generation, __ATOMIC_RELAXED) !=
+            generation ||
+        __atomic_load_n(&shared->checkpoints, __ATOMIC_RELAXED) !=
+            checkpoints) {
+      continue;
+    }
+    if (generation == ctx->shared_generation &&
+        checkpoints == ctx->shared_checkpoints) {
+      return 0;
+    }
+    pthread_rwlock_wrlock(&ctx->op_lock);
+    int ret = 0;
+    if (generation == ctx->shared_generation) {
+      // a checkpoint wrote the journal home, nothing else changed
+      ctx->journaled_blocks = (struct block_set){{0}};
+    } else if (checkpoints == ctx->shared_checkpoints) {
+      ret = apply_journal(ctx->journal_pos, ctx->journal_sequence, pos);
+    } else {
+      ret = reload_metadata(pos);
+    }
+    pthread_rwlock_unlock(&ctx->op_lock);
+    // what was read may be torn if a checkpoint started meanwhile
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool is_torn =
+        __atomic_load_n(&shared->checkpoints, __ATOMIC_RELAXED) != checkpoints;
+    if (ret || is_torn) {
+      // all of it is read again next time
+      ctx->shared_generation = ctx->shared_checkpoints = UINT64_MAX;
+      if (is_torn) {
+        continue;
+      }
+      return -1;
+    }
+    ctx->journal_pos = pos;
+    ctx->journal_sequence = sequence;
+    ctx->shared_checkpoints = checkpoints;
+    ctx->num_free_blocks =
+        count_free_bits(ctx->used_block_bitmap, 0, DISK_BLOCKS);
+    ctx->num_free_inodes = count_free_bits(ctx->inode_bitmap, 0, MAX_FILES);
+    if (ctx->sb.features & FS_FEATURE_LOG) {
+      count_segments();
+    }
+    ctx->is_dedup_index_loaded = false;
+    __atomic_store_n(&ctx->shared_generation, generation, __ATOMIC_RELEASE);
+    return 0;
+  }
+}
+
+// Waits for the process publishing a commit or checkpoint of a shared mount
+// to finish, by taking the lock of the segment it holds meanwhile, which
+// also recovers the image if the process died.
+int wait_shared(const char *func) {
+  if (lock_segment(func, false)) {
+    return -1;
+  }
+  pthread_mutex_unlock(&ctx->shared->lock);
+  return 0;
+}
+
+// Starts a call changing a shared mount. The first of the calls in progress
+// takes the lock of the segment, see lock_segment, and brings the metadata
+// up to date; the others join it. Calls wait while the lock is being
+// released, so that other processes get their turn between changes.
+int join_change(const char *func) {
+  pthread_mutex_lock(&ctx->change_lock);
+  while (ctx->is_shared_releasing ||
+         (ctx->shared_changes && ctx->is_shared_held == false)) {
+    pthread_cond_wait(&ctx->change_cond, &ctx->change_lock);
+  }
+  if (ctx->shared_changes++) {
+    pthread_mutex_unlock(&ctx->change_lock);
+    return 0;
+  }
+  ctx->shared_owner = pthread_self();
+  pthread_mutex_unlock(&ctx->change_lock);
+  int ret = lock_segment(func, true);
+  if (ret == 0) {
+    pthread_rwlock_wrlock(&ctx->refresh_lock);
+    ret = refresh_metadata() ? -1 : 0;
+    pthread_rwlock_unlock(&ctx->refresh_lock);
+    if (ret) {
+      fprintf(stderr, "%s: failed to reload metadata\n", func);
+      ctx->shared->is_changing = false;
+      pthread_mutex_unlock(&ctx->shared->lock);
+    }
+  }
+  pthread_mutex_lock(&ctx->change_lock);
+  if (ret) {
+    ctx->shared_changes = 0;
+  }
+  __atomic_store_n(&ctx->is_shared_held, ret == 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&ctx->change_cond);
+  pthread_mutex_unlock(&ctx->change_lock);
+  return ret;
+}
+
+// Ends a call changing a shared mount and returns ret, or -1 if the commit
+// releasing the lock of the segment failed. The thread that took the lock
+// waits for the other calls, commits all of their changes for the other
+// processes to apply, which is all the lock is held for, and lets go of the
+// files they changed; see release_file_data.
+int leave_change(int ret) {
+  pthread_mutex_lock(&ctx->change_lock);
+  if (pthread_equal(ctx->shared_owner, pthread_self()) == false) {
+    ctx->shared_changes--;
+    pthread_cond_broadcast(&ctx->change_cond);
+    pthread_mutex_unlock(&ctx->change_lock);
+    return ret;
+  }
+  ctx->is_shared_releasing = true;
+  while (ctx->shared_changes > 1) {
+    pthread_cond_wait(&ctx->change_cond, &ctx->change_lock);
+  }
+  pthread_mutex_unlock(&ctx->change_lock);
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  if (journal_commit_all()) {
+    fprintf(stderr, "leave_change: failed to commit\n");
+    ret = -1;
+  }
+  pthread_rwlock_unlock(&ctx->op_lock);
+  pthread_mutex_lock(&ctx->change_lock);
+  __atomic_store_n(&ctx->is_shared_held, false, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ctx->change_lock);
+  release_file_data();
+  pthread_mutex_lock(&ctx->change_lock);
+  ctx->shared->is_changing = false;
+  pthread_mutex_unlock(&ctx->shared->lock);
+  ctx->shared_changes = 0;
+  ctx->is_shared_releasing = false;
+  pthread_cond_broadcast(&ctx->change_cond);
+  pthread_mutex_unlock(&ctx->change_lock);
+  return ret;
+}
+
+// Takes what a call on a shared mount needs: the lock of the segment if it
+// changes metadata, see join_change, or else refresh_lock shared, bringing
+// the metadata up to date first unless the process holds the lock of the
+// segment. Returns -1, with nothing held, if that fails. Does nothing for
+// other mounts.
+int lock_shared(const char *func, bool is_change) {
+  if (ctx->shared == NULL) {
+    return 0;
+  }
+  if (is_change) {
+    return join_change(func);
+  }
+  pthread_rwlock_rdlock(&ctx->refresh_lock);
+  while (__atomic_load_n(&ctx->is_shared_held, __ATOMIC_ACQUIRE) == false &&
+         __atomic_load_n(&ctx->shared->generation, __ATOMIC_ACQUIRE) !=
+             __atomic_load_n(&ctx->shared_generation, __ATOMIC_ACQUIRE)) {
+    pthread_rwlock_unlock(&ctx->refresh_lock);
+    pthread_rwlock_wrlock(&ctx->refresh_lock);
+    int ret = ctx->is_shared_held ? 0 : refresh_metadata();
+    pthread_rwlock_unlock(&ctx->refresh_lock);
+    if (ret == -1 || (ret == 1 && wait_shared(func))) {
+      fprintf(stderr, "%s: failed to reload metadata\n", func);
+      return -1;
+    }
+    pthread_rwlock_rdlock(&ctx->refresh_lock);
+  }
+  return 0;
+}
+
+// Releases what lock_shared took and returns ret, or -1 if the commit of a
+// change failed; see leave_change.
+int unlock_shared(bool is_change, int ret) {
+  if (ctx->shared == NULL) {
+    return ret;
+  }
+  if (is_change) {
+    return leave_change(ret);
+  }
+  pthread_rwlock_unlock(&ctx->refresh_lock);
+  return ret;
+}
+
+// Locks the data of the file at inode inum, or of every file if inum is -1,
+// against the other processes sharing the mount, with a lock of byte
+// IMAGE_FILE_BYTE + inum of the image: shared to read the file and
+// exclusive to change it. The calls of the process share the lock and count
+// on it; they exclude each other with the inode locks. An exclusive lock is
+// kept until the changes to the file are committed, see release_file_data,
+// so that other processes only read the file once they can apply them.
+// Unless wait, fails rather than wait for another process. Does nothing for
+// other mounts.
+int lock_file_data(int inum, bool is_write, bool wait) {
+  if (ctx->shared == NULL) {
+    return 0;
+  }
+  if (inum == -1) {
+    for (int i = 0; i < MAX_FILES; i++) {
+      if (lock_file_data(i, is_write, wait)) {
+        while (i--) {
+          unlock_file_data(i, is_write);
+        }
+        return -1;
+      }
+    }
+    return 0;
+  }
+  short type = is_write ? F_WRLCK : F_RDLCK;
+  int ret = 0;
+  pthread_mutex_lock(&ctx->file_lock);
+  while (ret == 0 && ctx->file_lock_types[inum] != F_WRLCK &&
+         ctx->file_lock_types[inum] != type) {
+    // a shared lock is let go of rather than made exclusive, which would
+    // deadlock with another process doing the same
+    if (ctx->is_file_locking[inum] || ctx->file_readers[inum]) {
+      if (wait == false) {
+        ret = -1;
+      } else {
+        pthread_cond_wait(&ctx->file_cond, &ctx->file_lock);
+      }
+      continue;
+    }
+    ctx->is_file_locking[inum] = true;
+    pthread_mutex_unlock(&ctx->file_lock);
+    ret = lock_image(ctx->lock_fd, type, IMAGE_FILE_BYTE + inum, wait);
+    pthread_mutex_lock(&ctx->file_lock);
+    ctx->is_file_locking[inum] = false;
+    if (ret == 0) {
+      ctx->file_lock_types[inum] = type;
+    }
+    pthread_cond_broadcast(&ctx->file_cond);
+  }
+  if (ret == 0 && is_write) {
+    ctx->file_writers[inum]++;
+  } else if (ret == 0) {
+    ctx->file_readers[inum]++;
+  }
+  pthread_mutex_unlock(&ctx->file_lock);
+  return ret;
+}
+
+// Releases the lock of file data lock_file_data took. An exclusive lock
+// stays while the process holds the lock of the segment, whose release
+// commits the changes to the file.
+void unlock_file_data(int inum, bool is_write) {
+  if (ctx->shared == NULL) {
+    return;
+  }
+  if (inum == -1) {
+    for (int i = 0; i < MAX_FILES; i++) {
+      unlock_file_data(i, is_write);
+    }
+    return;
+  }
+  pthread_mutex_lock(&ctx->file_lock);
+  if (is_write) {
+    ctx->file_writers[inum]--;
+  } else {
+    ctx->file_readers[inum]--;
+  }
+  update_file_data_lock(
+      inum, __atomic_load_n(&ctx->is_shared_held, __ATOMIC_ACQUIRE));
+  pthread_mutex_unlock(&ctx->file_lock);
+}
+
+// Changes the lock of the data of inode inum to the one the calls of the
+// process still count on, keeping an exclusive lock if is_kept. That is
+// never more than the lock held, which the image grants right away. Called
+// with file_lock held.
+void update_file_data_lock(int inum, bool is_kept) {
+  short type = F_UNLCK;
+  if (ctx->file_writers[inum] ||
+      (is_kept && ctx->file_lock_types[inum] == F_WRLCK)) {
+    type = F_WRLCK;
+  } else if (ctx->file_readers[inum]) {
+    type = F_RDLCK;
+  }
+  if (type != ctx->file_lock_types[inum]) {
+    lock_image(ctx->lock_fd, type, IMAGE_FILE_BYTE + inum, false);
+    ctx->file_lock_types[inum] = type;
+    pthread_cond_broadcast(&ctx->file_cond);
+  }
+}
+
+// Lets go of the exclusive locks of file data kept for the changes of the
+// process, once they are committed and before the lock of the segment is
+// released.
+void release_file_data() {
+  pthread_mutex_lock(&ctx->file_lock);
+  for (int i = 0; i < MAX_FILES; i++) {
+    update_file_data_lock(i, false);
+  }
+  pthread_mutex_unlock(&ctx->file_lock);
+}
+
+/*
+ * Library functions
+ */
+
+int make_fs(const char *disk_name) {
+  struct fs_options opts = {.features = FS_FEATURE_CHECKSUM};
+  return make_fs_opts(disk_name, &opts);
+}
+
+int make_fs_opts(const char *disk_name, const struct fs_options *opts) {
+  lock_mount(true);
+  int ret = make_fs_locked(disk_name, opts);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int make_fs_locked(const char *disk_name, const struct fs_options *opts) {
+  uint32_t features = opts ? opts->features : 0;
+  if (features & ~(FS_FEATURE_COMPRESSION | FS_FEATURE_DEDUP |
+                   FS_FEATURE_CHECKSUM | FS_FEATURE_LOG)) {
+    fprintf(stderr, "make_fs: unknown features\n");
+    return -1;
+  }
+  if ((features & FS_FEATURE_COMPRESSION) && (features & FS_FEATURE_DEDUP)) {
+    fprintf(stderr, "make_fs: compression and dedup are exclusive\n");
+    return -1;
+  }
+  int block_size = opts && opts->block_size ? opts->block_size : BLOCK_SIZE;
+  if (is_block_size(block_size) == false) {
+    fprintf(stderr, "make_fs: invalid block size\n");
+    return -1;
+  }
+  if (make_disk_sized(disk_name, block_size)) {
+    fprintf(stderr, "make_fs: make_disk failed\n");
+    return -1;
+  }
+  if (open_disk(disk_name)) {
+    fprintf(stderr, "make_fs: open_disk failed\n");
+    return -1;
+  }
+
+  set_block_size(block_size);
+  // each region starts on a block of its own, right after the previous one
+  int next = 1;
+  ctx->sb.dir_table_offset = next;
+  next += BLOCKS_FOR(sizeof(ctx->dir_table));
+  ctx->sb.inode_metadata_offset = next;
+  next += BLOCKS_FOR(sizeof(ctx->inode_bitmap));
+  ctx->sb.used_block_bitmap_offset = next;
+  next += BLOCKS_FOR(sizeof(ctx->used_block_bitmap));
+  ctx->sb.inode_offset = next;
+  next += BLOCKS_FOR(sizeof(ctx->inode_table));
+  ctx->sb.snapshot_offset = next;
+  next += BLOCKS_FOR(sizeof(ctx->snapshot_dir_table)) +
+          BLOCKS_FOR(sizeof(ctx->snapshot_inode_bitmap)) +
+          BLOCKS_FOR(sizeof(ctx->snapshot_inode_table)) +
+          BLOCKS_FOR(sizeof(ctx->snapshot_block_bitmap)) +
+          BLOCKS_FOR(sizeof(ctx->snapshot_free_bitmap));
+  assert(next <= (block_size < 2048 ? METADATA_MAX_BLOCKS : METADATA_BLOCKS));
+  ctx->sb.dedup_offset = next;
+  ctx->sb.data_offset = next;
+  if (features & FS_FEATURE_DEDUP) {
+    ctx->sb.data_offset += DEDUP_BLOCKS;
+  }
+  ctx->sb.checksum_offset = ctx->sb.data_offset;
+  if (features & FS_FEATURE_CHECKSUM) {
+    ctx->sb.data_offset += CHECKSUM_BLOCKS;
+  }
+  ctx->sb.journal_offset = ctx->sb.data_offset;
+  ctx->sb.data_offset += JOURNAL_BLOCKS;
+  ctx->sb.has_snapshot = false;
+  ctx->sb.features = features;
+  ctx->sb.is_clean = true;
+  ctx->sb.free_blocks = DISK_BLOCKS - ctx->sb.data_offset;
+  ctx->sb.free_inodes = MAX_FILES;
+  ctx->sb.block_size = block_size;
+  ctx->sb.log_head = ctx->sb.data_offset;
+
+  // write super block
+  union fs_block block_buffer;
+  memset(&block_buffer, 0, ctx->block_size);
+  block_buffer.super = ctx->sb;
+  if (block_write(0, &block_buffer)) {
+    fprintf(stderr, "make_fs: failed to write super block\n");
+    return -1;
+  }
+
+  // write used block bitmap
+  memset(ctx->used_block_bitmap, 0, sizeof(ctx->used_block_bitmap));
+  for (int i = 0; i < ctx->sb.data_offset; i++) {
+    bitmap_set(ctx->used_block_bitmap, i, 1);
+  }
+  memset(&block_buffer, 0, ctx->block_size);
+  memcpy(block_buffer.used_block_bitmap, ctx->used_block_bitmap,
+         sizeof(ctx->used_block_bitmap));
+  if (block_write(ctx->sb.used_block_bitmap_offset,
+                  &block_buffer.used_block_bitmap)) {
+    fprintf(stderr, "make_fs: failed to write used block bitmap\n");
+    return -1;
+  }
+
+  // write empty journal
+  memset(&block_buffer, 0, ctx->block_size);
+  block_buffer.journal_header.magic = JOURNAL_MAGIC;
+  block_buffer.journal_header.sequence = 1;
+  if (block_write(ctx->sb.journal_offset, &block_buffer)) {
+    fprintf(stderr, "make_fs: failed to write journal header\n");
+    return -1;
+  }
+
+  if (close_disk()) {
+    fprintf(stderr, "make_fs: close_disk failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int mount_fs(const char *disk_name) {
+  struct op_call call = op_start(FS_OP_MOUNT, -1, -1, 0, disk_name);
+  lock_mount(true);
+  int ret = -1;
+  if (lock_private(disk_name) == 0) {
+    ret = mount_fs_locked(disk_name);
+    if (ret) {
+      unlock_private();
+    }
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int mount_fs_locked(const char *disk_name) {
+  if (open_disk(disk_name)) {
+    fprintf(stderr, "mount_fs: open_disk failed\n");
+    return -1;
+  }
+  // after a clean unmount only the metadata used on every operation is read
+  if (load_metadata(false)) {
+    fprintf(stderr, "mount_fs: failed to load metadata\n");
+    close_disk();
+    return -1;
+  }
+  if (ctx->sb.is_clean) {
+    ctx->num_free_blocks = ctx->sb.free_blocks;
+    ctx->num_free_inodes = ctx->sb.free_inodes;
+  } else if (scan_metadata()) {
+    fprintf(stderr, "mount_fs: recovery scan failed\n");
+    close_disk();
+    return -1;
+  }
+  ctx->dedup_lookups = ctx->dedup_hits = 0;
+  if (ctx->sb.features & FS_FEATURE_LOG) {
+    count_segments();
+  }
+
+  // a crash from now on leaves the file system unclean
+  ctx->sb.is_clean = false;
+  mark_dirty(&ctx->sb, sizeof(ctx->sb));
+  if (journal_commit()) {
+    fprintf(stderr, "mount_fs: failed to commit super block\n");
+    close_disk();
+    return -1;
+  }
+  // on a shared mount, segments are only cleaned by fs_clean
+  if ((ctx->sb.features & FS_FEATURE_LOG) && ctx->shared == NULL &&
+      start_cleaner()) {
+    fprintf(stderr, "mount_fs: failed to start the segment cleaner\n");
+    close_disk();
+    return -1;
+  }
+
+  ctx->is_read_only = false;
+  ctx->is_mounted = true;
+  return 0;
+}
+
+int mount_fs_shared(const char *disk_name) {
+  struct op_call call = op_start(FS_OP_MOUNT, -1, -1, 0, disk_name);
+  lock_mount(true);
+  int ret = mount_fs_shared_locked(disk_name);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+// Mounts disk_name alongside the other processes that have it mounted
+// shared. The first one mounts it as mount_fs does, which recovers the image
+// if the processes that had it mounted before died; the others read the
+// metadata the image and its journal hold. All of the metadata is loaded, as
+// the journal is applied to it rather than to the image.
+int mount_fs_shared_locked(const char *disk_name) {
+  bool is_first;
+  if (open_shared(disk_name, &is_first)) {
+    fprintf(stderr, "mount_fs_shared: failed to open shared segment\n");
+    return -1;
+  }
+  int ret = 0;
+  if (is_first) {
+    // no other process uses the new segment yet
+    ctx->shared_checkpoints = 0;
+    ret = mount_fs_locked(disk_name);
+    for (int i = 0; ret == 0 && i < METADATA_REGIONS; i++) {
+      if (require_region(ctx->metadata_regions[i].mem)) {
+        close_disk();
+        ctx->is_mounted = false;
+        ret = -1;
+      }
+    }
+  } else if (open_disk(disk_name)) {
+    fprintf(stderr, "mount_fs_shared: open_disk failed\n");
+    ret = -1;
+  } else {
+    set_block_size(disk_block_size());
+    ctx->shared_generation = ctx->shared_checkpoints = UINT64_MAX;
+    do {
+      ret = refresh_metadata();
+    } while (ret == 1 && wait_shared("mount_fs_shared") == 0);
+    if (ret) {
+      fprintf(stderr, "mount_fs_shared: failed to load metadata\n");
+      close_disk();
+      ret = -1;
+    }
+    ctx->dedup_lookups = ctx->dedup_hits = 0;
+    ctx->is_read_only = false;
+    ctx->is_mounted = ret == 0;
+  }
+  if (ret) {
+    close_shared(is_first);
+    return -1;
+  }
+  lock_image(ctx->lock_fd, F_RDLCK, IMAGE_MOUNTED_BYTE, false);
+  lock_image(ctx->lock_fd, F_UNLCK, IMAGE_MOUNTING_BYTE, false);
+  return 0;
+}
+
+int fs_snapshot_mount(const char *disk_name) {
+  lock_mount(true);
+  int ret = fs_snapshot_mount_locked(disk_name);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_snapshot_mount_locked(const char *disk_name) {
+  if (open_disk(disk_name)) {
+    fprintf(stderr, "fs_snapshot_mount: open_disk failed\n");
+    return -1;
+  }
+  if (load_metadata(true)) {
+    fprintf(stderr, "fs_snapshot_mount: failed to load metadata\n");
+    close_disk();
+    return -1;
+  }
+  if (ctx->sb.has_snapshot == false) {
+    fprintf(stderr, "fs_snapshot_mount: no snapshot\n");
+    close_disk();
+    return -1;
+  }
+
+  // the frozen metadata replaces the live metadata
+  memcpy(ctx->dir_table, ctx->snapshot_dir_table, sizeof(ctx->dir_table));
+  memcpy(ctx->inode_bitmap, ctx->snapshot_inode_bitmap,
+         sizeof(ctx->inode_bitmap));
+  memcpy(ctx->inode_table, ctx->snapshot_inode_table, sizeof(ctx->inode_table));
+  memcpy(ctx->used_block_bitmap, ctx->snapshot_block_bitmap,
+         sizeof(ctx->used_block_bitmap));
+  memset(ctx->snapshot_free_bitmap, 0, sizeof(ctx->snapshot_free_bitmap));
+  memset(ctx->block_refcount, 0, sizeof(ctx->block_refcount));
+  memset(ctx->dedup_index, 0, sizeof(ctx->dedup_index));
+  ctx->is_dedup_index_loaded = true;
+
+  ctx->is_read_only = true;
+  ctx->is_mounted = true;
+  return 0;
+}
+
+int umount_fs(const char *disk_name) {
+  struct op_call call = op_start(FS_OP_UMOUNT, -1, -1, 0, NULL);
+  lock_mount(true);
+  int ret = umount_fs_locked();
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int umount_fs_locked() {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "umount_fs: file system not mounted\n");
+    return -1;
+  }
+  // only the last process to unmount a shared mount marks the image clean;
+  // the others have nothing left to write. It is the last if no other
+  // process holds IMAGE_MOUNTED_BYTE, whether or not the others unmounted.
+  struct shared_mount *shared = ctx->shared;
+  bool is_last = true;
+  if (shared) {
+    lock_image(ctx->lock_fd, F_WRLCK, IMAGE_MOUNTING_BYTE, true);
+    is_last = lock_image(ctx->lock_fd, F_WRLCK, IMAGE_MOUNTED_BYTE, false) == 0;
+    if (is_last && lock_segment("umount_fs", true)) {
+      lock_image(ctx->lock_fd, F_RDLCK, IMAGE_MOUNTED_BYTE, false);
+      lock_image(ctx->lock_fd, F_UNLCK, IMAGE_MOUNTING_BYTE, false);
+      return -1;
+    }
+  }
+
+  if (release_mappings()) {
+    fprintf(stderr, "umount_fs: failed to release mappings\n");
+    goto fail;
+  }
+  if (is_last && ctx->is_read_only == false &&
+      ((shared && refresh_metadata()) || mark_clean())) {
+    fprintf(stderr, "umount_fs: failed to flush journal\n");
+    goto fail;
+  }
+  stop_cleaner();
+
+  wait_async();
+  if (close_disk()) {
+    fprintf(stderr, "umount_fs: close_disk failed\n");
+    goto fail;
+  }
+
+  if (shared) {
+    for (int i = 0; i < MAX_FILES; i++) {
+      __atomic_fetch_sub(&shared->open_count[i], ctx->open_count[i],
+                         __ATOMIC_RELAXED);
+    }
+    if (is_last) {
+      shared->is_changing = false;
+      pthread_mutex_unlock(&shared->lock);
+    }
+    close_shared(is_last);
+  } else if (ctx->lock_fd != -1) {
+    unlock_private();
+  }
+  free_async_completions();
+  free_fds();
+  ctx->is_mounted = false;
+  ctx->is_read_only = false;
+  return 0;
+fail:
+  if (shared) {
+    if (is_last) {
+      lock_image(ctx->lock_fd, F_RDLCK, IMAGE_MOUNTED_BYTE, false);
+      shared->is_changing = false;
+      pthread_mutex_unlock(&shared->lock);
+    }
+    lock_image(ctx->lock_fd, F_UNLCK, IMAGE_MOUNTING_BYTE, false);
+  }
+  return -1;
+}
+
+int fs_snapshot_create() {
+  lock_mount(true);
+  int ret = -1;
+  if (lock_shared("fs_snapshot_create", true) == 0) {
+    ret = unlock_shared(true, fs_snapshot_create_locked());
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_snapshot_create_locked() {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_snapshot_create: file system not mounted\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_snapshot_create: file system is read-only\n");
+    return -1;
+  }
+  if (release_snapshot()) {
+    fprintf(stderr, "fs_snapshot_create: failed to release old snapshot\n");
+    return -1;
+  }
+
+  // Data and indirect blocks are written through, so freezing the metadata is
+  // all it takes: from now on the blocks it references are copied on write.
+  // The frozen copies and the super block saying they exist commit together.
+  memcpy(ctx->snapshot_dir_table, ctx->dir_table, sizeof(ctx->dir_table));
+  memcpy(ctx->snapshot_inode_bitmap, ctx->inode_bitmap,
+         sizeof(ctx->inode_bitmap));
+  memcpy(ctx->snapshot_inode_table, ctx->inode_table, sizeof(ctx->inode_table));
+  // blocks waiting for a commit or an unmap to be freed are still marked
+  // used, but the frozen metadata no longer references them
+  for (size_t i = 0; i < sizeof(ctx->snapshot_block_bitmap); i++) {
+    ctx->snapshot_block_bitmap[i] = ctx->used_block_bitmap[i] &
+                                    ~ctx->freed_block_bitmap[i] &
+                                    ~ctx->pinned_free_bitmap[i];
+  }
+  ctx->sb.has_snapshot = true;
+  // the frozen copies are replaced whole, so they count as loaded
+  for (int i = 0; i < METADATA_REGIONS; i++) {
+    if (ctx->metadata_regions[i].offset == &ctx->sb.snapshot_offset) {
+      ctx->metadata_regions[i].is_loaded = true;
+    }
+  }
+  mark_dirty(ctx->snapshot_dir_table, sizeof(ctx->snapshot_dir_table));
+  mark_dirty(ctx->snapshot_inode_bitmap, sizeof(ctx->snapshot_inode_bitmap));
+  mark_dirty(ctx->snapshot_inode_table, sizeof(ctx->snapshot_inode_table));
+  mark_dirty(ctx->snapshot_block_bitmap, sizeof(ctx->snapshot_block_bitmap));
+  mark_dirty(&ctx->sb, sizeof(ctx->sb));
+  if (journal_commit()) {
+    fprintf(stderr, "fs_snapshot_create: failed to commit snapshot\n");
+    return -1;
+  }
+  return 0;
+}
+
+int fs_snapshot_delete() {
+  lock_mount(true);
+  int ret = -1;
+  if (lock_shared("fs_snapshot_delete", true) == 0) {
+    ret = unlock_shared(true, fs_snapshot_delete_locked());
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_snapshot_delete_locked() {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_snapshot_delete: file system not mounted\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_snapshot_delete: file system is read-only\n");
+    return -1;
+  }
+  if (ctx->sb.has_snapshot == false) {
+    fprintf(stderr, "fs_snapshot_delete: no snapshot\n");
+    return -1;
+  }
+  if (release_snapshot()) {
+    fprintf(stderr, "fs_snapshot_delete: failed to release snapshot\n");
+    return -1;
+  }
+  journal_end_op(-1);
+  return journal_commit_due();
+}
+
+int fs_dedup_stats(struct fs_dedup_stats *stats) {
+  lock_mount(false);
+  int ret = -1;
+  if (lock_shared("fs_dedup_stats", false) == 0) {
+    lock_alloc();
+    ret = fs_dedup_stats_locked(stats);
+    unlock_alloc();
+    ret = unlock_shared(false, ret);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_dedup_stats_locked(struct fs_dedup_stats *stats) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_dedup_stats: file system not mounted\n");
+    return -1;
+  }
+  if ((ctx->sb.features & FS_FEATURE_DEDUP) == 0) {
+    fprintf(stderr, "fs_dedup_stats: dedup not enabled\n");
+    return -1;
+  }
+  if (load_dedup_index()) {
+    fprintf(stderr, "fs_dedup_stats: failed to load dedup index\n");
+    return -1;
+  }
+  memset(stats, 0, sizeof(*stats));
+  stats->lookups = ctx->dedup_lookups;
+  stats->hits = ctx->dedup_hits;
+  stats->hit_ratio =
+      ctx->dedup_lookups ? (double)ctx->dedup_hits / ctx->dedup_lookups : 0;
+  for (int i = ctx->sb.data_offset; i < DISK_BLOCKS; i++) {
+    if (ctx->block_refcount[i]) {
+      stats->unique_blocks++;
+      stats->saved_blocks += ctx->block_refcount[i] - 1;
+    }
+  }
+  stats->index_memory = sizeof(ctx->dedup_index) + sizeof(ctx->block_refcount) +
+                        sizeof(ctx->block_fingerprint);
+  return 0;
+}
+
+int fs_statfs(struct fs_statfs *statfs) {
+  lock_mount(false);
+  int ret = -1;
+  if (lock_shared("fs_statfs", false) == 0) {
+    pthread_mutex_lock(&ctx->dir_lock);
+    lock_alloc();
+    ret = fs_statfs_locked(statfs);
+    unlock_alloc();
+    pthread_mutex_unlock(&ctx->dir_lock);
+    ret = unlock_shared(false, ret);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+// Reports the free space from the counters bitmap_set keeps, so only the
+// largest free extent takes a scan.
+int fs_statfs_locked(struct fs_statfs *statfs) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_statfs: file system not mounted\n");
+    return -1;
+  }
+  memset(statfs, 0, sizeof(*statfs));
+  statfs->block_size = ctx->block_size;
+  statfs->total_blocks = DISK_BLOCKS - ctx->sb.data_offset;
+  statfs->free_blocks = ctx->num_free_blocks;
+  statfs->freeing_blocks = ctx->freed_block_count;
+  statfs->largest_free_extent = largest_free_extent();
+  statfs->total_inodes = MAX_FILES;
+  statfs->free_inodes = ctx->num_free_inodes;
+  return 0;
+}
+
+int fs_fsck(const char *disk_name, const struct fs_fsck_options *opts,
+            struct fs_fsck_report *report) {
+  lock_mount(true);
+  int ret = fs_fsck_locked(disk_name, opts, report);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_fsck_locked(const char *disk_name,
+                   const struct fs_fsck_options *opts,
+                   struct fs_fsck_report *report) {
+  if (ctx->is_mounted) {
+    fprintf(stderr, "fs_fsck: file system mounted\n");
+    return -1;
+  }
+  struct fsck_state *state = calloc(1, sizeof(*state));
+  if (state == NULL) {
+    fprintf(stderr, "fs_fsck: out of memory\n");
+    return -1;
+  }
+  state->ctx = ctx;
+  state->repair = opts && opts->repair;
+  state->num_threads = opts && opts->threads > 0
+                           ? opts->threads
+                           : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  state->num_threads = MAX(1, MIN(state->num_threads, FSCK_MAX_THREADS));
+  memset(report, 0, sizeof(*report));
+
+  int ret = -1;
+  if (open_disk(disk_name)) {
+    fprintf(stderr, "fs_fsck: open_disk failed\n");
+    goto out;
+  }
+  // the journal is replayed even without repair, it holds committed changes
+  if (load_metadata(true)) {
+    fprintf(stderr, "fs_fsck: failed to load metadata\n");
+  } else if (fsck_check(state, report)) {
+    fprintf(stderr, "fs_fsck: check failed\n");
+  } else if (state->repair) {
+    ctx->num_free_blocks =
+        count_free_bits(ctx->used_block_bitmap, 0, DISK_BLOCKS);
+    ctx->num_free_inodes = count_free_bits(ctx->inode_bitmap, 0, MAX_FILES);
+    if (mark_clean()) {
+      fprintf(stderr, "fs_fsck: failed to flush journal\n");
+    } else {
+      report->repaired = report->bad_dir_entries || report->missing_inodes ||
+                         report->orphaned_inodes || report->bad_pointers ||
+                         report->missing_blocks || report->orphaned_blocks;
+      ret = 0;
+    }
+  } else {
+    ret = 0;
+  }
+  if (close_disk()) {
+    fprintf(stderr, "fs_fsck: close_disk failed\n");
+    ret = -1;
+  }
+out:
+  for (int i = 0; i < DISK_BLOCKS; i++) {
+    free(state->indirect[i]);
+  }
+  free(state);
+  return ret;
+}
+
+int fs_defrag(const char *name, struct fs_defrag_report *report) {
+  lock_mount(false);
+  int ret = -1;
+  // the blocks of any file may move
+  if (lock_file_data(-1, true, true) == 0) {
+    if (lock_shared("fs_defrag", true) == 0) {
+      ret = unlock_shared(true, fs_defrag_locked(name, report));
+    }
+    unlock_file_data(-1, true);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_defrag_locked(const char *name, struct fs_defrag_report *report) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_defrag: file system not mounted\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_defrag: file system is read-only\n");
+    return -1;
+  }
+  if (defrag_begin()) {
+    fprintf(stderr, "fs_defrag: failed to reclaim freed blocks\n");
+    return -1;
+  }
+  pthread_rwlock_rdlock(&ctx->op_lock);
+  pthread_mutex_lock(&ctx->dir_lock);
+  struct dir_entry *dentry = get_dentry(name);
+  if (dentry == NULL) {
+    pthread_mutex_unlock(&ctx->dir_lock);
+    pthread_rwlock_unlock(&ctx->op_lock);
+    fprintf(stderr, "fs_defrag: file not found\n");
+    return -1;
+  }
+  int inum = dentry->inode_number;
+  lock_inode(inum, true);
+  pthread_mutex_unlock(&ctx->dir_lock);
+  memset(report, 0, sizeof(*report));
+  report->free_extents_before = count_free_extents();
+  int budget = DEFRAG_MAX_BLOCKS;
+  int ret = defrag_file(inum, &budget, report);
+  report->free_extents_after = count_free_extents();
+  unlock_inode(inum);
+  journal_end_op(inum);
+  pthread_rwlock_unlock(&ctx->op_lock);
+  if (journal_commit_due()) {
+    return -1;
+  }
+  if (ret == -1) {
+    fprintf(stderr, "fs_defrag: failed to move data blocks\n");
+    return -1;
+  }
+  // the moved blocks' old homes may make room for more once released
+  return ret || report->moved_blocks;
+}
+
+int fs_defrag_all(struct fs_defrag_report *report) {
+  lock_mount(false);
+  int ret = -1;
+  // the blocks of any file may move
+  if (lock_file_data(-1, true, true) == 0) {
+    if (lock_shared("fs_defrag_all", true) == 0) {
+      ret = unlock_shared(true, fs_defrag_all_locked(report));
+    }
+    unlock_file_data(-1, true);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_defrag_all_locked(struct fs_defrag_report *report) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_defrag_all: file system not mounted\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_defrag_all: file system is read-only\n");
+    return -1;
+  }
+  if (defrag_begin()) {
+    fprintf(stderr, "fs_defrag_all: failed to reclaim freed blocks\n");
+    return -1;
+  }
+  memset(report, 0, sizeof(*report));
+  report->free_extents_before = count_free_extents();
+  // once the budget is spent the remaining files are only measured
+  int budget = DEFRAG_MAX_BLOCKS;
+  int ret = 0;
+  pthread_rwlock_rdlock(&ctx->op_lock);
+  for (int inum = 0; inum < MAX_FILES && ret != -1; inum++) {
+    pthread_mutex_lock(&ctx->dir_lock);
+    if (bitmap_test(ctx->inode_bitmap, inum) == false) {
+      pthread_mutex_unlock(&ctx->dir_lock);
+      continue;
+    }
+    lock_inode(inum, true);
+    pthread_mutex_unlock(&ctx->dir_lock);
+    int file_ret = defrag_file(inum, &budget, report);
+    unlock_inode(inum);
+    journal_end_op(inum);
+    ret = file_ret == -1 ? -1 : ret | file_ret;
+  }
+  pthread_rwlock_unlock(&ctx->op_lock);
+  report->free_extents_after = count_free_extents();
+  if (journal_commit_due()) {
+    return -1;
+  }
+  if (ret == -1) {
+    fprintf(stderr, "fs_defrag_all: failed to move data blocks\n");
+    return -1;
+  }
+  // the moved blocks' old homes may make room for more once released
+  return ret || report->moved_blocks;
+}
+
+int fs_clean(struct fs_clean_report *report) {
+  lock_mount(false);
+  int ret = -1;
+  // the blocks of any file may move
+  if (lock_file_data(-1, true, true) == 0) {
+    if (lock_shared("fs_clean", true) == 0) {
+      ret = unlock_shared(true, fs_clean_locked(report));
+    }
+    unlock_file_data(-1, true);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+// Runs one cleaning pass: the blocks of the segments pick_victims marks are
+// moved to the log head a file at a time, like fs_defrag_all moves them, and
+// the new block maps are committed, which frees the segments. The pass holds
+// op_lock exclusively, so passes started by fs_clean and by the cleaner thread
+// run one after the other, and no operation sees the free blocks a pass takes
+// before its commit gives them back.
+int fs_clean_locked(struct fs_clean_report *report) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_clean: file system not mounted\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_clean: file system is read-only\n");
+    return -1;
+  }
+  if ((ctx->sb.features & FS_FEATURE_LOG) == 0) {
+    fprintf(stderr, "fs_clean: file system is not log-structured\n");
+    return -1;
+  }
+  memset(report, 0, sizeof(*report));
+  wait_async(); // blocks are moved by copying what they hold
+  lock_alloc();
+  int ret = (ctx->sb.features & FS_FEATURE_DEDUP) ? load_dedup_index() : 0;
+  unlock_alloc();
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  // blocks freed by earlier operations only leave their segments once
+  // committed, which is not worth it without a segment to clean
+  bool victims[LOG_SEGMENTS];
+  lock_alloc();
+  int picked = ret ? 0 : pick_victims(victims);
+  unlock_alloc();
+  if (picked && ctx->freed_block_count && journal_commit()) {
+    ret = -1;
+  }
+  lock_alloc();
+  picked = picked && ret == 0 ? pick_victims(victims) : 0;
+  ctx->clean_victims = picked ? victims : NULL;
+  unlock_alloc();
+  int budget = LOG_CLEAN_BLOCKS;
+  for (int inum = 0; picked && inum < MAX_FILES && ret == 0 && budget > 0;
+       inum++) {
+    pthread_mutex_lock(&ctx->dir_lock);
+    if (bitmap_test(ctx->inode_bitmap, inum) == false) {
+      pthread_mutex_unlock(&ctx->dir_lock);
+      continue;
+    }
+    lock_inode(inum, true);
+    pthread_mutex_unlock(&ctx->dir_lock);
+    lock_alloc();
+    ret = clean_file(inum, victims, &budget, report);
+    unlock_alloc();
+    unlock_inode(inum);
+    journal_end_op(inum);
+  }
+  lock_alloc();
+  ctx->clean_victims = NULL;
+  unlock_alloc();
+  // the moved blocks' old homes are free once the new block maps commit
+  if (ret == 0 && report->moved_blocks && journal_commit()) {
+    ret = -1;
+  }
+  pthread_rwlock_unlock(&ctx->op_lock);
+  lock_alloc();
+  for (int i = 0; picked && i < LOG_SEGMENTS; i++) {
+    report->segments += victims[i] && ctx->segment_used[i] == 0;
+  }
+  report->clean_segments = ctx->num_clean_segments;
+  unlock_alloc();
+  stat_add(&stats_shard()->stats.cleaned_blocks, report->moved_blocks);
+  if (ret == -1) {
+    fprintf(stderr, "fs_clean: failed to move blocks\n");
+    return -1;
+  }
+  return 0;
+}
+
+int fs_stats(struct fs_stats *stats) {
+  lock_mount(false);
+  pthread_mutex_lock(&ctx->stats_lock);
+  sum_stats(stats);
+  uint64_t *counters = (uint64_t *)stats;
+  const uint64_t *base = (const uint64_t *)&ctx->stats_base;
+  for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++) {
+    counters[i] -= base[i];
+  }
+  pthread_mutex_unlock(&ctx->stats_lock);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return 0;
+}
+
+// Counting goes on during a reset, so the counters are never cleared; later
+// sums subtract the ones taken now instead.
+int fs_stats_reset() {
+  lock_mount(false);
+  pthread_mutex_lock(&ctx->stats_lock);
+  sum_stats(&ctx->stats_base);
+  pthread_mutex_unlock(&ctx->stats_lock);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return 0;
+}
+
+// Tracing works whether or not a file system is mounted, so a trace may
+// start with the mount.
+int fs_trace_start(const char *path) {
+  lock_mount(false);
+  pthread_mutex_lock(&ctx->trace_lock);
+  int ret = 0;
+  FILE *file = NULL;
+  if (ctx->trace_file) {
+    fprintf(stderr, "fs_trace_start: already tracing\n");
+    ret = -1;
+  } else if ((file = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "fs_trace_start: failed to open trace\n");
+    ret = -1;
+  } else {
+    uint32_t header[2] = {FS_TRACE_MAGIC, FS_TRACE_VERSION};
+    fwrite(header, sizeof(header), 1, file);
+    ctx->trace_start_ns = now_ns();
+    __atomic_store_n(&ctx->trace_file, file, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&ctx->trace_lock);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_trace_stop() {
+  lock_mount(false);
+  pthread_mutex_lock(&ctx->trace_lock);
+  int ret = 0;
+  if (ctx->trace_file == NULL) {
+    fprintf(stderr, "fs_trace_stop: not tracing\n");
+    ret = -1;
+  } else {
+    if (fclose(ctx->trace_file)) {
+      fprintf(stderr, "fs_trace_stop: failed to write trace\n");
+      ret = -1;
+    }
+    __atomic_store_n(&ctx->trace_file, NULL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&ctx->trace_lock);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return ret;
+}
+
+int fs_open(const char *name) {
+  struct op_call call = op_start(FS_OP_OPEN, -1, -1, 0, name);
+  lock_mount(false);
+  int ret = -1;
+  // the lock of a shared mount orders the open with fs_delete elsewhere
+  if (lock_shared("fs_open", true) == 0) {
+    pthread_mutex_lock(&ctx->dir_lock);
+    ret = fs_open_locked(name);
+    pthread_mutex_unlock(&ctx->dir_lock);
+    ret = unlock_shared(true, ret);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int fs_open_locked(const char *name) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_open: file system not mounted\n");
+    return -1;
+  }
+  struct dir_entry *dentry = get_dentry(name);
+  if (dentry == NULL) {
+    fprintf(stderr, "fs_open: file not found\n");
+    return -1;
+  }
+  int fildes = claim_fd();
+  if (fildes == -1) {
+    fprintf(stderr, "fs_open: no available file descriptors\n");
+    return -1;
+  }
+  struct file_descriptor *fd = get_fd(fildes);
+  fd->is_used = true;
+  fd->inode_number = dentry->inode_number;
+  fd->offset = 0;
+  fd->advice = FS_ADVICE_NORMAL;
+  fd->readahead_start = fd->readahead_end = fd->readahead_size = 0;
+  // under dir_lock, so fs_delete sees the file open
+  __atomic_fetch_add(&ctx->open_count[fd->inode_number], 1, __ATOMIC_RELAXED);
+  if (ctx->shared) {
+    __atomic_fetch_add(&ctx->shared->open_count[fd->inode_number], 1,
+                       __ATOMIC_RELAXED);
+  }
+  return fildes;
+}
+
+int fs_close(int fildes) {
+  struct op_call call = op_start(FS_OP_CLOSE, fildes, -1, 0, NULL);
+  lock_mount(false);
+  int ret = fs_close_locked(fildes);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int fs_close_locked(int fildes) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_close: file system not mounted\n");
+    return -1;
+  }
+  struct file_descriptor *fd = get_fd(fildes);
+  if (fd == NULL) {
+    fprintf(stderr, "fs_close: invalid file descriptor\n");
+    return -1;
+  }
+  if (fd->is_used == false) {
+    fprintf(stderr, "fs_close: file descriptor not in use\n");
+    return -1;
+  }
+  __atomic_fetch_sub(&ctx->open_count[fd->inode_number], 1, __ATOMIC_RELAXED);
+  if (ctx->shared) {
+    __atomic_fetch_sub(&ctx->shared->open_count[fd->inode_number], 1,
+                       __ATOMIC_RELAXED);
+  }
+  fd->is_used = false;
+  fd->inode_number = -1;
+  fd->offset = 0;
+  release_fd(fildes);
+  return 0;
+}
+
+int fs_create(const char *name) {
+  struct op_call call = op_start(FS_OP_CREATE, -1, -1, 0, name);
+  lock_mount(false);
+  if (lock_shared("fs_create", true)) {
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return op_end(&call, -1);
+  }
+  if (reclaim_freed_blocks(1)) {
+    fprintf(stderr, "fs_create: failed to reclaim freed blocks\n");
+    unlock_shared(true, -1);
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return op_end(&call, -1);
+  }
+  pthread_rwlock_rdlock(&ctx->op_lock);
+  pthread_mutex_lock(&ctx->dir_lock);
+  int ret = fs_create_locked(name);
+  pthread_mutex_unlock(&ctx->dir_lock);
+  pthread_rwlock_unlock(&ctx->op_lock);
+  if (journal_commit_due()) {
+    ret = -1;
+  }
+  ret = unlock_shared(true, ret);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int fs_create_locked(const char *name) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_create: file system not mounted\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_create: file system is read-only\n");
+    return -1;
+  }
+  if (strlen(name) == 0 || strlen(name) > MAX_FILE_NAME_CHAR) {
+    fprintf(stderr, "fs_create: invalid file name\n");
+    return -1;
+  }
+  if (get_dentry(name)) {
+    fprintf(stderr, "fs_create: file already exists\n");
+    return -1;
+  }
+  if (ctx->num_free_inodes == 0) {
+    fprintf(stderr, "fs_create: root directory is full\n");
+    return -1;
+  }
+  int inum = claim_inum_from_bitmap();
+  assert(inum != -1);
+  struct dir_entry *dentry = claim_dentry(inum, name);
+  assert(dentry != NULL);
+  int free_block_num = claim_unused_data_block();
+  if (free_block_num == -1) {
+    fprintf(stderr, "fs_create: no free blocks\n");
+    return -1;
+  }
+  assert(free_block_num >= ctx->sb.data_offset);
+  struct inode *inode = &ctx->inode_table[inum];
+  inode->direct_offset[0] = free_block_num;
+  inode->file_size = 0;
+  mark_dirty(inode, INODE_SIZE);
+  journal_end_op(inum);
+  return 0;
+}
+
+int fs_delete(const char *name) {
+  struct op_call call = op_start(FS_OP_DELETE, -1, -1, 0, name);
+  lock_mount(false);
+  if (lock_shared("fs_delete", true)) {
+    pthread_rwlock_unlock(&ctx->mount_lock);
+    return op_end(&call, -1);
+  }
+  pthread_rwlock_rdlock(&ctx->op_lock);
+  pthread_mutex_lock(&ctx->dir_lock);
+  int ret = fs_delete_locked(name);
+  pthread_mutex_unlock(&ctx->dir_lock);
+  pthread_rwlock_unlock(&ctx->op_lock);
+  if (journal_commit_due()) {
+    ret = -1;
+  }
+  ret = unlock_shared(true, ret);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
 }
 
-size_t read_bytes(int block_num, struct file_descriptor *fd, void *buf,
-                  size_t nbyte) {
-  union fs_block block_buffer;
-  if (block_read(block_num, &block_buffer)) {
-    fprintf(stderr, "read_bytes: failed to read data block %d\n", block_num);
+int fs_delete_locked(const char *name) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_delete: file system not mounted\n");
     return -1;
   }
-  uint16_t offset_in_block = fd->offset % BLOCK_SIZE;
-  int file_size = inode_table[fd->inode_number].file_size;
-  size_t bytes_read = 0;
-  nbyte = MIN(nbyte, file_size - fd->offset);
-  while (bytes_read < nbyte) {
-    if (offset_in_block == BLOCK_SIZE) {
-      int next_block_num = get_data_block_num(fd->inode_number, fd->offset);
-      assert(next_block_num >= sb.data_offset);
-      assert(next_block_num != block_num);
-      if (block_read(next_block_num, &block_buffer)) {
-        fprintf(stderr, "read_bytes: failed to read data block %d\n",
-                next_block_num);
-        return -1;
-      }
-      block_num = next_block_num;
-      offset_in_block = 0;
-    }
-    size_t bytes_to_read =
-        MIN(nbyte - bytes_read, BLOCK_SIZE - offset_in_block);
-    memcpy((char *)buf + bytes_read, block_buffer.data + offset_in_block,
-           bytes_to_read);
-    bytes_read += bytes_to_read;
-    offset_in_block += bytes_to_read;
-    fd->offset += bytes_to_read;
+  if (ctx->is_read_only) {
+    fprintf(stderr, "fs_delete: file system is read-only\n");
+    return -1;
   }
-  return bytes_read;
-}
-
-size_t write_bytes(int block_num, struct file_descriptor *fd, const void *buf,
-                   size_t nbyte) {
-  union fs_block block_buffer;
-  if (block_read(block_num, &block_buffer)) {
-    fprintf(stderr, "write_bytes: failed to read data block\n");
+  struct dir_entry *dentry = get_dentry(name);
+  if (dentry == NULL) {
+    fprintf(stderr, "fs_delete: file not found\n");
     return -1;
   }
-  uint16_t inum = fd->inode_number;
-  uint16_t offset_in_block = fd->offset % BLOCK_SIZE;
-  size_t bytes_written = 0;
-  nbyte = MIN(nbyte, MAX_FILE_SIZE - fd->offset);
-  while (bytes_written < nbyte) {
-    if (offset_in_block == BLOCK_SIZE) {
-      if (block_write(block_num, &block_buffer)) {
-        fprintf(stderr, "write_bytes: failed to write data block\n");
-        return -1;
-      }
-      memset(&block_buffer, 0, sizeof(block_buffer));
-      if (bitmap_full(used_block_bitmap, sizeof(used_block_bitmap))) {
-        break;
-      }
-      int next_block_num = get_data_block_num(inum, fd->offset);
-      if (next_block_num == -1) {
-        fprintf(stderr, "write_bytes: failed to get data block number\n");
-        return -1;
-      }
-      if (next_block_num == 0) { // allocate new data block
-        next_block_num = claim_unused_data_block();
-        if (add_inode_data_block(inum, next_block_num)) {
-          fprintf(stderr,
-                  "write_bytes: failed to assign data block %d to inode\n",
-                  next_block_num);
-          return -1;
-        }
-      }
-      assert(next_block_num >= sb.data_offset);
-      assert(next_block_num != block_num);
-      block_num = next_block_num;
-      offset_in_block = 0;
-    }
-    size_t bytes_to_write =
-        MIN(nbyte - bytes_written, BLOCK_SIZE - offset_in_block);
-    memcpy(block_buffer.data + offset_in_block, (char *)buf + bytes_written,
-           bytes_to_write);
-    bytes_written += bytes_to_write;
-    offset_in_block += bytes_to_write;
-    fd->offset += bytes_to_write;
+  if (__atomic_load_n(&ctx->open_count[dentry->inode_number],
+                      __ATOMIC_RELAXED) ||
+      (ctx->shared &&
+       __atomic_load_n(&ctx->shared->open_count[dentry->inode_number],
+                       __ATOMIC_RELAXED))) {
+    fprintf(stderr, "fs_delete: file is open\n");
+    return -1;
   }
-  if (block_write(block_num, &block_buffer)) {
-    fprintf(stderr, "write_bytes: failed to write data block\n");
+  int inum = dentry->inode_number;
+  struct inode *inode = &ctx->inode_table[inum];
+  // a defragmentation may still be moving the blocks of the file
+  lock_inode(inum, true);
+  int ret = release_inode_blocks(inode);
+  unlock_inode(inum);
+  if (ret) {
     return -1;
   }
-  inode_table[inum].file_size = MAX(inode_table[inum].file_size, fd->offset);
-  return bytes_written;
+  bitmap_set(ctx->inode_bitmap, inum, 0);
+  clear_dentry(dentry);
+  journal_end_op(inum);
+  return 0;
 }
 
-// Recursively clear indirect blocks. indirection_level > 0 means entries in
-// block_num point to indirect blocks.
-int clear_indirect_block(uint16_t block_num, int indirection_level) {
-  union fs_block block_buffer;
-  if (block_read(block_num, &block_buffer)) {
-    fprintf(stderr, "clear_indirect_block: failed to read indirect block\n");
-    return -1;
-  }
-  union fs_block empty_block;
-  memset(&empty_block, 0, BLOCK_SIZE);
-  for (int i = 0; i < DIRECT_OFFSETS_PER_BLOCK; i++) {
-    if (block_buffer.block_offsets[i]) {
-      if (indirection_level > SINGLE_INDIRECTION) {
-        if (clear_indirect_block(block_buffer.block_offsets[i],
-                                 indirection_level - 1)) {
-          fprintf(stderr,
-                  "clear_indirect_block: failed to clear indirect block\n");
-          return -1;
-        }
-      } else if (block_write(block_buffer.block_offsets[i], &empty_block)) {
-        fprintf(stderr, "clear_indirect_block: failed to clear data block %d\n",
-                block_buffer.block_offsets[i]);
+// Releases all blocks of an inode and empties it.
+int release_inode_blocks(struct inode *inode) {
+  for (int i = 0; i < DIRECT_OFFSETS_PER_INODE; i++) {
+    if (inode->direct_offset[i]) {
+      if (release_data_block(inode->direct_offset[i])) {
+        fprintf(stderr, "fs_delete: failed to clear data block %d\n",
+                inode->direct_offset[i]);
         return -1;
       }
-      bitmap_set(used_block_bitmap, block_buffer.block_offsets[i], 0);
+      inode->direct_offset[i] = 0;
     }
   }
-  if (block_write(block_num, &empty_block)) {
-    fprintf(stderr, "clear_indirect_block: failed to clear indirect block\n");
-    return -1;
+  if (inode->single_indirect_offset) {
+    if (clear_indirect_block(inode->single_indirect_offset,
+                             SINGLE_INDIRECTION)) {
+      fprintf(stderr, "fs_delete: failed to clear single indirect block\n");
+      return -1;
+    }
+    inode->single_indirect_offset = 0;
+  }
+  if (inode->double_indirect_offset) {
+    if (clear_indirect_block(inode->double_indirect_offset,
+                             DOUBLE_INDIRECTION)) {
+      fprintf(stderr, "fs_delete: failed to clear double indirect block\n");
+      return -1;
+    }
+    inode->double_indirect_offset = 0;
   }
-  bitmap_set(used_block_bitmap, block_num, 0);
+  inode->file_size = 0;
+  mark_dirty(inode, INODE_SIZE);
   return 0;
 }
 
-/*
- * Library functions
- */
-
-int make_fs(const char *disk_name) {
-  if (make_disk(disk_name)) {
-    fprintf(stderr, "make_fs: make_disk failed\n");
-    return -1;
+int fs_read(int fildes, void *buf, size_t nbyte) {
+  struct op_call call = op_start(FS_OP_READ, fildes, -1, nbyte, NULL);
+  int inum = lock_file("fs_read", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
-  if (open_disk(disk_name)) {
-    fprintf(stderr, "make_fs: open_disk failed\n");
-    return -1;
+  call.offset = get_fd(fildes)->offset;
+  int ret = unlock_file(inum, false, fs_read_locked(fildes, buf, nbyte));
+  return op_end(&call, ret);
+}
+
+int fs_read_locked(int fildes, void *buf, size_t nbyte) {
+  struct iovec iov = {buf, nbyte};
+  return fs_readv_locked(fildes, &iov, 1, nbyte);
+}
+
+int fs_write(int fildes, void *buf, size_t nbyte) {
+  struct op_call call = op_start(FS_OP_WRITE, fildes, -1, nbyte, NULL);
+  int inum = lock_file("fs_write", fildes, true,
+                       nbyte / ctx->block_size + RESERVED_BLOCKS);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
+  call.offset = get_fd(fildes)->offset;
+  int ret = unlock_file(inum, true, fs_write_locked(fildes, buf, nbyte));
+  return op_end(&call, ret);
+}
 
-  sb.dir_table_offset = 1;
-  sb.inode_metadata_offset = 2;
-  sb.used_block_bitmap_offset = 3;
-  sb.inode_offset = 4;
-  sb.data_offset = 5;
+int fs_write_locked(int fildes, void *buf, size_t nbyte) {
+  struct iovec iov = {buf, nbyte};
+  return fs_writev_locked(fildes, &iov, 1, nbyte);
+}
 
-  // write super block
-  union fs_block block_buffer;
-  memset(&block_buffer, 0, BLOCK_SIZE);
-  block_buffer.super = sb;
-  if (block_write(0, &block_buffer)) {
-    fprintf(stderr, "make_fs: failed to write super block\n");
-    return -1;
+int fs_readv(int fildes, const struct iovec *iov, int iovcnt) {
+  ssize_t nbyte = iov_length(iov, iovcnt);
+  struct op_call call = op_start(FS_OP_READV, fildes, -1, MAX(nbyte, 0), NULL);
+  if (nbyte == -1) {
+    fprintf(stderr, "fs_readv: invalid buffers\n");
+    return op_end(&call, -1);
+  }
+  int inum = lock_file("fs_readv", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
+  call.offset = get_fd(fildes)->offset;
+  int ret =
+      unlock_file(inum, false, fs_readv_locked(fildes, iov, iovcnt, nbyte));
+  return op_end(&call, ret);
+}
 
-  // write used block bitmap
-  for (int i = 0; i < METADATA_BLOCKS; i++) {
-    bitmap_set(used_block_bitmap, i, 1);
+// Buffers are filled in order, in one pass over the block map, as if they
+// were one buffer of nbyte bytes.
+int fs_readv_locked(int fildes, const struct iovec *iov, int iovcnt,
+                    size_t nbyte) {
+  struct iov_iter iter;
+  iter_init(&iter, iov, iovcnt);
+  return read_fd(get_fd(fildes), &iter, nbyte);
+}
+
+int read_fd(struct file_descriptor *fd, struct iov_iter *iter, size_t nbyte) {
+  size_t bytes_read;
+  readahead_fd(fd, nbyte);
+  if (ctx->sb.features & FS_FEATURE_COMPRESSION) {
+    bytes_read = read_bytes_compressed(fd, iter, nbyte);
+  } else {
+    int start_block = get_data_block_num(fd->inode_number, fd->offset);
+    if (start_block <= 0) {
+      fprintf(stderr, "fs_read: no data block found for offset\n");
+      return -1;
+    }
+    bytes_read = read_bytes(start_block, fd, iter, nbyte);
   }
-  memset(&block_buffer, 0, BLOCK_SIZE);
-  memcpy(block_buffer.used_block_bitmap, used_block_bitmap,
-         sizeof(used_block_bitmap));
-  if (block_write(sb.used_block_bitmap_offset,
-                  &block_buffer.used_block_bitmap)) {
-    fprintf(stderr, "make_fs: failed to write used block bitmap\n");
-    return -1;
+  if (bytes_read != (size_t)-1 && fd->advice == FS_ADVICE_SEQUENTIAL) {
+    evict_behind(fd);
   }
+  return bytes_read;
+}
 
-  if (close_disk()) {
-    fprintf(stderr, "make_fs: close_disk failed\n");
-    return -1;
+int fs_writev(int fildes, const struct iovec *iov, int iovcnt) {
+  ssize_t nbyte = iov_length(iov, iovcnt);
+  struct op_call call = op_start(FS_OP_WRITEV, fildes, -1, MAX(nbyte, 0), NULL);
+  if (nbyte == -1) {
+    fprintf(stderr, "fs_writev: invalid buffers\n");
+    return op_end(&call, -1);
+  }
+  int inum = lock_file("fs_writev", fildes, true,
+                       nbyte / ctx->block_size + RESERVED_BLOCKS);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
+  call.offset = get_fd(fildes)->offset;
+  int ret =
+      unlock_file(inum, true, fs_writev_locked(fildes, iov, iovcnt, nbyte));
+  return op_end(&call, ret);
+}
 
-  return 0;
+// Gathered buffers are written like one buffer of nbyte bytes: the same
+// block map updates, read-modify-writes and disk writes.
+int fs_writev_locked(int fildes, const struct iovec *iov, int iovcnt,
+                     size_t nbyte) {
+  struct iov_iter iter;
+  iter_init(&iter, iov, iovcnt);
+  return write_fd(get_fd(fildes), &iter, nbyte);
 }
 
-int mount_fs(const char *disk_name) {
-  if (open_disk(disk_name)) {
-    fprintf(stderr, "mount_fs: open_disk failed\n");
-    return -1;
+int write_fd(struct file_descriptor *fd, struct iov_iter *iter, size_t nbyte) {
+  size_t bytes_written;
+  if (ctx->sb.features & FS_FEATURE_COMPRESSION) {
+    bytes_written = write_bytes_compressed(fd, iter, nbyte);
+  } else if (nbyte >= WRITE_PARALLEL_MIN &&
+             (ctx->sb.features & FS_FEATURE_DEDUP) == 0) {
+    // deduplication looks every block up, so it stays sequential
+    bytes_written = write_bytes_parallel(fd, iter, nbyte);
+  } else {
+    bytes_written = write_bytes_at(fd, iter, nbyte);
   }
+  return bytes_written;
+}
 
-  union fs_block block_buffer;
-  // read super block
-  if (block_read(0, &block_buffer)) {
-    fprintf(stderr, "mount_fs: failed to read super block\n");
+int fs_copy_range(int src_fildes, off_t src_offset, int dst_fildes,
+                  off_t dst_offset, size_t len) {
+  struct op_call call =
+      op_start(FS_OP_COPY_RANGE, dst_fildes, dst_offset, len, NULL);
+  call.src_fd = src_fildes;
+  call.src_offset = src_offset;
+  if (src_offset < 0 || dst_offset < 0) {
+    fprintf(stderr, "fs_copy_range: invalid offset\n");
+    return op_end(&call, -1);
+  }
+  len = MIN(len, INT_MAX);
+  int src_inum;
+  int dst_inum = lock_files(src_fildes, dst_fildes,
+                            len / ctx->block_size + RESERVED_BLOCKS, &src_inum);
+  if (dst_inum == -1) {
+    return op_end(&call, -1);
+  }
+  int ret = unlock_files(src_inum, dst_inum,
+                         fs_copy_range_locked(src_fildes, src_offset,
+                                              dst_fildes, dst_offset, len));
+  return op_end(&call, ret);
+}
+
+// Copies up to len bytes at src_offset of one file to dst_offset of another,
+// or of the same file if the ranges do not overlap, without moving the
+// descriptors' offsets. The copy stops at the end of the source and grows
+// the destination as needed. Where both offsets are equally far into their
+// blocks, whole blocks are copied on the disk by copy_blocks; the rest goes
+// through a buffer of COPY_BUFFER_SIZE bytes.
+int fs_copy_range_locked(int src_fildes, off_t src_offset, int dst_fildes,
+                         off_t dst_offset, size_t len) {
+  struct file_descriptor src = *get_fd(src_fildes);
+  struct file_descriptor dst = *get_fd(dst_fildes);
+  int src_size = ctx->inode_table[src.inode_number].file_size;
+  int dst_size = ctx->inode_table[dst.inode_number].file_size;
+  if (src_offset > src_size || dst_offset > dst_size) {
+    fprintf(stderr, "fs_copy_range: offset exceeds file size\n");
     return -1;
   }
-  if (memvcmp(&block_buffer.super, 0, sizeof(sb))) {
-    fprintf(stderr, "mount_fs: file system not initialized\n");
+  len = MIN(len, (size_t)(src_size - src_offset));
+  len = MIN(len, (size_t)(MAX_FILE_SIZE - dst_offset));
+  if (src.inode_number == dst.inode_number && src_offset < dst_offset + len &&
+      dst_offset < src_offset + len) {
+    fprintf(stderr, "fs_copy_range: overlapping ranges\n");
     return -1;
   }
-  sb = block_buffer.super;
+  if (len == 0) {
+    return 0;
+  }
+  wait_async(); // for the source blocks still being written
+  src.offset = src_offset;
+  dst.offset = dst_offset;
+  size_t copied = 0;
+  if ((ctx->sb.features & FS_FEATURE_COMPRESSION) == 0 &&
+      src_offset % ctx->block_size == dst_offset % ctx->block_size) {
+    size_t head = MIN(len, (ctx->block_size - src_offset % ctx->block_size) %
+                               ctx->block_size);
+    int count = (len - head) / ctx->block_size;
+    if (head && (copied = copy_buffered(&src, &dst, head)) != head) {
+      return copied;
+    }
+    int blocks = count ? copy_blocks(&src, &dst, count) : 0;
+    if (blocks == -1) {
+      return -1;
+    }
+    copied += (size_t)blocks * ctx->block_size;
+    if (blocks < count) {
+      return copied;
+    }
+  }
+  size_t rest = copy_buffered(&src, &dst, len - copied);
+  return rest == (size_t)-1 ? -1 : (int)(copied + rest);
+}
 
-  // read directory table
-  if (block_read(sb.dir_table_offset, &block_buffer)) {
-    fprintf(stderr, "mount_fs: failed to read directory table\n");
+// Copies nbyte bytes from the offset of src to the offset of dst through a
+// buffer. Returns the bytes copied, fewer if the disk filled up, or -1.
+size_t copy_buffered(struct file_descriptor *src, struct file_descriptor *dst,
+                     size_t nbyte) {
+  char *buf = malloc(MIN(nbyte, COPY_BUFFER_SIZE));
+  size_t copied = 0;
+  if (buf == NULL) {
+    fprintf(stderr, "fs_copy_range: out of memory\n");
     return -1;
   }
-  memcpy(dir_table, block_buffer.dir_table, sizeof(dir_table));
+  while (copied < nbyte) {
+    size_t len = MIN(nbyte - copied, COPY_BUFFER_SIZE);
+    struct iovec iov = {buf, len};
+    struct iov_iter iter;
+    iter_init(&iter, &iov, 1);
+    if (read_fd(src, &iter, len) != (int)len) {
+      copied = -1;
+      break;
+    }
+    iter_init(&iter, &iov, 1);
+    int written = write_fd(dst, &iter, len);
+    if (written == -1) {
+      copied = -1;
+      break;
+    }
+    copied += written;
+    if (written < (int)len) {
+      break;
+    }
+  }
+  free(buf);
+  return copied;
+}
 
-  // read inode bitmap
-  if (block_read(sb.inode_metadata_offset, &block_buffer)) {
-    fprintf(stderr, "mount_fs: failed to read inode bitmap\n");
-    return -1;
+// Copies count whole blocks from the offset of src to the offset of dst,
+// both at a block boundary, a batch of blocks at a time. With
+// FS_FEATURE_DEDUP the destination shares the source's blocks; otherwise its
+// blocks are mapped by map_data_blocks and physically consecutive runs are
+// copied on the disk by block_copy, checksums carried over. Returns the
+// number of blocks copied, fewer if the disk filled up, or -1.
+int copy_blocks(struct file_descriptor *src, struct file_descriptor *dst,
+                int count) {
+  uint16_t src_block_nums[COPY_BATCH_BLOCKS];
+  uint16_t dst_block_nums[COPY_BATCH_BLOCKS];
+  bool is_dedup = ctx->sb.features & FS_FEATURE_DEDUP;
+  bool is_checksummed = ctx->sb.features & FS_FEATURE_CHECKSUM;
+  struct inode *dst_inode = &ctx->inode_table[dst->inode_number];
+  int copied = 0;
+  while (copied < count) {
+    int n = MIN(count - copied, COPY_BATCH_BLOCKS);
+    int dst_block_idx = dst->offset / ctx->block_size;
+    if (get_data_block_nums(src->inode_number, src->offset / ctx->block_size, n,
+                            src_block_nums)) {
+      fprintf(stderr, "fs_copy_range: failed to get data block numbers\n");
+      return -1;
+    }
+    int mapped =
+        is_dedup
+            ? share_data_blocks(dst->inode_number, dst_block_idx, n,
+                                src_block_nums)
+            : map_data_blocks(dst->inode_number, dst_block_idx, n,
+                              dst_block_nums);
+    if (mapped == 1) {
+      break;
+    }
+    if (mapped) {
+      return -1;
+    }
+    for (int i = 0; is_dedup == false && i < n;) {
+      int run = 1;
+      while (i + run < n &&
+             src_block_nums[i + run] == src_block_nums[i] + run &&
+             dst_block_nums[i + run] == dst_block_nums[i] + run) {
+        run++;
+      }
+      assert(src_block_nums[i] >= ctx->sb.data_offset);
+      if (block_copy(src_block_nums[i], dst_block_nums[i], run)) {
+        fprintf(stderr, "fs_copy_range: failed to copy data blocks %d-%d\n",
+                src_block_nums[i], src_block_nums[i] + run - 1);
+        return -1;
+      }
+      for (int j = i; is_checksummed && j < i + run; j++) {
+        ctx->block_checksums[dst_block_nums[j]] =
+            ctx->block_checksums[src_block_nums[j]];
+        mark_dirty(&ctx->block_checksums[dst_block_nums[j]], sizeof(uint32_t));
+      }
+      i += run;
+    }
+    copied += n;
+    src->offset += n * ctx->block_size;
+    dst->offset += n * ctx->block_size;
+    if (dst->offset > dst_inode->file_size) {
+      dst_inode->file_size = dst->offset;
+      mark_dirty(dst_inode, INODE_SIZE);
+    }
   }
-  memcpy(inode_bitmap, block_buffer.inode_bitmap, sizeof(inode_bitmap));
+  return copied;
+}
 
-  // read used block bitmap
-  if (block_read(sb.used_block_bitmap_offset, &block_buffer)) {
-    fprintf(stderr, "mount_fs: failed to read used block bitmap\n");
+// Maps count data blocks of inode inum, starting at block index
+// first_block_idx, to block_nums, which other files hold, taking a reference
+// on each. Returns 1, with nothing changed, if the disk cannot hold the
+// indirect blocks the mapping may need.
+int share_data_blocks(uint16_t inum, int first_block_idx, int count,
+                      const uint16_t *block_nums) {
+  uint16_t old_block_nums[COPY_BATCH_BLOCKS];
+  assert(count <= COPY_BATCH_BLOCKS);
+  if (get_data_block_nums(inum, first_block_idx, count, old_block_nums)) {
+    fprintf(stderr, "share_data_blocks: failed to get data block numbers\n");
     return -1;
   }
-  memcpy(used_block_bitmap, block_buffer.used_block_bitmap,
-         sizeof(used_block_bitmap));
-
-  // read inode table
-  if (block_read(sb.inode_offset, &block_buffer)) {
-    fprintf(stderr, "mount_fs: failed to read inodes\n");
+  int reserve = 2 * (count / DIRECT_OFFSETS_PER_BLOCK + 3);
+  if (claim_data_blocks(0, reserve, NULL)) {
+    return 1;
+  }
+  lock_alloc();
+  if (load_dedup_index()) {
+    unlock_alloc();
     return -1;
   }
-  memcpy(inode_table, block_buffer.inode_table, sizeof(inode_table));
-
-  is_mounted = true;
+  for (int i = 0; i < count; i++) {
+    assert(block_nums[i] >= ctx->sb.data_offset);
+    if (block_nums[i] != old_block_nums[i]) {
+      ctx->block_refcount[block_nums[i]] =
+          MAX(ctx->block_refcount[block_nums[i]], 1) + 1;
+      mark_dirty(&ctx->block_refcount[block_nums[i]], sizeof(uint16_t));
+    }
+  }
+  unlock_alloc();
+  if (set_data_block_nums(inum, first_block_idx, count, block_nums)) {
+    fprintf(stderr, "share_data_blocks: failed to update block map\n");
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    if (old_block_nums[i] && old_block_nums[i] != block_nums[i] &&
+        release_data_block(old_block_nums[i])) {
+      return -1;
+    }
+  }
   return 0;
 }
 
-int umount_fs(const char *disk_name) {
-  if (is_mounted == false) {
-    fprintf(stderr, "umount_fs: file system not mounted\n");
-    return -1;
+int fs_map(int fildes, off_t offset, size_t len, const void **ptr) {
+  struct op_call call = op_start(FS_OP_MAP, fildes, offset, len, NULL);
+  int inum = lock_file("fs_map", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
+  int ret = unlock_file(inum, false, fs_map_locked(fildes, offset, len, ptr));
+  return op_end(&call, ret);
+}
 
-  union fs_block block_buffer;
-  memset(&block_buffer, 0, BLOCK_SIZE);
-
-  // write super block
-  block_buffer.super = sb;
-  if (block_write(0, &block_buffer)) {
-    fprintf(stderr, "umount_fs: failed to write super block\n");
+// Hands out up to len bytes at offset of the file as one read-only range,
+// without moving the descriptor's offset. A range in consecutive blocks is
+// the disk's own pages, mapped and pinned, so the caller reads the file
+// without a copy; other ranges, and those of compressed files, are read
+// into memory once, as are all ranges of a shared mount, whose blocks other
+// processes could change. Returns the bytes in the range, fewer than len at
+// the end of the file.
+int fs_map_locked(int fildes, off_t offset, size_t len, const void **ptr) {
+  uint16_t inum = get_fd(fildes)->inode_number;
+  int file_size = ctx->inode_table[inum].file_size;
+  if (offset < 0 || offset >= file_size || len == 0) {
+    fprintf(stderr, "fs_map: invalid range\n");
     return -1;
   }
-
-  // write directory table
-  memset(&block_buffer, 0, BLOCK_SIZE);
-  memcpy(block_buffer.dir_table, dir_table, sizeof(dir_table));
-  if (block_write(sb.dir_table_offset, &block_buffer)) {
-    fprintf(stderr, "umount_fs: failed to write directory table\n");
+  len = MIN(len, (size_t)(file_size - offset));
+  struct mapping *m = NULL;
+  if ((ctx->sb.features & FS_FEATURE_COMPRESSION) == 0 &&
+      ctx->shared == NULL) {
+    m = map_blocks(inum, offset, len);
+  }
+  if (m == NULL) {
+    m = map_copy(fildes, offset, len);
+  }
+  if (m == NULL) {
     return -1;
   }
+  pthread_mutex_lock(&ctx->map_lock);
+  m->next = ctx->mappings;
+  ctx->mappings = m;
+  pthread_mutex_unlock(&ctx->map_lock);
+  *ptr = m->ptr;
+  return len;
+}
 
-  // write inode bitmap
-  memset(&block_buffer, 0, BLOCK_SIZE);
-  memcpy(block_buffer.inode_bitmap, inode_bitmap, sizeof(inode_bitmap));
-  if (block_write(sb.inode_metadata_offset, &block_buffer)) {
-    fprintf(stderr, "umount_fs: failed to write inode bitmap\n");
-    return -1;
+// Maps the blocks holding len bytes at offset of inode inum and pins them,
+// if they are consecutive on the disk and pass their checksums; NULL
+// otherwise.
+struct mapping *map_blocks(uint16_t inum, int offset, int len) {
+  int first_idx = offset / ctx->block_size;
+  int count = (offset + len - 1) / ctx->block_size - first_idx + 1;
+  uint16_t *block_nums = malloc(count * sizeof(uint16_t));
+  struct mapping *m = malloc(sizeof(*m));
+  char *mem = NULL;
+  if (block_nums == NULL || m == NULL ||
+      get_data_block_nums(inum, first_idx, count, block_nums)) {
+    goto fail;
+  }
+  for (int i = 1; i < count; i++) {
+    if (block_nums[i] != block_nums[0] + i) {
+      goto fail;
+    }
+  }
+  assert(block_nums[0] >= ctx->sb.data_offset);
+  mem = block_map(block_nums[0], count);
+  for (int i = 0; mem && i < count; i++) {
+    if (verify_block_checksum(block_nums[i], mem + i * ctx->block_size)) {
+      goto fail;
+    }
+  }
+  if (mem == NULL) {
+    goto fail;
   }
+  lock_alloc();
+  for (int i = 0; i < count; i++) {
+    __atomic_add_fetch(&ctx->block_pins[block_nums[i]], 1, __ATOMIC_RELAXED);
+  }
+  unlock_alloc();
+  m->ptr = mem + offset % ctx->block_size;
+  m->mem = mem;
+  m->first_block = block_nums[0];
+  m->count = count;
+  free(block_nums);
+  return m;
+fail:
+  if (mem) {
+    block_unmap(mem, count);
+  }
+  free(block_nums);
+  free(m);
+  return NULL;
+}
 
-  // write used block bitmap
-  memset(&block_buffer, 0, BLOCK_SIZE);
-  memcpy(block_buffer.used_block_bitmap, used_block_bitmap,
-         sizeof(used_block_bitmap));
-  if (block_write(sb.used_block_bitmap_offset, &block_buffer)) {
-    fprintf(stderr, "umount_fs: failed to write used block bitmap\n");
-    return -1;
+// Reads len bytes at offset of the file open as fildes into a new copy.
+struct mapping *map_copy(int fildes, int offset, int len) {
+  struct mapping *m = malloc(sizeof(*m));
+  char *mem = malloc(len);
+  if (m == NULL || mem == NULL) {
+    fprintf(stderr, "fs_map: out of memory\n");
+    goto fail;
   }
+  struct file_descriptor fd = *get_fd(fildes);
+  struct iovec iov = {mem, len};
+  struct iov_iter iter;
+  fd.offset = offset;
+  iter_init(&iter, &iov, 1);
+  if (read_fd(&fd, &iter, len) != len) {
+    goto fail;
+  }
+  m->ptr = mem;
+  m->mem = mem;
+  m->first_block = -1;
+  m->count = 0;
+  return m;
+fail:
+  free(mem);
+  free(m);
+  return NULL;
+}
 
-  // write inode table
-  memset(&block_buffer, 0, BLOCK_SIZE);
-  memcpy(block_buffer.inode_table, inode_table, sizeof(inode_table));
-  if (block_write(sb.inode_offset, &block_buffer)) {
-    fprintf(stderr, "umount_fs: failed to write inodes\n");
-    return -1;
+int fs_unmap(const void *ptr) {
+  struct op_call call = op_start(FS_OP_UNMAP, -1, -1, 0, NULL);
+  lock_mount(false);
+  struct mapping *m = NULL;
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_unmap: file system not mounted\n");
+  } else {
+    pthread_mutex_lock(&ctx->map_lock);
+    struct mapping **prev = &ctx->mappings;
+    while (*prev && (*prev)->ptr != ptr) {
+      prev = &(*prev)->next;
+    }
+    if ((m = *prev)) {
+      *prev = m->next;
+    }
+    pthread_mutex_unlock(&ctx->map_lock);
+    if (m == NULL) {
+      fprintf(stderr, "fs_unmap: not a mapped range\n");
+    }
   }
+  int ret = m ? release_mapping(m) : -1;
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
 
-  if (close_disk()) {
-    fprintf(stderr, "umount_fs: close_disk failed\n");
-    return -1;
+// Unmaps m and unpins its blocks, freeing the ones freed while pinned.
+int release_mapping(struct mapping *m) {
+  int ret = 0;
+  if (m->first_block == -1) {
+    free(m->mem);
+    free(m);
+    return 0;
+  }
+  ret = block_unmap(m->mem, m->count);
+  lock_alloc();
+  for (int i = m->first_block; i < m->first_block + m->count; i++) {
+    if (__atomic_sub_fetch(&ctx->block_pins[i], 1, __ATOMIC_RELAXED) == 0 &&
+        bitmap_test(ctx->pinned_free_bitmap, i)) {
+      bitmap_set(ctx->pinned_free_bitmap, i, 0);
+      ret |= free_data_block(i);
+    }
   }
+  unlock_alloc();
+  free(m);
+  return ret;
+}
 
-  memset(fds, 0, sizeof(fds));
-  is_mounted = false;
-  return 0;
+// Releases the mappings still held, whose ranges become invalid.
+int release_mappings() {
+  int ret = 0;
+  while (ctx->mappings) {
+    struct mapping *m = ctx->mappings;
+    ctx->mappings = m->next;
+    ret |= release_mapping(m);
+  }
+  return ret;
 }
 
-int fs_open(const char *name) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_open: file system not mounted\n");
-    return -1;
+int fs_advise(int fildes, off_t offset, size_t len, int advice) {
+  struct op_call call = op_start(FS_OP_ADVISE, fildes, offset, len, NULL);
+  call.advice = advice;
+  int inum = lock_file("fs_advise", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
-  struct dir_entry *dentry = get_dentry(name);
-  if (dentry == NULL) {
-    fprintf(stderr, "fs_open: file not found\n");
+  int ret =
+      unlock_file(inum, false, fs_advise_locked(fildes, offset, len, advice));
+  return op_end(&call, ret);
+}
+
+// Records how the file will be read through the descriptor, or acts on the
+// len bytes at offset, up to the end of the file if len is 0: WILLNEED
+// resolves their block map, reading the indirect blocks it takes, and starts
+// loading the blocks into the host's page cache; DONTNEED lets it drop them.
+int fs_advise_locked(int fildes, off_t offset, size_t len, int advice) {
+  struct file_descriptor *fd = get_fd(fildes);
+  int file_size = ctx->inode_table[fd->inode_number].file_size;
+  if (offset < 0 || offset > file_size) {
+    fprintf(stderr, "fs_advise: invalid range\n");
     return -1;
   }
-  for (int fildes = 0; fildes < MAX_FD; fildes++) {
-    struct file_descriptor *fd = &fds[fildes];
-    if (fd->is_used == false) {
-      fd->is_used = true;
-      fd->inode_number = dentry->inode_number;
-      fd->offset = 0;
-      return fildes;
+  len = len == 0 ? (size_t)(file_size - offset)
+                 : MIN(len, (size_t)(file_size - offset));
+  switch (advice) {
+  case FS_ADVICE_NORMAL:
+  case FS_ADVICE_SEQUENTIAL:
+  case FS_ADVICE_RANDOM:
+    fd->advice = advice;
+    fd->readahead_start = fd->readahead_end = fd->readahead_size = 0;
+    return 0;
+  case FS_ADVICE_WILLNEED:
+    return advise_blocks(fd->inode_number, offset, len, true);
+  case FS_ADVICE_DONTNEED:
+    return advise_blocks(fd->inode_number, offset, len, false);
+  }
+  fprintf(stderr, "fs_advise: unknown advice\n");
+  return -1;
+}
+
+// Asks the host to load, or to drop, the data blocks holding the len bytes at
+// offset of inode inum, one run of consecutive blocks at a time. Compressed
+// files are advised whole clusters at a time.
+int advise_blocks(uint16_t inum, int offset, int len, bool is_prefetch) {
+  struct fs_stats *stats = &stats_shard()->stats;
+  uint16_t block_nums[READ_BATCH_BLOCKS];
+  if (len <= 0) {
+    return 0;
+  }
+  int first_block_idx = offset / ctx->block_size;
+  int last_block_idx = (offset + len - 1) / ctx->block_size;
+  if (ctx->sb.features & FS_FEATURE_COMPRESSION) {
+    first_block_idx -= first_block_idx % COMPRESSION_CLUSTER_BLOCKS;
+    last_block_idx |= COMPRESSION_CLUSTER_BLOCKS - 1;
+  }
+  for (int idx = first_block_idx; idx <= last_block_idx;
+       idx += READ_BATCH_BLOCKS) {
+    int count = MIN(last_block_idx - idx + 1, READ_BATCH_BLOCKS);
+    if (get_data_block_nums(inum, idx, count, block_nums)) {
+      fprintf(stderr, "advise_blocks: failed to get data block numbers\n");
+      return -1;
+    }
+    for (int i = 0; i < count;) {
+      int run = 1;
+      while (i + run < count && block_nums[i + run] == block_nums[i] + run) {
+        run++;
+      }
+      // holes and the unused ends of compressed clusters are 0
+      if (block_nums[i] && is_prefetch) {
+        if (block_prefetch(block_nums[i], run)) {
+          return -1;
+        }
+        stat_add(&stats->prefetched_blocks, run);
+      } else if (block_nums[i]) {
+        if (block_evict(block_nums[i], run)) {
+          return -1;
+        }
+        stat_add(&stats->evicted_blocks, run);
+      }
+      i += run;
     }
   }
-  fprintf(stderr, "fs_open: no available file descriptors\n");
-  return -1;
-}
-
-int fs_close(int fildes) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_close: file system not mounted\n");
-    return -1;
-  }
-  struct file_descriptor *fd = &fds[fildes];
-  if (fd->is_used == false) {
-    fprintf(stderr, "fs_close: file descriptor not in use\n");
-    return -1;
-  }
-  fd->is_used = false;
-  fd->inode_number = -1;
-  fd->offset = 0;
   return 0;
 }
 
-int fs_create(const char *name) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_create: file system not mounted\n");
-    return -1;
-  }
-  if (strlen(name) == 0 || strlen(name) > MAX_FILE_NAME_CHAR) {
-    fprintf(stderr, "fs_create: invalid file name\n");
-    return -1;
+// Prefetches past a read of nbyte bytes at the offset of fd. A read within
+// the readahead range continues it; without advice, only a read continuing
+// where an earlier one ended starts prefetching, and a read elsewhere starts
+// the range over. Prefetching is due once the read comes within half of
+// readahead_size of the prefetched end, and readahead_size doubles each time
+// up to READAHEAD_MAX_SIZE. Descriptors advised FS_ADVICE_RANDOM prefetch
+// nothing. Readahead is a hint, so its failures leave the read alone.
+void readahead_fd(struct file_descriptor *fd, size_t nbyte) {
+  if (fd->advice == FS_ADVICE_RANDOM) {
+    return;
   }
-  if (get_dentry(name)) {
-    fprintf(stderr, "fs_create: file already exists\n");
-    return -1;
+  int file_size = ctx->inode_table[fd->inode_number].file_size;
+  int end = MIN((size_t)fd->offset + nbyte, (size_t)file_size);
+  if (fd->offset < fd->readahead_start || fd->offset > fd->readahead_end ||
+      fd->readahead_size == 0) {
+    bool is_continued = fd->readahead_size == 0 && fd->readahead_end &&
+                        fd->offset == fd->readahead_end;
+    fd->readahead_start = fd->offset;
+    fd->readahead_end = end;
+    if (fd->advice != FS_ADVICE_SEQUENTIAL && is_continued == false) {
+      fd->readahead_size = 0;
+      return;
+    }
+    fd->readahead_size = READAHEAD_MIN_SIZE;
   }
-  if (bitmap_full(inode_bitmap, sizeof(inode_bitmap))) {
-    fprintf(stderr, "fs_create: root directory is full\n");
-    return -1;
+  if (end + fd->readahead_size / 2 <= fd->readahead_end) {
+    return;
   }
-  int inum = claim_inum_from_bitmap();
-  assert(inum != -1);
-  struct dir_entry *dentry = claim_dentry(inum, name);
-  assert(dentry != NULL);
-  int free_block_num = claim_unused_data_block();
-  if (free_block_num == -1) {
-    fprintf(stderr, "fs_create: no free blocks\n");
-    return -1;
+  int prefetch_end = MIN((size_t)end + fd->readahead_size, (size_t)file_size);
+  if (prefetch_end > fd->readahead_end) {
+    advise_blocks(fd->inode_number, fd->readahead_end,
+                  prefetch_end - fd->readahead_end, true);
+    fd->readahead_end = prefetch_end;
   }
-  assert(free_block_num >= sb.data_offset);
-  struct inode *inode = &inode_table[inum];
-  inode->direct_offset[0] = free_block_num;
-  inode->file_size = 0;
-  return 0;
+  fd->readahead_size = MIN(2 * fd->readahead_size, READAHEAD_MAX_SIZE);
 }
 
-int fs_delete(const char *name) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_delete: file system not mounted\n");
-    return -1;
+// Lets the host drop the whole blocks, or clusters of a compressed file, a
+// descriptor advised FS_ADVICE_SEQUENTIAL has read past, so that a scan does
+// not push other files out of its page cache.
+void evict_behind(struct file_descriptor *fd) {
+  int unit = ctx->sb.features & FS_FEATURE_COMPRESSION
+                 ? COMPRESSION_CLUSTER_SIZE
+                 : ctx->block_size;
+  int done = fd->offset - fd->offset % unit;
+  if (done > fd->readahead_start) {
+    advise_blocks(fd->inode_number, fd->readahead_start,
+                  done - fd->readahead_start, false);
+    fd->readahead_start = done;
   }
-  struct dir_entry *dentry = get_dentry(name);
-  if (dentry == NULL) {
-    fprintf(stderr, "fs_delete: file not found\n");
-    return -1;
+}
+
+int fs_read_async(int fildes, void *buf, size_t nbyte, uint64_t user_data) {
+  struct op_call call = op_start(FS_OP_READ_ASYNC, fildes, -1, nbyte, NULL);
+  int inum = lock_file("fs_read_async", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
-  for (int fildes = 0; fildes < MAX_FD; fildes++) {
-    struct file_descriptor *fd = &fds[fildes];
-    if (fd->is_used && dentry->inode_number == fd->inode_number) {
-      fprintf(stderr, "fs_delete: file is open\n");
+  call.offset = get_fd(fildes)->offset;
+  int ret = unlock_file(inum, false,
+                        fs_read_async_locked(fildes, buf, nbyte, user_data));
+  return op_end(&call, ret);
+}
+
+// Resolves the block map and queues a disk request per run of physically
+// consecutive blocks. Blocks buf covers only part of are read into the bounce
+// blocks of the request. Compressed files are read right away.
+int fs_read_async_locked(int fildes, void *buf, size_t nbyte,
+                         uint64_t user_data) {
+  struct file_descriptor *fd = get_fd(fildes);
+  struct async_request *request;
+  nbyte = MIN(nbyte, ctx->inode_table[fd->inode_number].file_size - fd->offset);
+  if ((ctx->sb.features & FS_FEATURE_COMPRESSION) || nbyte == 0) {
+    int bytes_read = nbyte ? fs_read_locked(fildes, buf, nbyte) : 0;
+    if (bytes_read == -1 ||
+        (request = new_async_request(user_data, bytes_read, 0)) == NULL) {
       return -1;
     }
+    return submit_async(request);
   }
-  struct inode *inode = &inode_table[dentry->inode_number];
-  union fs_block empty_block;
-  memset(&empty_block, 0, BLOCK_SIZE);
-  for (int i = 0; i < DIRECT_OFFSETS_PER_INODE; i++) {
-    if (inode->direct_offset[i]) {
-      if (block_write(inode->direct_offset[i], &empty_block)) {
-        fprintf(stderr, "fs_delete: failed to clear data block %d\n",
-                inode->direct_offset[i]);
-        return -1;
-      }
-      bitmap_set(used_block_bitmap, inode->direct_offset[i], 0);
-      inode->direct_offset[i] = 0;
+  int first_block_idx = fd->offset / ctx->block_size;
+  int offset_in_block = fd->offset % ctx->block_size;
+  size_t end = offset_in_block + nbyte;
+  int count = (end - 1) / ctx->block_size + 1;
+  uint16_t *block_nums = malloc(count * sizeof(uint16_t));
+  request = new_async_request(user_data, nbyte, count);
+  if (block_nums == NULL || request == NULL) {
+    fprintf(stderr, "fs_read_async: out of memory\n");
+    goto err;
+  }
+  request->is_read = true;
+  if (get_data_block_nums(fd->inode_number, first_block_idx, count,
+                          block_nums)) {
+    fprintf(stderr, "fs_read_async: failed to get data block numbers\n");
+    goto err;
+  }
+  // verified on the disk queue's threads, which must not load it
+  if ((ctx->sb.features & FS_FEATURE_CHECKSUM) &&
+      require_region(ctx->block_checksums)) {
+    goto err;
+  }
+  char *data = buf;
+  for (int i = 0; i < count;) {
+    if (block_nums[i] < ctx->sb.data_offset) {
+      fprintf(stderr, "fs_read_async: no data block found for offset\n");
+      goto err;
+    }
+    size_t block_start = (size_t)i * ctx->block_size;
+    if (block_start < offset_in_block || block_start + ctx->block_size > end) {
+      union fs_block *bounce = &request->bounce[i == 0 ? 0 : 1];
+      struct async_part *part =
+          add_async_part(request, block_nums[i], 1, bounce, false);
+      size_t start = MAX(block_start, offset_in_block);
+      part->copy_to = data + start - offset_in_block;
+      part->copy_from = start - block_start;
+      part->copy_len = MIN(end, block_start + ctx->block_size) - start;
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (i + run < count && block_nums[i + run] == block_nums[i] + run &&
+           block_start + (size_t)(run + 1) * ctx->block_size <= end) {
+      run++;
     }
+    add_async_part(request, block_nums[i], run,
+                   data + block_start - offset_in_block, false);
+    i += run;
   }
-  if (inode->single_indirect_offset) {
-    if (clear_indirect_block(inode->single_indirect_offset,
-                             SINGLE_INDIRECTION)) {
-      fprintf(stderr, "fs_delete: failed to clear single indirect block\n");
+  free(block_nums);
+  fd->offset += nbyte;
+  // other processes must not move the blocks before they are read
+  lock_file_data(fd->inode_number, false, true);
+  request->data_inum = fd->inode_number;
+  return submit_async(request);
+err:
+  free(block_nums);
+  free(request);
+  return -1;
+}
+
+int fs_write_async(int fildes, void *buf, size_t nbyte, uint64_t user_data) {
+  struct op_call call = op_start(FS_OP_WRITE_ASYNC, fildes, -1, nbyte, NULL);
+  int inum = lock_file("fs_write_async", fildes, true,
+                       nbyte / ctx->block_size + RESERVED_BLOCKS);
+  if (inum == -1) {
+    return op_end(&call, -1);
+  }
+  call.offset = get_fd(fildes)->offset;
+  int ret = unlock_file(inum, true,
+                        fs_write_async_locked(fildes, buf, nbyte, user_data));
+  return op_end(&call, ret);
+}
+
+// Maps the whole blocks of the write up front, like write_bytes_parallel, and
+// queues a disk request per run of consecutive blocks; their checksums and
+// the file size are updated right away. The partial blocks at either end are
+// read, changed and written before returning. Writes that compress,
+// deduplicate or do not fit on the disk are done right away as well.
+int fs_write_async_locked(int fildes, void *buf, size_t nbyte,
+                          uint64_t user_data) {
+  struct file_descriptor *fd = get_fd(fildes);
+  uint16_t inum = fd->inode_number;
+  const char *data = buf;
+  nbyte = MIN(nbyte, MAX_FILE_SIZE - fd->offset);
+  size_t head = MIN(nbyte, (ctx->block_size - fd->offset % ctx->block_size) %
+                               ctx->block_size);
+  int first_block_idx = (fd->offset + head) / ctx->block_size;
+  int count = (nbyte - head) / ctx->block_size;
+  size_t tail = nbyte - head - (size_t)count * ctx->block_size;
+  struct async_request *request = NULL;
+  uint16_t *block_nums = NULL;
+  struct iovec iov = {buf, nbyte};
+  struct iov_iter iter;
+  int mapped = 1;
+  iter_init(&iter, &iov, 1);
+  if ((ctx->sb.features & (FS_FEATURE_COMPRESSION | FS_FEATURE_DEDUP)) == 0 &&
+      count > 0) {
+    block_nums = malloc(count * sizeof(uint16_t));
+    if (block_nums == NULL) {
+      fprintf(stderr, "fs_write_async: out of memory\n");
       return -1;
     }
-    inode->single_indirect_offset = 0;
+    mapped = map_data_blocks(inum, first_block_idx, count, block_nums);
   }
-  if (inode->double_indirect_offset) {
-    if (clear_indirect_block(inode->double_indirect_offset,
-                             DOUBLE_INDIRECTION)) {
-      fprintf(stderr, "fs_delete: failed to clear double indirect block\n");
+  if (mapped == 1) {
+    free(block_nums);
+    int bytes_written = fs_write_locked(fildes, buf, nbyte);
+    if (bytes_written == -1 ||
+        (request = new_async_request(user_data, bytes_written, 0)) == NULL) {
       return -1;
     }
-    inode->double_indirect_offset = 0;
+    return submit_async(request);
   }
-  bitmap_set(inode_bitmap, dentry->inode_number, 0);
-  clear_dentry(dentry);
-  inode->file_size = 0;
-  return 0;
-}
-
-int fs_read(int fildes, void *buf, size_t nbyte) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_read: file system not mounted\n");
-    return -1;
+  if (mapped || (head && write_bytes_at(fd, &iter, head) != head)) {
+    goto err;
   }
-  struct file_descriptor *fd = &fds[fildes];
-  if (fd->is_used == false) {
-    fprintf(stderr, "fs_read: invalid file descriptor\n");
-    return -1;
+  if ((request = new_async_request(user_data, nbyte, count)) == NULL) {
+    goto err;
   }
-  int start_block = get_data_block_num(fd->inode_number, fd->offset);
-  if (start_block <= 0) {
-    fprintf(stderr, "fs_read: no data block found for offset\n");
-    return -1;
+  bool is_checksummed = ctx->sb.features & FS_FEATURE_CHECKSUM;
+  for (int i = 0; i < count;) {
+    int run = 1;
+    while (i + run < count && block_nums[i + run] == block_nums[i] + run) {
+      run++;
+    }
+    const char *run_data = data + head + (size_t)i * ctx->block_size;
+    for (int j = 0; is_checksummed && j < run; j++) {
+      ctx->block_checksums[block_nums[i] + j] =
+          block_checksum(run_data + (size_t)j * ctx->block_size);
+      mark_dirty(&ctx->block_checksums[block_nums[i] + j], sizeof(uint32_t));
+    }
+    add_async_part(request, block_nums[i], run, (void *)run_data, true);
+    i += run;
   }
-  size_t bytes_read = read_bytes(start_block, fd, buf, nbyte);
-  return bytes_read;
+  fd->offset += (size_t)count * ctx->block_size;
+  if (fd->offset > ctx->inode_table[inum].file_size) {
+    ctx->inode_table[inum].file_size = fd->offset;
+    mark_dirty(&ctx->inode_table[inum], INODE_SIZE);
+  }
+  iter_advance(&iter, (size_t)count * ctx->block_size);
+  if (tail && write_bytes_at(fd, &iter, tail) != tail) {
+    goto err;
+  }
+  free(block_nums);
+  return submit_async(request);
+err:
+  free(block_nums);
+  free(request);
+  return -1;
 }
 
-int fs_write(int fildes, void *buf, size_t nbyte) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_write: file system not mounted\n");
-    return -1;
-  }
-  struct file_descriptor *fd = &fds[fildes];
-  if (fd->is_used == false) {
-    fprintf(stderr, "fs_read: invalid file descriptor\n");
-    return -1;
-  };
-  int start_block = get_data_block_num(fd->inode_number, fd->offset);
-  if (start_block == -1) {
-    fprintf(stderr, "fs_write: failed to get data block number\n");
+int fs_poll_completions(struct fs_completion *completions, int max,
+                        int min_complete) {
+  lock_mount(false);
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_poll_completions: file system not mounted\n");
+    pthread_rwlock_unlock(&ctx->mount_lock);
     return -1;
   }
-  if (start_block == 0) {
-    start_block = claim_unused_data_block();
-    if (start_block <= 0) {
-      fprintf(stderr, "fs_write: failed to get unused data block\n");
-      return -1;
+  int n = 0;
+  pthread_mutex_lock(&ctx->async_lock);
+  while (n < max) {
+    struct async_request *request = ctx->async_completed;
+    if (request == NULL) {
+      // nothing in flight could satisfy the wait
+      if (n >= min_complete || ctx->async_inflight == 0) {
+        break;
+      }
+      pthread_cond_wait(&ctx->async_cond, &ctx->async_lock);
+      continue;
     }
-    add_inode_data_block(fd->inode_number, start_block);
+    if ((ctx->async_completed = request->next) == NULL) {
+      ctx->async_completed_tail = NULL;
+    }
+    completions[n].user_data = request->user_data;
+    completions[n].result = request->result;
+    n++;
+    free(request);
   }
-  size_t bytes_written = write_bytes(start_block, fd, buf, nbyte);
-  return bytes_written;
+  pthread_mutex_unlock(&ctx->async_lock);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return n;
+}
+
+int fs_set_write_threads(int threads) {
+  lock_mount(false);
+  __atomic_store_n(&ctx->write_threads, threads, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return 0;
 }
 
 int fs_get_filesize(int fildes) {
-  struct file_descriptor *fd = &fds[fildes];
-  if (fd->is_used == false) {
-    fprintf(stderr, "fs_get_filesize: invalid file descriptor\n");
-    return -1;
+  struct op_call call = op_start(FS_OP_GET_FILESIZE, fildes, -1, 0, NULL);
+  int inum = lock_file("fs_get_filesize", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
-  return inode_table[fd->inode_number].file_size;
+  int ret = unlock_file(inum, false, ctx->inode_table[inum].file_size);
+  return op_end(&call, ret);
 }
 
 int fs_listfiles(char ***files) {
+  struct op_call call = op_start(FS_OP_LISTFILES, -1, -1, 0, NULL);
+  lock_mount(false);
+  int ret = -1;
+  if (lock_shared("fs_listfiles", false) == 0) {
+    pthread_mutex_lock(&ctx->dir_lock);
+    ret = fs_listfiles_locked(files);
+    pthread_mutex_unlock(&ctx->dir_lock);
+    ret = unlock_shared(false, ret);
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int fs_listfiles_locked(char ***files) {
   *files = calloc(MAX_FILES, sizeof(char *));
   char **file_name_ptr = *files;
   for (int i = 0; i < MAX_FILES; i++) {
-    if (dir_table[i].is_used) {
-      if (strlen(dir_table[i].name) == 0) {
+    if (ctx->dir_table[i].is_used) {
+      if (strlen(ctx->dir_table[i].name) == 0) {
         fprintf(stderr, "fs_listfiles: invalid file name\n");
         return -1;
       }
-      *file_name_ptr = strdup(dir_table[i].name);
+      *file_name_ptr = strdup(ctx->dir_table[i].name);
       file_name_ptr++;
     }
   }
@@ -803,16 +6849,22 @@ int fs_listfiles(char ***files) {
 }
 
 int fs_lseek(int fildes, off_t offset) {
+  struct op_call call = op_start(FS_OP_LSEEK, fildes, offset, 0, NULL);
   if (offset < 0) {
     fprintf(stderr, "fs_lseek: invalid offset\n");
-    return -1;
+    return op_end(&call, -1);
   };
-  struct file_descriptor *fd = &fds[fildes];
-  if (fd->is_used == false) {
-    fprintf(stderr, "fs_lseek: invalid file descriptor\n");
-    return -1;
+  int inum = lock_file("fs_lseek", fildes, false, 0);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
-  if (offset > inode_table[fd->inode_number].file_size) {
+  int ret = unlock_file(inum, false, fs_lseek_locked(fildes, offset));
+  return op_end(&call, ret);
+}
+
+int fs_lseek_locked(int fildes, off_t offset) {
+  struct file_descriptor *fd = get_fd(fildes);
+  if (offset > ctx->inode_table[fd->inode_number].file_size) {
     fprintf(stderr, "fs_lseek: offset exceeds file size\n");
     return -1;
   }
@@ -821,68 +6873,405 @@ int fs_lseek(int fildes, off_t offset) {
 }
 
 int fs_truncate(int fildes, off_t length) {
-  if (is_mounted == false) {
-    fprintf(stderr, "fs_truncate: file system not mounted\n");
-    return -1;
+  struct op_call call = op_start(FS_OP_TRUNCATE, fildes, length, 0, NULL);
+  int inum = lock_file("fs_truncate", fildes, true, RESERVED_BLOCKS);
+  if (inum == -1) {
+    return op_end(&call, -1);
   }
-  struct file_descriptor *fd = &fds[fildes];
-  if (fd->is_used == false) {
-    fprintf(stderr, "fs_truncate: invalid file descriptor\n");
-    return -1;
-  }
-  struct inode *inode = &inode_table[fd->inode_number];
+  int ret = unlock_file(inum, true, fs_truncate_locked(fildes, length));
+  return op_end(&call, ret);
+}
+
+int fs_truncate_locked(int fildes, off_t length) {
+  struct file_descriptor *fd = get_fd(fildes);
+  struct inode *inode = &ctx->inode_table[fd->inode_number];
   int file_size = inode->file_size;
   if (length < 0 || length > file_size) {
     fprintf(stderr, "fs_truncate: invalid length\n");
     return -1;
   }
-  // free data block starting from length
-  off_t offset = length;
-  union fs_block block_buffer;
-  while (offset < file_size) {
-    int cur_block_num = get_data_block_num(fd->inode_number, offset);
-    assert(cur_block_num >= sb.data_offset);
-    uint16_t offset_in_block = offset % BLOCK_SIZE;
-    if (block_read(cur_block_num, &block_buffer)) {
-      fprintf(stderr, "fs_truncate: failed to read data block %d\n",
-              cur_block_num);
-      return -1;
-    }
-    memset(block_buffer.data + offset_in_block, 0,
-           BLOCK_SIZE - offset_in_block);
-    if (offset_in_block == 0) {
-      bitmap_set(used_block_bitmap, cur_block_num, 0);
+  // free data blocks past the new end of file
+  int first_free_idx = (length + ctx->block_size - 1) / ctx->block_size;
+  if (ctx->sb.features & FS_FEATURE_COMPRESSION) {
+    // the cluster holding the new end of file is stored again at its new
+    // size, the clusters after it are freed whole
+    int cluster_idx = length / COMPRESSION_CLUSTER_SIZE;
+    int size_in_cluster = length % COMPRESSION_CLUSTER_SIZE;
+    if (size_in_cluster) {
+      char cluster[COMPRESSION_CLUSTER_SIZE];
+      if (read_cluster(fd->inode_number, cluster_idx, cluster) ||
+          write_cluster(fd->inode_number, cluster_idx, cluster,
+                        size_in_cluster)) {
+        fprintf(stderr, "fs_truncate: failed to rewrite last cluster\n");
+        return -1;
+      }
+      cluster_idx++;
     }
-    offset += BLOCK_SIZE - offset_in_block;
+    first_free_idx = cluster_idx * COMPRESSION_CLUSTER_BLOCKS;
   }
-  // walk inode table and free entries starting from length
-  int block_idx = length / BLOCK_SIZE;
-  off_t offset_in_block = length % BLOCK_SIZE;
-  while (block_idx < DIRECT_OFFSETS_PER_INODE) {
-    if (offset_in_block == 0) {
-      inode->direct_offset[block_idx] = 0;
-      bitmap_set(used_block_bitmap, inode->direct_offset[block_idx], 0);
+  for (int i = first_free_idx; i < DIRECT_OFFSETS_PER_INODE; i++) {
+    if (inode->direct_offset[i]) {
+      if (release_data_block(inode->direct_offset[i])) {
+        fprintf(stderr, "fs_truncate: failed to clear data block %d\n",
+                inode->direct_offset[i]);
+        return -1;
+      }
+      inode->direct_offset[i] = 0;
     }
-    block_idx++;
-    offset_in_block = 0;
   }
-  if (inode->single_indirect_offset) {
-    if (clear_indirect_block(inode->single_indirect_offset,
-                             SINGLE_INDIRECTION)) {
-      fprintf(stderr, "fs_truncate: failed to clear single indirect block\n");
-      return -1;
-    }
-    inode->single_indirect_offset = 0;
+  first_free_idx -= DIRECT_OFFSETS_PER_INODE;
+  if (truncate_indirect_block(&inode->single_indirect_offset,
+                              SINGLE_INDIRECTION, first_free_idx)) {
+    fprintf(stderr, "fs_truncate: failed to clear single indirect block\n");
+    return -1;
   }
-  if (inode->double_indirect_offset) {
-    if (clear_indirect_block(inode->double_indirect_offset,
-                             DOUBLE_INDIRECTION)) {
-      fprintf(stderr, "fs_truncate: failed to clear double indirect block\n");
-      return -1;
-    }
-    inode->double_indirect_offset = 0;
+  first_free_idx -= DIRECT_OFFSETS_PER_BLOCK;
+  if (truncate_indirect_block(&inode->double_indirect_offset,
+                              DOUBLE_INDIRECTION, first_free_idx)) {
+    fprintf(stderr, "fs_truncate: failed to clear double indirect block\n");
+    return -1;
   }
   fd->offset = MIN(fd->offset, length);
   inode->file_size = length;
+  mark_dirty(inode, INODE_SIZE);
+  return 0;
+}
+
+int fs_sync() {
+  struct op_call call = op_start(FS_OP_SYNC, -1, -1, 0, NULL);
+  lock_mount(false);
+  int ret = 0;
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_sync: file system not mounted\n");
+    ret = -1;
+  } else if (ctx->is_read_only == false) {
+    pthread_rwlock_wrlock(&ctx->op_lock);
+    ret = journal_commit();
+    pthread_rwlock_unlock(&ctx->op_lock);
+    if (ret || block_sync()) {
+      fprintf(stderr, "fs_sync: failed to commit\n");
+      ret = -1;
+    }
+  }
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int fs_fsync(int fildes) {
+  struct op_call call = op_start(FS_OP_FSYNC, fildes, -1, 0, NULL);
+  lock_mount(false);
+  int ret = fs_fsync_locked(fildes);
+  pthread_rwlock_unlock(&ctx->mount_lock);
+  return op_end(&call, ret);
+}
+
+int fs_fsync_locked(int fildes) {
+  if (ctx->is_mounted == false) {
+    fprintf(stderr, "fs_fsync: file system not mounted\n");
+    return -1;
+  }
+  struct file_descriptor *fd = get_fd(fildes);
+  int inum = fd && fd->is_used ? fd->inode_number : -1;
+  if (inum == -1) {
+    fprintf(stderr, "fs_fsync: invalid file descriptor\n");
+    return -1;
+  }
+  if (ctx->is_read_only) {
+    return 0;
+  }
+  // the data blocks of the file are already written, only its metadata may
+  // not be committed yet; the commit waits for the operations in progress
+  pthread_rwlock_wrlock(&ctx->op_lock);
+  int ret = journal_commit_inode(inum);
+  pthread_rwlock_unlock(&ctx->op_lock);
+  if (ret || block_sync()) {
+    fprintf(stderr, "fs_fsync: failed to commit\n");
+    return -1;
+  }
   return 0;
 }
+
+/*
+ * Context functions
+ */
+
+// Allocates a context and mounts disk_name in it with mount.
+struct fs_ctx *mount_ctx(const char *disk_name,
+                         int (*mount)(const char *disk_name)) {
+  struct fs_ctx *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    fprintf(stderr, "fs_mount: out of memory\n");
+    return NULL;
+  }
+  init_ctx(c);
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = mount(disk_name);
+  enter_ctx(prev);
+  if (ret) {
+    destroy_ctx(c);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+fs_ctx *fs_mount(const char *disk_name) {
+  return mount_ctx(disk_name, mount_fs);
+}
+
+fs_ctx *fs_mount_snapshot(const char *disk_name) {
+  return mount_ctx(disk_name, fs_snapshot_mount);
+}
+
+fs_ctx *fs_mount_shared(const char *disk_name) {
+  return mount_ctx(disk_name, mount_fs_shared);
+}
+
+int fs_unmount(fs_ctx *c) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = umount_fs(NULL);
+  enter_ctx(prev);
+  if (ret == 0) {
+    destroy_ctx(c);
+    free(c);
+  }
+  return ret;
+}
+
+int fs_ctx_open(fs_ctx *c, const char *name) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_open(name);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_close(fs_ctx *c, int fildes) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_close(fildes);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_create(fs_ctx *c, const char *name) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_create(name);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_delete(fs_ctx *c, const char *name) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_delete(name);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_read(fs_ctx *c, int fildes, void *buf, size_t nbyte) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_read(fildes, buf, nbyte);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_write(fs_ctx *c, int fildes, void *buf, size_t nbyte) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_write(fildes, buf, nbyte);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_readv(fs_ctx *c, int fildes, const struct iovec *iov, int iovcnt) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_readv(fildes, iov, iovcnt);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_writev(fs_ctx *c, int fildes, const struct iovec *iov, int iovcnt) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_writev(fildes, iov, iovcnt);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_copy_range(fs_ctx *c, int src_fildes, off_t src_offset,
+                      int dst_fildes, off_t dst_offset, size_t len) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_copy_range(src_fildes, src_offset, dst_fildes, dst_offset, len);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_map(fs_ctx *c, int fildes, off_t offset, size_t len,
+               const void **ptr) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_map(fildes, offset, len, ptr);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_advise(fs_ctx *c, int fildes, off_t offset, size_t len,
+                  int advice) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_advise(fildes, offset, len, advice);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_unmap(fs_ctx *c, const void *ptr) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_unmap(ptr);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_read_async(fs_ctx *c, int fildes, void *buf, size_t nbyte,
+                      uint64_t user_data) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_read_async(fildes, buf, nbyte, user_data);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_write_async(fs_ctx *c, int fildes, void *buf, size_t nbyte,
+                       uint64_t user_data) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_write_async(fildes, buf, nbyte, user_data);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_poll_completions(fs_ctx *c, struct fs_completion *completions,
+                            int max, int min_complete) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_poll_completions(completions, max, min_complete);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_set_write_threads(fs_ctx *c, int threads) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_set_write_threads(threads);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_get_filesize(fs_ctx *c, int fildes) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_get_filesize(fildes);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_listfiles(fs_ctx *c, char ***files) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_listfiles(files);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_lseek(fs_ctx *c, int fildes, off_t offset) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_lseek(fildes, offset);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_truncate(fs_ctx *c, int fildes, off_t length) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_truncate(fildes, length);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_sync(fs_ctx *c) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_sync();
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_fsync(fs_ctx *c, int fildes) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_fsync(fildes);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_snapshot_create(fs_ctx *c) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_snapshot_create();
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_snapshot_delete(fs_ctx *c) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_snapshot_delete();
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_dedup_stats(fs_ctx *c, struct fs_dedup_stats *stats) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_dedup_stats(stats);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_statfs(fs_ctx *c, struct fs_statfs *statfs) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_statfs(statfs);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_defrag(fs_ctx *c, const char *name,
+                  struct fs_defrag_report *report) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_defrag(name, report);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_defrag_all(fs_ctx *c, struct fs_defrag_report *report) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_defrag_all(report);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_clean(fs_ctx *c, struct fs_clean_report *report) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_clean(report);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_stats(fs_ctx *c, struct fs_stats *stats) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_stats(stats);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_stats_reset(fs_ctx *c) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_stats_reset();
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_trace_start(fs_ctx *c, const char *path) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_trace_start(path);
+  enter_ctx(prev);
+  return ret;
+}
+
+int fs_ctx_trace_stop(fs_ctx *c) {
+  struct fs_ctx *prev = enter_ctx(c);
+  int ret = fs_trace_stop();
+  enter_ctx(prev);
+  return ret;
+}
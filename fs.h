@@ -9,9 +9,185 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#define FS_FEATURE_COMPRESSION 0x1 /* compress file data in clusters */
+#define FS_FEATURE_DEDUP 0x2       /* share identical data blocks */
+#define FS_FEATURE_CHECKSUM 0x4    /* checksum data and indirect blocks */
+#define FS_FEATURE_LOG 0x8         /* append data and block maps to a log */
+
+/* Advice for fs_advise. The first three say how the file will be read
+ * through the descriptor, the last two act on the range given. */
+#define FS_ADVICE_NORMAL 0     /* prefetch once reads turn out sequential */
+#define FS_ADVICE_SEQUENTIAL 1 /* prefetch ahead and drop what was read */
+#define FS_ADVICE_RANDOM 2     /* prefetch nothing */
+#define FS_ADVICE_WILLNEED 3   /* start loading the range */
+#define FS_ADVICE_DONTNEED 4   /* drop the range from the cache */
+
+struct fs_options {
+  uint32_t features;   /* FS_FEATURE_* flags */
+  uint32_t block_size; /* power of two from 4 KiB to 64 KiB, 0 for 4 KiB */
+};
+
+struct fs_dedup_stats {
+  uint64_t lookups;       /* fingerprint lookups since mount */
+  uint64_t hits;          /* lookups that found a duplicate block */
+  double hit_ratio;       /* hits / lookups */
+  uint64_t unique_blocks; /* data blocks holding deduplicated data */
+  uint64_t saved_blocks;  /* block map entries sharing another's block */
+  size_t index_memory;    /* bytes used by the fingerprint index */
+};
+
+struct fs_statfs {
+  uint32_t block_size;          /* bytes per block */
+  uint64_t total_blocks;        /* blocks of the data area */
+  uint64_t free_blocks;         /* data blocks free for new data */
+  uint64_t freeing_blocks;      /* freed, and free after the next commit */
+  uint64_t largest_free_extent; /* longest run of free data blocks */
+  uint64_t total_inodes;
+  uint64_t free_inodes;
+};
+
+struct fs_fsck_options {
+  bool repair; /* fix what can be fixed and write it back */
+  int threads; /* worker threads, 0 for one per online CPU */
+};
+
+struct fs_fsck_report {
+  uint64_t files;               /* directory entries checked */
+  uint64_t bad_dir_entries;     /* entries with an invalid or shared inode */
+  uint64_t missing_inodes;      /* inodes in use but marked free */
+  uint64_t orphaned_inodes;     /* inodes marked used without an entry */
+  uint64_t bad_pointers;        /* block map entries outside the data area */
+  uint64_t cross_linked_blocks; /* blocks with more references than allowed */
+  uint64_t missing_blocks;      /* blocks in use but marked free */
+  uint64_t orphaned_blocks;     /* blocks marked used that nothing references */
+  uint64_t checksum_errors;     /* referenced blocks failing their checksum */
+  uint64_t bytes_read;          /* bytes read from the disk */
+  bool repaired;                /* problems were found and fixed */
+};
+
+struct fs_clean_report {
+  uint64_t segments;       /* segments the call emptied of used blocks */
+  uint64_t moved_blocks;   /* data and indirect blocks moved to the log */
+  uint64_t clean_segments; /* segments without used blocks after the call */
+};
+
+struct fs_defrag_report {
+  uint64_t files;               /* files looked at by the call */
+  uint64_t blocks;              /* data blocks of those files */
+  uint64_t extents_before;      /* runs of consecutive data blocks before */
+  uint64_t extents_after;       /* and after the call */
+  uint64_t free_extents_before; /* runs of free blocks before */
+  uint64_t free_extents_after;  /* and after the call */
+  uint64_t moved_blocks;        /* data blocks moved by the call */
+};
+
+/* Calls counted by fs_stats */
+enum fs_op {
+  FS_OP_MOUNT,
+  FS_OP_UMOUNT,
+  FS_OP_OPEN,
+  FS_OP_CLOSE,
+  FS_OP_CREATE,
+  FS_OP_DELETE,
+  FS_OP_READ,
+  FS_OP_WRITE,
+  FS_OP_READ_ASYNC,
+  FS_OP_WRITE_ASYNC,
+  FS_OP_GET_FILESIZE,
+  FS_OP_LISTFILES,
+  FS_OP_LSEEK,
+  FS_OP_TRUNCATE,
+  FS_OP_SYNC,
+  FS_OP_FSYNC,
+  FS_OP_READV,
+  FS_OP_WRITEV,
+  FS_OP_COPY_RANGE,
+  FS_OP_MAP,
+  FS_OP_UNMAP,
+  FS_OP_ADVISE,
+  FS_OP_COUNT
+};
+
+#define FS_STATS_BUCKETS 32
+
+struct fs_op_stats {
+  uint64_t calls;
+  uint64_t errors;   /* calls that returned -1 */
+  uint64_t total_ns; /* time spent in the calls */
+  /* latency[i] counts the calls that took 2^i to 2^(i+1) ns, the last
+   * bucket the ones that took longer */
+  uint64_t latency[FS_STATS_BUCKETS];
+};
+
+struct fs_io_stats {
+  uint64_t calls; /* block function calls, vectored ones counting once */
+  uint64_t bytes;
+  uint64_t ns;
+};
+
+/* Counted since the context was set up or last reset; all fields are
+ * uint64_t */
+struct fs_stats {
+  struct fs_op_stats ops[FS_OP_COUNT]; /* indexed by enum fs_op */
+  struct fs_io_stats disk_reads;
+  struct fs_io_stats disk_writes;
+  struct fs_io_stats disk_syncs;
+  uint64_t alloc_calls;        /* data block allocations */
+  uint64_t alloc_scanned;      /* bitmap entries they looked at */
+  uint64_t map_lookups;        /* block map lookups */
+  uint64_t map_blocks;         /* block map entries they resolved */
+  uint64_t map_indirect_reads; /* indirect blocks they read */
+  uint64_t prefetched_blocks;  /* data blocks the host was asked to load */
+  uint64_t evicted_blocks;     /* and to drop from its page cache */
+  uint64_t cleaned_blocks;     /* blocks the segment cleaner moved */
+};
+
+/* A trace starts with FS_TRACE_MAGIC and FS_TRACE_VERSION, each a uint32_t,
+ * followed by one record per call in the order the calls ended. A record is
+ * followed by the name_len bytes of the name the call took, if any. */
+#define FS_TRACE_MAGIC 0x43525446 /* "FTRC" */
+#define FS_TRACE_VERSION 2
+
+struct fs_trace_record {
+  uint64_t time_ns;     /* when the call started, since the trace started */
+  int64_t offset;       /* file offset of a read, write or copy destination,
+                         * the offset of a seek or length of a truncate, or
+                         * -1 */
+  int64_t src_offset;   /* source offset of a copy, or -1 */
+  uint32_t size;        /* bytes asked for by a read, write or copy */
+  int32_t fd;           /* descriptor passed, the destination of a copy, or
+                         * -1 */
+  int32_t src_fd;       /* source descriptor of a copy, or -1 */
+  int32_t result;       /* value returned */
+  uint32_t duration_ns; /* time spent in the call, saturated */
+  uint8_t op;           /* enum fs_op */
+  uint8_t name_len;
+  uint8_t advice;       /* FS_ADVICE_* of an advise, else 0 */
+  uint8_t padding;
+};
+
+/* The outcome of an asynchronous read or write */
+struct fs_completion {
+  uint64_t user_data; /* as passed when the request was submitted */
+  int result;         /* bytes read or written, or -1 on failure */
+};
+
+/* A context holds one mounted file system, so that a process can mount
+ * several images at once. The functions without a context work on a default
+ * context of their own. All of them may be called from any thread. */
+typedef struct fs_ctx fs_ctx;
 
 int make_fs(const char *disk_name);
+int make_fs_opts(const char *disk_name, const struct fs_options *opts);
 int mount_fs(const char *disk_name);
+/* Mount disk_name alongside other processes that mount it this way, which
+ * see each other's changes without remounting. A shared segment named after
+ * the image coordinates them: calls that change the image run one at a time
+ * across all of the processes and write their metadata through before
+ * returning. */
+int mount_fs_shared(const char *disk_name);
 int umount_fs(const char *disk_name);
 int fs_open(const char *name);
 int fs_close(int fildes);
@@ -19,8 +195,97 @@ int fs_create(const char *name);
 int fs_delete(const char *name);
 int fs_read(int fildes, void *buf, size_t nbyte);
 int fs_write(int fildes, void *buf, size_t nbyte);
+int fs_readv(int fildes, const struct iovec *iov, int iovcnt);
+int fs_writev(int fildes, const struct iovec *iov, int iovcnt);
+int fs_copy_range(int src_fildes, off_t src_offset, int dst_fildes,
+                  off_t dst_offset, size_t len);
+/* Point *ptr at up to len bytes at offset of fildes, read-only, and return
+ * how many. The bytes stay as they were, whatever is written to the file,
+ * until fs_unmap(*ptr) or the unmount. */
+int fs_map(int fildes, off_t offset, size_t len, const void **ptr);
+int fs_unmap(const void *ptr);
+/* Give advice, one of FS_ADVICE_*, about len bytes at offset of fildes, up
+ * to the end of the file if len is 0. Data is cached in the page cache of
+ * the host, which the advice steers. */
+int fs_advise(int fildes, off_t offset, size_t len, int advice);
+/* Start reading or writing nbyte bytes at the offset of fildes, which moves
+ * past them right away, and return 0 without waiting for the disk. buf must
+ * stay untouched until the request shows up in fs_poll_completions. */
+int fs_read_async(int fildes, void *buf, size_t nbyte, uint64_t user_data);
+int fs_write_async(int fildes, void *buf, size_t nbyte, uint64_t user_data);
+/* Store up to max completed requests in completions, waiting until at least
+ * min_complete are done or nothing is left in flight; returns their count */
+int fs_poll_completions(struct fs_completion *completions, int max,
+                        int min_complete);
+/* threads that large writes are split across, 0 (the default) for one per
+ * online CPU */
+int fs_set_write_threads(int threads);
 int fs_get_filesize(int fildes);
 int fs_listfiles(char ***files);
 int fs_lseek(int fildes, off_t offset);
 int fs_truncate(int fildes, off_t length);
+int fs_sync();
+int fs_fsync(int fildes);
+int fs_snapshot_create();
+int fs_snapshot_delete();
+int fs_snapshot_mount(const char *disk_name);
+int fs_dedup_stats(struct fs_dedup_stats *stats);
+int fs_statfs(struct fs_statfs *statfs);
+int fs_fsck(const char *disk_name, const struct fs_fsck_options *opts,
+            struct fs_fsck_report *report);
+int fs_defrag(const char *name, struct fs_defrag_report *report);
+int fs_defrag_all(struct fs_defrag_report *report);
+/* Move the used blocks of sparse segments of a log-structured image to the
+ * log, as the cleaner does in the background */
+int fs_clean(struct fs_clean_report *report);
+int fs_stats(struct fs_stats *stats);
+int fs_stats_reset();
+int fs_trace_start(const char *path);
+int fs_trace_stop();
+
+fs_ctx *fs_mount(const char *disk_name); /* NULL on failure */
+fs_ctx *fs_mount_snapshot(const char *disk_name);
+fs_ctx *fs_mount_shared(const char *disk_name);
+int fs_unmount(fs_ctx *ctx); /* frees ctx on success */
+int fs_ctx_open(fs_ctx *ctx, const char *name);
+int fs_ctx_close(fs_ctx *ctx, int fildes);
+int fs_ctx_create(fs_ctx *ctx, const char *name);
+int fs_ctx_delete(fs_ctx *ctx, const char *name);
+int fs_ctx_read(fs_ctx *ctx, int fildes, void *buf, size_t nbyte);
+int fs_ctx_write(fs_ctx *ctx, int fildes, void *buf, size_t nbyte);
+int fs_ctx_readv(fs_ctx *ctx, int fildes, const struct iovec *iov, int iovcnt);
+int fs_ctx_writev(fs_ctx *ctx, int fildes, const struct iovec *iov,
+                  int iovcnt);
+int fs_ctx_copy_range(fs_ctx *ctx, int src_fildes, off_t src_offset,
+                      int dst_fildes, off_t dst_offset, size_t len);
+int fs_ctx_map(fs_ctx *ctx, int fildes, off_t offset, size_t len,
+               const void **ptr);
+int fs_ctx_unmap(fs_ctx *ctx, const void *ptr);
+int fs_ctx_advise(fs_ctx *ctx, int fildes, off_t offset, size_t len,
+                  int advice);
+int fs_ctx_read_async(fs_ctx *ctx, int fildes, void *buf, size_t nbyte,
+                      uint64_t user_data);
+int fs_ctx_write_async(fs_ctx *ctx, int fildes, void *buf, size_t nbyte,
+                       uint64_t user_data);
+int fs_ctx_poll_completions(fs_ctx *ctx, struct fs_completion *completions,
+                            int max, int min_complete);
+int fs_ctx_set_write_threads(fs_ctx *ctx, int threads);
+int fs_ctx_get_filesize(fs_ctx *ctx, int fildes);
+int fs_ctx_listfiles(fs_ctx *ctx, char ***files);
+int fs_ctx_lseek(fs_ctx *ctx, int fildes, off_t offset);
+int fs_ctx_truncate(fs_ctx *ctx, int fildes, off_t length);
+int fs_ctx_sync(fs_ctx *ctx);
+int fs_ctx_fsync(fs_ctx *ctx, int fildes);
+int fs_ctx_snapshot_create(fs_ctx *ctx);
+int fs_ctx_snapshot_delete(fs_ctx *ctx);
+int fs_ctx_dedup_stats(fs_ctx *ctx, struct fs_dedup_stats *stats);
+int fs_ctx_statfs(fs_ctx *ctx, struct fs_statfs *statfs);
+int fs_ctx_defrag(fs_ctx *ctx, const char *name,
+                  struct fs_defrag_report *report);
+int fs_ctx_defrag_all(fs_ctx *ctx, struct fs_defrag_report *report);
+int fs_ctx_clean(fs_ctx *ctx, struct fs_clean_report *report);
+int fs_ctx_stats(fs_ctx *ctx, struct fs_stats *stats);
+int fs_ctx_stats_reset(fs_ctx *ctx);
+int fs_ctx_trace_start(fs_ctx *ctx, const char *path);
+int fs_ctx_trace_stop(fs_ctx *ctx);
 #endif /* INCLUDE_FS_H */
@@ -0,0 +1,68 @@
+#include "fs.h"
+#include <time.h>
+#include <unistd.h>
+
+// Exit status, as with e2fsck: 0 if the file system is clean, 1 if problems
+// were fixed, 4 if problems were left, 8 if it could not be checked.
+int main(int argc, char *argv[]) {
+  struct fs_fsck_options opts = {.repair = false, .threads = 0};
+  struct fs_fsck_report report;
+  struct timespec start, end;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "yj:")) != -1) {
+    switch (opt) {
+    case 'y':
+      opts.repair = true;
+      break;
+    case 'j':
+      opts.threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-y] [-j threads] disk_name\n", argv[0]);
+      return 8;
+    }
+  }
+  if (optind + 1 != argc) {
+    fprintf(stderr, "usage: %s [-y] [-j threads] disk_name\n", argv[0]);
+    return 8;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (fs_fsck(argv[optind], &opts, &report)) {
+    return 8;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("%llu files\n", (unsigned long long)report.files);
+  printf("%llu bad directory entries\n",
+         (unsigned long long)report.bad_dir_entries);
+  printf("%llu missing inodes\n", (unsigned long long)report.missing_inodes);
+  printf("%llu orphaned inodes\n", (unsigned long long)report.orphaned_inodes);
+  printf("%llu bad block pointers\n", (unsigned long long)report.bad_pointers);
+  printf("%llu cross-linked blocks\n",
+         (unsigned long long)report.cross_linked_blocks);
+  printf("%llu missing blocks\n", (unsigned long long)report.missing_blocks);
+  printf("%llu orphaned blocks\n", (unsigned long long)report.orphaned_blocks);
+  printf("%llu checksum errors\n", (unsigned long long)report.checksum_errors);
+  printf("read %llu MiB in %.3f s (%.1f MiB/s)\n",
+         (unsigned long long)report.bytes_read >> 20, seconds,
+         report.bytes_read / (double)(1 << 20) / seconds);
+
+  bool has_problems = report.bad_dir_entries || report.missing_inodes ||
+                      report.orphaned_inodes || report.bad_pointers ||
+                      report.cross_linked_blocks || report.missing_blocks ||
+                      report.orphaned_blocks || report.checksum_errors;
+  if (has_problems == false) {
+    return 0;
+  }
+  // cross-linked blocks and checksum errors are reported, not fixed
+  if (report.repaired && report.cross_linked_blocks == 0 &&
+      report.checksum_errors == 0) {
+    printf("file system repaired\n");
+    return 1;
+  }
+  return 4;
+}
@@ -0,0 +1,76 @@
+#include "hash.h"
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r);
+static uint64_t read64(const uint8_t *p);
+static uint64_t round64(uint64_t acc, uint64_t input);
+static uint64_t merge_round64(uint64_t acc, uint64_t val);
+
+uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+uint64_t read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+uint64_t merge_round64(uint64_t acc, uint64_t val) {
+  acc ^= round64(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash64(const void *data, size_t size) {
+  const uint8_t *p = data;
+  const uint8_t *end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    uint64_t v1 = PRIME64_1 + PRIME64_2;
+    uint64_t v2 = PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -PRIME64_1;
+    do {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = merge_round64(h, v1);
+    h = merge_round64(h, v2);
+    h = merge_round64(h, v3);
+    h = merge_round64(h, v4);
+  } else {
+    h = PRIME64_5;
+  }
+  h += size;
+
+  for (; end - p >= 8; p += 8) {
+    h ^= round64(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
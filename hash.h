@@ -0,0 +1,11 @@
+#ifndef INCLUDE_HASH_H
+#define INCLUDE_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fast non-cryptographic 64-bit hash (xxHash64 construction). Equal inputs
+// hash equal; callers comparing data must still compare the bytes.
+uint64_t hash64(const void *data, size_t size);
+
+#endif /* INCLUDE_HASH_H */
@@ -0,0 +1,165 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_LENGTH_MASK 15
+#define LZ_SKIP_SHIFT 5
+
+static uint32_t lz_read32(const uint8_t *p);
+static uint32_t lz_hash(uint32_t sequence);
+static uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, int length);
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend,
+                                const uint8_t *literals, int literal_length,
+                                int offset, int match_length);
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, int length);
+
+uint32_t lz_read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint32_t lz_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the extra bytes of a length whose nibble overflowed.
+uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, int length) {
+  for (; length >= 255; length -= 255) {
+    if (op >= oend)
+      return NULL;
+    *op++ = 255;
+  }
+  if (op >= oend)
+    return NULL;
+  *op++ = length;
+  return op;
+}
+
+// Writes one sequence. A match_length of 0 writes the final, literal-only
+// sequence. Returns NULL if dst is too small.
+uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend,
+                         const uint8_t *literals, int literal_length,
+                         int offset, int match_length) {
+  int match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+  if (op >= oend)
+    return NULL;
+  uint8_t *token = op++;
+  *token = (literal_length < LZ_LENGTH_MASK ? literal_length : LZ_LENGTH_MASK)
+           << 4;
+  if (literal_length >= LZ_LENGTH_MASK &&
+      (op = lz_put_length(op, oend, literal_length - LZ_LENGTH_MASK)) == NULL)
+    return NULL;
+  if (oend - op < literal_length)
+    return NULL;
+  memcpy(op, literals, literal_length);
+  op += literal_length;
+  if (match_length == 0)
+    return op;
+
+  if (oend - op < 2)
+    return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  *token |= match_code < LZ_LENGTH_MASK ? match_code : LZ_LENGTH_MASK;
+  if (match_code >= LZ_LENGTH_MASK)
+    return lz_put_length(op, oend, match_code - LZ_LENGTH_MASK);
+  return op;
+}
+
+// Reads the extra bytes of a length whose nibble overflowed.
+int lz_get_length(const uint8_t **ip, const uint8_t *iend, int length) {
+  uint8_t byte;
+  do {
+    if (*ip >= iend)
+      return -1;
+    byte = *(*ip)++;
+    length += byte;
+  } while (byte == 255);
+  return length;
+}
+
+int lz_compress(const void *src, int src_size, void *dst, int dst_capacity) {
+  const uint8_t *base = src;
+  const uint8_t *ip = base;
+  const uint8_t *anchor = base;
+  const uint8_t *iend = base + src_size;
+  uint8_t *op = dst;
+  const uint8_t *oend = op + dst_capacity;
+  int table[1 << LZ_HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+
+  // Misses make the scan step grow, so incompressible input is skipped over
+  // quickly instead of being hashed byte by byte.
+  int misses = 0;
+  while (iend - ip > LZ_MIN_MATCH) {
+    uint32_t sequence = lz_read32(ip);
+    uint32_t hash = lz_hash(sequence);
+    int candidate = table[hash];
+    table[hash] = ip - base;
+    if (candidate < 0 || ip - base - candidate > LZ_MAX_OFFSET ||
+        lz_read32(base + candidate) != sequence) {
+      ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+      continue;
+    }
+    const uint8_t *match = base + candidate;
+    int match_length = LZ_MIN_MATCH;
+    while (ip + match_length < iend && ip[match_length] == match[match_length])
+      match_length++;
+    op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - match,
+                         match_length);
+    if (op == NULL)
+      return 0;
+    ip += match_length;
+    anchor = ip;
+    misses = 0;
+  }
+  op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+  if (op == NULL)
+    return 0;
+  return op - (uint8_t *)dst;
+}
+
+int lz_decompress(const void *src, int src_size, void *dst, int dst_capacity) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = ip + src_size;
+  uint8_t *ostart = dst;
+  uint8_t *op = ostart;
+  const uint8_t *oend = op + dst_capacity;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    int literal_length = token >> 4;
+    if (literal_length == LZ_LENGTH_MASK &&
+        (literal_length = lz_get_length(&ip, iend, literal_length)) < 0)
+      return -1;
+    if (literal_length > iend - ip || literal_length > oend - op)
+      return -1;
+    memcpy(op, ip, literal_length);
+    op += literal_length;
+    ip += literal_length;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op - ostart)
+      return -1;
+    int match_length = token & LZ_LENGTH_MASK;
+    if (match_length == LZ_LENGTH_MASK &&
+        (match_length = lz_get_length(&ip, iend, match_length)) < 0)
+      return -1;
+    match_length += LZ_MIN_MATCH;
+    if (match_length > oend - op)
+      return -1;
+    // byte by byte: the match may overlap the bytes it produces
+    const uint8_t *match = op - offset;
+    for (int i = 0; i < match_length; i++)
+      op[i] = match[i];
+    op += match_length;
+  }
+  return op - ostart;
+}
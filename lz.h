@@ -0,0 +1,24 @@
+#ifndef INCLUDE_LZ_H
+#define INCLUDE_LZ_H
+
+/*
+ * A small LZ77 codec in the spirit of LZ4: a compressed stream is a sequence
+ * of (literals, match) pairs, each introduced by a one-byte token holding the
+ * literal length in the high nibble and the match length minus LZ_MIN_MATCH
+ * in the low nibble. A nibble of 15 is followed by extra length bytes, summed
+ * until one is not 255. Matches are encoded as a 2-byte little-endian offset
+ * back into the output. The final sequence carries literals only.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Compresses src_size bytes of src into dst. Returns the compressed size, or
+// 0 if the result would not fit in dst_capacity bytes.
+int lz_compress(const void *src, int src_size, void *dst, int dst_capacity);
+
+// Decompresses src_size bytes of src into dst. Returns the decompressed size,
+// or -1 if the stream is malformed or does not fit in dst_capacity bytes.
+int lz_decompress(const void *src, int src_size, void *dst, int dst_capacity);
+
+#endif /* INCLUDE_LZ_H */
@@ -0,0 +1,314 @@
+#include "fs.h"
+#include <time.h>
+#include <unistd.h>
+
+// Replays a trace taken with fs_trace_start against a fresh image, one call
+// at a time in the order the traced calls ended, and prints the latency of
+// each kind of call, replayed and traced, as a JSON array. With -t the calls
+// start at the times they were traced at; otherwise as fast as possible.
+// Written data is a fixed pattern, as traces hold no contents, and vectored
+// calls use one buffer, as traces hold the total size only. An unmap
+// releases the latest range still mapped, as traces hold no pointers.
+
+#define MAX_FD (1 << 16)
+#define MAX_MAPPINGS 1024
+#define MAX_COMPLETIONS 64
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+struct op_latencies {
+  uint64_t *replayed; // in ns
+  uint64_t *traced;
+  int calls;
+  int capacity;
+  int errors;     // replayed calls that returned -1
+  int mismatches; // replayed calls that failed or succeeded unlike the traced
+};
+
+const char *op_names[FS_OP_COUNT] = {
+    "mount",      "umount",      "open",         "close",
+    "create",     "delete",      "read",         "write",
+    "read_async", "write_async", "get_filesize", "listfiles",
+    "lseek",      "truncate",    "sync",         "fsync",
+    "readv",      "writev",      "copy_range",   "map",
+    "unmap",      "advise"};
+
+struct op_latencies latencies[FS_OP_COUNT];
+int fds[MAX_FD]; // replayed descriptor of each traced one, or -1
+char *buf;
+size_t buf_size;
+int async_pending; // requests not reaped yet
+const void *mappings[MAX_MAPPINGS]; // ranges mapped and not unmapped yet
+int num_mappings;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void check(bool ok, const char *what) {
+  if (ok == false) {
+    fprintf(stderr, "replay: %s failed\n", what);
+    exit(1);
+  }
+}
+
+// Reaps completed asynchronous requests, waiting for at least min_complete.
+void reap(int min_complete) {
+  struct fs_completion completions[MAX_COMPLETIONS];
+  while (async_pending > 0) {
+    int n = fs_poll_completions(completions, MAX_COMPLETIONS,
+                                MIN(min_complete, MAX_COMPLETIONS));
+    check(n >= 0, "fs_poll_completions");
+    async_pending -= n;
+    min_complete -= n;
+    if (min_complete <= 0) {
+      return;
+    }
+  }
+}
+
+// Makes buf hold at least size bytes, once the requests using it are done.
+void grow_buf(size_t size) {
+  if (size <= buf_size) {
+    return;
+  }
+  reap(async_pending);
+  free(buf);
+  buf = malloc(size);
+  check(buf != NULL, "malloc");
+  memset(buf, 'x', size);
+  buf_size = size;
+}
+
+int replay_fd(int fd) { return fd >= 0 && fd < MAX_FD ? fds[fd] : -1; }
+
+// Replays the call of record, which took name, and returns its result.
+int replay(const struct fs_trace_record *record, const char *name,
+           const char *disk_name) {
+  int fd = replay_fd(record->fd);
+  struct iovec iov = {buf, record->size};
+  char **files;
+  int ret;
+
+  switch (record->op) {
+  case FS_OP_MOUNT:
+    return mount_fs(disk_name);
+  case FS_OP_UMOUNT:
+    ret = umount_fs(disk_name);
+    if (ret == 0) {
+      async_pending = 0; // their completions are dropped, and mappings
+      num_mappings = 0;  // released
+    }
+    return ret;
+  case FS_OP_OPEN:
+    ret = fs_open(name);
+    if (ret >= 0 && record->result >= 0 && record->result < MAX_FD) {
+      fds[record->result] = ret;
+    }
+    return ret;
+  case FS_OP_CLOSE:
+    ret = fs_close(fd);
+    if (ret == 0) {
+      fds[record->fd] = -1;
+    }
+    return ret;
+  case FS_OP_CREATE:
+    return fs_create(name);
+  case FS_OP_DELETE:
+    return fs_delete(name);
+  case FS_OP_READ:
+    return fs_read(fd, buf, record->size);
+  case FS_OP_WRITE:
+    return fs_write(fd, buf, record->size);
+  case FS_OP_READ_ASYNC:
+    ret = fs_read_async(fd, buf, record->size, 0);
+    async_pending += ret == 0;
+    return ret;
+  case FS_OP_WRITE_ASYNC:
+    ret = fs_write_async(fd, buf, record->size, 0);
+    async_pending += ret == 0;
+    return ret;
+  case FS_OP_GET_FILESIZE:
+    return fs_get_filesize(fd);
+  case FS_OP_LISTFILES:
+    ret = fs_listfiles(&files);
+    if (ret == 0) {
+      for (char **file = files; *file; file++) {
+        free(*file);
+      }
+      free(files);
+    }
+    return ret;
+  case FS_OP_LSEEK:
+    return fs_lseek(fd, record->offset);
+  case FS_OP_TRUNCATE:
+    return fs_truncate(fd, record->offset);
+  case FS_OP_SYNC:
+    return fs_sync();
+  case FS_OP_FSYNC:
+    return fs_fsync(fd);
+  case FS_OP_READV:
+    return fs_readv(fd, &iov, 1);
+  case FS_OP_WRITEV:
+    return fs_writev(fd, &iov, 1);
+  case FS_OP_COPY_RANGE:
+    return fs_copy_range(replay_fd(record->src_fd), record->src_offset, fd,
+                         record->offset, record->size);
+  case FS_OP_MAP:
+    ret = fs_map(fd, record->offset, record->size, &mappings[num_mappings]);
+    num_mappings += ret >= 0 && num_mappings < MAX_MAPPINGS - 1;
+    return ret;
+  case FS_OP_UNMAP:
+    return fs_unmap(num_mappings ? mappings[--num_mappings] : NULL);
+  case FS_OP_ADVISE:
+    return fs_advise(fd, record->offset, record->size, record->advice);
+  }
+  return -1;
+}
+
+void add_latency(int op, uint64_t replayed, uint64_t traced) {
+  struct op_latencies *op_latencies = &latencies[op];
+  if (op_latencies->calls == op_latencies->capacity) {
+    op_latencies->capacity = MAX(2 * op_latencies->capacity, 1024);
+    op_latencies->replayed = realloc(op_latencies->replayed,
+                                     op_latencies->capacity * sizeof(uint64_t));
+    op_latencies->traced = realloc(op_latencies->traced,
+                                   op_latencies->capacity * sizeof(uint64_t));
+    check(op_latencies->replayed != NULL && op_latencies->traced != NULL,
+          "realloc");
+  }
+  op_latencies->replayed[op_latencies->calls] = replayed;
+  op_latencies->traced[op_latencies->calls] = traced;
+  op_latencies->calls++;
+}
+
+int compare_latencies(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Prints the latencies of the kinds of calls the trace held.
+void report() {
+  bool is_first = true;
+  printf("[");
+  for (int op = 0; op < FS_OP_COUNT; op++) {
+    struct op_latencies *op_latencies = &latencies[op];
+    int n = op_latencies->calls;
+    if (n == 0) {
+      continue;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) {
+      total += op_latencies->replayed[i];
+    }
+    qsort(op_latencies->replayed, n, sizeof(uint64_t), compare_latencies);
+    qsort(op_latencies->traced, n, sizeof(uint64_t), compare_latencies);
+    printf("%s\n  {\"op\": \"%s\", \"calls\": %d, \"errors\": %d, "
+           "\"mismatches\": %d, \"seconds\": %.6f, \"p50_us\": %.2f, "
+           "\"p99_us\": %.2f, \"traced_p50_us\": %.2f, "
+           "\"traced_p99_us\": %.2f}",
+           is_first ? "" : ",", op_names[op], n, op_latencies->errors,
+           op_latencies->mismatches, total / 1e9,
+           op_latencies->replayed[n / 2] / 1e3,
+           op_latencies->replayed[n * 99 / 100] / 1e3,
+           op_latencies->traced[n / 2] / 1e3,
+           op_latencies->traced[n * 99 / 100] / 1e3);
+    is_first = false;
+    free(op_latencies->replayed);
+    free(op_latencies->traced);
+  }
+  printf("\n]\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *disk_name = "replay_fs";
+  bool is_timed = false;
+  struct fs_trace_record record;
+  char name[UINT8_MAX + 1];
+  uint32_t header[2];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "td:")) != -1) {
+    switch (opt) {
+    case 't':
+      is_timed = true;
+      break;
+    case 'd':
+      disk_name = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t] [-d disk_name] trace_file\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    fprintf(stderr, "usage: %s [-t] [-d disk_name] trace_file\n", argv[0]);
+    return 1;
+  }
+  FILE *trace = fopen(argv[optind], "rb");
+  check(trace != NULL, "opening the trace");
+  check(fread(header, sizeof(header), 1, trace) == 1 &&
+            header[0] == FS_TRACE_MAGIC && header[1] == FS_TRACE_VERSION,
+        "reading the trace header");
+  memset(fds, -1, sizeof(fds));
+
+  remove(disk_name);
+  check(make_fs(disk_name) == 0, "make_fs");
+  // a trace taken on a mounted file system starts without the mount
+  bool is_mounted = false;
+  if (fread(&record, sizeof(record), 1, trace) == 1 &&
+      record.op != FS_OP_MOUNT) {
+    check(mount_fs(disk_name) == 0, "mount_fs");
+    is_mounted = true;
+  }
+  fseek(trace, sizeof(header), SEEK_SET);
+
+  uint64_t replay_start = now_ns();
+  uint64_t trace_start = UINT64_MAX;
+  while (fread(&record, sizeof(record), 1, trace) == 1) {
+    check(record.op < FS_OP_COUNT, "reading a trace record");
+    check(fread(name, 1, record.name_len, trace) == record.name_len,
+          "reading a trace record");
+    name[record.name_len] = '\0';
+    trace_start = MIN(trace_start, record.time_ns);
+    if (is_timed) {
+      uint64_t due = replay_start + (record.time_ns - trace_start);
+      uint64_t now = now_ns();
+      if (due > now) {
+        struct timespec ts = {(due - now) / 1000000000,
+                              (due - now) % 1000000000};
+        nanosleep(&ts, NULL);
+      }
+    }
+    if (record.op == FS_OP_READ || record.op == FS_OP_WRITE ||
+        record.op == FS_OP_READ_ASYNC || record.op == FS_OP_WRITE_ASYNC ||
+        record.op == FS_OP_READV || record.op == FS_OP_WRITEV) {
+      grow_buf(record.size);
+    }
+
+    uint64_t start = now_ns();
+    int ret = replay(&record, name, disk_name);
+    uint64_t ns = now_ns() - start;
+    add_latency(record.op, ns, record.duration_ns);
+    latencies[record.op].errors += ret == -1;
+    latencies[record.op].mismatches += (ret == -1) != (record.result == -1);
+    if (record.op == FS_OP_MOUNT || record.op == FS_OP_UMOUNT) {
+      is_mounted = ret == 0 ? record.op == FS_OP_MOUNT : is_mounted;
+    }
+    reap(0);
+  }
+  check(feof(trace), "reading the trace");
+  fclose(trace);
+
+  if (is_mounted) {
+    reap(async_pending);
+    check(umount_fs(disk_name) == 0, "umount_fs");
+  }
+  check(remove(disk_name) == 0, "remove");
+  report();
+  free(buf);
+  return 0;
+}
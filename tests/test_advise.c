@@ -0,0 +1,109 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define FILE_SIZE (8 * BYTES_MB)
+#define FILE_BLOCKS (FILE_SIZE / 4096)
+#define READ_SIZE (64 * BYTES_KB)
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+// Reads the file open as fd from offset to the end in READ_SIZE reads and
+// checks it holds data.
+void read_all(int fd, int offset, const char *data) {
+  char *buf = malloc(READ_SIZE);
+  assert(fs_lseek(fd, offset) == 0);
+  for (; offset < FILE_SIZE; offset += READ_SIZE) {
+    int n = MIN(READ_SIZE, FILE_SIZE - offset);
+    assert(fs_read(fd, buf, READ_SIZE) == n);
+    assert(memcmp(buf, data + offset, n) == 0);
+  }
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options compression = {.features = FS_FEATURE_COMPRESSION};
+  struct fs_stats stats;
+  char *data = malloc(FILE_SIZE);
+  char buf[4096];
+  int fd;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fd >= 0);
+  assert(fs_write(fd, data, FILE_SIZE) == FILE_SIZE);
+  assert(fs_sync() == 0);
+
+  // without advice, prefetching starts once a read continues the last one,
+  // and a read elsewhere stops it
+  assert(fs_stats_reset() == 0);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+  assert(fs_stats(&stats) == 0 && stats.prefetched_blocks == 0);
+  assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+  assert(fs_stats(&stats) == 0 && stats.prefetched_blocks > 0);
+  assert(fs_lseek(fd, FILE_SIZE / 2) == 0);
+  assert(fs_stats_reset() == 0);
+  assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+  assert(fs_stats(&stats) == 0 && stats.prefetched_blocks == 0);
+  assert(stats.evicted_blocks == 0);
+
+  // random reads prefetch nothing, even in order
+  assert(fs_advise(fd, 0, 0, FS_ADVICE_RANDOM) == 0);
+  assert(fs_stats_reset() == 0);
+  read_all(fd, 0, data);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.prefetched_blocks == 0 && stats.evicted_blocks == 0);
+
+  // a scan prefetches the rest of the file once, ahead of the reads, and
+  // drops every block it read
+  assert(fs_advise(fd, 0, 0, FS_ADVICE_SEQUENTIAL) == 0);
+  assert(fs_stats_reset() == 0);
+  read_all(fd, 0, data);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.prefetched_blocks == FILE_BLOCKS - READ_SIZE / 4096);
+  assert(stats.evicted_blocks == FILE_BLOCKS);
+
+  // ranges are loaded or dropped right away, up to the end of the file
+  assert(fs_stats_reset() == 0);
+  assert(fs_advise(fd, 100, 3 * 4096, FS_ADVICE_WILLNEED) == 0);
+  assert(fs_stats(&stats) == 0 && stats.prefetched_blocks == 4);
+  assert(fs_advise(fd, FILE_SIZE - 4096, 0, FS_ADVICE_WILLNEED) == 0);
+  assert(fs_advise(fd, FILE_SIZE - 10, 100, FS_ADVICE_DONTNEED) == 0);
+  assert(fs_advise(fd, FILE_SIZE, 100, FS_ADVICE_DONTNEED) == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.prefetched_blocks == 5 && stats.evicted_blocks == 1);
+  assert(stats.ops[FS_OP_ADVISE].calls == 4);
+
+  assert(fs_advise(fd, FILE_SIZE + 1, 10, FS_ADVICE_WILLNEED) == -1);
+  assert(fs_advise(fd, -1, 10, FS_ADVICE_WILLNEED) == -1);
+  assert(fs_advise(fd, 0, 10, 99) == -1);
+  assert(fs_advise(-1, 0, 10, FS_ADVICE_NORMAL) == -1);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // compressed files are advised a whole cluster at a time
+  assert(make_fs_opts(disk_name, &compression) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fs_write(fd, data, FILE_SIZE) == FILE_SIZE);
+  assert(fs_stats_reset() == 0);
+  assert(fs_advise(fd, 5 * 4096, 10, FS_ADVICE_WILLNEED) == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.prefetched_blocks > 1 && stats.prefetched_blocks <= 8);
+  assert(fs_advise(fd, 0, 0, FS_ADVICE_SEQUENTIAL) == 0);
+  read_all(fd, 0, data);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+}
@@ -0,0 +1,134 @@
+#include "../disk.h"
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define FILE_SIZE (8 * BYTES_MB)
+#define WRITE_SIZE (128 * BYTES_KB)
+#define READ_SIZE 250000
+#define MAX_REQUESTS 128
+
+// Reaps count requests, whose user data is their index, and checks that each
+// one moved the bytes sizes holds for it.
+void reap(int count, const int *sizes) {
+  struct fs_completion completions[MAX_REQUESTS];
+  bool seen[MAX_REQUESTS] = {false};
+  int reaped = 0;
+  while (reaped < count) {
+    int n = fs_poll_completions(completions, MAX_REQUESTS, 1);
+    assert(n > 0);
+    for (int i = 0; i < n; i++) {
+      int idx = (int)completions[i].user_data;
+      assert(idx < count && seen[idx] == false);
+      seen[idx] = true;
+      assert(completions[i].result == sizes[idx]);
+    }
+    reaped += n;
+  }
+  assert(fs_poll_completions(completions, MAX_REQUESTS, 1) == 0);
+}
+
+void test_backend(const char *disk_name, bool use_io_uring) {
+  const char *file_name = "test_file";
+  char *buf = malloc(FILE_SIZE);
+  char *read_buf = malloc(FILE_SIZE);
+  int sizes[MAX_REQUESTS];
+  int fd;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+  disk_set_io_uring(use_io_uring);
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+
+  // unaligned writes, submitted back to back
+  int count = 0;
+  sizes[count] = 100;
+  assert(fs_write_async(fd, buf, 100, count++) == 0);
+  for (int off = 100; off < FILE_SIZE; off += WRITE_SIZE) {
+    sizes[count] = FILE_SIZE - off < WRITE_SIZE ? FILE_SIZE - off : WRITE_SIZE;
+    assert(fs_write_async(fd, buf + off, sizes[count], count) == 0);
+    count++;
+  }
+  assert(fs_get_filesize(fd) == FILE_SIZE);
+  reap(count, sizes);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, buf, FILE_SIZE) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // unaligned reads, verified against the checksums after a remount
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  memset(read_buf, 0, FILE_SIZE);
+  assert(fs_lseek(fd, 123) == 0);
+  count = 0;
+  for (int off = 123; off < FILE_SIZE; off += READ_SIZE) {
+    sizes[count] = FILE_SIZE - off < READ_SIZE ? FILE_SIZE - off : READ_SIZE;
+    assert(fs_read_async(fd, read_buf + off, READ_SIZE, count++) == 0);
+  }
+  reap(count, sizes);
+  assert(memcmp(read_buf + 123, buf + 123, FILE_SIZE - 123) == 0);
+
+  // reads at the end of the file complete with 0 bytes
+  sizes[0] = 0;
+  assert(fs_read_async(fd, read_buf, 10, 0) == 0);
+  reap(1, sizes);
+  assert(fs_read_async(-1, read_buf, 10, 0) == -1);
+
+  // unreaped completions are dropped on unmount
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_write_async(fd, buf, WRITE_SIZE, 0) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  struct fs_fsck_report report;
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.checksum_errors == 0);
+  assert(remove(disk_name) == 0);
+  free(buf);
+  free(read_buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options opts = {.features = FS_FEATURE_COMPRESSION};
+  struct fs_completion completion;
+  char buf[BLOCK_SIZE];
+  int fd;
+
+  test_backend(disk_name, true);
+  test_backend(disk_name, false);
+
+  // compressed files are written and read before the call returns
+  memset(buf, 'x', BLOCK_SIZE);
+  remove(disk_name);
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_poll_completions(&completion, 1, 1) == 0);
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fd >= 0);
+  assert(fs_write_async(fd, buf, BLOCK_SIZE, 7) == 0);
+  assert(fs_poll_completions(&completion, 1, 0) == 1);
+  assert(completion.user_data == 7 && completion.result == BLOCK_SIZE);
+  assert(fs_lseek(fd, 0) == 0);
+  memset(buf, 0, BLOCK_SIZE);
+  assert(fs_read_async(fd, buf, BLOCK_SIZE, 8) == 0);
+  assert(fs_poll_completions(&completion, 1, 1) == 1);
+  assert(completion.user_data == 8 && completion.result == BLOCK_SIZE);
+  assert(buf[0] == 'x' && buf[BLOCK_SIZE - 1] == 'x');
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_poll_completions(&completion, 1, 1) == -1);
+  assert(remove(disk_name) == 0);
+}
@@ -0,0 +1,117 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BIG_SIZE (4 * BYTES_MB)
+#define NUM_SMALL 40
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options opts = {.features = FS_FEATURE_CHECKSUM,
+                            .block_size = 64 * BYTES_KB};
+  struct fs_fsck_report report;
+  struct fs_dedup_stats stats;
+  struct stat st;
+  char name[16];
+  char *data = malloc(BIG_SIZE);
+  char *read_buf = malloc(BIG_SIZE);
+  int fd;
+
+  for (int i = 0; i < BIG_SIZE; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+
+  // the largest blocks make the disk as many times larger
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(stat(disk_name, &st) == 0 && st.st_size == 8192LL * 64 * BYTES_KB);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("big") == 0);
+  fd = fs_open("big");
+  assert(fd >= 0);
+  assert(fs_write(fd, data, BIG_SIZE) == BIG_SIZE);
+  assert(fs_close(fd) == 0);
+
+  // a write across a block boundary changes only its bytes
+  fd = fs_open("big");
+  assert(fs_lseek(fd, 64 * BYTES_KB - 10) == 0);
+  assert(fs_write(fd, data, 100) == 100);
+  assert(fs_lseek(fd, 64 * BYTES_KB - 10) == 0);
+  assert(fs_read(fd, read_buf, 100) == 100);
+  assert(memcmp(read_buf, data, 100) == 0);
+  assert(fs_lseek(fd, 64 * BYTES_KB - 10) == 0);
+  assert(fs_write(fd, data + 64 * BYTES_KB - 10, 100) == 100);
+  assert(fs_truncate(fd, BIG_SIZE - 5) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("big");
+  assert(fs_get_filesize(fd) == BIG_SIZE - 5);
+  assert(fs_read(fd, read_buf, BIG_SIZE) == BIG_SIZE - 5);
+  assert(memcmp(read_buf, data, BIG_SIZE - 5) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.files == 1 && report.checksum_errors == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0);
+  assert(remove(disk_name) == 0);
+
+  // the smallest blocks spread the dedup and checksum regions over more
+  // metadata blocks than a transaction has ever held
+  opts.features = FS_FEATURE_DEDUP | FS_FEATURE_CHECKSUM;
+  opts.block_size = 1 * BYTES_KB;
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(stat(disk_name, &st) == 0 && st.st_size == 8192LL * BYTES_KB);
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_SMALL; i++) {
+    sprintf(name, "small%d", i);
+    assert(fs_create(name) == 0);
+    fd = fs_open(name);
+    assert(fd >= 0);
+    assert(fs_write(fd, data, 8 * BYTES_KB) == 8 * BYTES_KB);
+    assert(fs_write(fd, data + i, 100) == 100);
+    assert(fs_close(fd) == 0);
+  }
+  assert(fs_dedup_stats(&stats) == 0);
+  assert(stats.hits >= (NUM_SMALL - 1) * 8);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_SMALL; i++) {
+    sprintf(name, "small%d", i);
+    fd = fs_open(name);
+    assert(fd >= 0);
+    assert(fs_read(fd, read_buf, BIG_SIZE) == 8 * BYTES_KB + 100);
+    assert(memcmp(read_buf, data, 8 * BYTES_KB) == 0);
+    assert(memcmp(read_buf + 8 * BYTES_KB, data + i, 100) == 0);
+    assert(fs_close(fd) == 0);
+    if (i % 2) {
+      assert(fs_delete(name) == 0);
+    }
+  }
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.files == NUM_SMALL / 2 && report.checksum_errors == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0);
+  assert(remove(disk_name) == 0);
+
+  // the default is 4 KiB
+  assert(make_fs(disk_name) == 0);
+  assert(stat(disk_name, &st) == 0 && st.st_size == 8192LL * 4 * BYTES_KB);
+  assert(remove(disk_name) == 0);
+
+  // sizes must be powers of two in range
+  opts.features = 0;
+  opts.block_size = 512;
+  assert(make_fs_opts(disk_name, &opts) == -1);
+  opts.block_size = 12 * BYTES_KB;
+  assert(make_fs_opts(disk_name, &opts) == -1);
+  opts.block_size = 128 * BYTES_KB;
+  assert(make_fs_opts(disk_name, &opts) == -1);
+  free(data);
+  free(read_buf);
+}
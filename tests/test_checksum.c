@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BLOCK_SIZE 4096
+
+// Flips one byte of the first block of the disk image that starts with marker.
+void corrupt_block(const char *disk_name, const char *marker) {
+  FILE *disk = fopen(disk_name, "r+b");
+  assert(disk != NULL);
+  char block[BLOCK_SIZE];
+  for (long offset = 0; fread(block, BLOCK_SIZE, 1, disk) == 1;
+       offset += BLOCK_SIZE) {
+    if (memcmp(block, marker, strlen(marker)) == 0) {
+      block[BLOCK_SIZE / 2] ^= 0x01;
+      assert(fseek(disk, offset, SEEK_SET) == 0);
+      assert(fwrite(block, BLOCK_SIZE, 1, disk) == 1);
+      assert(fclose(disk) == 0);
+      return;
+    }
+  }
+  assert(0 && "marker not found");
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  const char *file_name = "test_file";
+  const char *marker = "corrupt me";
+  char *buf = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  int fd;
+
+  for (int i = 0; i < BYTES_MB; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+  memcpy(buf + 100 * BLOCK_SIZE, marker, strlen(marker));
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // a clean image verifies after a remount
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // reads covering the corrupted block fail, other reads still work
+  corrupt_block(disk_name, marker);
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == -1);
+  assert(fs_lseek(fd, 100 * BLOCK_SIZE + 10) == 0);
+  assert(fs_read(fd, read_buf, 10) == -1);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, 100 * BLOCK_SIZE) == 100 * BLOCK_SIZE);
+  assert(memcmp(read_buf, buf, 100 * BLOCK_SIZE) == 0);
+  assert(fs_lseek(fd, 101 * BLOCK_SIZE) == 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB - 101 * BLOCK_SIZE);
+  assert(memcmp(read_buf, buf + 101 * BLOCK_SIZE,
+                BYTES_MB - 101 * BLOCK_SIZE) == 0);
+
+  // rewriting the block repairs it
+  assert(fs_lseek(fd, 100 * BLOCK_SIZE) == 0);
+  assert(fs_write(fd, buf + 100 * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+  assert(fs_close(fd) == 0);
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(buf);
+  free(read_buf);
+}
@@ -0,0 +1,82 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define FILE_SIZE (12 * BYTES_MB)
+#define NUM_FILES 4
+
+int main() {
+  const char *disk_name = "test_fs";
+  const char *file_names[NUM_FILES] = {"1", "2", "3", "4"};
+  struct fs_options opts = {.features = FS_FEATURE_COMPRESSION};
+  char *text = malloc(FILE_SIZE);
+  char *read_buf = malloc(FILE_SIZE);
+  char random_buf[3 * BYTES_KB * 10];
+  char patch[] = "patched in the middle of a cluster";
+  int fd;
+
+  // highly compressible text
+  for (int len = 0; len < FILE_SIZE;) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "record %08d: the quick brown fox\n",
+                     len / 40);
+    n = n < FILE_SIZE - len ? n : FILE_SIZE - len;
+    memcpy(text + len, line, n);
+    len += n;
+  }
+  for (int i = 0; i < sizeof(random_buf); i++) {
+    random_buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // 48 MiB of text fits on a 32 MiB disk
+  for (int i = 0; i < NUM_FILES; i++) {
+    assert(fs_create(file_names[i]) == 0);
+    fd = fs_open(file_names[i]);
+    assert(fd >= 0);
+    assert(fs_write(fd, text, FILE_SIZE) == FILE_SIZE);
+    assert(fs_get_filesize(fd) == FILE_SIZE);
+    assert(fs_close(fd) == 0);
+  }
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    fd = fs_open(file_names[i]);
+    assert(fd >= 0);
+    memset(read_buf, 0, FILE_SIZE);
+    assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(read_buf, text, FILE_SIZE) == 0);
+    assert(fs_close(fd) == 0);
+  }
+
+  // overwrite in the middle, then truncate inside a cluster
+  fd = fs_open(file_names[0]);
+  assert(fd >= 0);
+  assert(fs_lseek(fd, 5 * BYTES_MB + 100) == 0);
+  assert(fs_write(fd, patch, sizeof(patch)) == sizeof(patch));
+  memcpy(text + 5 * BYTES_MB + 100, patch, sizeof(patch));
+  assert(fs_truncate(fd, 5 * BYTES_MB + 1000) == 0);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == 5 * BYTES_MB + 1000);
+  assert(memcmp(read_buf, text, 5 * BYTES_MB + 1000) == 0);
+
+  // data that does not compress is stored as is
+  assert(fs_write(fd, random_buf, sizeof(random_buf)) == sizeof(random_buf));
+  assert(fs_lseek(fd, 5 * BYTES_MB + 1000) == 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == sizeof(random_buf));
+  assert(memcmp(read_buf, random_buf, sizeof(random_buf)) == 0);
+  assert(fs_close(fd) == 0);
+
+  for (int i = 0; i < NUM_FILES; i++) {
+    assert(fs_delete(file_names[i]) == 0);
+  }
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(text);
+  free(read_buf);
+}
@@ -0,0 +1,153 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BIG_SIZE (3 * BYTES_MB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options opts = {.features = FS_FEATURE_CHECKSUM};
+  struct fs_fsck_report report;
+  struct fs_stats stats;
+  char *data = malloc(BIG_SIZE);
+  char *read_buf = malloc(BIG_SIZE + 8192);
+  int src, dst, copied;
+  char c;
+
+  for (int i = 0; i < BIG_SIZE; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("src") == 0 && fs_create("dst") == 0);
+  src = fs_open("src");
+  dst = fs_open("dst");
+  assert(src >= 0 && dst >= 0);
+  assert(fs_write(src, data, BIG_SIZE) == BIG_SIZE);
+  assert(fs_sync() == 0);
+
+  // aligned whole blocks are copied on the disk, not through the caller
+  assert(fs_stats_reset() == 0);
+  assert(fs_copy_range(src, 0, dst, 0, BIG_SIZE) == BIG_SIZE);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.disk_reads.bytes < BYTES_MB);
+  assert(fs_get_filesize(dst) == BIG_SIZE);
+  assert(fs_lseek(dst, 0) == 0);
+  assert(fs_read(dst, read_buf, BIG_SIZE) == BIG_SIZE);
+  assert(memcmp(read_buf, data, BIG_SIZE) == 0);
+
+  // unaligned edges, equally far into their blocks, leave the rest alone
+  assert(fs_copy_range(src, 100, dst, 4096 * 3 + 100, 50000) == 50000);
+  assert(fs_lseek(dst, 0) == 0);
+  assert(fs_read(dst, read_buf, BIG_SIZE) == BIG_SIZE);
+  assert(memcmp(read_buf, data, 4096 * 3 + 100) == 0);
+  assert(memcmp(read_buf + 4096 * 3 + 100, data + 100, 50000) == 0);
+  assert(memcmp(read_buf + 4096 * 3 + 100 + 50000,
+                data + 4096 * 3 + 100 + 50000,
+                BIG_SIZE - 4096 * 3 - 100 - 50000) == 0);
+
+  // misaligned copies go through the buffer
+  assert(fs_copy_range(src, 1, dst, 10, 100000) == 100000);
+  assert(fs_lseek(dst, 10) == 0);
+  assert(fs_read(dst, read_buf, 100000) == 100000);
+  assert(memcmp(read_buf, data + 1, 100000) == 0);
+  assert(fs_copy_range(src, 0, dst, 0, 200000) == 200000);
+
+  // the destination grows, and the copy stops at the end of the source
+  assert(fs_copy_range(src, BIG_SIZE - 8192, dst, BIG_SIZE, 100000) == 8192);
+  assert(fs_get_filesize(dst) == BIG_SIZE + 8192);
+  assert(fs_lseek(dst, 0) == 0);
+  assert(fs_read(dst, read_buf, BIG_SIZE + 8192) == BIG_SIZE + 8192);
+  assert(memcmp(read_buf, data, BIG_SIZE) == 0);
+  assert(memcmp(read_buf + BIG_SIZE, data + BIG_SIZE - 8192, 8192) == 0);
+  assert(fs_copy_range(src, BIG_SIZE, dst, 0, 10) == 0);
+
+  // within one file, ranges must not overlap
+  assert(fs_copy_range(src, 0, src, BIG_SIZE, 8192) == 8192);
+  assert(fs_lseek(src, BIG_SIZE) == 0);
+  assert(fs_read(src, read_buf, 8192) == 8192);
+  assert(memcmp(read_buf, data, 8192) == 0);
+  assert(fs_copy_range(src, 0, src, 4096, 8192) == -1);
+
+  // writes to either file leave the other untouched
+  assert(fs_lseek(src, 0) == 0);
+  assert(fs_write(src, "changed", 7) == 7);
+  assert(fs_lseek(dst, 0) == 0);
+  assert(fs_read(dst, read_buf, 4096) == 4096);
+  assert(memcmp(read_buf, data, 4096) == 0);
+  assert(fs_lseek(src, 0) == 0);
+  assert(fs_write(src, data, 7) == 7);
+
+  // descriptor offsets do not move
+  assert(fs_lseek(dst, 7) == 0);
+  assert(fs_copy_range(src, 0, dst, 0, 4096) == 4096);
+  assert(fs_read(dst, &c, 1) == 1 && c == data[7]);
+
+  assert(fs_copy_range(src, BIG_SIZE + 8193, dst, 0, 10) == -1);
+  assert(fs_copy_range(src, 0, dst, BIG_SIZE + 8193, 10) == -1);
+  assert(fs_copy_range(src, -1, dst, 0, 10) == -1);
+  assert(fs_copy_range(-1, 0, dst, 0, 10) == -1);
+  assert(fs_copy_range(src, 0, -1, 0, 10) == -1);
+  assert(fs_close(src) == 0 && fs_close(dst) == 0);
+  assert(fs_delete("src") == 0);
+
+  // the copy survives the source
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  dst = fs_open("dst");
+  assert(dst >= 0);
+  assert(fs_read(dst, read_buf, BIG_SIZE) == BIG_SIZE);
+  assert(memcmp(read_buf, data, BIG_SIZE) == 0);
+  assert(fs_close(dst) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0);
+  assert(remove(disk_name) == 0);
+
+  // compressed files are copied cluster by cluster through the buffer
+  opts.features = FS_FEATURE_COMPRESSION;
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("src") == 0 && fs_create("dst") == 0);
+  src = fs_open("src");
+  dst = fs_open("dst");
+  assert(fs_write(src, data, BIG_SIZE) == BIG_SIZE);
+  assert(fs_copy_range(src, 0, dst, 0, BIG_SIZE) == BIG_SIZE);
+  assert(fs_copy_range(src, 1, dst, 4096 * 3 + 100, 50000) == 50000);
+  assert(fs_read(dst, read_buf, BIG_SIZE) == BIG_SIZE);
+  assert(memcmp(read_buf, data, 4096 * 3 + 100) == 0);
+  assert(memcmp(read_buf + 4096 * 3 + 100, data + 1, 50000) == 0);
+  assert(memcmp(read_buf + 4096 * 3 + 100 + 50000,
+                data + 4096 * 3 + 100 + 50000,
+                BIG_SIZE - 4096 * 3 - 100 - 50000) == 0);
+  assert(fs_close(src) == 0 && fs_close(dst) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0);
+  assert(remove(disk_name) == 0);
+
+  // a copy larger than the free space is cut short
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("src") == 0 && fs_create("dst") == 0);
+  src = fs_open("src");
+  dst = fs_open("dst");
+  for (int i = 0; i < 6; i++) {
+    assert(fs_write(src, data, BIG_SIZE) == BIG_SIZE);
+  }
+  copied = fs_copy_range(src, 0, dst, 0, 6 * BIG_SIZE);
+  assert(copied > 0 && copied < 6 * BIG_SIZE && copied % 4096 == 0);
+  assert(fs_get_filesize(dst) == copied);
+  assert(fs_lseek(dst, copied - 4096) == 0);
+  assert(fs_read(dst, read_buf, 4096) == 4096);
+  assert(memcmp(read_buf, data + (copied - 4096) % BIG_SIZE, 4096) == 0);
+  assert(fs_close(src) == 0 && fs_close(dst) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+  free(read_buf);
+}
@@ -0,0 +1,143 @@
+#include "../fs.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BIG_SIZE (10 * BYTES_MB) // reaches the double indirect block
+#define BIG_TRUNCATED (100 * BYTES_KB)
+#define OVERWRITE_SIZE BYTES_MB
+#define OVERWRITE_OFFSET (40 * BYTES_KB)
+#define OVERWRITE_LEN (200 * BYTES_KB)
+#define GROW_SIZE (20 * BYTES_KB)
+#define GROWN_SIZE (200 * BYTES_KB)
+#define SMALL_SIZE (64 * BYTES_KB)
+
+const char *disk_name = "test_fs";
+char *old_data;
+char *new_data;
+
+void write_file(const char *name, const char *data, int size) {
+  assert(fs_create(name) == 0);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_write(fd, (void *)data, size) == size);
+  assert(fs_close(fd) == 0);
+}
+
+// Returns whether the file name holds exactly size bytes of data.
+bool has_contents(const char *name, const char *data, int size) {
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  char *buf = malloc(size + 1);
+  bool is_equal = fs_get_filesize(fd) == size &&
+                  fs_read(fd, buf, size + 1) == size &&
+                  memcmp(buf, data, size) == 0;
+  assert(fs_close(fd) == 0);
+  free(buf);
+  return is_equal;
+}
+
+// Runs in a process of its own: commits a set of files, then changes each of
+// them with one operation and waits to be killed before the group commit
+// that would make the changes durable.
+void writer(int pipe_fd) {
+  assert(mount_fs(disk_name) == 0);
+  write_file("big", old_data, BIG_SIZE);
+  write_file("over", old_data, OVERWRITE_SIZE);
+  write_file("grow", old_data, GROW_SIZE);
+  write_file("gone", old_data, SMALL_SIZE);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // shrinks the indirect blocks, overwrites data blocks in the middle of the
+  // file, extends the file into its single indirect block and frees blocks
+  int fd = fs_open("big");
+  assert(fs_truncate(fd, BIG_TRUNCATED) == 0);
+  assert(fs_close(fd) == 0);
+  fd = fs_open("over");
+  assert(fs_lseek(fd, OVERWRITE_OFFSET) == 0);
+  assert(fs_write(fd, new_data, OVERWRITE_LEN) == OVERWRITE_LEN);
+  assert(fs_close(fd) == 0);
+  fd = fs_open("grow");
+  assert(fs_lseek(fd, GROW_SIZE) == 0);
+  assert(fs_write(fd, old_data + GROW_SIZE, GROWN_SIZE - GROW_SIZE) ==
+         GROWN_SIZE - GROW_SIZE);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("gone") == 0);
+  write_file("new", new_data, SMALL_SIZE);
+  assert(write(pipe_fd, "x", 1) == 1);
+  pause();
+}
+
+// Each change made by writer either committed or left its file as it was.
+void check_files() {
+  assert(has_contents("big", old_data, BIG_SIZE) ||
+         has_contents("big", old_data, BIG_TRUNCATED));
+  char *over = malloc(OVERWRITE_SIZE);
+  memcpy(over, old_data, OVERWRITE_SIZE);
+  memcpy(over + OVERWRITE_OFFSET, new_data, OVERWRITE_LEN);
+  assert(has_contents("over", old_data, OVERWRITE_SIZE) ||
+         has_contents("over", over, OVERWRITE_SIZE));
+  free(over);
+  assert(has_contents("grow", old_data, GROW_SIZE) ||
+         has_contents("grow", old_data, GROWN_SIZE));
+  assert(fs_open("gone") == -1 || has_contents("gone", old_data, SMALL_SIZE));
+  assert(fs_open("new") == -1 || has_contents("new", new_data, 0) ||
+         has_contents("new", new_data, SMALL_SIZE));
+}
+
+void crash_and_recover(uint32_t features) {
+  struct fs_options opts = {.features = features};
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  int pipe_fds[2];
+  assert(pipe(pipe_fds) == 0);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    writer(pipe_fds[1]);
+  }
+  close(pipe_fds[1]);
+  char c;
+  assert(read(pipe_fds[0], &c, 1) == 1);
+  close(pipe_fds[0]);
+  assert(kill(pid, SIGKILL) == 0);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFSIGNALED(status));
+
+  // the recovery scan finds every committed block intact
+  assert(mount_fs(disk_name) == 0);
+  check_files();
+  assert(umount_fs(disk_name) == 0);
+  struct fs_fsck_report report;
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0 && report.bad_pointers == 0);
+  assert(mount_fs(disk_name) == 0);
+  check_files();
+  assert(umount_fs(disk_name) == 0);
+}
+
+int main() {
+  old_data = malloc(BIG_SIZE);
+  new_data = malloc(OVERWRITE_LEN);
+  for (int i = 0; i < BIG_SIZE; i++) {
+    old_data[i] = 'a' + rand() % 26;
+  }
+  for (int i = 0; i < OVERWRITE_LEN; i++) {
+    new_data[i] = 'A' + rand() % 26;
+  }
+
+  crash_and_recover(0);
+  crash_and_recover(FS_FEATURE_CHECKSUM);
+
+  assert(remove(disk_name) == 0);
+  free(old_data);
+  free(new_data);
+}
@@ -0,0 +1,107 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define NUM_DISKS 4
+
+const char *disk_names[NUM_DISKS] = {"test_fs0", "test_fs1", "test_fs2",
+                                     "test_fs3"};
+
+// Fills buf with the contents of the file on disk idx.
+void fill(char *buf, int idx) {
+  for (int i = 0; i < BYTES_MB; i++) {
+    buf[i] = 'a' + (idx * 5 + i / 4096) % 26;
+  }
+}
+
+// Fills its own image through its own context.
+void *disk_worker(void *arg) {
+  int idx = (int)(long)arg;
+  char *buf = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  fill(buf, idx);
+  fs_ctx *ctx = fs_mount(disk_names[idx]);
+  assert(ctx != NULL);
+  assert(fs_ctx_create(ctx, "file") == 0);
+  assert(fs_ctx_create(ctx, disk_names[idx]) == 0);
+  int fd = fs_ctx_open(ctx, "file");
+  assert(fd >= 0);
+  for (int i = 0; i < 4; i++) {
+    assert(fs_ctx_write(ctx, fd, buf, BYTES_MB) == BYTES_MB);
+  }
+  assert(fs_ctx_get_filesize(ctx, fd) == 4 * BYTES_MB);
+  assert(fs_ctx_truncate(ctx, fd, BYTES_MB) == 0);
+  assert(fs_ctx_lseek(ctx, fd, 0) == 0);
+  assert(fs_ctx_read(ctx, fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+  assert(fs_ctx_fsync(ctx, fd) == 0);
+  assert(fs_ctx_close(ctx, fd) == 0);
+  assert(fs_unmount(ctx) == 0);
+  free(buf);
+  free(read_buf);
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[NUM_DISKS];
+  char *buf = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  char **files;
+  int fd;
+
+  for (int i = 0; i < NUM_DISKS; i++) {
+    remove(disk_names[i]); // remove disk if it exists
+    assert(make_fs(disk_names[i]) == 0);
+  }
+  assert(fs_mount("missing_fs") == NULL);
+
+  // the default context stays usable next to the others
+  remove("test_fs");
+  assert(make_fs("test_fs") == 0);
+  assert(mount_fs("test_fs") == 0);
+  assert(fs_create("default") == 0);
+  for (long i = 0; i < NUM_DISKS; i++) {
+    assert(pthread_create(&threads[i], NULL, disk_worker, (void *)i) == 0);
+  }
+  for (int i = 0; i < NUM_DISKS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+  assert(fs_listfiles(&files) == 0);
+  assert(strcmp(files[0], "default") == 0 && files[1] == NULL);
+  free(files[0]);
+  free(files);
+  assert(umount_fs("test_fs") == 0);
+
+  // every image holds only what its own context wrote
+  for (int i = 0; i < NUM_DISKS; i++) {
+    fs_ctx *ctx = fs_mount(disk_names[i]);
+    assert(ctx != NULL);
+    assert(fs_ctx_listfiles(ctx, &files) == 0);
+    int num_files = 0;
+    for (char **file = files; *file; file++, num_files++) {
+      assert(strcmp(*file, "file") == 0 || strcmp(*file, disk_names[i]) == 0);
+      free(*file);
+    }
+    free(files);
+    assert(num_files == 2);
+    fd = fs_ctx_open(ctx, "file");
+    assert(fd >= 0);
+    fill(buf, i);
+    assert(fs_ctx_read(ctx, fd, read_buf, BYTES_MB) == BYTES_MB);
+    assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+    assert(fs_ctx_close(ctx, fd) == 0);
+    assert(fs_unmount(ctx) == 0);
+
+    struct fs_fsck_report report;
+    assert(fs_fsck(disk_names[i], NULL, &report) == 0);
+    assert(report.files == 2 && report.orphaned_blocks == 0);
+    assert(remove(disk_names[i]) == 0);
+  }
+
+  assert(remove("test_fs") == 0);
+  free(buf);
+  free(read_buf);
+}
@@ -0,0 +1,95 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define NUM_FILES 40
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options opts = {.features = FS_FEATURE_DEDUP};
+  struct fs_dedup_stats stats;
+  char file_name[16];
+  char *buf = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  int fd;
+
+  for (int i = 0; i < BYTES_MB; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+  memset(buf + BYTES_MB / 2, 0, BYTES_MB / 4); // zero pages
+
+  remove(disk_name); // remove disk if it exists
+  opts.features |= FS_FEATURE_COMPRESSION;
+  assert(make_fs_opts(disk_name, &opts) == -1); // exclusive features
+  opts.features = FS_FEATURE_DEDUP;
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // 40 MiB of identical files fit on a 32 MiB disk
+  for (int i = 0; i < NUM_FILES; i++) {
+    snprintf(file_name, sizeof(file_name), "%d", i);
+    assert(fs_create(file_name) == 0);
+    fd = fs_open(file_name);
+    assert(fd >= 0);
+    assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+    assert(fs_close(fd) == 0);
+  }
+  assert(fs_dedup_stats(&stats) == 0);
+  assert(stats.lookups == NUM_FILES * BYTES_MB / 4096);
+  assert(stats.hits > (NUM_FILES - 1) * BYTES_MB / 4096);
+  assert(stats.hit_ratio > 0.9);
+  assert(stats.unique_blocks == 3 * BYTES_MB / 4 / 4096 + 1);
+  assert(stats.index_memory > 0);
+  printf("dedup: %llu/%llu hits, %llu blocks saved, %zu bytes of index\n",
+         (unsigned long long)stats.hits, (unsigned long long)stats.lookups,
+         (unsigned long long)stats.saved_blocks, stats.index_memory);
+
+  // changing a shared block leaves the other files alone
+  fd = fs_open("0");
+  assert(fd >= 0);
+  assert(fs_write(fd, "changed", 7) == 7);
+  assert(fs_close(fd) == 0);
+  fd = fs_open("1");
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+  assert(fs_truncate(fd, 100) == 0);
+  assert(fs_close(fd) == 0);
+  for (int i = 2; i < NUM_FILES; i += 2) {
+    snprintf(file_name, sizeof(file_name), "%d", i);
+    assert(fs_delete(file_name) == 0);
+  }
+
+  // the index survives a remount
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("0");
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, "changed", 7) == 0);
+  assert(memcmp(read_buf + 7, buf + 7, BYTES_MB - 7) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_create("new") == 0);
+  fd = fs_open("new");
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+  assert(fs_close(fd) == 0);
+  assert(fs_dedup_stats(&stats) == 0);
+  assert(stats.hits == stats.lookups);
+  for (int i = 1; i < NUM_FILES; i += 2) {
+    snprintf(file_name, sizeof(file_name), "%d", i);
+    fd = fs_open(file_name);
+    assert(fd >= 0);
+    memset(read_buf, 0, BYTES_MB);
+    assert(fs_read(fd, read_buf, BYTES_MB) == (i == 1 ? 100 : BYTES_MB));
+    assert(memcmp(read_buf, buf, i == 1 ? 100 : BYTES_MB) == 0);
+    assert(fs_close(fd) == 0);
+  }
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(buf);
+  free(read_buf);
+}
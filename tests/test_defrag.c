@@ -0,0 +1,121 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define CHUNK_SIZE (16 * BYTES_KB)
+#define FILE_SIZE (2 * BYTES_MB)
+#define NUM_FILES 6
+
+const char *file_names[NUM_FILES] = {"1", "2", "3", "4", "5", "6"};
+char *bufs[NUM_FILES];
+
+void check_file(int i) {
+  char *read_buf = malloc(FILE_SIZE);
+  int fd = fs_open(file_names[i]);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, bufs[i], FILE_SIZE) == 0);
+  assert(fs_close(fd) == 0);
+  free(read_buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_defrag_report report;
+  int fds[NUM_FILES];
+  int ret, calls;
+
+  for (int i = 0; i < NUM_FILES; i++) {
+    bufs[i] = malloc(FILE_SIZE);
+    for (int j = 0; j < FILE_SIZE; j++) {
+      bufs[i][j] = 'A' + rand() % 26;
+    }
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // interleaved appends scatter the blocks of every file
+  for (int i = 0; i < NUM_FILES; i++) {
+    assert(fs_create(file_names[i]) == 0);
+    fds[i] = fs_open(file_names[i]);
+    assert(fds[i] >= 0);
+  }
+  for (int offset = 0; offset < FILE_SIZE; offset += CHUNK_SIZE) {
+    for (int i = 0; i < NUM_FILES; i++) {
+      assert(fs_write(fds[i], bufs[i] + offset, CHUNK_SIZE) == CHUNK_SIZE);
+    }
+  }
+  for (int i = 0; i < NUM_FILES; i++) {
+    assert(fs_close(fds[i]) == 0);
+  }
+  assert(fs_delete(file_names[1]) == 0);
+  assert(fs_delete(file_names[4]) == 0);
+
+  // one file at a time, in calls of bounded work
+  assert(fs_defrag("none", &report) == -1);
+  calls = 0;
+  do {
+    ret = fs_defrag(file_names[0], &report);
+    assert(ret >= 0);
+    assert(report.files == 1);
+    assert(report.moved_blocks <= 256);
+    if (calls++ == 0) {
+      assert(report.extents_before > FILE_SIZE / CHUNK_SIZE / 2);
+    }
+  } while (ret == 1);
+  assert(calls > 1);
+  assert(report.extents_after == 1);
+  check_file(0);
+
+  // then the rest, which also compacts the free space
+  calls = 0;
+  do {
+    ret = fs_defrag_all(&report);
+    assert(ret >= 0);
+    assert(report.files == NUM_FILES - 2);
+    if (calls++ == 0) {
+      assert(report.extents_before > NUM_FILES - 2);
+    }
+  } while (ret == 1);
+  assert(report.extents_after == NUM_FILES - 2);
+  assert(report.free_extents_after <= report.free_extents_before);
+  assert(fs_defrag_all(&report) == 0);
+  assert(report.moved_blocks == 0);
+  assert(report.extents_before == NUM_FILES - 2);
+  printf("defrag: %llu extents, %llu free extents after %d calls\n",
+         (unsigned long long)report.extents_after,
+         (unsigned long long)report.free_extents_after, calls);
+
+  // the moves survive a remount
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (i != 1 && i != 4) {
+      check_file(i);
+    }
+  }
+
+  // files shared with a snapshot stay in place
+  assert(fs_snapshot_create() == 0);
+  assert(fs_create(file_names[1]) == 0);
+  fds[1] = fs_open(file_names[1]);
+  assert(fds[1] >= 0);
+  assert(fs_write(fds[1], bufs[1], FILE_SIZE) == FILE_SIZE);
+  assert(fs_close(fds[1]) == 0);
+  assert(fs_defrag_all(&report) >= 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (i != 4) {
+      check_file(i);
+    }
+  }
+
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    free(bufs[i]);
+  }
+}
@@ -0,0 +1,177 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BLOCK_SIZE 4096
+#define INODE_BITMAP_BLOCK 2
+#define USED_BLOCK_BITMAP_BLOCK 3
+#define NUM_FILES 4
+
+const char *disk_name = "test_fs";
+char *buf;
+
+// Overwrites the first size bytes of block block_num of the disk image.
+void patch_block(int block_num, const void *data, size_t size) {
+  FILE *disk = fopen(disk_name, "r+b");
+  assert(disk != NULL);
+  assert(fseek(disk, (long)block_num * BLOCK_SIZE, SEEK_SET) == 0);
+  assert(fwrite(data, size, 1, disk) == 1);
+  assert(fclose(disk) == 0);
+}
+
+// Returns the first block of the disk image that starts with size bytes of
+// data.
+int find_block(const void *data, size_t size) {
+  char block[BLOCK_SIZE];
+  FILE *disk = fopen(disk_name, "rb");
+  assert(disk != NULL);
+  for (int block_num = 0; fread(block, BLOCK_SIZE, 1, disk) == 1;
+       block_num++) {
+    if (memcmp(block, data, size) == 0) {
+      assert(fclose(disk) == 0);
+      return block_num;
+    }
+  }
+  assert(false);
+}
+
+bool is_clean(const struct fs_fsck_report *report) {
+  return report->bad_dir_entries == 0 && report->missing_inodes == 0 &&
+         report->orphaned_inodes == 0 && report->bad_pointers == 0 &&
+         report->cross_linked_blocks == 0 && report->missing_blocks == 0 &&
+         report->orphaned_blocks == 0 && report->checksum_errors == 0;
+}
+
+// Repairs the image and checks that a second pass finds nothing.
+void repair(int threads) {
+  struct fs_fsck_options opts = {.repair = true, .threads = threads};
+  struct fs_fsck_report report;
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(report.repaired);
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(is_clean(&report) && report.repaired == false);
+}
+
+void check_files() {
+  char file_name[16];
+  char *read_buf = malloc(BYTES_MB);
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    snprintf(file_name, sizeof(file_name), "%d", i);
+    int fd = fs_open(file_name);
+    assert(fd >= 0);
+    assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+    assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+    assert(fs_close(fd) == 0);
+  }
+  assert(umount_fs(disk_name) == 0);
+  free(read_buf);
+}
+
+int main() {
+  struct fs_fsck_options opts = {.repair = false, .threads = 4};
+  struct fs_fsck_report report;
+  char file_name[16];
+  char block[BLOCK_SIZE];
+  int fd;
+
+  buf = malloc(BYTES_MB);
+  for (int i = 0; i < BYTES_MB; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    snprintf(file_name, sizeof(file_name), "%d", i);
+    assert(fs_create(file_name) == 0);
+    fd = fs_open(file_name);
+    assert(fd >= 0);
+    assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+    assert(fs_close(fd) == 0);
+  }
+  assert(fs_fsck(disk_name, &opts, &report) == -1); // mounted
+  assert(umount_fs(disk_name) == 0);
+
+  // a consistent image passes
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(is_clean(&report));
+  assert(report.files == NUM_FILES);
+  // the indirect blocks, and the windows of blocks in use for the checksums
+  assert(report.bytes_read > NUM_FILES * BYTES_MB &&
+         report.bytes_read < 8192ULL * BLOCK_SIZE / 4);
+
+  // a cleared block bitmap loses every block in use
+  memset(block, 0, sizeof(block));
+  patch_block(USED_BLOCK_BITMAP_BLOCK, block, sizeof(block));
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(report.missing_blocks > NUM_FILES * BYTES_MB / BLOCK_SIZE);
+  assert(report.repaired == false);
+  assert(fs_fsck(disk_name, &opts, &report) == 0); // nothing was changed
+  assert(report.missing_blocks > NUM_FILES * BYTES_MB / BLOCK_SIZE);
+  repair(1);
+  check_files();
+
+  // a full block bitmap leaks every free block
+  memset(block, 0xff, sizeof(block));
+  patch_block(USED_BLOCK_BITMAP_BLOCK, block, sizeof(block));
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(report.orphaned_blocks > 4000);
+  assert(report.missing_blocks == 0);
+  repair(4);
+  check_files();
+
+  // an inode without a directory entry is released
+  patch_block(INODE_BITMAP_BLOCK, block, 8);
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(report.orphaned_inodes == 64 - NUM_FILES);
+  repair(3);
+  check_files();
+
+  // blocks freed by a delete that committed right before a crash
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    assert(mount_fs(disk_name) == 0);
+    assert(fs_delete("0") == 0);
+    assert(fs_sync() == 0);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(report.files == NUM_FILES - 1);
+  assert(report.orphaned_blocks >= BYTES_MB / BLOCK_SIZE);
+  repair(0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_open("0") == -1);
+  assert(umount_fs(disk_name) == 0);
+
+  // a damaged data block fails its checksum
+  memset(block, 0, sizeof(block));
+  patch_block(find_block(buf + BYTES_MB / 2, BLOCK_SIZE), block, 1);
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(report.checksum_errors == 1);
+
+  // without checksums only the indirect blocks are read
+  struct fs_options plain = {.features = 0};
+  assert(make_fs_opts(disk_name, &plain) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("0") == 0);
+  fd = fs_open("0");
+  assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, &opts, &report) == 0);
+  assert(is_clean(&report));
+  assert(report.bytes_read == BLOCK_SIZE);
+
+  assert(remove(disk_name) == 0);
+  free(buf);
+}
@@ -0,0 +1,108 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define FILE_SIZE (64 * BYTES_KB)
+#define NUM_FILES 40
+
+// Runs ops in a child process that exits without unmounting, like a crash.
+void crash_after(void (*ops)(const char *, const char *), const char *disk_name,
+                 const char *buf) {
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    ops(disk_name, buf);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void create_files(const char *disk_name, const char *buf) {
+  char file_name[16];
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    snprintf(file_name, sizeof(file_name), "%d", i);
+    assert(fs_create(file_name) == 0);
+    int fd = fs_open(file_name);
+    assert(fd >= 0);
+    assert(fs_write(fd, (void *)buf, FILE_SIZE) == FILE_SIZE);
+    assert(fs_close(fd) == 0);
+  }
+}
+
+void delete_files(const char *disk_name, const char *buf) {
+  char **files;
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_listfiles(&files) == 0);
+  for (int i = 0; files[i]; i++) {
+    assert(fs_delete(files[i]) == 0);
+  }
+}
+
+// Checks that every file is either empty or whole and returns their number.
+int check_files(const char *buf) {
+  char **files;
+  char read_buf[FILE_SIZE];
+  int num_files = 0;
+  assert(fs_listfiles(&files) == 0);
+  for (int i = 0; files[i]; i++, num_files++) {
+    int fd = fs_open(files[i]);
+    assert(fd >= 0);
+    int size = fs_get_filesize(fd);
+    assert(size == 0 || size == FILE_SIZE);
+    if (size) {
+      assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+      assert(memcmp(read_buf, buf, FILE_SIZE) == 0);
+    }
+    assert(fs_close(fd) == 0);
+    free(files[i]);
+  }
+  free(files);
+  return num_files;
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  char *buf = malloc(FILE_SIZE);
+  int fd;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+
+  // committed creates and writes survive, in whole operations
+  crash_after(create_files, disk_name, buf);
+  assert(mount_fs(disk_name) == 0);
+  int num_files = check_files(buf);
+  assert(num_files >= NUM_FILES * 3 / 4);
+  assert(umount_fs(disk_name) == 0);
+
+  // so do deletes, and the recovered image stays usable
+  crash_after(delete_files, disk_name, buf);
+  assert(mount_fs(disk_name) == 0);
+  assert(check_files(buf) < num_files);
+  assert(fs_create("new") == 0);
+  fd = fs_open("new");
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("new");
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == FILE_SIZE);
+  assert(fs_close(fd) == 0);
+  check_files(buf);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(buf);
+}
@@ -0,0 +1,148 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define CHUNK_SIZE (32 * BYTES_KB) // an eighth of a segment
+#define NUM_FILES 48
+#define FILE_CHUNKS 20
+#define FILE_SIZE (FILE_CHUNKS * CHUNK_SIZE)
+#define SEGMENT_BLOCKS 64
+
+// Checks that the file name holds size bytes of data.
+void check_file(const char *name, const char *data, int size) {
+  char *buf = malloc(size);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == size);
+  assert(fs_read(fd, buf, size) == size);
+  assert(memcmp(buf, data, size) == 0);
+  assert(fs_close(fd) == 0);
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options log = {.features = FS_FEATURE_LOG | FS_FEATURE_CHECKSUM};
+  struct fs_statfs before, after;
+  struct fs_clean_report report;
+  struct fs_stats stats;
+  char name[16];
+  char *data = malloc(FILE_SIZE);
+  int fds[NUM_FILES];
+  int fd;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &log) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // writes go to the head of the log, leaving holes behind: the first
+  // replaces the empty block the file was created with, an overwrite the
+  // block it changes
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fs_write(fd, data, 8 * 4096) == 8 * 4096);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&before) == 0);
+  assert(before.largest_free_extent == before.free_blocks - 1);
+  assert(fs_lseek(fd, 5 * 4096 + 10) == 0);
+  assert(fs_write(fd, data + 5 * 4096 + 10, 100) == 100);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&after) == 0);
+  assert(after.free_blocks == before.free_blocks);
+  assert(after.largest_free_extent == after.free_blocks - 2);
+  assert(fs_close(fd) == 0);
+
+  // the log continues where it was after a remount, rather than filling the
+  // first hole
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("file");
+  assert(fs_lseek(fd, 10) == 0);
+  assert(fs_write(fd, data + 10, 100) == 100);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&after) == 0);
+  assert(after.largest_free_extent == after.free_blocks - 3);
+  check_file("file", data, 8 * 4096);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("file") == 0);
+
+  // files appended to side by side share segments; deleting every other one
+  // leaves them half used. The cleaner may start on them as soon as they are
+  // deleted.
+  assert(fs_stats_reset() == 0);
+  for (int i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "file%d", i);
+    assert(fs_create(name) == 0);
+    fds[i] = fs_open(name);
+  }
+  for (int chunk = 0; chunk < FILE_CHUNKS; chunk++) {
+    for (int i = 0; i < NUM_FILES; i++) {
+      assert(fs_write(fds[i], data + chunk * CHUNK_SIZE, CHUNK_SIZE) ==
+             CHUNK_SIZE);
+    }
+  }
+  for (int i = 0; i < NUM_FILES; i++) {
+    assert(fs_close(fds[i]) == 0);
+    if (i % 2) {
+      sprintf(name, "file%d", i);
+      assert(fs_delete(name) == 0);
+    }
+  }
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&before) == 0);
+
+  // the next write wakes the cleaner, as few segments are clean, unless it
+  // is already at work
+  assert(fs_create("trigger") == 0);
+  fd = fs_open("trigger");
+  assert(fs_write(fd, data, 100) == 100);
+  assert(fs_close(fd) == 0);
+  for (int i = 0; i < 500; i++) {
+    assert(fs_stats(&stats) == 0);
+    if (stats.cleaned_blocks) {
+      break;
+    }
+    usleep(10 * 1000);
+  }
+  assert(stats.cleaned_blocks > 0);
+
+  // passes run until no segment is worth cleaning, which compacts the
+  // free space into clean segments
+  for (int i = 0; i < 100; i++) {
+    assert(fs_clean(&report) == 0);
+    if (report.segments == 0) {
+      break;
+    }
+    assert(report.moved_blocks > 0);
+  }
+  assert(report.segments == 0);
+  assert(fs_statfs(&after) == 0);
+  assert(after.free_blocks >= before.free_blocks - 1);
+  assert(report.clean_segments * SEGMENT_BLOCKS >= after.free_blocks / 2);
+  for (int i = 0; i < NUM_FILES; i += 2) {
+    sprintf(name, "file%d", i);
+    check_file(name, data, FILE_SIZE);
+  }
+  check_file("trigger", data, 100);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_clean(&report) == -1);
+
+  struct fs_fsck_report fsck_report;
+  assert(fs_fsck(disk_name, NULL, &fsck_report) == 0);
+  assert(fsck_report.orphaned_blocks == 0 && fsck_report.missing_blocks == 0 &&
+         fsck_report.cross_linked_blocks == 0 &&
+         fsck_report.checksum_errors == 0);
+
+  // images that update in place have no log to clean
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_clean(&report) == -1);
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+}
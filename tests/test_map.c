@@ -0,0 +1,115 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define FILE_SIZE (10 * 4096)
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_fsck_report report;
+  struct fs_statfs statfs;
+  struct fs_stats stats;
+  const void *ptr, *other;
+  char *data = malloc(FILE_SIZE);
+  char buf[4096];
+  uint64_t free_blocks;
+  int fd, other_fd;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+  memset(buf, 'z', sizeof(buf));
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fd >= 0);
+  assert(fs_write(fd, data, FILE_SIZE) == FILE_SIZE);
+  assert(fs_sync() == 0);
+
+  // consecutive blocks are mapped from the disk, not read
+  assert(fs_stats_reset() == 0);
+  assert(fs_map(fd, 4096 + 100, 2 * 4096, &ptr) == 2 * 4096);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.disk_reads.bytes == 0);
+  assert(memcmp(ptr, data + 4096 + 100, 2 * 4096) == 0);
+  assert(fs_statfs(&statfs) == 0);
+  free_blocks = statfs.free_blocks;
+
+  // blocks outside the range are still written in place
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_write(fd, buf, 4096) == 4096);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_blocks == free_blocks);
+
+  // the three pinned blocks are copied on write, and the range keeps the
+  // bytes it was mapped with
+  assert(fs_lseek(fd, 4096) == 0);
+  for (int i = 0; i < 3; i++) {
+    assert(fs_write(fd, buf, 4096) == 4096);
+  }
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_blocks == free_blocks - 3);
+  assert(memcmp(ptr, data + 4096 + 100, 2 * 4096) == 0);
+  assert(fs_lseek(fd, 4096 + 100) == 0);
+  assert(fs_read(fd, buf, 10) == 10 && memcmp(buf, "zzzzzzzzzz", 10) == 0);
+
+  // new files do not reuse the pinned blocks
+  memset(buf, 'y', sizeof(buf));
+  assert(fs_create("other") == 0);
+  other_fd = fs_open("other");
+  assert(other_fd >= 0);
+  for (int i = 0; i < 4; i++) {
+    assert(fs_write(other_fd, buf, 4096) == 4096);
+  }
+  assert(fs_sync() == 0);
+  assert(memcmp(ptr, data + 4096 + 100, 2 * 4096) == 0);
+
+  // unmapping frees the old blocks; writes to them go in place again
+  assert(fs_unmap(ptr) == 0);
+  assert(fs_unmap(ptr) == -1);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_blocks == free_blocks - 4);
+  assert(fs_lseek(fd, 4096) == 0);
+  assert(fs_write(fd, buf, 4096) == 4096);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_blocks == free_blocks - 4);
+
+  // a deleted file's blocks stay until its last range goes
+  assert(fs_map(other_fd, 0, 4 * 4096, &other) == 4 * 4096);
+  assert(fs_close(other_fd) == 0);
+  assert(fs_delete("other") == 0);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_blocks == free_blocks - 4);
+  assert(memcmp(other, buf, 4096) == 0);
+  assert(fs_unmap(other) == 0);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_blocks == free_blocks);
+
+  // ranges stop at the end of the file
+  assert(fs_map(fd, FILE_SIZE - 5, 100, &ptr) == 5);
+  assert(fs_unmap(ptr) == 0);
+  assert(fs_map(fd, FILE_SIZE, 1, &ptr) == -1);
+  assert(fs_map(fd, -1, 1, &ptr) == -1);
+  assert(fs_map(fd, 0, 0, &ptr) == -1);
+  assert(fs_map(-1, 0, 1, &ptr) == -1);
+  assert(fs_unmap(buf) == -1);
+
+  // ranges still held are released by the unmount
+  assert(fs_map(fd, 0, 10, &ptr) == 10);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_unmap(ptr) == -1);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+}
@@ -1,13 +1,14 @@
 #include "../fs.h"
 #include <assert.h>
 
-#define MAX_FD 32
+#define MAX_FD (1 << 16)
+#define NUM_FILES 32
 
 int main() {
   const char *disk_name = "test_fs";
   const char *file_name = "test_file";
-  int fds[MAX_FD];
-  const char *file_names[MAX_FD] = {
+  static int fds[MAX_FD];
+  const char *file_names[NUM_FILES] = {
       "1",  "2",  "3",  "4",  "5",  "6",  "7",  "8",  "9",  "10", "11",
       "12", "13", "14", "15", "16", "17", "18", "19", "20", "21", "22",
       "23", "24", "25", "26", "27", "28", "29", "30", "31", "32",
@@ -30,15 +31,20 @@ int main() {
   }
   assert(fs_close(fds[0]) == -1); // fd not in use
 
-  // open multiple files
+  // open multiple files, each as often as it fits
   for (int i = 0; i < MAX_FD; i++) {
-    assert(fs_create(file_names[i]) == 0);
-    fds[i] = fs_open(file_names[i]);
+    if (i < NUM_FILES) {
+      assert(fs_create(file_names[i]) == 0);
+    }
+    fds[i] = fs_open(file_names[i % NUM_FILES]);
+    assert(fds[i] >= 0);
   }
   assert(fs_open(file_name) == -1); // fd limit reached
+  assert(fs_delete(file_names[0]) == -1); // file is open
   for (int i = 0; i < MAX_FD; i++) {
     assert(fs_close(fds[i]) == 0);
   }
+  assert(fs_delete(file_names[0]) == 0);
 
   assert(umount_fs(disk_name) == 0);
   assert(fs_open(file_name) == -1); // disk not mounted
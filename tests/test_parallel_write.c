@@ -0,0 +1,93 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define FILE_SIZE (16 * BYTES_MB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  const char *file_name = "test_file";
+  struct fs_options opts = {.features = FS_FEATURE_CHECKSUM};
+  struct fs_fsck_report report;
+  char *buf0 = malloc(FILE_SIZE);
+  char *buf1 = malloc(FILE_SIZE);
+  char *big_buf = malloc(40 * BYTES_MB);
+  char *read_buf = malloc(40 * BYTES_MB);
+  int fd;
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf0[i] = 'A' + rand() % 26;
+    buf1[i] = 'a' + rand() % 26;
+  }
+  memset(big_buf, 'x', 40 * BYTES_MB);
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_set_write_threads(4) == 0);
+
+  // an unaligned write splits into a head, whole blocks and a tail
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf0, 100) == 100);
+  assert(fs_write(fd, buf0 + 100, FILE_SIZE - 200) == FILE_SIZE - 200);
+  assert(fs_write(fd, buf0 + FILE_SIZE - 100, 100) == 100);
+  assert(fs_get_filesize(fd) == FILE_SIZE);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, buf0, FILE_SIZE) == 0);
+  assert(fs_snapshot_create() == 0);
+
+  // overwriting blocks shared with the snapshot moves them
+  assert(fs_lseek(fd, 12345) == 0);
+  assert(fs_write(fd, buf1, 8 * BYTES_MB) == 8 * BYTES_MB);
+  memcpy(buf1 + 8 * BYTES_MB, buf0, FILE_SIZE - 8 * BYTES_MB);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(fs_snapshot_mount(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, buf0, FILE_SIZE) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // the live file system verifies its checksums after a remount
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, buf0, 12345) == 0);
+  assert(memcmp(read_buf + 12345, buf1, 8 * BYTES_MB) == 0);
+  assert(memcmp(read_buf + 12345 + 8 * BYTES_MB, buf0 + 12345 + 8 * BYTES_MB,
+                FILE_SIZE - 12345 - 8 * BYTES_MB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_snapshot_delete() == 0);
+  assert(fs_delete(file_name) == 0);
+
+  // a write larger than the free space writes what fits
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  int bytes_written = fs_write(fd, big_buf, 40 * BYTES_MB);
+  assert(bytes_written > 20 * BYTES_MB && bytes_written < 40 * BYTES_MB);
+  assert(fs_get_filesize(fd) == bytes_written);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, bytes_written) == bytes_written);
+  assert(memcmp(read_buf, big_buf, bytes_written) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0);
+  assert(remove(disk_name) == 0);
+  free(buf0);
+  free(buf1);
+  free(big_buf);
+  free(read_buf);
+}
@@ -0,0 +1,142 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BIG_SIZE (6 * BYTES_MB)
+#define NUM_SMALL 300
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_options opts = {.features = FS_FEATURE_CHECKSUM};
+  struct fs_stats vectored, contiguous;
+  struct fs_fsck_report report;
+  struct iovec iov[NUM_SMALL];
+  char *data = malloc(BIG_SIZE);
+  char *read_buf = malloc(BIG_SIZE);
+  char *p;
+  int fd, fd_c;
+
+  for (int i = 0; i < BIG_SIZE; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+  assert(fs_set_write_threads(4) == 0);
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // a header, payload and trailer gathered from three buffers move the same
+  // bytes to the disk as one buffer, with as many block map lookups
+  assert(fs_create("vectored") == 0 && fs_create("contiguous") == 0);
+  fd = fs_open("vectored");
+  fd_c = fs_open("contiguous");
+  assert(fd >= 0 && fd_c >= 0);
+  assert(fs_write(fd, data, 4000) == 4000);
+  assert(fs_write(fd_c, data, 4000) == 4000);
+  assert(fs_sync() == 0);
+  iov[0] = (struct iovec){data, 16};
+  iov[1] = (struct iovec){data + 16, 3 * 4096 + 100 - 16 - 8};
+  iov[2] = (struct iovec){data + 3 * 4096 + 100 - 8, 8};
+  assert(fs_stats_reset() == 0);
+  assert(fs_writev(fd, iov, 3) == 3 * 4096 + 100);
+  assert(fs_stats(&vectored) == 0);
+  assert(fs_stats_reset() == 0);
+  assert(fs_write(fd_c, data, 3 * 4096 + 100) == 3 * 4096 + 100);
+  assert(fs_stats(&contiguous) == 0);
+  assert(vectored.disk_reads.bytes == contiguous.disk_reads.bytes);
+  assert(vectored.disk_writes.bytes == contiguous.disk_writes.bytes);
+  assert(vectored.map_lookups == contiguous.map_lookups);
+  assert(vectored.alloc_calls == contiguous.alloc_calls);
+
+  // and are scattered back the same way
+  assert(fs_lseek(fd, 4000) == 0 && fs_lseek(fd_c, 4000) == 0);
+  assert(fs_stats_reset() == 0);
+  assert(fs_read(fd_c, read_buf, 3 * 4096 + 100) == 3 * 4096 + 100);
+  assert(fs_stats(&contiguous) == 0);
+  memset(read_buf, 0, 3 * 4096 + 100);
+  iov[0].iov_base = read_buf;
+  iov[1].iov_base = read_buf + 16;
+  iov[2].iov_base = read_buf + 3 * 4096 + 100 - 8;
+  assert(fs_stats_reset() == 0);
+  assert(fs_readv(fd, iov, 3) == 3 * 4096 + 100);
+  assert(fs_stats(&vectored) == 0);
+  assert(memcmp(read_buf, data, 3 * 4096 + 100) == 0);
+  assert(vectored.disk_reads.bytes == contiguous.disk_reads.bytes);
+  assert(vectored.map_lookups == contiguous.map_lookups);
+  assert(fs_close(fd_c) == 0);
+  assert(fs_delete("contiguous") == 0);
+
+  // many small and empty buffers, crossing blocks anywhere
+  p = data;
+  for (int i = 0; i < NUM_SMALL; i++) {
+    iov[i].iov_base = p;
+    iov[i].iov_len = i % 5 == 0 ? 0 : 37 + i % 3;
+    p += iov[i].iov_len;
+  }
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_writev(fd, iov, NUM_SMALL) == p - data);
+  for (int i = 0; i < NUM_SMALL; i++) {
+    iov[i].iov_base = read_buf + ((char *)iov[i].iov_base - data);
+  }
+  memset(read_buf, 0, p - data);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_readv(fd, iov, NUM_SMALL) == p - data);
+  assert(memcmp(read_buf, data, p - data) == 0);
+
+  // a large write, split across worker threads and straddling blocks
+  iov[0] = (struct iovec){data, 1};
+  iov[1] = (struct iovec){data + 1, BYTES_MB + 5};
+  iov[2] = (struct iovec){data + BYTES_MB + 6, 2 * BYTES_MB};
+  iov[3] = (struct iovec){data + 3 * BYTES_MB + 6, BIG_SIZE - 3 * BYTES_MB - 6};
+  assert(fs_lseek(fd, 10) == 0);
+  assert(fs_writev(fd, iov, 4) == BIG_SIZE);
+  assert(fs_get_filesize(fd) == BIG_SIZE + 10);
+  memset(read_buf, 0, BIG_SIZE);
+  assert(fs_lseek(fd, 10) == 0);
+  assert(fs_read(fd, read_buf, BIG_SIZE) == BIG_SIZE);
+  assert(memcmp(read_buf, data, BIG_SIZE) == 0);
+
+  // reads stop at the end of the file
+  iov[0] = (struct iovec){read_buf, 2};
+  iov[1] = (struct iovec){read_buf + 2, 98};
+  assert(fs_lseek(fd, BIG_SIZE + 10 - 3) == 0);
+  assert(fs_readv(fd, iov, 2) == 3);
+  assert(memcmp(read_buf, data + BIG_SIZE - 3, 3) == 0);
+
+  assert(fs_writev(fd, iov, -1) == -1);
+  assert(fs_writev(-1, iov, 2) == -1);
+  assert(fs_readv(-1, iov, 2) == -1);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0);
+  assert(remove(disk_name) == 0);
+
+  // compressed files gather and scatter cluster by cluster
+  opts.features = FS_FEATURE_COMPRESSION;
+  assert(make_fs_opts(disk_name, &opts) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fd >= 0);
+  for (int i = 0; i < 3; i++) {
+    iov[i] = (struct iovec){data + i * 100, 100};
+  }
+  assert(fs_writev(fd, iov, 3) == 300);
+  memset(read_buf, 0, 300);
+  for (int i = 0; i < 3; i++) {
+    iov[i].iov_base = read_buf + (2 - i) * 100;
+  }
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_readv(fd, iov, 3) == 300);
+  for (int i = 0; i < 3; i++) {
+    assert(memcmp(read_buf + (2 - i) * 100, data + i * 100, 100) == 0);
+  }
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+  free(read_buf);
+}
@@ -0,0 +1,122 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define FILE_SIZE (30 * BYTES_MB)
+#define BLOCK_SIZE 4096
+
+const char *disk_name = "test_fs";
+const char *file_name = "big_file";
+char *buf;
+
+void write_file() {
+  assert(fs_create(file_name) == 0);
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_close(fd) == 0);
+}
+
+// Points the last entry of the first block of the disk image that looks like
+// an indirect block of the file, starting with 16 consecutive block numbers,
+// outside of the disk, which its checksum no longer matches.
+void corrupt_indirect_block() {
+  FILE *disk = fopen(disk_name, "r+b");
+  assert(disk != NULL);
+  uint16_t block[BLOCK_SIZE / sizeof(uint16_t)];
+  for (long offset = 0; fread(block, BLOCK_SIZE, 1, disk) == 1;
+       offset += BLOCK_SIZE) {
+    int i = 1;
+    while (block[0] && i < 16 && block[i] == block[0] + i) {
+      i++;
+    }
+    if (i == 16) {
+      block[BLOCK_SIZE / sizeof(uint16_t) - 1] = 0xffff;
+      assert(fseek(disk, offset, SEEK_SET) == 0);
+      assert(fwrite(block, BLOCK_SIZE, 1, disk) == 1);
+      assert(fclose(disk) == 0);
+      return;
+    }
+  }
+  assert(0 && "indirect block not found");
+}
+
+int main() {
+  buf = malloc(FILE_SIZE);
+  memset(buf, 'a', FILE_SIZE);
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+
+  // crash right after the commit of a delete, before the blocks it freed are
+  // released
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    assert(mount_fs(disk_name) == 0);
+    write_file();
+    assert(fs_sync() == 0);
+    assert(fs_delete(file_name) == 0);
+    assert(fs_sync() == 0);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // the recovery scan gets the blocks back
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_open(file_name) == -1);
+  write_file();
+  assert(umount_fs(disk_name) == 0);
+
+  // clean remounts load the rest of the metadata when it is first needed
+  for (int i = 0; i < 100; i++) {
+    assert(mount_fs(disk_name) == 0);
+    assert(umount_fs(disk_name) == 0);
+  }
+  assert(mount_fs(disk_name) == 0);
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  char read_buf[BYTES_KB];
+  assert(fs_lseek(fd, FILE_SIZE - BYTES_KB) == 0);
+  assert(fs_read(fd, read_buf, BYTES_KB) == BYTES_KB);
+  assert(memcmp(read_buf, buf, BYTES_KB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete(file_name) == 0);
+  write_file();
+  assert(umount_fs(disk_name) == 0);
+
+  // a damaged indirect block left by a crash does not stop the recovery
+  // scan; reads through it fail until fsck deals with it
+  pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    assert(mount_fs(disk_name) == 0);
+    _exit(0);
+  }
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  corrupt_indirect_block();
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_KB) == BYTES_KB);
+  assert(memcmp(read_buf, buf, BYTES_KB) == 0);
+  char *file_buf = malloc(FILE_SIZE);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, file_buf, FILE_SIZE) == -1);
+  free(file_buf);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  struct fs_fsck_report report;
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.checksum_errors == 1 && report.bad_pointers == 1);
+
+  assert(remove(disk_name) == 0);
+  free(buf);
+}
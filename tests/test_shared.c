@@ -0,0 +1,265 @@
+#include "../fs.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define CHUNK_SIZE (64 * BYTES_KB)
+#define NUM_WORKERS 4
+#define COMMON_SIZE (NUM_WORKERS * CHUNK_SIZE)
+#define NUM_CHANGES 100
+
+const char *disk_name = "test_fs";
+
+// Checks that the file name holds size bytes of data.
+void check_file(fs_ctx *c, const char *name, const char *data, int size) {
+  char *buf = malloc(size);
+  int fd = c ? fs_ctx_open(c, name) : fs_open(name);
+  assert(fd >= 0);
+  assert((c ? fs_ctx_read(c, fd, buf, size) : fs_read(fd, buf, size)) == size);
+  assert(memcmp(buf, data, size) == 0);
+  assert((c ? fs_ctx_close(c, fd) : fs_close(fd)) == 0);
+  free(buf);
+}
+
+// Runs in a process of its own: writes a file of its own and its chunk of
+// the common file, and reads the file the parent wrote.
+void worker(int i, const char *data) {
+  char name[16];
+  fs_ctx *c = fs_mount_shared(disk_name);
+  assert(c != NULL);
+  sprintf(name, "worker%d", i);
+  assert(fs_ctx_create(c, name) == 0);
+  int fd = fs_ctx_open(c, name);
+  assert(fs_ctx_write(c, fd, (void *)(data + i), CHUNK_SIZE) == CHUNK_SIZE);
+  assert(fs_ctx_close(c, fd) == 0);
+  fd = fs_ctx_open(c, "common");
+  assert(fs_ctx_lseek(c, fd, i * CHUNK_SIZE) == 0);
+  assert(fs_ctx_write(c, fd, (void *)(data + i * CHUNK_SIZE), CHUNK_SIZE) ==
+         CHUNK_SIZE);
+  assert(fs_ctx_close(c, fd) == 0);
+  check_file(c, "parent", data, CHUNK_SIZE);
+  assert(fs_unmount(c) == 0);
+  exit(EXIT_SUCCESS);
+}
+
+// Runs in a process of its own: deletes a file, but not one the parent has
+// open.
+void deleter() {
+  fs_ctx *c = fs_mount_shared(disk_name);
+  assert(c != NULL);
+  assert(fs_ctx_delete(c, "parent") == -1);
+  assert(fs_ctx_delete(c, "worker0") == 0);
+  assert(fs_unmount(c) == 0);
+  exit(EXIT_SUCCESS);
+}
+
+// Runs in a process of its own: mounts the image, tells the parent through
+// pipe_fd and writes the file name over and over until killed, mostly in the
+// middle of a write holding the lock of the segment.
+void rewriter(int pipe_fd, const char *name, const char *data) {
+  fs_ctx *c = fs_mount_shared(disk_name);
+  assert(c != NULL);
+  assert(fs_ctx_create(c, name) == 0);
+  int fd = fs_ctx_open(c, name);
+  assert(write(pipe_fd, "x", 1) == 1);
+  for (;;) {
+    assert(fs_ctx_lseek(c, fd, 0) == 0);
+    assert(fs_ctx_write(c, fd, (void *)data, COMMON_SIZE) == COMMON_SIZE);
+  }
+}
+
+// Whether the shared memory segment of the image is there.
+bool has_segment() {
+  struct stat st;
+  char path[64];
+  assert(stat(disk_name, &st) == 0);
+  sprintf(path, "/dev/shm/fs-%llx-%llx", (unsigned long long)st.st_dev,
+          (unsigned long long)st.st_ino);
+  return access(path, F_OK) == 0;
+}
+
+void wait_for(pid_t pid) {
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main() {
+  char *data = malloc(COMMON_SIZE + NUM_WORKERS);
+  char *zeros = calloc(1, COMMON_SIZE);
+  char *buf = malloc(COMMON_SIZE);
+  pid_t pids[NUM_WORKERS];
+  int fd;
+
+  for (int i = 0; i < COMMON_SIZE + NUM_WORKERS; i++) {
+    data[i] = 'A' + rand() % 26;
+  }
+  remove(disk_name); // remove disk if it exists
+  assert(mount_fs_shared(disk_name) == -1);
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs_shared(disk_name) == 0);
+  assert(fs_create("common") == 0);
+  fd = fs_open("common");
+  assert(fs_write(fd, zeros, COMMON_SIZE) == COMMON_SIZE);
+  assert(fs_close(fd) == 0);
+  assert(fs_create("parent") == 0);
+  fd = fs_open("parent");
+  assert(fs_write(fd, data, CHUNK_SIZE) == CHUNK_SIZE);
+
+  // the workers write side by side with the parent reading; each write is
+  // seen whole or not at all
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    pids[i] = fork();
+    assert(pids[i] != -1);
+    if (pids[i] == 0) {
+      worker(i, data);
+    }
+  }
+  int common_fd = fs_open("common");
+  int running = NUM_WORKERS;
+  while (running) {
+    assert(fs_lseek(common_fd, 0) == 0);
+    assert(fs_read(common_fd, buf, COMMON_SIZE) == COMMON_SIZE);
+    for (int i = 0; i < NUM_WORKERS; i++) {
+      char *chunk = buf + i * CHUNK_SIZE;
+      assert(memcmp(chunk, zeros, CHUNK_SIZE) == 0 ||
+             memcmp(chunk, data + i * CHUNK_SIZE, CHUNK_SIZE) == 0);
+    }
+    running = 0;
+    for (int i = 0; i < NUM_WORKERS; i++) {
+      int status;
+      pid_t pid = pids[i] ? waitpid(pids[i], &status, WNOHANG) : 0;
+      if (pid == pids[i] && pid) {
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        pids[i] = 0;
+      }
+      running += pids[i] != 0;
+    }
+  }
+
+  // their files and writes show up without a remount
+  char **files;
+  int num_files = 0;
+  assert(fs_listfiles(&files) == 0);
+  for (char **file = files; *file; file++, num_files++) {
+    free(*file);
+  }
+  free(files);
+  assert(num_files == 2 + NUM_WORKERS);
+  check_file(NULL, "common", data, COMMON_SIZE);
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    char name[16];
+    sprintf(name, "worker%d", i);
+    check_file(NULL, name, data + i, CHUNK_SIZE);
+  }
+  assert(fs_close(common_fd) == 0);
+
+  // a file open in one process cannot be deleted by another
+  pid_t pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    deleter();
+  }
+  wait_for(pid);
+  assert(fs_open("worker0") == -1);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("parent") == 0);
+
+  // the last process to unmount leaves the image clean
+  assert(umount_fs(disk_name) == 0);
+  struct fs_fsck_report report;
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.files == 1 + NUM_WORKERS - 1);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0);
+  assert(mount_fs(disk_name) == 0);
+  check_file(NULL, "common", data, COMMON_SIZE);
+
+  // a private mount keeps shared ones off the image, and the other way
+  // around, within a process too
+  assert(mount_fs_shared(disk_name) == -1);
+  assert(fs_mount_shared(disk_name) == NULL);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs_shared(disk_name) == 0);
+  assert(fs_mount(disk_name) == NULL);
+
+  // another mount follows the changes without a remount, applying them from
+  // the journal, or reading all of the metadata again once the journal fills
+  // up and is written home; its own changes show up here the same way
+  fs_ctx *other = fs_mount_shared(disk_name);
+  assert(other != NULL);
+  for (int i = 0; i < NUM_CHANGES; i++) {
+    char name[16];
+    sprintf(name, "change%d", i);
+    assert(fs_create(name) == 0);
+    fd = fs_open(name);
+    assert(fs_write(fd, data + i, 100) == 100);
+    assert(fs_close(fd) == 0);
+    check_file(other, name, data + i, 100);
+    if (i % 2) {
+      assert(fs_ctx_delete(other, name) == 0);
+      assert(fs_open(name) == -1);
+    }
+  }
+  assert(fs_unmount(other) == 0);
+  check_file(NULL, "change98", data + 98, 100);
+
+  // a process killed while mounted, likely holding the lock of the segment
+  // halfway through a write, neither blocks the others nor leaves the image
+  // damaged
+  int pipe_fds[2];
+  assert(pipe(pipe_fds) == 0);
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    rewriter(pipe_fds[1], "killed", data);
+  }
+  close(pipe_fds[1]);
+  char c;
+  assert(read(pipe_fds[0], &c, 1) == 1);
+  close(pipe_fds[0]);
+  usleep(20 * 1000);
+  assert(kill(pid, SIGKILL) == 0);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(fs_create("survivor") == 0);
+  fd = fs_open("survivor");
+  assert(fs_write(fd, data, CHUNK_SIZE) == CHUNK_SIZE);
+  assert(fs_close(fd) == 0);
+  check_file(NULL, "common", data, COMMON_SIZE);
+  assert(umount_fs(disk_name) == 0);
+  assert(has_segment() == false);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0 && report.bad_pointers == 0);
+
+  // nor does one killed between calls, with no process left mounted: the
+  // next mount finds its segment stale and recovers the image
+  assert(pipe(pipe_fds) == 0);
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    rewriter(pipe_fds[1], "killed_last", data);
+  }
+  close(pipe_fds[1]);
+  assert(read(pipe_fds[0], &c, 1) == 1);
+  close(pipe_fds[0]);
+  assert(kill(pid, SIGKILL) == 0);
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(has_segment());
+  assert(mount_fs_shared(disk_name) == 0);
+  check_file(NULL, "survivor", data, CHUNK_SIZE);
+  assert(umount_fs(disk_name) == 0);
+  assert(has_segment() == false);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.orphaned_blocks == 0 && report.missing_blocks == 0 &&
+         report.checksum_errors == 0 && report.bad_pointers == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+  free(zeros);
+  free(buf);
+}
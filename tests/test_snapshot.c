@@ -0,0 +1,126 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  const char *file_name = "test_file";
+  const char *new_file = "new_file";
+  const char *big_file = "big_file";
+  char *buf0 = malloc(BYTES_MB);
+  char *buf1 = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  int fd;
+
+  memset(buf0, 'a', BYTES_MB);
+  memset(buf1, 'b', BYTES_MB);
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(fs_snapshot_mount(disk_name) == -1); // no snapshot yet
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_snapshot_delete() == -1); // no snapshot yet
+
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf0, BYTES_MB) == BYTES_MB);
+  assert(fs_close(fd) == 0);
+  assert(fs_create(big_file) == 0);
+  fd = fs_open(big_file);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf0, BYTES_MB) == BYTES_MB);
+  assert(fs_close(fd) == 0);
+  assert(fs_snapshot_create() == 0);
+
+  // overwrite, shrink, delete and create after the snapshot
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_lseek(fd, 100) == 0);
+  assert(fs_write(fd, buf1, BYTES_MB / 2) == BYTES_MB / 2);
+  assert(fs_truncate(fd, BYTES_MB / 4) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete(big_file) == 0);
+  // reuse of freed blocks must not hit the snapshot
+  for (int i = 0; i < 8; i++) {
+    assert(fs_create(new_file) == 0);
+    fd = fs_open(new_file);
+    assert(fd >= 0);
+    assert(fs_write(fd, buf1, BYTES_MB) == BYTES_MB);
+    assert(fs_close(fd) == 0);
+    assert(fs_delete(new_file) == 0);
+  }
+  assert(fs_create(new_file) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // the snapshot still sees the old contents and is read-only
+  assert(fs_snapshot_mount(disk_name) == 0);
+  assert(fs_create("other") == -1);
+  assert(fs_open(new_file) == -1);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == BYTES_MB);
+  assert(fs_write(fd, buf1, 1) == -1);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf0, BYTES_MB) == 0);
+  assert(fs_close(fd) == 0);
+  fd = fs_open(big_file);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+  assert(memcmp(read_buf, buf0, BYTES_MB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // the live file system sees the new contents
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == BYTES_MB / 4);
+  assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB / 4);
+  assert(memcmp(read_buf, buf0, 100) == 0);
+  assert(memcmp(read_buf + 100, buf1, BYTES_MB / 4 - 100) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_open(big_file) == -1);
+
+  // dropping the snapshot releases the blocks only it referenced
+  assert(fs_snapshot_delete() == 0);
+  assert(fs_create(big_file) == 0);
+  fd = fs_open(big_file);
+  assert(fd >= 0);
+  for (int i = 0; i < 31; i++) {
+    assert(fs_write(fd, buf1, BYTES_MB) == BYTES_MB);
+  }
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_snapshot_mount(disk_name) == -1);
+
+  // a snapshot taken while deleted blocks wait for the next commit does not
+  // reference them, so none are lost when it is dropped
+  struct fs_fsck_report report;
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf0, BYTES_MB) == BYTES_MB);
+  assert(fs_close(fd) == 0);
+  assert(fs_snapshot_create() == 0);
+  assert(fs_delete(file_name) == 0);
+  assert(fs_snapshot_create() == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.missing_blocks == 0 && report.orphaned_blocks == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_snapshot_delete() == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_fsck(disk_name, NULL, &report) == 0);
+  assert(report.missing_blocks == 0 && report.orphaned_blocks == 0);
+
+  assert(remove(disk_name) == 0);
+  free(buf0);
+  free(buf1);
+  free(read_buf);
+}
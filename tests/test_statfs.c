@@ -0,0 +1,76 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define NUM_FILES 5
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_statfs empty, statfs;
+  char name[16];
+  char *buf = malloc(BYTES_MB);
+  int fd;
+
+  memset(buf, 'x', BYTES_MB);
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(fs_statfs(&statfs) == -1);
+  assert(mount_fs(disk_name) == 0);
+
+  // an empty image is one free extent
+  assert(fs_statfs(&empty) == 0);
+  assert(empty.block_size == 4096);
+  assert(empty.total_blocks > 0 && empty.total_blocks < 8192);
+  assert(empty.free_blocks == empty.total_blocks);
+  assert(empty.largest_free_extent == empty.total_blocks);
+  assert(empty.freeing_blocks == 0);
+  assert(empty.total_inodes == 64 && empty.free_inodes == 64);
+
+  // files take an inode and their data and indirect blocks
+  for (int i = 0; i < NUM_FILES; i++) {
+    sprintf(name, "file%d", i);
+    assert(fs_create(name) == 0);
+    fd = fs_open(name);
+    assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+    assert(fs_close(fd) == 0);
+  }
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_inodes == 64 - NUM_FILES);
+  assert(statfs.free_blocks ==
+         empty.free_blocks - NUM_FILES * (BYTES_MB / 4096 + 1));
+  assert(statfs.largest_free_extent == statfs.free_blocks);
+
+  // freed blocks are free once the deletion commits, and leave a hole
+  assert(fs_delete("file1") == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_inodes == 64 - NUM_FILES + 1);
+  assert(statfs.freeing_blocks == BYTES_MB / 4096 + 1);
+  assert(fs_sync() == 0);
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.freeing_blocks == 0);
+  assert(statfs.free_blocks ==
+         empty.free_blocks - (NUM_FILES - 1) * (BYTES_MB / 4096 + 1));
+  assert(statfs.largest_free_extent ==
+         statfs.free_blocks - (BYTES_MB / 4096 + 1));
+
+  // the counts survive an unmount
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  struct fs_statfs remounted;
+  assert(fs_statfs(&remounted) == 0);
+  assert(memcmp(&remounted, &statfs, sizeof(statfs)) == 0);
+
+  // creation fails once every inode is taken
+  for (int i = 0; i < 64; i++) {
+    sprintf(name, "new%d", i);
+    assert(fs_create(name) == (i < remounted.free_inodes ? 0 : -1));
+  }
+  assert(fs_statfs(&statfs) == 0);
+  assert(statfs.free_inodes == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_statfs(&statfs) == -1);
+  assert(remove(disk_name) == 0);
+  free(buf);
+}
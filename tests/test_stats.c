@@ -0,0 +1,116 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define NUM_THREADS 8
+#define NUM_READS 1000
+
+const char *file_name = "test_file";
+
+uint64_t histogram_total(const struct fs_op_stats *op) {
+  uint64_t total = 0;
+  for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+    total += op->latency[i];
+  }
+  return total;
+}
+
+// Reads the first 4 KiB of the file NUM_READS times.
+void *reader(void *arg) {
+  char buf[4096];
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  for (int i = 0; i < NUM_READS; i++) {
+    assert(fs_lseek(fd, 0) == 0);
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+  }
+  assert(fs_close(fd) == 0);
+  return NULL;
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  struct fs_stats stats;
+  pthread_t threads[NUM_THREADS];
+  char *buf = malloc(BYTES_MB);
+  int fd;
+
+  memset(buf, 'x', BYTES_MB);
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_MOUNT].calls == 1);
+  assert(stats.disk_reads.calls > 0 && stats.disk_reads.bytes > 0);
+
+  // every call is counted, with its errors and latency
+  assert(fs_stats_reset() == 0);
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, BYTES_MB) == BYTES_MB);
+  assert(fs_read(fd, buf, 10) == -1); // at the end of the file
+  assert(fs_read(-1, buf, 10) == -1);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, buf, BYTES_MB) == BYTES_MB);
+  assert(fs_sync() == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_CREATE].calls == 1);
+  assert(stats.ops[FS_OP_OPEN].calls == 1);
+  assert(stats.ops[FS_OP_WRITE].calls == 1);
+  assert(stats.ops[FS_OP_WRITE].errors == 0);
+  assert(stats.ops[FS_OP_READ].calls == 3);
+  assert(stats.ops[FS_OP_READ].errors == 2);
+  assert(stats.ops[FS_OP_LSEEK].calls == 1);
+  assert(stats.ops[FS_OP_SYNC].calls == 1);
+  assert(stats.ops[FS_OP_MOUNT].calls == 0);
+  for (int i = 0; i < FS_OP_COUNT; i++) {
+    assert(histogram_total(&stats.ops[i]) == stats.ops[i].calls);
+  }
+  assert(stats.ops[FS_OP_WRITE].total_ns > 0);
+
+  // the disk, allocator and block map counters
+  assert(stats.disk_writes.bytes >= BYTES_MB);
+  assert(stats.disk_writes.ns > 0);
+  assert(stats.disk_reads.bytes >= BYTES_MB);
+  assert(stats.disk_syncs.calls > 0);
+  assert(stats.alloc_calls >= BYTES_MB / 4096);
+  assert(stats.alloc_scanned >= stats.alloc_calls);
+  assert(stats.map_lookups > 0 && stats.map_blocks >= BYTES_MB / 4096);
+  assert(stats.map_indirect_reads > 0);
+  assert(fs_close(fd) == 0);
+
+  // threads count on their own, and nothing is lost
+  assert(fs_stats_reset() == 0);
+  for (long i = 0; i < NUM_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, reader, NULL) == 0);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_READ].calls == NUM_THREADS * NUM_READS);
+  assert(stats.ops[FS_OP_LSEEK].calls == NUM_THREADS * NUM_READS);
+  assert(stats.ops[FS_OP_OPEN].calls == NUM_THREADS);
+  assert(stats.disk_reads.calls >= NUM_THREADS * NUM_READS);
+  assert(umount_fs(disk_name) == 0);
+
+  // contexts count separately
+  fs_ctx *ctx = fs_mount(disk_name);
+  assert(ctx != NULL);
+  assert(fs_ctx_stats(ctx, &stats) == 0);
+  assert(stats.ops[FS_OP_MOUNT].calls == 1);
+  assert(stats.ops[FS_OP_READ].calls == 0);
+  assert(fs_ctx_stats_reset(ctx) == 0);
+  assert(fs_ctx_stats(ctx, &stats) == 0);
+  assert(stats.ops[FS_OP_MOUNT].calls == 0 && stats.disk_reads.calls == 0);
+  assert(fs_unmount(ctx) == 0);
+  assert(fs_stats(&stats) == 0);
+  assert(stats.ops[FS_OP_UMOUNT].calls == 1);
+
+  assert(remove(disk_name) == 0);
+  free(buf);
+}
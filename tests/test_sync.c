@@ -0,0 +1,86 @@
+#include "../fs.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BYTES_KB 1024
+#define FILE_SIZE (64 * BYTES_KB)
+
+const char *disk_name = "test_fs";
+char buf[FILE_SIZE];
+
+// Runs ops in a child process that exits without unmounting, like a crash.
+void crash_after(void (*ops)()) {
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    assert(mount_fs(disk_name) == 0);
+    ops();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void create_file(const char *file_name) {
+  assert(fs_create(file_name) == 0);
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_close(fd) == 0);
+}
+
+void check_file(const char *file_name) {
+  char read_buf[FILE_SIZE];
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, FILE_SIZE) == FILE_SIZE);
+  assert(memcmp(read_buf, buf, FILE_SIZE) == 0);
+  assert(fs_close(fd) == 0);
+}
+
+void fsync_file() {
+  assert(fs_create("fsynced") == 0);
+  int fd = fs_open("fsynced");
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, FILE_SIZE) == FILE_SIZE);
+  assert(fs_fsync(fd) == 0);
+  assert(fs_fsync(fd) == 0); // nothing left to commit
+  assert(fs_close(fd) == 0);
+}
+
+void sync_then_create() {
+  create_file("synced");
+  assert(fs_sync() == 0);
+  assert(fs_sync() == 0); // nothing left to commit
+  assert(fs_create("lost") == 0);
+}
+
+int main() {
+  for (int i = 0; i < FILE_SIZE; i++) {
+    buf[i] = 'A' + rand() % 26;
+  }
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(fs_sync() == -1);  // not mounted
+  assert(fs_fsync(0) == -1);
+
+  // a file survives a crash once fs_fsync returns
+  crash_after(fsync_file);
+  assert(mount_fs(disk_name) == 0);
+  check_file("fsynced");
+  assert(umount_fs(disk_name) == 0);
+
+  // so does everything up to fs_sync, but not what follows it
+  crash_after(sync_then_create);
+  assert(mount_fs(disk_name) == 0);
+  check_file("fsynced");
+  check_file("synced");
+  assert(fs_open("lost") == -1);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+}
@@ -0,0 +1,130 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define NUM_THREADS 8
+#define NUM_ROUNDS 4
+#define CHUNK_SIZE (64 * BYTES_KB)
+#define NUM_OPENS 4096
+
+// Fills buf with the contents thread idx writes in round.
+void fill(char *buf, int idx, int round) {
+  for (int i = 0; i < BYTES_MB; i++) {
+    buf[i] = 'a' + (idx * 7 + round * 3 + i / 4096) % 26;
+  }
+}
+
+// Rewrites, reads back and shrinks a file of its own.
+void *file_worker(void *arg) {
+  int idx = (int)(long)arg;
+  char file_name[16];
+  char *buf = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  snprintf(file_name, sizeof(file_name), "file%d", idx);
+  assert(fs_create(file_name) == 0);
+  int fd = fs_open(file_name);
+  assert(fd >= 0);
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    fill(buf, idx, round);
+    assert(fs_lseek(fd, 0) == 0);
+    for (int off = 0; off < BYTES_MB; off += CHUNK_SIZE) {
+      assert(fs_write(fd, buf + off, CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    assert(fs_get_filesize(fd) == BYTES_MB);
+    assert(fs_lseek(fd, 0) == 0);
+    assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+    assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+    if (round < NUM_ROUNDS - 1) {
+      assert(fs_truncate(fd, BYTES_MB / 2) == 0);
+    }
+    assert(fs_fsync(fd) == 0);
+  }
+  assert(fs_close(fd) == 0);
+
+  // descriptors are handed out and taken back concurrently
+  int *fds = malloc(NUM_OPENS * sizeof(int));
+  for (int i = 0; i < NUM_OPENS; i++) {
+    fds[i] = fs_open(file_name);
+    assert(fds[i] >= 0);
+  }
+  for (int i = 0; i < NUM_OPENS; i++) {
+    assert(fs_get_filesize(fds[i]) == BYTES_MB);
+    assert(fs_close(fds[i]) == 0);
+  }
+  free(fds);
+  free(buf);
+  free(read_buf);
+  return NULL;
+}
+
+// Creates, lists and deletes small files while the others write.
+void *dir_worker(void *arg) {
+  char file_name[16];
+  char **files;
+  for (int i = 0; i < 64; i++) {
+    snprintf(file_name, sizeof(file_name), "tmp%d", i % 4);
+    assert(fs_create(file_name) == 0);
+    int fd = fs_open(file_name);
+    assert(fd >= 0);
+    assert(fs_write(fd, file_name, sizeof(file_name)) == sizeof(file_name));
+    assert(fs_close(fd) == 0);
+    assert(fs_listfiles(&files) == 0);
+    bool found = false;
+    for (char **file = files; *file; file++) {
+      found |= strcmp(*file, file_name) == 0;
+      free(*file);
+    }
+    free(files);
+    assert(found);
+    assert(fs_delete(file_name) == 0);
+  }
+  return NULL;
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  pthread_t threads[NUM_THREADS + 1];
+  char *buf = malloc(BYTES_MB);
+  char *read_buf = malloc(BYTES_MB);
+  char file_name[16];
+  char **files;
+
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  for (long i = 0; i < NUM_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, file_worker, (void *)i) == 0);
+  }
+  assert(pthread_create(&threads[NUM_THREADS], NULL, dir_worker, NULL) == 0);
+  for (int i = 0; i <= NUM_THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+  assert(fs_listfiles(&files) == 0);
+  int num_files = 0;
+  for (char **file = files; *file; file++, num_files++) {
+    free(*file);
+  }
+  free(files);
+  assert(num_files == NUM_THREADS);
+  assert(umount_fs(disk_name) == 0);
+
+  // every file holds what its thread wrote last
+  assert(mount_fs(disk_name) == 0);
+  for (int i = 0; i < NUM_THREADS; i++) {
+    snprintf(file_name, sizeof(file_name), "file%d", i);
+    int fd = fs_open(file_name);
+    assert(fd >= 0);
+    fill(buf, i, NUM_ROUNDS - 1);
+    assert(fs_read(fd, read_buf, BYTES_MB) == BYTES_MB);
+    assert(memcmp(read_buf, buf, BYTES_MB) == 0);
+    assert(fs_close(fd) == 0);
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(buf);
+  free(read_buf);
+}
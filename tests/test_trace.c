@@ -0,0 +1,134 @@
+#include "../fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define NUM_THREADS 4
+#define NUM_CALLS 1000
+#define MAX_RECORDS (NUM_THREADS * NUM_CALLS + 16)
+
+const char *file_name = "test_file";
+
+struct fs_trace_record records[MAX_RECORDS];
+char names[MAX_RECORDS][UINT8_MAX + 1];
+
+// Reads the trace at path into records and names, and returns the number of
+// records.
+int read_trace(const char *path) {
+  FILE *trace = fopen(path, "rb");
+  uint32_t header[2];
+  int n = 0;
+  assert(trace != NULL);
+  assert(fread(header, sizeof(header), 1, trace) == 1);
+  assert(header[0] == FS_TRACE_MAGIC && header[1] == FS_TRACE_VERSION);
+  while (fread(&records[n], sizeof(records[n]), 1, trace) == 1) {
+    assert(records[n].op < FS_OP_COUNT);
+    assert(fread(names[n], 1, records[n].name_len, trace) ==
+           records[n].name_len);
+    names[n][records[n].name_len] = '\0';
+    n++;
+  }
+  assert(feof(trace));
+  fclose(trace);
+  return n;
+}
+
+void *sizer(void *arg) {
+  int fd = (int)(long)arg;
+  for (int i = 0; i < NUM_CALLS; i++) {
+    assert(fs_get_filesize(fd) == 50);
+  }
+  return NULL;
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  const char *trace_name = "trace_file";
+  pthread_t threads[NUM_THREADS];
+  char buf[10000];
+  int fd;
+
+  memset(buf, 'x', sizeof(buf));
+  remove(disk_name); // remove disk if it exists
+  assert(make_fs(disk_name) == 0);
+  assert(fs_trace_stop() == -1);
+
+  // every call is logged with its arguments and result, mount included
+  assert(fs_trace_start(trace_name) == 0);
+  assert(fs_trace_start(trace_name) == -1);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, buf, sizeof(buf)) == sizeof(buf));
+  assert(fs_lseek(fd, 100) == 0);
+  assert(fs_read(fd, buf, 200) == 200);
+  assert(fs_read(-1, buf, 10) == -1);
+  assert(fs_truncate(fd, 50) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(fs_trace_stop() == 0);
+  assert(mount_fs(disk_name) == 0); // not logged
+
+  struct fs_trace_record expected[] = {
+      {.op = FS_OP_MOUNT, .fd = -1, .offset = -1, .result = 0},
+      {.op = FS_OP_CREATE, .fd = -1, .offset = -1, .result = 0},
+      {.op = FS_OP_OPEN, .fd = -1, .offset = -1, .result = fd},
+      {.op = FS_OP_WRITE, .fd = fd, .offset = 0, .size = 10000,
+       .result = 10000},
+      {.op = FS_OP_LSEEK, .fd = fd, .offset = 100, .result = 0},
+      {.op = FS_OP_READ, .fd = fd, .offset = 100, .size = 200, .result = 200},
+      {.op = FS_OP_READ, .fd = -1, .offset = -1, .size = 10, .result = -1},
+      {.op = FS_OP_TRUNCATE, .fd = fd, .offset = 50, .result = 0},
+      {.op = FS_OP_CLOSE, .fd = fd, .offset = -1, .result = 0},
+      {.op = FS_OP_UMOUNT, .fd = -1, .offset = -1, .result = 0},
+  };
+  const char *expected_names[] = {disk_name, file_name, file_name, "", "",
+                                  "",        "",        "",        "", ""};
+  int n = read_trace(trace_name);
+  assert(n == sizeof(expected) / sizeof(expected[0]));
+  for (int i = 0; i < n; i++) {
+    assert(records[i].op == expected[i].op);
+    assert(records[i].fd == expected[i].fd);
+    assert(records[i].offset == expected[i].offset);
+    assert(records[i].size == expected[i].size);
+    assert(records[i].result == expected[i].result);
+    assert(strcmp(names[i], expected_names[i]) == 0);
+    assert(i == 0 || records[i].time_ns >= records[i - 1].time_ns);
+  }
+
+  // records of concurrent calls are whole
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_trace_start(trace_name) == 0);
+  for (long i = 0; i < NUM_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, sizer, (void *)(long)fd) == 0);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+  assert(fs_trace_stop() == 0);
+  n = read_trace(trace_name);
+  assert(n == NUM_THREADS * NUM_CALLS);
+  for (int i = 0; i < n; i++) {
+    assert(records[i].op == FS_OP_GET_FILESIZE);
+    assert(records[i].fd == fd && records[i].result == 50);
+  }
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // contexts trace separately, until they are unmounted
+  fs_ctx *ctx = fs_mount(disk_name);
+  assert(ctx != NULL);
+  assert(fs_ctx_trace_start(ctx, trace_name) == 0);
+  assert(fs_trace_stop() == -1);
+  assert(fs_ctx_create(ctx, "other") == 0);
+  assert(fs_unmount(ctx) == 0);
+  n = read_trace(trace_name);
+  assert(n == 2);
+  assert(records[0].op == FS_OP_CREATE && strcmp(names[0], "other") == 0);
+  assert(records[1].op == FS_OP_UMOUNT);
+
+  assert(remove(trace_name) == 0);
+  assert(remove(disk_name) == 0);
+}